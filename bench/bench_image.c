@@ -0,0 +1,164 @@
+/*
+ * Synthetic IMD Image Generator for the libimd benchmarks.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+#include "bench_image.h"
+#include "libimd.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Sector sizes cycled through by BENCH_LAYOUT_MIXED, with sectors per track for each */
+static const uint32_t MIXED_SIZES[] = { 128, 256, 512, 1024, 2048, 4096, 8192 };
+static const uint8_t MIXED_SPT[] = { 26, 16, 9, 5, 3, 2, 1 };
+#define MIXED_SIZE_COUNT (sizeof(MIXED_SIZES) / sizeof(MIXED_SIZES[0]))
+
+uint32_t bench_rand(uint32_t* state) {
+    uint32_t x = *state ? *state : 0x9E3779B9u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+void bench_track_format(const BenchImageSpec* spec, size_t track, uint8_t* mode, uint32_t* sector_size, uint8_t* spt, int* interleave) {
+    if (spec->layout == BENCH_LAYOUT_MIXED) {
+        size_t size_index = track % MIXED_SIZE_COUNT;
+        *mode = (uint8_t)(track % LIBIMD_NUM_MODES);
+        *sector_size = MIXED_SIZES[size_index];
+        *spt = MIXED_SPT[size_index];
+    }
+    else {
+        *mode = spec->mode;
+        *sector_size = spec->sector_size;
+        *spt = spec->sectors_per_track;
+    }
+    /* An interleave must be below the sector count (imdf_format_track rule) */
+    *interleave = (spec->interleave > 1 && spec->interleave < *spt) ? spec->interleave : 1;
+}
+
+static uint8_t size_code_of(uint32_t sector_size) {
+    uint8_t code = 0;
+    while (code < 6 && (128u << code) < sector_size) code++;
+    return code;
+}
+
+uint64_t bench_image_data_bytes(const BenchImageSpec* spec) {
+    uint64_t total = 0;
+    size_t tracks = (size_t)spec->num_cyls * spec->num_heads;
+
+    for (size_t t = 0; t < tracks; ++t) {
+        uint8_t mode, spt;
+        uint32_t sector_size;
+        int interleave;
+        bench_track_format(spec, t, &mode, &sector_size, &spt, &interleave);
+        total += (uint64_t)spt * sector_size;
+    }
+    return total;
+}
+
+/* Picks a record type and fills the sector's data to match it */
+static uint8_t fill_sector(const BenchImageSpec* spec, uint32_t* rng, uint8_t* data, uint32_t size) {
+    uint32_t roll = bench_rand(rng) % 100;
+    uint8_t flag;
+
+    if (roll < (uint32_t)spec->pct_unavailable) {
+        memset(data, LIBIMD_FILL_BYTE_DEFAULT, size);
+        return IMD_SDR_UNAVAILABLE;
+    }
+    roll -= (uint32_t)spec->pct_unavailable;
+    if (roll < (uint32_t)spec->pct_compressed) {
+        memset(data, (uint8_t)bench_rand(rng), size);
+        flag = IMD_SDR_COMPRESSED;
+    }
+    else {
+        uint32_t x = bench_rand(rng);
+        for (uint32_t i = 0; i < size; ++i) {
+            x = x * 1103515245u + 12345u;
+            data[i] = (uint8_t)(x >> 16);
+        }
+        data[0] ^= (data[0] == data[1]) ? 0xFF : 0; /* Never uniform */
+        flag = IMD_SDR_NORMAL;
+    }
+
+    roll = bench_rand(rng) % 100;
+    if (roll < (uint32_t)spec->pct_deleted) flag += 2;   /* 0x01/0x02 -> 0x03/0x04 (deleted-data mark) */
+    else if (roll < (uint32_t)(spec->pct_deleted + spec->pct_error)) flag += 4; /* -> 0x05/0x06 (data error) */
+    return flag;
+}
+
+int bench_generate_image(const char* path, const BenchImageSpec* spec, long* size_out) {
+    static const ImdWriteOpts opts = { IMD_COMPRESSION_AS_READ, 0, 0, { 0, 1, 2, 3, 4, 5 }, LIBIMD_IL_AS_READ };
+    uint32_t rng = spec->seed;
+    char comment[256];
+    FILE* f;
+    int res;
+
+    f = fopen(path, "wb");
+    if (!f) return IMD_ERR_WRITE_ERROR;
+
+    snprintf(comment, sizeof(comment), "libimd_bench synthetic image '%s' (%u cyl, %u head, seed %u)\r\n",
+        spec->name, (unsigned)spec->num_cyls, (unsigned)spec->num_heads, (unsigned)spec->seed);
+    res = imd_write_file_header(f, "1.18");
+    if (res == 0) res = imd_write_comment_block(f, comment, strlen(comment));
+
+    for (uint16_t cyl = 0; cyl < spec->num_cyls && res == 0; ++cyl) {
+        for (uint8_t head = 0; head < spec->num_heads && res == 0; ++head) {
+            size_t track_number = (size_t)cyl * spec->num_heads + head;
+            uint32_t sector_size;
+            int il;
+            ImdTrackInfo track;
+
+            memset(&track, 0, sizeof(track));
+            bench_track_format(spec, track_number, &track.mode, &sector_size, &track.num_sectors, &il);
+            track.cyl = (uint8_t)cyl;
+            track.head = head;
+            track.sector_size_code = size_code_of(sector_size);
+            if (spec->maps && (track_number & 1)) track.hflag = IMD_HFLAG_CMAP_PRES | IMD_HFLAG_HMAP_PRES;
+
+            res = imd_alloc_track_data(&track);
+            if (res != 0) break;
+            for (uint8_t s = 0; s < track.num_sectors; ++s) {
+                /* Sector numbering with the requested interleave and a skew per cylinder */
+                track.smap[(s * il + (s * il / track.num_sectors) + cyl) % track.num_sectors] = (uint8_t)(s + 1);
+                track.cmap[s] = (uint8_t)cyl;
+                track.hmap[s] = head;
+            }
+            /* Collisions of the interleave formula: fall back to sequential numbering */
+            {
+                uint8_t seen[256] = { 0 };
+                int ok = 1;
+                for (uint8_t s = 0; s < track.num_sectors; ++s) {
+                    if (track.smap[s] == 0 || seen[track.smap[s]]++) ok = 0;
+                }
+                if (!ok) {
+                    for (uint8_t s = 0; s < track.num_sectors; ++s) track.smap[s] = (uint8_t)(s + 1);
+                }
+            }
+            for (uint8_t s = 0; s < track.num_sectors; ++s) {
+                track.sflag[s] = fill_sector(spec, &rng, track.data + (size_t)s * track.sector_size, track.sector_size);
+            }
+            track.loaded = 1;
+            res = imd_write_track_imd(f, &track, &opts);
+            imd_free_track_data(&track);
+        }
+    }
+
+    if (fclose(f) != 0 && res == 0) res = IMD_ERR_WRITE_ERROR;
+    if (res == 0 && size_out) {
+        f = fopen(path, "rb");
+        if (!f || fseek(f, 0, SEEK_END) != 0) {
+            res = IMD_ERR_SEEK_ERROR;
+        }
+        else {
+            *size_out = ftell(f);
+        }
+        if (f) fclose(f);
+    }
+    return res;
+}
@@ -0,0 +1,73 @@
+/*
+ * Synthetic IMD Image Generator for the libimd benchmarks.
+ * Builds reproducible images covering every recording mode, sector size,
+ * sector record type and optional map, from floppy-sized to very large.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+#ifndef BENCH_IMAGE_H
+#define BENCH_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Track layout of a generated image */
+#define BENCH_LAYOUT_UNIFORM 0  /* Every track uses mode, sector_size and sectors_per_track */
+#define BENCH_LAYOUT_MIXED   1  /* Tracks cycle through all modes and sector sizes 128-8192 */
+
+/* Description of a synthetic image */
+typedef struct {
+    const char* name;           /* Short identifier used in benchmark output */
+    int layout;                 /* BENCH_LAYOUT_* */
+    uint16_t num_cyls;          /* Cylinders (1-256) */
+    uint8_t num_heads;          /* Heads (1 or 2) */
+    uint8_t mode;               /* IMD mode of a uniform layout */
+    uint32_t sector_size;       /* Sector size of a uniform layout (128-8192) */
+    uint8_t sectors_per_track;  /* Sectors per track of a uniform layout */
+    int interleave;             /* Interleave of the sector numbering (1 = sequential) */
+    /* Percentages of sectors written as each record type; the rest are normal data */
+    int pct_compressed;
+    int pct_unavailable;
+    int pct_deleted;            /* Deleted-data address mark */
+    int pct_error;              /* Data error */
+    int maps;                   /* Non-zero to store cylinder and head maps on every other track */
+    uint32_t seed;              /* Seed of the data and record type choices */
+} BenchImageSpec;
+
+/**
+ * Writes a synthetic image. The same spec always yields the same comment and tracks
+ * (only the date in the header line differs).
+ * @param path Output path (overwritten).
+ * @param spec Image description.
+ * @param size_out Optional pointer to receive the file size in bytes.
+ * @return 0 on success, negative IMD_ERR_* code on error.
+ */
+int bench_generate_image(const char* path, const BenchImageSpec* spec, long* size_out);
+
+/**
+ * Gets the format of one track of a generated image.
+ * @param track Track number, cyl * num_heads + head.
+ * @param interleave Receives the interleave, reduced to 1 where the track has too few sectors for it.
+ */
+void bench_track_format(const BenchImageSpec* spec, size_t track, uint8_t* mode, uint32_t* sector_size, uint8_t* spt, int* interleave);
+
+/**
+ * Returns the sector data bytes described by a spec (unavailable sectors included).
+ */
+uint64_t bench_image_data_bytes(const BenchImageSpec* spec);
+
+/* Small deterministic generator (xorshift32) for data and workload choices */
+uint32_t bench_rand(uint32_t* state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_IMAGE_H */
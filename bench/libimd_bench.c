@@ -0,0 +1,582 @@
+/*
+ * libimd Benchmark Suite.
+ * Generates synthetic images and times the main library operations on them,
+ * printing one machine-readable record per scenario and image.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+ /* Define _DEFAULT_SOURCE to enable POSIX features like clock_gettime */
+#define _DEFAULT_SOURCE
+
+#include "bench_image.h"
+#include "libimd.h"
+#include "libimdf.h"
+#include "libimdchk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifndef GIT_VERSION_STR
+#define GIT_VERSION_STR "unknown"
+#endif
+
+#define BENCH_PATH_MAX 1024
+
+/* Output formats */
+#define OUT_JSON 0  /* One JSON object per line */
+#define OUT_CSV  1  /* Header line, then one comma-separated row per result */
+
+/* Benchmark run settings */
+typedef struct {
+    int quick;                  /* Skip the large images and shorten the time budget */
+    const char* filter;         /* Only run "scenario/image" names containing this (NULL = all) */
+    const char* dir;            /* Directory for generated and scratch files */
+    int output;                 /* OUT_* */
+    int stats;                  /* Collect library counters (imd_stats_enable) */
+    int keep;                   /* Keep the generated images */
+    uint64_t budget_ns;         /* Time budget per scenario; at least one operation always runs */
+} BenchConfig;
+
+/* One image under test */
+typedef struct {
+    BenchImageSpec spec;
+    int large;                  /* Skipped by --quick */
+    char path[BENCH_PATH_MAX];  /* Generated image */
+    long file_size;
+} BenchImage;
+
+/* Timed result of one scenario */
+typedef struct {
+    uint64_t ops;               /* Operations timed */
+    uint64_t bytes;             /* Payload bytes processed by those operations */
+    uint64_t ns;                /* Total time of the operations */
+} BenchResult;
+
+/* Logical sector of an image, as passed to imdf_read_sector/imdf_write_sector */
+typedef struct {
+    uint8_t cyl;
+    uint8_t head;
+    uint8_t id;
+    uint32_t size;
+} BenchSector;
+
+typedef int (*BenchFn)(const BenchConfig* cfg, const BenchImage* img, BenchResult* result);
+
+typedef struct {
+    const char* name;
+    BenchFn run;
+} BenchScenario;
+
+/* --- Images --- */
+
+static BenchImage images[] = {
+    /* name, layout, cyls, heads, mode, sector size, spt, interleave, %compressed, %unavailable, %deleted, %error, maps, seed */
+    { { "sssd_160k", BENCH_LAYOUT_UNIFORM, 40, 1, IMD_MODE_MFM_250, 512, 8, 1, 10, 1, 1, 1, 0, 1 }, 0, "", 0 },
+    { { "dsdd_360k", BENCH_LAYOUT_UNIFORM, 40, 2, IMD_MODE_MFM_250, 512, 9, 1, 10, 1, 1, 1, 0, 2 }, 0, "", 0 },
+    { { "sssd8_250k", BENCH_LAYOUT_UNIFORM, 77, 1, IMD_MODE_FM_500, 128, 26, 6, 20, 2, 2, 2, 0, 3 }, 0, "", 0 },
+    { { "dsdd8_1232k", BENCH_LAYOUT_UNIFORM, 77, 2, IMD_MODE_MFM_500, 1024, 8, 1, 5, 0, 0, 1, 0, 4 }, 0, "", 0 },
+    { { "dshd_1440k", BENCH_LAYOUT_UNIFORM, 80, 2, IMD_MODE_MFM_500, 512, 18, 1, 5, 0, 0, 0, 0, 5 }, 0, "", 0 },
+    { { "mixed_modes", BENCH_LAYOUT_MIXED, 84, 2, 0, 0, 0, 2, 25, 10, 5, 5, 1, 6 }, 0, "", 0 },
+    { { "large_16m", BENCH_LAYOUT_UNIFORM, 256, 2, IMD_MODE_MFM_300, 4096, 8, 1, 10, 1, 1, 1, 1, 7 }, 1, "", 0 },
+    { { "large_64m", BENCH_LAYOUT_UNIFORM, 256, 2, IMD_MODE_MFM_500, 8192, 16, 1, 10, 1, 1, 1, 1, 8 }, 1, "", 0 },
+};
+#define NUM_IMAGES (sizeof(images) / sizeof(images[0]))
+
+/* --- Helpers --- */
+
+static uint64_t now_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000u +
+        (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000u / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static void scratch_path(const BenchConfig* cfg, const BenchImage* img, const char* suffix, char* path, size_t path_size) {
+    snprintf(path, path_size, "%s/libimd_bench_%s%s", cfg->dir, img->spec.name, suffix);
+}
+
+static int copy_file(const char* src, const char* dst) {
+    static uint8_t buf[65536];
+    FILE* fin = fopen(src, "rb");
+    FILE* fout = fin ? fopen(dst, "wb") : NULL;
+    size_t got;
+    int res = 0;
+
+    if (!fin || !fout) {
+        if (fin) fclose(fin);
+        return -1;
+    }
+    while ((got = fread(buf, 1, sizeof(buf), fin)) > 0) {
+        if (fwrite(buf, 1, got, fout) != got) {
+            res = -1;
+            break;
+        }
+    }
+    if (ferror(fin)) res = -1;
+    fclose(fin);
+    if (fclose(fout) != 0) res = -1;
+    return res;
+}
+
+/* Lists the sectors of an image that hold data */
+static int list_sectors(const char* path, BenchSector** sectors_out, size_t* count_out) {
+    ImdImageFile* imdf = NULL;
+    BenchSector* sectors = NULL;
+    size_t num_tracks = 0;
+    size_t count = 0;
+    size_t capacity = 0;
+    int res;
+
+    res = imdf_open_ex(path, IMDF_OPEN_READ_ONLY, &imdf);
+    if (res != IMDF_ERR_OK) return res;
+    imdf_get_num_tracks(imdf, &num_tracks);
+
+    for (size_t t = 0; t < num_tracks; ++t) {
+        const ImdTrackInfo* track = imdf_get_track_info(imdf, t);
+        if (!track) continue;
+        for (uint8_t s = 0; s < track->num_sectors; ++s) {
+            if (!IMD_SDR_HAS_DATA(track->sflag[s])) continue;
+            if (count == capacity) {
+                size_t new_capacity = capacity ? capacity * 2 : 1024;
+                BenchSector* grown = (BenchSector*)realloc(sectors, new_capacity * sizeof(BenchSector));
+                if (!grown) {
+                    free(sectors);
+                    imdf_close(imdf);
+                    return IMDF_ERR_ALLOC;
+                }
+                sectors = grown;
+                capacity = new_capacity;
+            }
+            sectors[count].cyl = track->cyl;
+            sectors[count].head = track->head;
+            sectors[count].id = track->smap[s];
+            sectors[count].size = track->sector_size;
+            count++;
+        }
+    }
+    imdf_close(imdf);
+
+    if (count == 0) {
+        free(sectors);
+        return IMDF_ERR_NOT_FOUND;
+    }
+    *sectors_out = sectors;
+    *count_out = count;
+    return IMDF_ERR_OK;
+}
+
+/* True while a scenario should keep running: below its operation cap and time budget */
+static int keep_going(const BenchConfig* cfg, const BenchResult* result, uint64_t max_ops) {
+    if (result->ops == 0) return 1;
+    return result->ops < max_ops && result->ns < cfg->budget_ns;
+}
+
+/* --- Scenarios --- */
+
+static int open_with_flags(const BenchConfig* cfg, const BenchImage* img, BenchResult* result, unsigned flags) {
+    while (keep_going(cfg, result, 1000)) {
+        ImdImageFile* imdf = NULL;
+        uint64_t start = now_ns();
+        int res = imdf_open_ex(img->path, flags, &imdf);
+        imdf_close(imdf);
+        result->ns += now_ns() - start;
+        if (res != IMDF_ERR_OK) return res;
+        result->ops++;
+        result->bytes += (uint64_t)img->file_size;
+    }
+    return 0;
+}
+
+static int bench_open(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    return open_with_flags(cfg, img, result, IMDF_OPEN_READ_ONLY);
+}
+
+static int bench_open_lazy(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    return open_with_flags(cfg, img, result, IMDF_OPEN_READ_ONLY | IMDF_OPEN_LAZY);
+}
+
+static int bench_open_parallel(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    return open_with_flags(cfg, img, result, IMDF_OPEN_READ_ONLY | IMDF_OPEN_PARALLEL);
+}
+
+static int bench_read_random(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    BenchSector* sectors = NULL;
+    ImdImageFile* imdf = NULL;
+    uint8_t buffer[8192];
+    uint32_t rng = img->spec.seed;
+    size_t count = 0;
+    int res;
+
+    res = list_sectors(img->path, &sectors, &count);
+    if (res != IMDF_ERR_OK) return res;
+    res = imdf_open_ex(img->path, IMDF_OPEN_READ_ONLY, &imdf);
+
+    /* Batches of reads between clock samples, so the clock does not dominate */
+    while (res == IMDF_ERR_OK && keep_going(cfg, result, 10000000)) {
+        uint64_t start = now_ns();
+        for (int i = 0; i < 256 && res == IMDF_ERR_OK; ++i) {
+            const BenchSector* sector = &sectors[bench_rand(&rng) % count];
+            res = imdf_read_sector(imdf, sector->cyl, sector->head, sector->id, buffer, sizeof(buffer));
+            result->bytes += sector->size;
+        }
+        result->ns += now_ns() - start;
+        result->ops += 256;
+    }
+    imdf_close(imdf);
+    free(sectors);
+    return res;
+}
+
+/* Writes new (non-uniform) data to sectors of a scratch copy, then closes it */
+static int write_sectors(const BenchConfig* cfg, const BenchImage* img, BenchResult* result, int random_order, unsigned flags) {
+    char path[BENCH_PATH_MAX];
+    BenchSector* sectors = NULL;
+    ImdImageFile* imdf = NULL;
+    uint8_t buffer[8192];
+    uint32_t rng = img->spec.seed ^ 0x5A5A5A5Au;
+    size_t count = 0;
+    uint64_t start;
+    int res;
+
+    for (size_t i = 0; i < sizeof(buffer); ++i) buffer[i] = (uint8_t)bench_rand(&rng);
+
+    res = list_sectors(img->path, &sectors, &count);
+    if (res != IMDF_ERR_OK) return res;
+    scratch_path(cfg, img, "_write.imd", path, sizeof(path));
+    if (copy_file(img->path, path) != 0) {
+        free(sectors);
+        return IMDF_ERR_IO;
+    }
+
+    res = imdf_open_ex(path, flags, &imdf);
+    for (size_t i = 0; res == IMDF_ERR_OK && keep_going(cfg, result, count); ++i) {
+        const BenchSector* sector = &sectors[random_order ? bench_rand(&rng) % count : i];
+        buffer[0] = (uint8_t)i; /* Every write changes the data */
+        start = now_ns();
+        res = imdf_write_sector(imdf, sector->cyl, sector->head, sector->id, buffer, sector->size);
+        result->ns += now_ns() - start;
+        result->ops++;
+        result->bytes += sector->size;
+    }
+    /* Closing writes back any deferred changes, so it is part of the cost */
+    start = now_ns();
+    imdf_close(imdf);
+    result->ns += now_ns() - start;
+
+    remove(path);
+    free(sectors);
+    return res;
+}
+
+static int bench_write_seq(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    return write_sectors(cfg, img, result, 0, 0);
+}
+
+static int bench_write_random(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    return write_sectors(cfg, img, result, 1, 0);
+}
+
+static int bench_write_random_wb(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    return write_sectors(cfg, img, result, 1, IMDF_OPEN_WRITE_BACK);
+}
+
+static int bench_format_tracks(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    const BenchImageSpec* spec = &img->spec;
+    char path[BENCH_PATH_MAX];
+    int res = IMDF_ERR_OK;
+
+    scratch_path(cfg, img, "_format.imd", path, sizeof(path));
+    while (res == IMDF_ERR_OK && keep_going(cfg, result, 100)) {
+        ImdImageFile* imdf = NULL;
+        uint64_t start;
+
+        remove(path);
+        start = now_ns();
+        res = imdf_create(path, "libimd_bench format\r\n", &imdf);
+        for (uint16_t cyl = 0; cyl < spec->num_cyls && res == IMDF_ERR_OK; ++cyl) {
+            for (uint8_t head = 0; head < spec->num_heads && res == IMDF_ERR_OK; ++head) {
+                uint8_t mode, spt;
+                uint32_t sector_size;
+                int interleave;
+                bench_track_format(spec, (size_t)cyl * spec->num_heads + head, &mode, &sector_size, &spt, &interleave);
+                res = imdf_format_track(imdf, (uint8_t)cyl, head, mode, spt, sector_size, 1,
+                    interleave, 0, LIBIMD_FILL_BYTE_DEFAULT);
+            }
+        }
+        imdf_close(imdf);
+        result->ns += now_ns() - start;
+        result->ops++;
+        result->bytes += bench_image_data_bytes(spec);
+    }
+    remove(path);
+    return res;
+}
+
+static int bench_format_disk(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    const BenchImageSpec* spec = &img->spec;
+    size_t num_tracks = (size_t)spec->num_cyls * spec->num_heads;
+    ImdfTrackFormat* formats;
+    ImdfDiskGeometry geometry;
+    char path[BENCH_PATH_MAX];
+    int res = IMDF_ERR_OK;
+
+    formats = (ImdfTrackFormat*)calloc(num_tracks, sizeof(ImdfTrackFormat));
+    if (!formats) return IMDF_ERR_ALLOC;
+    for (size_t t = 0; t < num_tracks; ++t) {
+        bench_track_format(spec, t, &formats[t].mode, &formats[t].sector_size, &formats[t].num_sectors,
+            &formats[t].interleave);
+        formats[t].first_sector_id = 1;
+        formats[t].fill_byte = LIBIMD_FILL_BYTE_DEFAULT;
+    }
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.num_cyls = spec->num_cyls;
+    geometry.num_heads = spec->num_heads;
+    geometry.track_formats = formats;
+
+    scratch_path(cfg, img, "_format.imd", path, sizeof(path));
+    while (res == IMDF_ERR_OK && keep_going(cfg, result, 1000)) {
+        ImdImageFile* imdf = NULL;
+        uint64_t start;
+
+        remove(path);
+        start = now_ns();
+        res = imdf_create(path, "libimd_bench format\r\n", &imdf);
+        if (res == IMDF_ERR_OK) res = imdf_format_disk(imdf, &geometry);
+        imdf_close(imdf);
+        result->ns += now_ns() - start;
+        result->ops++;
+        result->bytes += bench_image_data_bytes(spec);
+    }
+    remove(path);
+    free(formats);
+    return res;
+}
+
+static int bench_imdchk(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    ImdChkOptions options;
+
+    options.error_mask = DEFAULT_ERROR_MASK;
+    options.max_allowed_cyl = -1;
+    options.required_head = -1;
+    options.max_allowed_sectors = -1;
+
+    while (keep_going(cfg, result, 1000)) {
+        ImdChkResults results;
+        uint64_t start = now_ns();
+        int res = imdchk_check_file(img->path, &options, &results);
+        result->ns += now_ns() - start;
+        if (res < 0) return res;
+        result->ops++;
+        result->bytes += (uint64_t)img->file_size;
+    }
+    return 0;
+}
+
+static int convert_to_bin(const BenchConfig* cfg, const BenchImage* img, BenchResult* result, unsigned ring_slots) {
+    static const ImdWriteOpts opts = { IMD_COMPRESSION_AS_READ, 0, 0, { 0, 1, 2, 3, 4, 5 }, LIBIMD_IL_AS_READ };
+    char path[BENCH_PATH_MAX];
+    int res = 0;
+
+    scratch_path(cfg, img, ".bin", path, sizeof(path));
+    while (res == 0 && keep_going(cfg, result, 1000)) {
+        FILE* fin;
+        FILE* fout;
+        ImdIo io;
+        long tracks;
+        uint64_t start = now_ns();
+
+        fin = fopen(img->path, "rb");
+        fout = fopen(path, "wb");
+        if (!fin || !fout) {
+            if (fin) fclose(fin);
+            if (fout) fclose(fout);
+            return IMD_ERR_WRITE_ERROR;
+        }
+        imd_io_init_file(&io, fin);
+        tracks = imd_convert_stream(&io, fout, IMD_CONVERT_BIN, &opts, ring_slots);
+        fclose(fin);
+        if (fclose(fout) != 0 && tracks >= 0) tracks = IMD_ERR_WRITE_ERROR;
+        result->ns += now_ns() - start;
+        if (tracks < 0) res = (int)tracks;
+        result->ops++;
+        result->bytes += (uint64_t)img->file_size;
+    }
+    remove(path);
+    return res;
+}
+
+static int bench_convert_bin(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    return convert_to_bin(cfg, img, result, 0);
+}
+
+static int bench_convert_bin_serial(const BenchConfig* cfg, const BenchImage* img, BenchResult* result) {
+    return convert_to_bin(cfg, img, result, 1);
+}
+
+static const BenchScenario scenarios[] = {
+    { "open", bench_open },
+    { "open_lazy", bench_open_lazy },
+    { "open_parallel", bench_open_parallel },
+    { "read_random", bench_read_random },
+    { "write_seq", bench_write_seq },
+    { "write_random", bench_write_random },
+    { "write_random_wb", bench_write_random_wb },
+    { "format_track_full_disk", bench_format_tracks },
+    { "format_disk", bench_format_disk },
+    { "imdchk_check_file", bench_imdchk },
+    { "convert_bin", bench_convert_bin },
+    { "convert_bin_serial", bench_convert_bin_serial },
+};
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* --- Output --- */
+
+static void print_header(const BenchConfig* cfg) {
+    if (cfg->output == OUT_CSV) {
+        printf("version,scenario,image,image_bytes,status,ops,bytes,total_ns,ns_per_op,mb_per_s,"
+            "bytes_read,bytes_written,allocations,image_rewrites,tracks_decoded,tracks_encoded\n");
+    }
+}
+
+static void print_result(const BenchConfig* cfg, const BenchScenario* scenario, const BenchImage* img,
+    int status, const BenchResult* result, const ImdStats* stats) {
+    double ns_per_op = result->ops ? (double)result->ns / (double)result->ops : 0.0;
+    double mb_per_s = result->ns ? ((double)result->bytes / 1e6) / ((double)result->ns / 1e9) : 0.0;
+
+    if (cfg->output == OUT_CSV) {
+        printf("%s,%s,%s,%ld,%d,%llu,%llu,%llu,%.1f,%.2f,%llu,%llu,%llu,%llu,%llu,%llu\n",
+            GIT_VERSION_STR, scenario->name, img->spec.name, img->file_size, status,
+            (unsigned long long)result->ops, (unsigned long long)result->bytes, (unsigned long long)result->ns,
+            ns_per_op, mb_per_s,
+            (unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written,
+            (unsigned long long)stats->allocations, (unsigned long long)stats->image_rewrites,
+            (unsigned long long)stats->tracks_decoded, (unsigned long long)stats->tracks_encoded);
+    }
+    else {
+        printf("{\"version\":\"%s\",\"scenario\":\"%s\",\"image\":\"%s\",\"image_bytes\":%ld,\"status\":%d,"
+            "\"ops\":%llu,\"bytes\":%llu,\"total_ns\":%llu,\"ns_per_op\":%.1f,\"mb_per_s\":%.2f",
+            GIT_VERSION_STR, scenario->name, img->spec.name, img->file_size, status,
+            (unsigned long long)result->ops, (unsigned long long)result->bytes, (unsigned long long)result->ns,
+            ns_per_op, mb_per_s);
+        if (cfg->stats) {
+            printf(",\"bytes_read\":%llu,\"bytes_written\":%llu,\"allocations\":%llu,\"image_rewrites\":%llu,"
+                "\"tracks_decoded\":%llu,\"tracks_encoded\":%llu",
+                (unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written,
+                (unsigned long long)stats->allocations, (unsigned long long)stats->image_rewrites,
+                (unsigned long long)stats->tracks_decoded, (unsigned long long)stats->tracks_encoded);
+        }
+        printf("}\n");
+    }
+    fflush(stdout);
+}
+
+/* --- Main --- */
+
+static void usage(const char* prog) {
+    fprintf(stderr, "libimd_bench %s\n", GIT_VERSION_STR);
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  --quick          Skip the large images and use a 100 ms budget per scenario\n");
+    fprintf(stderr, "  --filter TEXT    Only run scenario/image names containing TEXT\n");
+    fprintf(stderr, "  --dir DIR        Directory for generated images (default: .)\n");
+    fprintf(stderr, "  --budget-ms N    Time budget per scenario (default: 1000)\n");
+    fprintf(stderr, "  --csv            CSV output instead of JSON lines\n");
+    fprintf(stderr, "  --no-stats       Do not collect library counters\n");
+    fprintf(stderr, "  --keep           Keep the generated images\n");
+    fprintf(stderr, "  --list           List the scenarios and images, then exit\n");
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig cfg;
+    long budget_ms = -1;
+    int failures = 0;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.dir = ".";
+    cfg.stats = 1;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--quick") == 0) cfg.quick = 1;
+        else if (strcmp(argv[i], "--csv") == 0) cfg.output = OUT_CSV;
+        else if (strcmp(argv[i], "--no-stats") == 0) cfg.stats = 0;
+        else if (strcmp(argv[i], "--keep") == 0) cfg.keep = 1;
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) cfg.filter = argv[++i];
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) cfg.dir = argv[++i];
+        else if (strcmp(argv[i], "--budget-ms") == 0 && i + 1 < argc) budget_ms = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return 0;
+        }
+        else if (strcmp(argv[i], "--list") == 0) {
+            for (size_t s = 0; s < NUM_SCENARIOS; ++s) printf("scenario %s\n", scenarios[s].name);
+            for (size_t m = 0; m < NUM_IMAGES; ++m) {
+                printf("image %s%s\n", images[m].spec.name, images[m].large ? " (large)" : "");
+            }
+            return 0;
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (budget_ms < 0) budget_ms = cfg.quick ? 100 : 1000;
+    cfg.budget_ns = (uint64_t)budget_ms * 1000000u;
+
+    imd_stats_enable(cfg.stats);
+    print_header(&cfg);
+
+    for (size_t m = 0; m < NUM_IMAGES; ++m) {
+        BenchImage* img = &images[m];
+        int generated = 0;
+
+        if (cfg.quick && img->large) continue;
+
+        for (size_t s = 0; s < NUM_SCENARIOS; ++s) {
+            char name[256];
+            BenchResult result;
+            ImdStats stats;
+            int status;
+
+            snprintf(name, sizeof(name), "%s/%s", scenarios[s].name, img->spec.name);
+            if (cfg.filter && !strstr(name, cfg.filter)) continue;
+
+            if (!generated) {
+                scratch_path(&cfg, img, ".imd", img->path, sizeof(img->path));
+                status = bench_generate_image(img->path, &img->spec, &img->file_size);
+                if (status != 0) {
+                    fprintf(stderr, "libimd_bench: cannot generate %s (error %d)\n", img->path, status);
+                    failures++;
+                    break;
+                }
+                generated = 1;
+            }
+
+            memset(&result, 0, sizeof(result));
+            imd_reset_stats();
+            status = scenarios[s].run(&cfg, img, &result);
+            imd_get_stats(&stats);
+            print_result(&cfg, &scenarios[s], img, status, &result, &stats);
+            if (status < 0) failures++;
+        }
+
+        if (generated && !cfg.keep) remove(img->path);
+    }
+
+    return failures ? 1 : 0;
+}
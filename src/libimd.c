@@ -11,13 +11,49 @@
  *
  */
 
+ /* Define _DEFAULT_SOURCE to enable POSIX features like pthread_rwlock_t */
+#define _DEFAULT_SOURCE
+
 #include "libimd.h"
+#include "libimd_thread.h"
+#include "libimd_stats.h"
 #include <string.h> /* For memset, memcpy, strncpy, strcspn, sscanf */
 #include <stdlib.h> /* For malloc, free, realloc */
 #include <stdio.h>  /* For FILE, fread, fputc, etc. */
 #include <errno.h>  /* For errno */
 #include <time.h>   /* For time, localtime, strftime */
 #include <ctype.h>  /* For isdigit, isalpha, tolower in imd_ctoh */
+#include <limits.h> /* For LONG_MAX */
+
+/* SIMD kernels for the uniformity scan (see Uniformity Kernels below) */
+#if !defined(LIBIMD_DISABLE_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LIBIMD_HAVE_SSE2 1
+#include <emmintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#define LIBIMD_HAVE_AVX2 1
+#define LIBIMD_TARGET_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+#elif defined(__GNUC__) || defined(__clang__)
+#define LIBIMD_HAVE_AVX2 1
+#define LIBIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+#elif !defined(LIBIMD_DISABLE_SIMD) && (defined(__aarch64__) || defined(_M_ARM64))
+#define LIBIMD_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Storage class for small per-thread caches */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define LIBIMD_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define LIBIMD_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__) || defined(__clang__)
+#define LIBIMD_THREAD_LOCAL __thread
+#else
+#define LIBIMD_THREAD_LOCAL
+#endif
 
  /* Define to enable debug printf statements */
 //#define DEBUG_LIBIMD    /* Uncomment for debug */
@@ -33,6 +69,9 @@
 
 /* --- Constants and Internal Data --- */
 
+/* Encoded tracks up to this size are built on the stack by imd_write_track_imd */
+#define LIBIMD_ENCODE_STACK_BUFFER 20480
+
 /* Sentinel value for invalid position in interleave functions */
 #define LIBIMD_INVALID_SECTOR_POS 0xFF
 
@@ -45,46 +84,6 @@ static const size_t SECTOR_SIZE_LOOKUP_COUNT = sizeof(SECTOR_SIZE_LOOKUP) / size
 
 /* --- Internal Helper Functions --- */
 
-/**
- * @brief Reads a specified number of bytes from a file stream.
- * @param buffer Pointer to the buffer to read into.
- * @param size Number of bytes to read.
- * @param file File stream to read from.
- * @return Number of bytes successfully read. Returns value less than size on EOF or error.
- */
-static size_t read_bytes(void* buffer, size_t size, FILE* file) {
-    if (size == 0) return 0; /* Handle zero-size read */
-    /* Clear errno before fread */
-    errno = 0;
-    size_t bytes_read = fread(buffer, 1, size, file);
-    /* Caller must check feof/ferror if bytes_read < size */
-    return bytes_read;
-}
-
-/**
- * @brief Reads a single byte from a file stream.
- * @param file File stream to read from.
- * @param byte_out Pointer to store the read byte.
- * @return 1 on success, 0 on EOF, IMD_ERR_READ_ERROR on error.
- */
-static int read_byte(FILE* file, uint8_t* byte_out) {
-    errno = 0;
-    int result = fgetc(file);
-    if (result == EOF) {
-        if (ferror(file)) {
-            DEBUG_PRINTF("DEBUG: read_byte: fgetc returned EOF, ferror set (errno=%d). Returning IMD_ERR_READ_ERROR.\n", errno);
-            return IMD_ERR_READ_ERROR; /* Error takes precedence */
-        }
-        else {
-            DEBUG_PRINTF("DEBUG: read_byte: fgetc returned EOF, ferror NOT set (feof=%d). Returning 0.\n", feof(file));
-            return 0; /* EOF */
-        }
-    }
-    *byte_out = (uint8_t)result;
-    return 1; /* Success */
-}
-
-
 /**
  * @brief Writes a specified number of bytes to a file stream.
  * @param buffer Pointer to the buffer to write from.
@@ -94,7 +93,7 @@ static int read_byte(FILE* file, uint8_t* byte_out) {
  */
 static int write_bytes(const void* buffer, size_t size, FILE* file) {
     if (size == 0) return 0;
-    if (fwrite(buffer, 1, size, file) != size) {
+    if (imd_stat_fwrite(buffer, 1, size, file) != size) {
         /* DEBUG_PRINTF can be added here if write failures need investigation */
         return IMD_ERR_WRITE_ERROR;
     }
@@ -102,41 +101,19 @@ static int write_bytes(const void* buffer, size_t size, FILE* file) {
 }
 
 
-/* --- Public Function Implementations --- */
-
-/* --- Header and Comment Handling --- */
-
-int imd_read_file_header(FILE* fimd, ImdHeaderInfo* header_info, char* header_line_buf, size_t buf_size) {
-    char line[LIBIMD_MAX_HEADER_LINE];
-
-    if (!fimd) return IMD_ERR_INVALID_ARG; /* Use specific code */
-    clearerr(fimd); /* Clear status before read */
-    if (fgets(line, sizeof(line), fimd) == NULL) {
-        /*
-         * Check for error vs EOF.
-         * fgets returns NULL on error or EOF. The comment indicates
-         * EOF should be treated as a read error in this context.
-         * We check ferror to see if a specific error occurred, but
-         * ultimately return IMD_ERR_READ_ERROR in either case (EOF or error)
-         * according to the requirement. Directly returning the error code
-         * avoids the unused result warning for ferror.
-         */
-        DEBUG_PRINTF("DEBUG: imd_read_file_header: fgets returned NULL (ferror=%d, feof=%d). Returning IMD_ERR_READ_ERROR.\n", ferror(fimd), feof(fimd));
-        (void)ferror(fimd); /* Acknowledge check, but ignore result as per comment */
-        return IMD_ERR_READ_ERROR;
-    }
-
-    /* Store raw line if buffer provided */
-    if (header_line_buf && buf_size > 0) {
-        snprintf(header_line_buf, buf_size, "%s", line);
-    }
-
+/*
+ * Validates and parses a raw IMD header line ("IMD version: date time").
+ * The line is modified (trailing newline removed).
+ * Returns 0 on success (even if the date/time could not be parsed), IMD_ERR_READ_ERROR if
+ * the line is not an IMD header.
+ */
+static int parse_header_line(char* line, ImdHeaderInfo* header_info) {
     /* Remove trailing newline characters */
     line[strcspn(line, "\r\n")] = 0;
 
     /* Basic validation */
     if (strncmp(line, "IMD ", 4) != 0) {
-        DEBUG_PRINTF("DEBUG: imd_read_file_header: Header prefix 'IMD ' not found. Returning IMD_ERR_READ_ERROR.\n");
+        DEBUG_PRINTF("DEBUG: parse_header_line: Header prefix 'IMD ' not found. Returning IMD_ERR_READ_ERROR.\n");
         return IMD_ERR_READ_ERROR; /* Treat as read error (invalid format) */
     }
 
@@ -155,12 +132,12 @@ int imd_read_file_header(FILE* fimd, ImdHeaderInfo* header_info, char* header_li
 
         /* Check if parsing failed completely or partially */
         if (fields < 7) {
-            DEBUG_PRINTF("DEBUG: imd_read_file_header: sscanf parsed only %d fields (expected 7). Date/time may be invalid.\n", fields);
+            DEBUG_PRINTF("DEBUG: parse_header_line: sscanf parsed only %d fields (expected 7). Date/time may be invalid.\n", fields);
             /* Parsing failed to get all date/time fields. */
             /* Check if at least the version string was parsed. */
             if (sscanf(line, "IMD %31[^:]:", header_info->version) != 1) {
                 /* Version string itself couldn't be parsed, set to "Unknown" */
-                DEBUG_PRINTF("DEBUG: imd_read_file_header: Failed to parse version string. Setting to 'Unknown'.\n");
+                DEBUG_PRINTF("DEBUG: parse_header_line: Failed to parse version string. Setting to 'Unknown'.\n");
                 snprintf(header_info->version, sizeof(header_info->version), "Unknown");
                 header_info->version[sizeof(header_info->version) - 1] = '\0'; /* Ensure null termination */
             }
@@ -177,7 +154,7 @@ int imd_read_file_header(FILE* fimd, ImdHeaderInfo* header_info, char* header_li
                 header_info->second < 0 || header_info->second > 59)
             {
                 /* Values are out of range, treat as parse failure for date/time */
-                DEBUG_PRINTF("DEBUG: imd_read_file_header: Parsed date/time values out of range. Zeroing fields.\n");
+                DEBUG_PRINTF("DEBUG: parse_header_line: Parsed date/time values out of range. Zeroing fields.\n");
                 header_info->day = header_info->month = header_info->year = 0;
                 header_info->hour = header_info->minute = header_info->second = 0;
             }
@@ -187,6 +164,103 @@ int imd_read_file_header(FILE* fimd, ImdHeaderInfo* header_info, char* header_li
     return 0; /* Success (even if parsing failed, the header line was read) */
 }
 
+/* --- Public Function Implementations --- */
+
+/* --- Memory Allocation --- */
+
+static void* default_malloc(size_t size, void* ctx) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void* default_realloc(void* ptr, size_t size, void* ctx) {
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+static void default_free(void* ptr, void* ctx) {
+    (void)ctx;
+    free(ptr);
+}
+
+static ImdAllocator current_allocator = { default_malloc, default_realloc, default_free, NULL };
+
+int imd_set_allocator(const ImdAllocator* allocator) {
+    if (!allocator) {
+        current_allocator.malloc_fn = default_malloc;
+        current_allocator.realloc_fn = default_realloc;
+        current_allocator.free_fn = default_free;
+        current_allocator.ctx = NULL;
+        return 0;
+    }
+    if (!allocator->malloc_fn || !allocator->realloc_fn || !allocator->free_fn) return IMD_ERR_INVALID_ARG;
+    current_allocator = *allocator;
+    return 0;
+}
+
+void* imd_malloc(size_t size) {
+    if (imd_stats_active()) {
+        imd_stat_add(IMD_STAT_ALLOCATIONS, 1);
+        imd_stat_add(IMD_STAT_BYTES_ALLOCATED, size);
+    }
+    return current_allocator.malloc_fn(size, current_allocator.ctx);
+}
+
+void* imd_calloc(size_t count, size_t size) {
+    void* ptr;
+
+    if (size != 0 && count > SIZE_MAX / size) return NULL;
+    if (imd_stats_active()) {
+        imd_stat_add(IMD_STAT_ALLOCATIONS, 1);
+        imd_stat_add(IMD_STAT_BYTES_ALLOCATED, count * size);
+    }
+    ptr = current_allocator.malloc_fn(count * size, current_allocator.ctx);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void* imd_realloc(void* ptr, size_t size) {
+    if (imd_stats_active()) {
+        imd_stat_add(IMD_STAT_ALLOCATIONS, 1);
+        imd_stat_add(IMD_STAT_BYTES_ALLOCATED, size);
+    }
+    return current_allocator.realloc_fn(ptr, size, current_allocator.ctx);
+}
+
+void imd_free(void* ptr) {
+    if (ptr) current_allocator.free_fn(ptr, current_allocator.ctx);
+}
+
+/* --- Header and Comment Handling --- */
+
+int imd_read_file_header(FILE* fimd, ImdHeaderInfo* header_info, char* header_line_buf, size_t buf_size) {
+    char line[LIBIMD_MAX_HEADER_LINE];
+
+    if (!fimd) return IMD_ERR_INVALID_ARG; /* Use specific code */
+    clearerr(fimd); /* Clear status before read */
+    if (imd_stat_fgets(line, sizeof(line), fimd) == NULL) {
+        /*
+         * Check for error vs EOF.
+         * fgets returns NULL on error or EOF. The comment indicates
+         * EOF should be treated as a read error in this context.
+         * We check ferror to see if a specific error occurred, but
+         * ultimately return IMD_ERR_READ_ERROR in either case (EOF or error)
+         * according to the requirement. Directly returning the error code
+         * avoids the unused result warning for ferror.
+         */
+        DEBUG_PRINTF("DEBUG: imd_read_file_header: fgets returned NULL (ferror=%d, feof=%d). Returning IMD_ERR_READ_ERROR.\n", ferror(fimd), feof(fimd));
+        (void)ferror(fimd); /* Acknowledge check, but ignore result as per comment */
+        return IMD_ERR_READ_ERROR;
+    }
+
+    /* Store raw line if buffer provided */
+    if (header_line_buf && buf_size > 0) {
+        snprintf(header_line_buf, buf_size, "%s", line);
+    }
+
+    return parse_header_line(line, header_info);
+}
+
 /* Modified imd_read_comment_block: Update size only on success */
 char* imd_read_comment_block(FILE* fimd, size_t* comment_size_out) {
     char* buffer = NULL;
@@ -211,7 +285,7 @@ char* imd_read_comment_block(FILE* fimd, size_t* comment_size_out) {
     }
 
     clearerr(fimd); /* Clear status before reading loop */
-    while ((c = fgetc(fimd)) != EOF && c != LIBIMD_COMMENT_EOF_MARKER) {
+    while ((c = imd_stat_fgetc(fimd)) != EOF && c != LIBIMD_COMMENT_EOF_MARKER) {
         if (size >= capacity - 1) { /* Need space for char + null terminator */
             size_t new_capacity = capacity * 2;
             /* Add arbitrary upper limit if desired */
@@ -273,7 +347,7 @@ int imd_skip_comment_block(FILE* fimd) {
     int c;
     if (!fimd) return IMD_ERR_INVALID_ARG;
     clearerr(fimd); /* Clear status before read loop */
-    while ((c = fgetc(fimd)) != EOF && c != LIBIMD_COMMENT_EOF_MARKER);
+    while ((c = imd_stat_fgetc(fimd)) != EOF && c != LIBIMD_COMMENT_EOF_MARKER);
     if (c == EOF) {
         /*
         * If c is EOF, it means the loop terminated without finding
@@ -286,8 +360,9 @@ int imd_skip_comment_block(FILE* fimd) {
     return 0; /* Success */
 }
 
-int imd_write_file_header(FILE* fout, const char* version_string) {
-    if (!fout || !version_string) return IMD_ERR_INVALID_ARG;
+int imd_format_file_header(char* buf, size_t buf_size, const char* version_string, size_t* written_out) {
+    if (!buf || !version_string || !written_out) return IMD_ERR_INVALID_ARG;
+    *written_out = 0;
 
     time_t now = time(NULL);
     struct tm* tminfo = localtime(&now);
@@ -295,17 +370,33 @@ int imd_write_file_header(FILE* fout, const char* version_string) {
 
     /* Check if localtime returned NULL */
     if (tminfo == NULL) {
-        DEBUG_PRINTF("DEBUG: imd_write_file_header: localtime() returned NULL. Returning IMD_ERR_WRITE_ERROR.\n");
+        DEBUG_PRINTF("DEBUG: imd_format_file_header: localtime() returned NULL. Returning IMD_ERR_WRITE_ERROR.\n");
         return IMD_ERR_WRITE_ERROR; /* Indicate error occurred */
     }
 
     if (strftime(timestamp, sizeof(timestamp), "%d/%m/%Y %H:%M:%S", tminfo) == 0) {
-        DEBUG_PRINTF("DEBUG: imd_write_file_header: strftime() failed. Returning IMD_ERR_WRITE_ERROR.\n");
+        DEBUG_PRINTF("DEBUG: imd_format_file_header: strftime() failed. Returning IMD_ERR_WRITE_ERROR.\n");
         return IMD_ERR_WRITE_ERROR; /* Error formatting time */
     }
 
-    if (fprintf(fout, "IMD %s: %s\r\n", version_string, timestamp) < 0) {
-        DEBUG_PRINTF("DEBUG: imd_write_file_header: fprintf failed. Returning IMD_ERR_WRITE_ERROR.\n");
+    int len = snprintf(buf, buf_size, "IMD %s: %s\r\n", version_string, timestamp);
+    if (len < 0) return IMD_ERR_WRITE_ERROR;
+    if ((size_t)len >= buf_size) return IMD_ERR_BUFFER_TOO_SMALL; /* Also leaves room for the NUL */
+    *written_out = (size_t)len;
+    return 0;
+}
+
+int imd_write_file_header(FILE* fout, const char* version_string) {
+    char header[LIBIMD_MAX_HEADER_LINE];
+    size_t len;
+    int res;
+
+    if (!fout || !version_string) return IMD_ERR_INVALID_ARG;
+
+    res = imd_format_file_header(header, sizeof(header), version_string, &len);
+    if (res != 0) return (res == IMD_ERR_BUFFER_TOO_SMALL) ? IMD_ERR_INVALID_ARG : res; /* Version too long */
+    if (write_bytes(header, len, fout) != 0) {
+        DEBUG_PRINTF("DEBUG: imd_write_file_header: write failed. Returning IMD_ERR_WRITE_ERROR.\n");
         return IMD_ERR_WRITE_ERROR; /* Write error */
     }
     return 0;
@@ -320,7 +411,7 @@ int imd_write_comment_block(FILE* fout, const char* comment, size_t comment_len)
             return IMD_ERR_WRITE_ERROR; /* Error writing comment */
         }
     }
-    if (fputc(LIBIMD_COMMENT_EOF_MARKER, fout) == EOF) {
+    if (imd_stat_fputc(LIBIMD_COMMENT_EOF_MARKER, fout) == EOF) {
         DEBUG_PRINTF("DEBUG: imd_write_comment_block: fputc failed for marker. Returning IMD_ERR_WRITE_ERROR.\n");
         return IMD_ERR_WRITE_ERROR; /* Error writing terminator */
     }
@@ -387,7 +478,7 @@ int imd_alloc_track_data(ImdTrackInfo* track) {
     }
 
     /* Allocate */
-    track->data = (uint8_t*)malloc(total_data_size);
+    track->data = (uint8_t*)imd_malloc(total_data_size);
     if (!track->data) {
         DEBUG_PRINTF("DEBUG: imd_alloc_track_data: Error - malloc failed for %zu bytes.\n", total_data_size);
         track->data_size = 0;
@@ -411,654 +502,304 @@ const uint32_t* imd_get_sector_size_lookup(size_t* count) {
 void imd_free_track_data(ImdTrackInfo* track) {
     if (track && track->data) {
         DEBUG_PRINTF("DEBUG: imd_free_track_data: Freeing data buffer for track C%u H%u.\n", track->cyl, track->head);
-        free(track->data);
+        imd_free(track->data);
         track->data = NULL;
         track->data_size = 0;
         track->loaded = 0; /* Reset loaded flag when freeing */
     }
 }
 
-/* Modified imd_load_track to use new IMD_SDR_* defines */
-int imd_load_track(FILE* fimd, ImdTrackInfo* track, uint8_t fill_byte) {
+/* How parse_track_buffer handles sector data */
+#define PARSE_FLAGS_ONLY  0 /* Header, maps and flags only */
+#define PARSE_LOAD_ALLOC  1 /* Expand the data into a new allocation */
+#define PARSE_LOAD_INTO   2 /* Expand the data into caller-owned storage */
+#define PARSE_FLAGS_PARTIAL 3 /* As PARSE_FLAGS_ONLY, the final sector's data may be cut short by the end of the input */
+#define PARSE_LOADS_DATA(load_data) ((load_data) == PARSE_LOAD_ALLOC || (load_data) == PARSE_LOAD_INTO)
+
+/*
+ * Parses one track record from a memory buffer: header, maps and sector flags.
+ * With PARSE_LOAD_ALLOC the sector data is also expanded into a new allocation; with
+ * PARSE_LOAD_INTO it is expanded into data_buf (data_buf_size bytes, owned by the caller).
+ * Absent cylinder/head maps are filled with the track's cylinder/head, as imd_load_track does.
+ * Returns 1 on success, 0 if the buffer is empty, negative IMD_ERR_* on error.
+ * On error, no data is left allocated in (or referenced by) the track.
+ */
+static int parse_track_buffer(const uint8_t* buf, size_t len, ImdTrackInfo* track, uint8_t fill_byte, int load_data,
+    uint8_t* data_buf, size_t data_buf_size, size_t* consumed_out) {
+    size_t pos;
     uint8_t head_byte;
-    size_t current_offset = 0;
-    int read_status;
-    long start_pos;
 
-    if (!fimd || !track) { /* Check both */
-        return IMD_ERR_INVALID_ARG;
-    }
+    if ((!buf && len > 0) || !track) return IMD_ERR_INVALID_ARG;
+    memset(track, 0, sizeof(ImdTrackInfo));
+    if (consumed_out) *consumed_out = 0;
+    if (len == 0) return 0; /* Clean end of image */
 
-    start_pos = ftell(fimd); /* Remember start position for error recovery */
-    if (start_pos < 0) {
-        DEBUG_PRINTF("DEBUG: imd_load_track: ftell failed before reading track. Returning IMD_ERR_SEEK_ERROR.\n");
-        return IMD_ERR_SEEK_ERROR; /* Use specific error */
-    }
-
-    memset(track, 0, sizeof(ImdTrackInfo)); /* Initialize track structure */
-
-    /* Read track header */
-    clearerr(fimd); /* Clear status before reading header */
-    read_status = read_byte(fimd, &track->mode);
-    if (read_status <= 0) { /* EOF or error before first byte */
-        DEBUG_PRINTF("DEBUG: imd_load_track: EOF or Error (%d) reading first track byte. Pos=%ld.\n", read_status, start_pos);
-        if (read_status < 0) {
-            /* Attempt to seek back only if an error occurred */
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) {
-                DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after read error.\n");
-                /* Can't do much more, error already occurred */
-            }
-            return IMD_ERR_READ_ERROR; /* Return specific error */
-        }
-        return 0; /* Return 0 for clean EOF */
-    }
-    /* If we read the first byte, subsequent non-success (EOF or error) is a failure */
-    if (read_byte(fimd, &track->cyl) != 1 ||
-        read_byte(fimd, &head_byte) != 1 ||
-        read_byte(fimd, &track->num_sectors) != 1 ||
-        read_byte(fimd, &track->sector_size_code) != 1)
-    {
-        DEBUG_PRINTF("DEBUG: imd_load_track: Error/EOF reading track header fields.\n");
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back on error */
-            DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after header read error.\n");
-        }
-        return IMD_ERR_READ_ERROR; /* Treat as read error */
+    if (len < 5) {
+        DEBUG_PRINTF("DEBUG: parse_track_buffer: Truncated track header (%zu bytes). Returning IMD_ERR_READ_ERROR.\n", len);
+        return IMD_ERR_READ_ERROR;
     }
+    track->mode = buf[0];
+    track->cyl = buf[1];
+    head_byte = buf[2];
+    track->num_sectors = buf[3];
+    track->sector_size_code = buf[4];
+    pos = 5;
 
-
-    /* Decode header fields */
     track->head = head_byte & IMD_HFLAG_HEAD_MASK;
     track->hflag = head_byte & IMD_HFLAG_MASK;
-    /* Validate critical header fields */
     if (track->mode >= LIBIMD_NUM_MODES || track->head > 1 || track->sector_size_code >= SECTOR_SIZE_LOOKUP_COUNT) {
-        DEBUG_PRINTF("DEBUG: imd_load_track: Invalid header field (mode=%u, head=%u, size_code=%u). Returning IMD_ERR_READ_ERROR.\n", track->mode, track->head, track->sector_size_code);
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after invalid header.\n");
-        }
-        return IMD_ERR_READ_ERROR; /* Invalid format */
-    }
-    /* Use direct lookup */
-    track->sector_size = SECTOR_SIZE_LOOKUP[track->sector_size_code];
-    if (track->sector_size == 0) { /* Should not happen if code is valid */
-        DEBUG_PRINTF("DEBUG: imd_load_track: Invalid sector size derived from code %u. Returning IMD_ERR_READ_ERROR.\n", track->sector_size_code);
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after invalid sector size.\n");
-        }
+        DEBUG_PRINTF("DEBUG: parse_track_buffer: Invalid header field (mode=%u, head=%u, size_code=%u). Returning IMD_ERR_READ_ERROR.\n", track->mode, track->head, track->sector_size_code);
         return IMD_ERR_READ_ERROR;
     }
+    track->sector_size = SECTOR_SIZE_LOOKUP[track->sector_size_code];
 
-    /* Validate num_sectors against buffer limits after it's read and before it's used as a size. */
-    if (track->num_sectors > LIBIMD_MAX_SECTORS_PER_TRACK) {
-        DEBUG_PRINTF("DEBUG: imd_load_track: Invalid num_sectors (%u > %d). Returning IMD_ERR_READ_ERROR.\n", track->num_sectors, LIBIMD_MAX_SECTORS_PER_TRACK);
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after invalid num_sectors.\n");
-        }
-        return IMD_ERR_READ_ERROR; /* Invalid format: num_sectors exceeds array bounds */
-    }
-
-    /* Read optional maps */
     if (track->num_sectors > 0) {
-        if (read_bytes(track->smap, track->num_sectors, fimd) != track->num_sectors) {
-            DEBUG_PRINTF("DEBUG: imd_load_track: Error/EOF reading Smap. Returning IMD_ERR_READ_ERROR.\n");
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after smap read error.\n");
-            }
-            return IMD_ERR_READ_ERROR;
-        }
-        if (track->hflag & IMD_HFLAG_CMAP_PRES) { /* Cylinder Map */
-            if (read_bytes(track->cmap, track->num_sectors, fimd) != track->num_sectors) {
-                DEBUG_PRINTF("DEBUG: imd_load_track: Error/EOF reading Cmap. Returning IMD_ERR_READ_ERROR.\n");
-                if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                    DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after cmap read error.\n");
-                }
-                return IMD_ERR_READ_ERROR;
-            }
+        size_t map_size = track->num_sectors;
+
+        if (len - pos < map_size) goto truncated;
+        memcpy(track->smap, buf + pos, map_size);
+        pos += map_size;
+        if (track->hflag & IMD_HFLAG_CMAP_PRES) {
+            if (len - pos < map_size) goto truncated;
+            memcpy(track->cmap, buf + pos, map_size);
+            pos += map_size;
         }
         else {
-            /* If Cmap not present, fill it with the track's cylinder number */
-            memset(track->cmap, track->cyl, track->num_sectors);
-        }
-        if (track->hflag & IMD_HFLAG_HMAP_PRES) { /* Head Map */
-            if (read_bytes(track->hmap, track->num_sectors, fimd) != track->num_sectors) {
-                DEBUG_PRINTF("DEBUG: imd_load_track: Error/EOF reading Hmap. Returning IMD_ERR_READ_ERROR.\n");
-                if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                    DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after hmap read error.\n");
-                }
-                return IMD_ERR_READ_ERROR;
-            }
+            memset(track->cmap, track->cyl, map_size);
+        }
+        if (track->hflag & IMD_HFLAG_HMAP_PRES) {
+            if (len - pos < map_size) goto truncated;
+            memcpy(track->hmap, buf + pos, map_size);
+            pos += map_size;
         }
         else {
-            /* If Hmap not present, fill it with the track's head number */
-            memset(track->hmap, track->head, track->num_sectors);
+            memset(track->hmap, track->head, map_size);
         }
     }
-    /* Call imd_alloc_track_data */
-    int alloc_status = imd_alloc_track_data(track);
-    if (alloc_status != 0) {
-        DEBUG_PRINTF("DEBUG: imd_load_track: Allocation failed via imd_alloc_track_data (status %d).\n", alloc_status);
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after alloc failure.\n");
+
+    if (load_data == PARSE_LOAD_INTO) {
+        size_t needed = (size_t)track->num_sectors * track->sector_size;
+        if (data_buf_size < needed) {
+            DEBUG_PRINTF("DEBUG: parse_track_buffer: Data buffer too small (%zu < %zu).\n", data_buf_size, needed);
+            return IMD_ERR_BUFFER_TOO_SMALL;
         }
-        return alloc_status; /* Return allocation error */
-    }
-    /* Handle the case where num_sectors was 0 (handled by imd_alloc_track_data) */
-    if (track->num_sectors == 0) {
-        track->loaded = 1; /* Consider loaded even with 0 sectors */
-        DEBUG_PRINTF("DEBUG: imd_load_track: Zero sectors. Returning 1 (Success).\n");
-        return 1; /* Valid track with 0 sectors */
+        track->data = (needed > 0) ? data_buf : NULL;
+        track->data_size = needed;
     }
-
-    /* Check if allocation resulted in data buffer (should have if num_sectors > 0) */
-    if (!track->data) {
-        /* This should theoretically not happen if alloc_status was 0 and num_sectors > 0 */
-        DEBUG_PRINTF("ERROR: imd_load_track: Allocation reported success but data is NULL.\n");
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after inconsistent alloc state.\n");
+    else if (load_data == PARSE_LOAD_ALLOC) {
+        int alloc_status = imd_alloc_track_data(track);
+        if (alloc_status != 0) {
+            DEBUG_PRINTF("DEBUG: parse_track_buffer: Allocation failed via imd_alloc_track_data (status %d).\n", alloc_status);
+            return alloc_status;
         }
-        return IMD_ERR_ALLOC; /* Should be alloc error */
     }
 
-    /* Read sector data */
+    /*
+     * Compressed and unavailable sectors are recorded as a pending run of consecutive sectors
+     * sharing one fill byte, so a blank or freshly formatted track is filled with a single memset.
+     */
+    size_t run_start = 0;   /* First sector of the pending fill run */
+    size_t run_count = 0;   /* Number of sectors in the pending fill run */
+    uint8_t run_byte = 0;   /* Fill byte of the pending run */
+    uint32_t expanded = 0;  /* Compressed sectors filled out, for the statistics */
+
     for (uint8_t i = 0; i < track->num_sectors; ++i) {
         uint8_t sector_type;
-        read_status = read_byte(fimd, &sector_type);
-        if (read_status != 1) { /* Check for success (1), handle EOF/Error */
-            DEBUG_PRINTF("DEBUG: imd_load_track: Error/EOF reading sector flag %u. Returning IMD_ERR_READ_ERROR.\n", i);
-            imd_free_track_data(track); /* Use free function */
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after sector flag read error.\n");
-            }
-            return IMD_ERR_READ_ERROR;
-        }
-        track->sflag[i] = sector_type; /* Store the raw SDR byte */
-        uint8_t* sector_ptr = track->data + current_offset;
+        int is_uniform = 0;
+        uint8_t uniform_byte = 0;
+
+        if (pos >= len) goto truncated;
+        sector_type = buf[pos++];
+        track->sflag[i] = sector_type;
 
-        /* Check if sector has data to read */
         if (IMD_SDR_HAS_DATA(sector_type)) {
+            /*
+             * Without the data, only the flags matter: the data of the final sector may be cut
+             * short by the end of the image, as skipping it with fseek always allowed.
+             */
+            if (load_data == PARSE_FLAGS_PARTIAL && i + 1 == track->num_sectors &&
+                len - pos < (IMD_SDR_IS_COMPRESSED(sector_type) ? 1 : track->sector_size)) {
+                DEBUG_PRINTF("DEBUG: parse_track_buffer: Final sector data truncated (%zu bytes left), flags accepted.\n", len - pos);
+                pos = len;
+                continue;
+            }
             if (IMD_SDR_IS_COMPRESSED(sector_type)) {
-                /* Compressed: read 1 fill byte */
-                uint8_t fill_value;
-                int fill_read_status = read_byte(fimd, &fill_value);
-                if (fill_read_status != 1) { /* Error or EOF reading fill byte */
-                    DEBUG_PRINTF("DEBUG: imd_load_track: Error/EOF reading fill byte for sector %u. Returning IMD_ERR_READ_ERROR.\n", i);
-                    imd_free_track_data(track);
-                    if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                        DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after fill byte read error.\n");
-                    }
-                    return IMD_ERR_READ_ERROR;
-                }
-                memset(sector_ptr, fill_value, track->sector_size);
+                if (pos >= len) goto truncated;
+                is_uniform = 1;
+                uniform_byte = buf[pos];
+                pos += 1;
+                expanded++;
             }
             else {
-                /* Normal: read sector_size bytes */
-                if (track->sector_size > LIBIMD_MAX_SECTOR_SIZE) { /* Should be caught by size check before */
-                    DEBUG_PRINTF("ERROR: imd_load_track: Invalid sector size %u > MAX %d. Returning IMD_ERR_READ_ERROR.\n", track->sector_size, LIBIMD_MAX_SECTOR_SIZE);
-                    imd_free_track_data(track);
-                    if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                        DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after invalid sector size check.\n");
-                    }
-                    return IMD_ERR_READ_ERROR;
-                }
-                if (read_bytes(sector_ptr, track->sector_size, fimd) != track->sector_size) {
-                    /* Error or EOF during data read - indicates truncated file or read error */
-                    DEBUG_PRINTF("DEBUG: imd_load_track: Error/EOF reading sector %u data. Returning IMD_ERR_READ_ERROR.\n", i);
-                    imd_free_track_data(track);
-                    if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                        DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after sector data read error.\n");
-                    }
-                    return IMD_ERR_READ_ERROR;
-                }
+                if (len - pos < track->sector_size) goto truncated;
+                if (track->data) memcpy(track->data + ((size_t)i * track->sector_size), buf + pos, track->sector_size);
+                pos += track->sector_size;
             }
         }
         else if (sector_type == IMD_SDR_UNAVAILABLE) {
-            /* Unavailable: No data follows, fill buffer */
-            memset(sector_ptr, fill_byte, track->sector_size);
+            is_uniform = 1;
+            uniform_byte = fill_byte;
         }
         else {
-            /* Error: Unknown/Invalid Sector Data Record type */
-            DEBUG_PRINTF("ERROR: imd_load_track: Unknown Sector Data Record type 0x%02X for sector %u. Returning IMD_ERR_READ_ERROR\n", sector_type, i);
-            imd_free_track_data(track);
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                DEBUG_PRINTF("DEBUG: imd_load_track: fseek back failed after unknown SDR type.\n");
-            }
-            return IMD_ERR_READ_ERROR;
+            DEBUG_PRINTF("ERROR: parse_track_buffer: Unknown Sector Data Record type 0x%02X for sector %u. Returning IMD_ERR_READ_ERROR\n", sector_type, i);
+            goto fail;
         }
-        /* Advance offset for next sector's data */
-        current_offset += track->sector_size;
-    }
-    track->loaded = 1;
-    DEBUG_PRINTF("DEBUG: imd_load_track: Success for C%u H%u. Returning 1.\n", track->cyl, track->head);
-    return 1; /* Success */
-}
-
-/* Helper to skip sector data based on flag */
-/* Returns 0 on success, negative IMD_ERR_* on failure */
-static int skip_sector_data(FILE* fimd, uint8_t sector_flag, uint32_t sector_size, long track_start_pos) {
-    long data_to_skip = 0;
-    int skip_result = IMD_ERR_READ_ERROR; /* Default to generic error */
 
-    DEBUG_PRINTF("DEBUG:   skip_sector_data: flag=0x%02X, size=%u\n", sector_flag, sector_size);
-
-    /* Determine amount of data to skip based on sector record type */
-    if (sector_flag == IMD_SDR_UNAVAILABLE) {
-        data_to_skip = 0; /* No data follows */
-    }
-    else if (IMD_SDR_IS_COMPRESSED(sector_flag)) { /* Handles 0x02, 0x04, 0x06, 0x08 */
-        data_to_skip = 1; /* Skip the single fill byte */
-    }
-    else if (sector_flag == IMD_SDR_NORMAL || sector_flag == IMD_SDR_NORMAL_DAM ||
-        sector_flag == IMD_SDR_NORMAL_ERR || sector_flag == IMD_SDR_DELETED_ERR) {
-        /* Handles 0x01, 0x03, 0x05, 0x07 */
-        data_to_skip = (long)sector_size; /* Skip the full sector data */
-    }
-    else {
-        /* Error: Unrecognized sector record type */
-        DEBUG_PRINTF("ERROR:   skip_sector_data: Invalid sector flag 0x%02X\n", sector_flag);
-        if (fseek(fimd, track_start_pos, SEEK_SET) != 0) { /* Attempt to restore position */
-            DEBUG_PRINTF("DEBUG:   skip_sector_data: fseek back failed after invalid flag.\n");
+        if (is_uniform) {
+            IMD_TRACK_SET_UNIFORM(track, i, 1);
+            if (track->data) {
+                if (run_count > 0 && run_byte == uniform_byte && run_start + run_count == i) {
+                    run_count++;
+                }
+                else {
+                    if (run_count > 0) memset(track->data + run_start * track->sector_size, run_byte, run_count * track->sector_size);
+                    run_start = i;
+                    run_count = 1;
+                    run_byte = uniform_byte;
+                }
+            }
         }
-        return IMD_ERR_READ_ERROR; /* Indicate invalid format error */
-    }
-
-
-    DEBUG_PRINTF("DEBUG:   skip_sector_data: calculated data_to_skip = %ld\n", data_to_skip);
-
-    if (data_to_skip == 0) {
-        return 0; /* Nothing to skip, success */
     }
+    if (run_count > 0) memset(track->data + run_start * track->sector_size, run_byte, run_count * track->sector_size);
 
-    /* Try fseek first */
-    clearerr(fimd);
-    long pos_before_seek = ftell(fimd);
-    if (pos_before_seek < 0) { /* Check ftell result */
-        DEBUG_PRINTF("ERROR:   skip_sector_data: ftell failed before seek.\n");
-        /* Cannot reliably seek back, return seek error */
-        return IMD_ERR_SEEK_ERROR;
+    track->loaded = PARSE_LOADS_DATA(load_data) ? 1 : 0;
+    if (PARSE_LOADS_DATA(load_data) && imd_stats_active()) {
+        imd_stat_add(IMD_STAT_TRACKS_DECODED, 1);
+        imd_stat_add(IMD_STAT_SECTORS_EXPANDED, expanded);
     }
+    if (consumed_out) *consumed_out = pos;
+    DEBUG_PRINTF("DEBUG: parse_track_buffer: Success for C%u H%u (%zu bytes). Returning 1.\n", track->cyl, track->head, pos);
+    return 1;
 
-    if (fseek(fimd, data_to_skip, SEEK_CUR) == 0) {
-        /* fseek reported success, check position */
-        long pos_after_seek = ftell(fimd);
-        if (pos_after_seek < 0) { /* Check ftell result after seek */
-            DEBUG_PRINTF("ERROR:   skip_sector_data: ftell failed after seek.\n");
-            if (fseek(fimd, track_start_pos, SEEK_SET) != 0) { /* Restore pos */
-                DEBUG_PRINTF("DEBUG:   skip_sector_data: fseek back failed after ftell error.\n");
-            }
-            skip_result = IMD_ERR_SEEK_ERROR;
-        }
-        else if (pos_after_seek == pos_before_seek + data_to_skip) {
-            /* Position matches exactly, seek was truly successful */
-            DEBUG_PRINTF("DEBUG:   skip_sector_data: fseek successful and position verified.\n");
-            skip_result = 0; /* Success! */
-        }
-        else {
-            /* fseek reported success, but position mismatch. This often indicates */
-            /* seeking past EOF on some systems/streams. Treat as error. */
-            DEBUG_PRINTF("WARNING: skip_sector_data: fseek successful but position mismatch (%ld vs %ld + %ld = %ld). Likely EOF.\n",
-                pos_after_seek, pos_before_seek, data_to_skip, pos_before_seek + data_to_skip);
-            if (fseek(fimd, track_start_pos, SEEK_SET) != 0) { /* Restore pos */
-                DEBUG_PRINTF("DEBUG:   skip_sector_data: fseek back failed after position mismatch.\n");
-            }
-            skip_result = IMD_ERR_READ_ERROR; /* Treat position mismatch as read error (EOF) */
-        }
+truncated:
+    DEBUG_PRINTF("DEBUG: parse_track_buffer: Track record truncated at offset %zu of %zu. Returning IMD_ERR_READ_ERROR.\n", pos, len);
+fail:
+    if (load_data == PARSE_LOAD_INTO) {
+        track->data = NULL; /* Caller's storage */
+        track->data_size = 0;
     }
     else {
-        /* fseek failed, try reading and discarding */
-        DEBUG_PRINTF("DEBUG:   skip_sector_data: fseek failed (errno=%d). Falling back to read.\n", errno);
-        clearerr(fimd); /* Clear stream errors before trying fread */
-        /* Ensure position is restored before attempting read fallback */
-        if (fseek(fimd, pos_before_seek, SEEK_SET) != 0) {
-            DEBUG_PRINTF("ERROR:   skip_sector_data: Failed to restore position before read fallback.\n");
-            /* Attempt track start restore */
-            if (fseek(fimd, track_start_pos, SEEK_SET) != 0) {
-                DEBUG_PRINTF("DEBUG:   skip_sector_data: fseek back to track start also failed.\n");
-            }
-            return IMD_ERR_SEEK_ERROR;
-        }
-
-        uint8_t skip_buf[512];
-        long remaining_skip = data_to_skip;
-        while (remaining_skip > 0) {
-            size_t read_amount = (remaining_skip > (long)sizeof(skip_buf)) ? sizeof(skip_buf) : (size_t)remaining_skip;
-            DEBUG_PRINTF("DEBUG:   skip_sector_data: Fallback read: trying to read %zu bytes\n", read_amount);
-            size_t bytes_actually_read = fread(skip_buf, 1, read_amount, fimd);
-            DEBUG_PRINTF("DEBUG:   skip_sector_data: Fallback read: actually read %zu bytes\n", bytes_actually_read);
-
-            if (bytes_actually_read < read_amount) {
-                /* Check if it was due to error or EOF */
-                if (ferror(fimd)) {
-                    DEBUG_PRINTF("ERROR:   skip_sector_data: Fallback read ERROR (ferror set, errno=%d)\n", errno);
-                    skip_result = IMD_ERR_READ_ERROR;
-                }
-                else { /* Must be EOF if not error */
-                    DEBUG_PRINTF("ERROR:   skip_sector_data: Fallback read ERROR (EOF reached mid-skip)\n");
-                    skip_result = IMD_ERR_READ_ERROR; /* EOF during data read is an error */
-                }
-                if (fseek(fimd, track_start_pos, SEEK_SET) != 0) { /* Restore pos */
-                    DEBUG_PRINTF("DEBUG:   skip_sector_data: fseek back failed after read error.\n");
-                }
-                goto end_skip; /* Exit while loop and function */
-            }
-            remaining_skip -= (long)bytes_actually_read;
-            DEBUG_PRINTF("DEBUG:   skip_sector_data: Fallback read: remaining_skip = %ld\n", remaining_skip);
-        }
-        /* If loop completed, skip was successful */
-        DEBUG_PRINTF("DEBUG:   skip_sector_data: Fallback read finished successfully.\n");
-        skip_result = 0; /* Success */
+        imd_free_track_data(track);
     }
-
-end_skip:
-    return skip_result;
+    return IMD_ERR_READ_ERROR;
 }
 
+/* Stack buffer size for reading a track record; larger records use a heap buffer */
+#define TRACK_READ_STACK_BUFFER 16384
 
-/* Reads header/maps only, skips data */
-int imd_read_track_header(FILE* fimd, ImdTrackInfo* track) {
-    uint8_t head_byte;
-    int read_status;
+/*
+ * Reads one track record from a stream and parses it with parse_track_buffer.
+ * The fixed header is read first, then the rest of the record is fetched with a
+ * single fread of its maximum possible length (every sector stored as normal data).
+ * The stream is then positioned exactly at the end of the record.
+ * On error, the original stream position is restored.
+ * Returns 1 on success, 0 on clean EOF at the start of the record, negative IMD_ERR_* on error.
+ */
+static int read_track_record(FILE* fimd, ImdTrackInfo* track, uint8_t fill_byte, int load_data) {
+    uint8_t stack_buf[TRACK_READ_STACK_BUFFER];
+    uint8_t* buf = stack_buf;
+    size_t got;
+    size_t max_len;
+    size_t consumed = 0;
+    size_t num_maps;
+    uint32_t max_sector_size;
     long start_pos;
-    uint8_t raw_mode, raw_cyl, raw_nsec, raw_ssize; /* For debug */
+    int res;
 
-    if (!fimd || !track) { /* Combined check */
-        DEBUG_PRINTF("DEBUG: imd_read_track_header: Invalid argument (NULL). Returning IMD_ERR_INVALID_ARG.\n");
-        return IMD_ERR_INVALID_ARG; /* Invalid arguments */
+    if (!fimd || !track) {
+        return IMD_ERR_INVALID_ARG;
     }
 
     start_pos = ftell(fimd); /* Remember start position for error recovery */
     if (start_pos < 0) {
-        DEBUG_PRINTF("DEBUG: imd_read_track_header: ftell failed. Returning IMD_ERR_SEEK_ERROR.\n");
+        DEBUG_PRINTF("DEBUG: read_track_record: ftell failed before reading track. Returning IMD_ERR_SEEK_ERROR.\n");
         return IMD_ERR_SEEK_ERROR;
     }
 
-    memset(track, 0, sizeof(ImdTrackInfo)); /* Initialize track structure */
+    memset(track, 0, sizeof(ImdTrackInfo));
 
-    /* Read track header bytes */
-    clearerr(fimd); /* Clear status before reading header */
-    read_status = read_byte(fimd, &raw_mode);
-    if (read_status <= 0) { /* EOF or error before first byte */
-        DEBUG_PRINTF("DEBUG: imd_read_track_header: EOF or Error (%d) reading first byte. Pos=%ld.\n", read_status, start_pos);
-        if (read_status < 0) {
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back only on error */
-                DEBUG_PRINTF("DEBUG: imd_read_track_header: fseek back failed after read error.\n");
-            }
-            return IMD_ERR_READ_ERROR; /* Return specific error */
-        }
-        return 0; /* Return 0 for clean EOF */
+    clearerr(fimd);
+    got = imd_stat_fread(stack_buf, 1, 5, fimd);
+    if (got == 0 && !ferror(fimd)) {
+        return 0; /* Clean EOF */
     }
-    /* If we read the first byte, subsequent non-success (EOF or error) is a failure */
-    if (read_byte(fimd, &raw_cyl) != 1 ||
-        read_byte(fimd, &head_byte) != 1 ||
-        read_byte(fimd, &raw_nsec) != 1 ||
-        read_byte(fimd, &raw_ssize) != 1)
-    {
-        DEBUG_PRINTF("DEBUG: imd_read_track_header: Error/EOF reading track header fields. Returning IMD_ERR_READ_ERROR.\n");
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back on error */
-            DEBUG_PRINTF("DEBUG: imd_read_track_header: fseek back failed after header read error.\n");
+    if (got < 5) {
+        DEBUG_PRINTF("DEBUG: read_track_record: Error/EOF reading track header (%zu bytes). Pos=%ld.\n", got, start_pos);
+        if (imd_stat_fseek(fimd, start_pos, SEEK_SET) != 0) {
+            DEBUG_PRINTF("DEBUG: read_track_record: fseek back failed after header read error.\n");
         }
         return IMD_ERR_READ_ERROR;
     }
 
-    DEBUG_PRINTF("DEBUG: imd_read_track_header: Raw Header Bytes: Mode=0x%02X, Cyl=0x%02X, HeadByte=0x%02X, Nsec=0x%02X, SSize=0x%02X\n",
-        raw_mode, raw_cyl, head_byte, raw_nsec, raw_ssize);
-
-
-    /* Assign and Decode header fields */
-    track->mode = raw_mode;
-    track->cyl = raw_cyl;
-    track->num_sectors = raw_nsec;
-    track->sector_size_code = raw_ssize;
-    track->head = head_byte & IMD_HFLAG_HEAD_MASK;
-    track->hflag = head_byte & IMD_HFLAG_MASK;
+    /* Upper bound of the record length; an invalid size code is rejected by the parser */
+    num_maps = 1 + ((stack_buf[2] & IMD_HFLAG_CMAP_PRES) ? 1 : 0) + ((stack_buf[2] & IMD_HFLAG_HMAP_PRES) ? 1 : 0);
+    max_sector_size = (stack_buf[4] < SECTOR_SIZE_LOOKUP_COUNT) ? SECTOR_SIZE_LOOKUP[stack_buf[4]] : 0;
+    max_len = 5 + (size_t)stack_buf[3] * (num_maps + 1 + max_sector_size);
 
-    /* Validate decoded fields */
-    if (track->mode >= LIBIMD_NUM_MODES || track->head > 1 || track->sector_size_code >= SECTOR_SIZE_LOOKUP_COUNT) {
-        DEBUG_PRINTF("ERROR: imd_read_track_header: Invalid decoded header field (mode=%u, head=%u, size_code=%u). Returning IMD_ERR_READ_ERROR.\n", track->mode, track->head, track->sector_size_code);
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_read_track_header: fseek back failed after invalid header.\n");
-        }
-        return IMD_ERR_READ_ERROR;
-    }
-    /* Use direct lookup */
-    track->sector_size = SECTOR_SIZE_LOOKUP[track->sector_size_code];
-    if (track->sector_size == 0) {
-        DEBUG_PRINTF("DEBUG: imd_read_track_header: Invalid sector size derived from code %u. Returning IMD_ERR_READ_ERROR.\n", track->sector_size_code);
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_read_track_header: fseek back failed after invalid sector size.\n");
+    if (max_len > sizeof(stack_buf)) {
+        buf = (uint8_t*)imd_malloc(max_len);
+        if (!buf) {
+            DEBUG_PRINTF("DEBUG: read_track_record: malloc(%zu) failed.\n", max_len);
+            if (imd_stat_fseek(fimd, start_pos, SEEK_SET) != 0) {
+                DEBUG_PRINTF("DEBUG: read_track_record: fseek back failed after alloc failure.\n");
+            }
+            return IMD_ERR_ALLOC;
         }
-        return IMD_ERR_READ_ERROR;
+        memcpy(buf, stack_buf, 5);
     }
 
-    DEBUG_PRINTF("DEBUG: imd_read_track_header: Decoded: Mode=%u, Cyl=%u, Head=%u, HFlag=0x%02X, Nsec=%u, SSizeCode=%u, SectorSize=%u\n",
-        track->mode, track->cyl, track->head, track->hflag, track->num_sectors, track->sector_size_code, track->sector_size);
-
+    /* A short read is expected for compressed/unavailable sectors near the end of the file */
+    got += imd_stat_fread(buf + 5, 1, max_len - 5, fimd);
+    if (ferror(fimd)) {
+        DEBUG_PRINTF("DEBUG: read_track_record: Read error after %zu bytes.\n", got);
+        res = IMD_ERR_READ_ERROR;
+    }
+    else {
+        res = parse_track_buffer(buf, got, track, fill_byte, load_data, NULL, 0, &consumed);
+    }
 
-    /* Read optional maps */
-    if (track->num_sectors > 0) {
-        DEBUG_PRINTF("DEBUG: imd_read_track_header: Reading %u smap bytes\n", track->num_sectors);
-        if (read_bytes(track->smap, track->num_sectors, fimd) != track->num_sectors) {
-            DEBUG_PRINTF("DEBUG: imd_read_track_header: Error/EOF reading Smap. Returning IMD_ERR_READ_ERROR.\n");
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                DEBUG_PRINTF("DEBUG: imd_read_track_header: fseek back failed after smap read error.\n");
-            }
-            return IMD_ERR_READ_ERROR;
-        }
-        if (track->hflag & IMD_HFLAG_CMAP_PRES) {
-            DEBUG_PRINTF("DEBUG: imd_read_track_header: Reading %u cmap bytes\n", track->num_sectors);
-            if (read_bytes(track->cmap, track->num_sectors, fimd) != track->num_sectors) {
-                DEBUG_PRINTF("DEBUG: imd_read_track_header: Error/EOF reading Cmap. Returning IMD_ERR_READ_ERROR.\n");
-                if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                    DEBUG_PRINTF("DEBUG: imd_read_track_header: fseek back failed after cmap read error.\n");
-                }
-                return IMD_ERR_READ_ERROR;
-            }
+    if (res == 1) {
+        /* Give back whatever was read past the end of this record */
+        if (consumed < got && imd_stat_fseek(fimd, start_pos + (long)consumed, SEEK_SET) != 0) {
+            DEBUG_PRINTF("DEBUG: read_track_record: fseek to end of record failed.\n");
+            imd_free_track_data(track);
+            res = IMD_ERR_SEEK_ERROR;
         }
-        if (track->hflag & IMD_HFLAG_HMAP_PRES) {
-            DEBUG_PRINTF("DEBUG: imd_read_track_header: Reading %u hmap bytes\n", track->num_sectors);
-            if (read_bytes(track->hmap, track->num_sectors, fimd) != track->num_sectors) {
-                DEBUG_PRINTF("DEBUG: imd_read_track_header: Error/EOF reading Hmap. Returning IMD_ERR_READ_ERROR.\n");
-                if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                    DEBUG_PRINTF("DEBUG: imd_read_track_header: fseek back failed after hmap read error.\n");
-                }
-                return IMD_ERR_READ_ERROR;
-            }
+    }
+    if (res != 1) {
+        if (imd_stat_fseek(fimd, start_pos, SEEK_SET) != 0) {
+            DEBUG_PRINTF("DEBUG: read_track_record: fseek back failed after error %d.\n", res);
         }
     }
 
-    /* Skip over sector data records */
-    DEBUG_PRINTF("DEBUG: imd_read_track_header: Skipping data for %u sectors\n", track->num_sectors);
-    for (uint8_t i = 0; i < track->num_sectors; ++i) {
-        uint8_t sector_type;
-        DEBUG_PRINTF("DEBUG:   imd_read_track_header: Reading flag for sector %u\n", i);
-        read_status = read_byte(fimd, &sector_type);
-        if (read_status != 1) { /* Error or EOF reading flag */
-            DEBUG_PRINTF("DEBUG: imd_read_track_header: Error/EOF reading flag in skip loop. Returning IMD_ERR_READ_ERROR.\n");
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                DEBUG_PRINTF("DEBUG: imd_read_track_header: fseek back failed after flag read error.\n");
-            }
-            return IMD_ERR_READ_ERROR;
-        }
-        /* Use the helper function to skip data based on the flag */
-        /* Pass start_pos for error recovery within skip_sector_data */
-        read_status = skip_sector_data(fimd, sector_type, track->sector_size, start_pos);
-        if (read_status != 0) {
-            DEBUG_PRINTF("DEBUG: imd_read_track_header: Error skipping data for sector %u. Returning %d.\n", i, read_status);
-            /* skip_sector_data should have restored position */
-            return read_status; /* Propagate specific error */
-        }
+    if (buf != stack_buf) {
+        imd_free(buf);
     }
+    return res;
+}
 
-    /* Ensure data fields are NULL/0 as we didn't load data */
-    track->data = NULL;
-    track->data_size = 0;
-    track->loaded = 0; /* Mark as header/maps only loaded */
+int imd_load_track(FILE* fimd, ImdTrackInfo* track, uint8_t fill_byte) {
+    return read_track_record(fimd, track, fill_byte, PARSE_LOAD_ALLOC);
+}
 
-    DEBUG_PRINTF("DEBUG: imd_read_track_header: Success for C%u H%u. Returning 1.\n", track->cyl, track->head);
-    return 1; /* Success */
+int imd_read_track_header(FILE* fimd, ImdTrackInfo* track) {
+    return read_track_record(fimd, track, 0, PARSE_FLAGS_PARTIAL);
 }
 
-/* Reads header/maps/flags, skips data */
 int imd_read_track_header_and_flags(FILE* fimd, ImdTrackInfo* track) {
-    uint8_t head_byte;
+    return read_track_record(fimd, track, 0, PARSE_FLAGS_PARTIAL);
+}
+
+/* Checks if track has valid sectors */
+/* Updated to use helper macros */
+int imd_track_has_valid_sectors(FILE* fimd, uint8_t cyl, uint8_t head) {
+    ImdTrackInfo track;
+    long original_pos;
+    int target_track_found = 0;      /* Flag: Have we encountered the target track? */
+    int target_track_has_valid = 0; /* Result for the target track (0 or 1) */
+    int final_result = IMD_ERR_TRACK_NOT_FOUND; /* Default return if target not found */
     int read_status;
-    long start_pos;
-    uint8_t raw_mode, raw_cyl, raw_nsec, raw_ssize; /* For debug */
-
-    if (!fimd || !track) {
-        /* Check for NULL arguments */
-        DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Invalid argument (fimd or track is NULL). Returning IMD_ERR_INVALID_ARG.\n");
-        return IMD_ERR_INVALID_ARG;
-    }
-
-    start_pos = ftell(fimd);
-    DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: ENTER. Pos=%ld, EOF=%d, Err=%d\n",
-        start_pos, feof(fimd), ferror(fimd));
-
-    /* start_pos already fetched */
-    if (start_pos < 0) {
-        DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: ftell failed. Returning IMD_ERR_SEEK_ERROR.\n");
-        return IMD_ERR_SEEK_ERROR;
-    }
-
-    memset(track, 0, sizeof(ImdTrackInfo)); /* Initialize track structure */
-
-    /* Read track header bytes */
-    clearerr(fimd); /* Clear status before reading header */
-    read_status = read_byte(fimd, &raw_mode);
-    if (read_status <= 0) { /* EOF or error before first byte */
-        DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: EOF or Error (%d) reading first byte. Pos=%ld.\n", read_status, start_pos);
-        if (read_status < 0) {
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back only on error */
-                DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: fseek back failed after read error.\n");
-            }
-            return IMD_ERR_READ_ERROR; /* Return specific error */
-        }
-        return 0; /* Return 0 for clean EOF */
-    }
-    /* If we read the first byte, subsequent non-success (EOF or error) is a failure */
-    if (read_byte(fimd, &raw_cyl) != 1 ||
-        read_byte(fimd, &head_byte) != 1 ||
-        read_byte(fimd, &raw_nsec) != 1 ||
-        read_byte(fimd, &raw_ssize) != 1)
-    {
-        DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Error/EOF reading track header fields. Returning IMD_ERR_READ_ERROR.\n");
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: fseek back failed after header read error.\n");
-        }
-        return IMD_ERR_READ_ERROR;
-    }
-
-    DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Raw Header Bytes: Mode=0x%02X, Cyl=0x%02X, HeadByte=0x%02X, Nsec=0x%02X, SSize=0x%02X\n",
-        raw_mode, raw_cyl, head_byte, raw_nsec, raw_ssize);
-
-
-    /* Assign and Decode header fields */
-    track->mode = raw_mode;
-    track->cyl = raw_cyl;
-    track->num_sectors = raw_nsec; /* Assignment */
-    track->sector_size_code = raw_ssize;
-    track->head = head_byte & IMD_HFLAG_HEAD_MASK;
-    track->hflag = head_byte & IMD_HFLAG_MASK;
-
-    /* Validate decoded fields */
-    if (track->mode >= LIBIMD_NUM_MODES || track->head > 1 || track->sector_size_code >= SECTOR_SIZE_LOOKUP_COUNT) {
-        DEBUG_PRINTF("ERROR: imd_read_track_header_and_flags: Invalid decoded header field (mode=%u, head=%u, size_code=%u). Returning IMD_ERR_READ_ERROR.\n", track->mode, track->head, track->sector_size_code);
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: fseek back failed after invalid header.\n");
-        }
-        return IMD_ERR_READ_ERROR;
-    }
-    /* Use direct lookup */
-    track->sector_size = SECTOR_SIZE_LOOKUP[track->sector_size_code];
-    if (track->sector_size == 0) {
-        DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Invalid sector size derived from code %u. Returning IMD_ERR_READ_ERROR.\n", track->sector_size_code);
-        if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-            DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: fseek back failed after invalid sector size.\n");
-        }
-        return IMD_ERR_READ_ERROR;
-    }
-
-    DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Decoded: Mode=%u, Cyl=%u, Head=%u, HFlag=0x%02X, Nsec=%u, SSizeCode=%u, SectorSize=%u\n",
-        track->mode, track->cyl, track->head, track->hflag, track->num_sectors, track->sector_size_code, track->sector_size);
-
-
-    /* Read optional maps */
-    if (track->num_sectors > 0) {
-        DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Reading %u smap bytes\n", track->num_sectors);
-        if (read_bytes(track->smap, track->num_sectors, fimd) != track->num_sectors) {
-            DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Error/EOF reading Smap. Returning IMD_ERR_READ_ERROR.\n");
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: fseek back failed after smap read error.\n");
-            }
-            return IMD_ERR_READ_ERROR;
-        }
-        if (track->hflag & IMD_HFLAG_CMAP_PRES) {
-            DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Reading %u cmap bytes\n", track->num_sectors);
-            if (read_bytes(track->cmap, track->num_sectors, fimd) != track->num_sectors) {
-                DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Error/EOF reading Cmap. Returning IMD_ERR_READ_ERROR.\n");
-                if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                    DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: fseek back failed after cmap read error.\n");
-                }
-                return IMD_ERR_READ_ERROR;
-            }
-        }
-        if (track->hflag & IMD_HFLAG_HMAP_PRES) {
-            DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Reading %u hmap bytes\n", track->num_sectors);
-            if (read_bytes(track->hmap, track->num_sectors, fimd) != track->num_sectors) {
-                DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Error/EOF reading Hmap. Returning IMD_ERR_READ_ERROR.\n");
-                if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                    DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: fseek back failed after hmap read error.\n");
-                }
-                return IMD_ERR_READ_ERROR;
-            }
-        }
-    }
-
-
-    /* Read flags and skip over sector data records based on flags read */
-    DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Reading flags and skipping data for %u sectors\n", track->num_sectors);
-    for (uint8_t i = 0; i < track->num_sectors; ++i) {
-        uint8_t sector_type;
-        /* Read flag individually */
-        read_status = read_byte(fimd, &sector_type); /* Check return value */
-        if (read_status != 1) { /* Error or EOF reading flag */
-            DEBUG_PRINTF("ERROR: imd_read_track_header_and_flags: ERROR reading flag for sector %u (status=%d, errno=%d, feof=%d, ferror=%d). Returning IMD_ERR_READ_ERROR.\n",
-                i, read_status, errno, feof(fimd), ferror(fimd));
-            if (fseek(fimd, start_pos, SEEK_SET) != 0) { /* Seek back */
-                DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: fseek back failed after flag read error.\n");
-            }
-            return IMD_ERR_READ_ERROR;
-        }
-        track->sflag[i] = sector_type; /* Store the flag */
-
-        DEBUG_PRINTF("DEBUG:   imd_read_track_header_and_flags: Skipping data for sector index %u (flag 0x%02X)\n", i, sector_type);
-        /* Pass start_pos for error recovery within skip_sector_data */
-        read_status = skip_sector_data(fimd, sector_type, track->sector_size, start_pos);
-        if (read_status != 0) {
-            DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Error skipping data for sector %u. Returning %d.\n", i, read_status);
-            /* skip_sector_data should have restored position */
-            return read_status; /* Propagate specific error */
-        }
-    }
-
-    /* Ensure data fields are NULL/0 as we didn't load data */
-    track->data = NULL;
-    track->data_size = 0;
-    track->loaded = 0; /* Mark as header/maps/flags only loaded */
-
-    DEBUG_PRINTF("DEBUG: imd_read_track_header_and_flags: Success for C%u H%u. Returning 1.\n", track->cyl, track->head);
-    return 1; /* Success */
-}
-
-/* Checks if track has valid sectors */
-/* Updated to use helper macros */
-int imd_track_has_valid_sectors(FILE* fimd, uint8_t cyl, uint8_t head) {
-    ImdTrackInfo track;
-    long original_pos;
-    int target_track_found = 0;      /* Flag: Have we encountered the target track? */
-    int target_track_has_valid = 0; /* Result for the target track (0 or 1) */
-    int final_result = IMD_ERR_TRACK_NOT_FOUND; /* Default return if target not found */
-    int read_status;
-    long current_pos; /* For debugging */
+    long current_pos; /* For debugging */
 
     if (!fimd) return IMD_ERR_INVALID_ARG;
 
@@ -1069,7 +810,7 @@ int imd_track_has_valid_sectors(FILE* fimd, uint8_t cyl, uint8_t head) {
     }
 
     /* Rewind to start to ensure we scan all tracks */
-    if (fseek(fimd, 0, SEEK_SET) != 0) {
+    if (imd_stat_fseek(fimd, 0, SEEK_SET) != 0) {
         DEBUG_PRINTF("DEBUG: imd_track_has_valid_sectors: fseek to start failed. Returning IMD_ERR_SEEK_ERROR.\n");
         return IMD_ERR_SEEK_ERROR;
     }
@@ -1078,7 +819,7 @@ int imd_track_has_valid_sectors(FILE* fimd, uint8_t cyl, uint8_t head) {
     read_status = imd_read_file_header(fimd, NULL, NULL, 0);
     if (read_status != 0) {
         DEBUG_PRINTF("DEBUG: imd_track_has_valid_sectors: Error reading header (%d).\n", read_status);
-        if (fseek(fimd, original_pos, SEEK_SET) != 0) {
+        if (imd_stat_fseek(fimd, original_pos, SEEK_SET) != 0) {
             /* Log if restoring file position fails. */
             DEBUG_PRINTF("DEBUG: imd_track_has_valid_sectors: fseek to restore original_pos failed.\n");
             /* Despite fseek failure, proceed to return the original error. */
@@ -1088,7 +829,7 @@ int imd_track_has_valid_sectors(FILE* fimd, uint8_t cyl, uint8_t head) {
     read_status = imd_skip_comment_block(fimd);
     if (read_status != 0) {
         DEBUG_PRINTF("DEBUG: imd_track_has_valid_sectors: Error skipping comment (%d).\n", read_status);
-        if (fseek(fimd, original_pos, SEEK_SET) != 0) {
+        if (imd_stat_fseek(fimd, original_pos, SEEK_SET) != 0) {
             /* Log if restoring file position fails. */
             DEBUG_PRINTF("DEBUG: imd_track_has_valid_sectors: fseek to restore original_pos failed.\n");
             /* Despite fseek failure, proceed to return the original error. */
@@ -1160,28 +901,1035 @@ int imd_track_has_valid_sectors(FILE* fimd, uint8_t cyl, uint8_t head) {
         }
     } /* end while */
 
-    DEBUG_PRINTF("DEBUG: --- Finished scanning ---\n");
-    if (fseek(fimd, original_pos, SEEK_SET) != 0) {
-        /* Log if restoring file position fails. */
-        DEBUG_PRINTF("DEBUG: imd_track_has_valid_sectors: fseek to restore original_pos failed.\n");
-        /* Despite fseek failure, proceed to return the original error. */
+    DEBUG_PRINTF("DEBUG: --- Finished scanning ---\n");
+    if (imd_stat_fseek(fimd, original_pos, SEEK_SET) != 0) {
+        /* Log if restoring file position fails. */
+        DEBUG_PRINTF("DEBUG: imd_track_has_valid_sectors: fseek to restore original_pos failed.\n");
+        /* Despite fseek failure, proceed to return the original error. */
+    }
+
+    return final_result; /* Return the determined result */
+}
+
+/* --- Buffer Parsing --- */
+
+int imd_read_file_header_buffer(const uint8_t* buf, size_t len, ImdHeaderInfo* header_info, size_t* consumed_out) {
+    char line[LIBIMD_MAX_HEADER_LINE];
+    size_t line_len = 0;
+
+    if (!buf && len > 0) return IMD_ERR_INVALID_ARG;
+    if (consumed_out) *consumed_out = 0;
+    if (len == 0) {
+        DEBUG_PRINTF("DEBUG: imd_read_file_header_buffer: Empty buffer. Returning IMD_ERR_READ_ERROR.\n");
+        return IMD_ERR_READ_ERROR;
+    }
+
+    /* Same line semantics as fgets(): up to and including '\n', at most sizeof(line) - 1 characters */
+    while (line_len < len && line_len < sizeof(line) - 1) {
+        line[line_len] = (char)buf[line_len];
+        if (buf[line_len++] == '\n') break;
+    }
+    line[line_len] = '\0';
+
+    int res = parse_header_line(line, header_info);
+    if (res == 0 && consumed_out) {
+        *consumed_out = line_len;
+    }
+    return res;
+}
+
+char* imd_read_comment_block_buffer(const uint8_t* buf, size_t len, size_t* comment_size_out, size_t* consumed_out) {
+    const uint8_t* marker;
+    size_t size;
+    char* comment;
+
+    if ((!buf && len > 0) || !comment_size_out) {
+        DEBUG_PRINTF("ERROR: imd_read_comment_block_buffer: Invalid argument.\n");
+        if (comment_size_out) *comment_size_out = 0;
+        return NULL;
+    }
+    *comment_size_out = 0;
+
+    marker = (len > 0) ? (const uint8_t*)memchr(buf, LIBIMD_COMMENT_EOF_MARKER, len) : NULL;
+    if (!marker) {
+        DEBUG_PRINTF("ERROR: imd_read_comment_block_buffer: End of buffer before marker (size=%zu).\n", len);
+        return NULL;
+    }
+    size = (size_t)(marker - buf);
+
+    comment = (char*)malloc(size + 1);
+    if (!comment) {
+        DEBUG_PRINTF("ERROR: imd_read_comment_block_buffer: malloc failed (%zu bytes).\n", size + 1);
+        return NULL;
+    }
+    if (size > 0) memcpy(comment, buf, size);
+    comment[size] = '\0';
+
+    *comment_size_out = size;
+    if (consumed_out) *consumed_out = size + 1; /* Includes the marker */
+    return comment;
+}
+
+int imd_load_track_buffer(const uint8_t* buf, size_t len, ImdTrackInfo* track, uint8_t fill_byte, size_t* consumed_out) {
+    return parse_track_buffer(buf, len, track, fill_byte, PARSE_LOAD_ALLOC, NULL, 0, consumed_out);
+}
+
+int imd_load_track_buffer_into(const uint8_t* buf, size_t len, ImdTrackInfo* track, uint8_t fill_byte,
+    uint8_t* data_buf, size_t data_buf_size, size_t* consumed_out) {
+    if (!data_buf && data_buf_size > 0) return IMD_ERR_INVALID_ARG;
+    return parse_track_buffer(buf, len, track, fill_byte, PARSE_LOAD_INTO, data_buf, data_buf_size, consumed_out);
+}
+
+int imd_read_track_header_and_flags_buffer(const uint8_t* buf, size_t len, ImdTrackInfo* track, size_t* consumed_out) {
+    return parse_track_buffer(buf, len, track, 0, PARSE_FLAGS_PARTIAL, NULL, 0, consumed_out);
+}
+
+
+/* --- Stream Parsing --- */
+
+/* Initial window of a stream source without peek; grows to the largest track record */
+#define STREAM_WINDOW_INITIAL (64 * 1024)
+
+static size_t file_io_read(void* ctx, void* buf, size_t size) {
+    return imd_stat_fread(buf, 1, size, (FILE*)ctx);
+}
+
+static int file_io_skip(void* ctx, size_t size) {
+    FILE* f = (FILE*)ctx;
+    uint8_t scratch[4096];
+
+    if (size <= LONG_MAX && imd_stat_fseek(f, (long)size, SEEK_CUR) == 0) return 0;
+    while (size > 0) { /* Not seekable: read and discard */
+        size_t chunk = (size < sizeof(scratch)) ? size : sizeof(scratch);
+        if (imd_stat_fread(scratch, 1, chunk, f) != chunk) return IMD_ERR_READ_ERROR;
+        size -= chunk;
+    }
+    return 0;
+}
+
+static long long file_io_tell(void* ctx) {
+    return (long long)ftell((FILE*)ctx);
+}
+
+void imd_io_init_file(ImdIo* io, FILE* f) {
+    if (!io) return;
+    io->read = file_io_read;
+    io->skip = file_io_skip;
+    io->tell = file_io_tell;
+    io->peek = NULL;
+    io->ctx = f;
+}
+
+static size_t memory_io_read(void* ctx, void* buf, size_t size) {
+    ImdIoMemory* mem = (ImdIoMemory*)ctx;
+    size_t n = mem->size - mem->pos;
+    if (n > size) n = size;
+    memcpy(buf, mem->data + mem->pos, n);
+    mem->pos += n;
+    return n;
+}
+
+static int memory_io_skip(void* ctx, size_t size) {
+    ImdIoMemory* mem = (ImdIoMemory*)ctx;
+    if (size > mem->size - mem->pos) return IMD_ERR_READ_ERROR;
+    mem->pos += size;
+    return 0;
+}
+
+static long long memory_io_tell(void* ctx) {
+    return (long long)((ImdIoMemory*)ctx)->pos;
+}
+
+static const uint8_t* memory_io_peek(void* ctx, size_t size, size_t* avail_out) {
+    ImdIoMemory* mem = (ImdIoMemory*)ctx;
+    size_t n = mem->size - mem->pos;
+    *avail_out = (n < size) ? n : size;
+    return mem->data + mem->pos;
+}
+
+void imd_io_init_memory(ImdIo* io, ImdIoMemory* mem, const uint8_t* data, size_t size) {
+    if (!io || !mem) return;
+    mem->data = data;
+    mem->size = data ? size : 0;
+    mem->pos = 0;
+    io->read = memory_io_read;
+    io->skip = memory_io_skip;
+    io->tell = memory_io_tell;
+    io->peek = memory_io_peek;
+    io->ctx = mem;
+}
+
+/* Forward-only window over an ImdIo source */
+typedef struct {
+    const ImdIo* io;
+    uint8_t* buf;               /* Window of a source without peek */
+    size_t capacity;
+    size_t start;               /* First unconsumed byte in buf */
+    size_t end;                 /* End of valid bytes in buf */
+    int eof;                    /* The source returned no more data */
+    long long consumed;         /* Bytes consumed since the start of the image */
+} StreamWindow;
+
+/*
+ * Returns a pointer to the next 'size' unconsumed bytes and stores how many are
+ * valid in *avail_out (fewer only at the end of input). NULL on allocation failure.
+ */
+static const uint8_t* stream_window_get(StreamWindow* w, size_t size, size_t* avail_out) {
+    if (w->io->peek) {
+        return w->io->peek(w->io->ctx, size, avail_out);
+    }
+
+    if (w->end - w->start < size && !w->eof) {
+        if (w->capacity - w->start < size) {
+            /* Move the unconsumed bytes to the front, growing the window if they still don't fit */
+            if (w->capacity < size) {
+                size_t new_capacity = (w->capacity > 0) ? w->capacity : STREAM_WINDOW_INITIAL;
+                while (new_capacity < size) new_capacity *= 2;
+                uint8_t* new_buf = (uint8_t*)imd_realloc(w->buf, new_capacity);
+                if (!new_buf) return NULL;
+                w->buf = new_buf;
+                w->capacity = new_capacity;
+            }
+            memmove(w->buf, w->buf + w->start, w->end - w->start);
+            w->end -= w->start;
+            w->start = 0;
+        }
+        while (w->end - w->start < size && !w->eof) {
+            size_t got = w->io->read(w->io->ctx, w->buf + w->end, w->capacity - w->end);
+            if (got == 0) w->eof = 1;
+            w->end += got;
+        }
+    }
+    *avail_out = (w->end - w->start < size) ? w->end - w->start : size;
+    return w->buf + w->start;
+}
+
+/* Consumes n bytes obtained from stream_window_get */
+static int stream_window_consume(StreamWindow* w, size_t n) {
+    w->consumed += (long long)n;
+    if (w->io->peek) {
+        return w->io->skip(w->io->ctx, n);
+    }
+    w->start += n;
+    return 0;
+}
+
+/*
+ * Makes the whole next track record available in the window and returns its
+ * length in *len_out, walking the sector flags to find where the record ends.
+ * A truncated or invalid record yields the bytes available, for parse_track_buffer to reject.
+ */
+static const uint8_t* stream_window_get_record(StreamWindow* w, size_t* len_out) {
+    const uint8_t* rec;
+    size_t avail;
+    size_t pos;
+    size_t num_sectors;
+    uint32_t sector_size;
+
+    rec = stream_window_get(w, 5, &avail);
+    if (!rec || avail < 5) {
+        *len_out = avail;
+        return rec;
+    }
+    if (rec[4] >= SECTOR_SIZE_LOOKUP_COUNT) { /* Invalid size code, nothing more to walk */
+        *len_out = avail;
+        return rec;
+    }
+    num_sectors = rec[3];
+    sector_size = SECTOR_SIZE_LOOKUP[rec[4]];
+    pos = 5 + num_sectors;
+    if (rec[2] & IMD_HFLAG_CMAP_PRES) pos += num_sectors;
+    if (rec[2] & IMD_HFLAG_HMAP_PRES) pos += num_sectors;
+
+    for (size_t i = 0; i < num_sectors; ++i) {
+        uint8_t flag;
+        rec = stream_window_get(w, pos + 1, &avail);
+        if (!rec || avail < pos + 1) break;
+        flag = rec[pos++];
+        if (flag > IMD_SDR_COMPRESSED_DEL_ERR) break; /* Invalid, left to the parser */
+        if (IMD_SDR_HAS_DATA(flag)) {
+            pos += IMD_SDR_IS_COMPRESSED(flag) ? 1 : sector_size;
+        }
+    }
+    rec = stream_window_get(w, pos, &avail);
+    *len_out = avail;
+    return rec;
+}
+
+/* Callbacks of one parse_stream_internal run; the conversion pipeline uses all of them */
+typedef struct {
+    /* Called once the comment block is parsed; nonzero (a negative IMD_ERR_*) aborts */
+    int (*on_header)(const ImdHeaderInfo* header, const uint8_t* comment, size_t comment_len, void* user_data);
+    /* Returns storage for the next track's data (at least size bytes), or NULL to abort */
+    uint8_t* (*get_data)(size_t size, void* user_data);
+    ImdStreamTrackFn on_track;
+    void* user_data;
+} StreamHooks;
+
+static long parse_stream_internal(const ImdIo* io, unsigned flags, ImdHeaderInfo* header_info,
+                                  char** comment_out, size_t* comment_len_out, const StreamHooks* hooks) {
+    StreamWindow w;
+    ImdHeaderInfo header;
+    const uint8_t* bytes;
+    const uint8_t* marker;
+    uint8_t* data = NULL;
+    size_t data_capacity = 0;
+    size_t avail;
+    size_t want;
+    size_t consumed = 0;
+    long track_count = 0;
+    int res;
+
+    if (comment_out) *comment_out = NULL;
+    if (comment_len_out) *comment_len_out = 0;
+    if (!io || !io->read || (io->peek && !io->skip)) return IMD_ERR_INVALID_ARG;
+
+    memset(&w, 0, sizeof(w));
+    w.io = io;
+
+    /* Header line */
+    bytes = stream_window_get(&w, LIBIMD_MAX_HEADER_LINE - 1, &avail);
+    if (!bytes) return IMD_ERR_ALLOC;
+    res = imd_read_file_header_buffer(bytes, avail, &header, &consumed);
+    if (res == 0 && header_info) *header_info = header;
+    if (res == 0) res = stream_window_consume(&w, consumed);
+    if (res != 0) goto done;
+
+    /* Comment block, up to the EOF marker */
+    want = 256;
+    for (;;) {
+        bytes = stream_window_get(&w, want, &avail);
+        if (!bytes) {
+            res = IMD_ERR_ALLOC;
+            goto done;
+        }
+        marker = (avail > 0) ? (const uint8_t*)memchr(bytes, LIBIMD_COMMENT_EOF_MARKER, avail) : NULL;
+        if (marker) break;
+        if (avail < want) {
+            DEBUG_PRINTF("DEBUG: imd_parse_stream: End of input before comment marker.\n");
+            res = IMD_ERR_READ_ERROR;
+            goto done;
+        }
+        want *= 2;
+    }
+    consumed = (size_t)(marker - bytes);
+    if (comment_out) {
+        *comment_out = (char*)imd_malloc(consumed + 1);
+        if (!*comment_out) {
+            res = IMD_ERR_ALLOC;
+            goto done;
+        }
+        memcpy(*comment_out, bytes, consumed);
+        (*comment_out)[consumed] = '\0';
+    }
+    if (comment_len_out) *comment_len_out = consumed;
+    if (hooks->on_header) {
+        res = hooks->on_header(&header, bytes, consumed, hooks->user_data);
+        if (res != 0) goto done;
+    }
+    res = stream_window_consume(&w, consumed + 1);
+    if (res != 0) goto done;
+
+    /* Track records */
+    for (;;) {
+        ImdTrackInfo track;
+        long long record_offset = w.consumed;
+        size_t record_len;
+
+        bytes = stream_window_get_record(&w, &record_len);
+        if (!bytes) {
+            res = IMD_ERR_ALLOC;
+            goto done;
+        }
+        if (flags & IMD_STREAM_FLAGS_ONLY) {
+            res = parse_track_buffer(bytes, record_len, &track, 0, PARSE_FLAGS_ONLY, NULL, 0, &consumed);
+        }
+        else if (hooks->get_data && record_len > 0) {
+            size_t need = (record_len >= 5 && bytes[4] < SECTOR_SIZE_LOOKUP_COUNT) ?
+                (size_t)bytes[3] * SECTOR_SIZE_LOOKUP[bytes[4]] : 0;
+            uint8_t* slot = hooks->get_data(need, hooks->user_data);
+            if (!slot) {
+                res = IMD_ERR_ALLOC;
+                goto done;
+            }
+            res = parse_track_buffer(bytes, record_len, &track, LIBIMD_FILL_BYTE_DEFAULT, PARSE_LOAD_INTO,
+                                     slot, need, &consumed);
+        }
+        else {
+            size_t need = (record_len >= 5 && bytes[4] < SECTOR_SIZE_LOOKUP_COUNT) ?
+                (size_t)bytes[3] * SECTOR_SIZE_LOOKUP[bytes[4]] : 0;
+            if (need > data_capacity) {
+                /* One buffer, reused for every track, sized for the largest so far */
+                uint8_t* new_data = (uint8_t*)imd_realloc(data, need);
+                if (!new_data) {
+                    res = IMD_ERR_ALLOC;
+                    goto done;
+                }
+                data = new_data;
+                data_capacity = need;
+            }
+            res = parse_track_buffer(bytes, record_len, &track, LIBIMD_FILL_BYTE_DEFAULT, PARSE_LOAD_INTO,
+                                     data, data_capacity, &consumed);
+        }
+        if (res == 0) break; /* Clean end of image */
+        if (res < 0) goto done;
+
+        track_count++;
+        if (hooks->on_track && hooks->on_track(&track, record_offset, hooks->user_data) != 0) break;
+        res = stream_window_consume(&w, consumed);
+        if (res != 0) goto done;
+    }
+    res = 0;
+
+done:
+    imd_free(data);
+    imd_free(w.buf);
+    if (res < 0) {
+        if (comment_out && *comment_out) {
+            imd_free(*comment_out);
+            *comment_out = NULL;
+        }
+        return res;
+    }
+    return track_count;
+}
+
+long imd_parse_stream(const ImdIo* io, unsigned flags, ImdHeaderInfo* header_info,
+                      char** comment_out, size_t* comment_len_out,
+                      ImdStreamTrackFn on_track, void* user_data) {
+    StreamHooks hooks = { NULL, NULL, on_track, user_data };
+    return parse_stream_internal(io, flags, header_info, comment_out, comment_len_out, &hooks);
+}
+
+
+/* --- Track Index --- */
+
+#define TRACK_INDEX_MAGIC "IMDX"
+#define TRACK_INDEX_VERSION 1
+#define TRACK_INDEX_HEADER_SIZE 28 /* magic(4) version(2) reserved(2) count(4) tracks_offset(8) image_size(8) */
+#define TRACK_INDEX_ENTRY_SIZE 22  /* offset(8) length(4) mode cyl head hflag nsec size_code unavail comp del err */
+
+static ImdTrackIndex* track_index_alloc(void) {
+    ImdTrackIndex* index = (ImdTrackIndex*)imd_calloc(1, sizeof(ImdTrackIndex));
+    if (!index) return NULL;
+    memset(index->lut, 0xFF, sizeof(index->lut)); /* All entries -1 */
+    return index;
+}
+
+/* Appends an entry and records it in the lookup table; the first record for a (cyl, head) wins */
+static int track_index_append(ImdTrackIndex* index, const ImdTrackIndexEntry* entry) {
+    if (index->count == index->capacity) {
+        size_t new_capacity = index->capacity ? index->capacity * 2 : 160;
+        ImdTrackIndexEntry* grown = (ImdTrackIndexEntry*)imd_realloc(index->entries, new_capacity * sizeof(ImdTrackIndexEntry));
+        if (!grown) return IMD_ERR_ALLOC;
+        index->entries = grown;
+        index->capacity = new_capacity;
+    }
+    index->entries[index->count] = *entry;
+    if (index->lut[entry->cyl][entry->head] < 0) {
+        index->lut[entry->cyl][entry->head] = (int32_t)index->count;
+    }
+    index->count++;
+    return 0;
+}
+
+static void fill_track_index_entry(ImdTrackIndexEntry* entry, const ImdTrackInfo* track, long offset, size_t length) {
+    memset(entry, 0, sizeof(*entry));
+    entry->offset = offset;
+    entry->length = (uint32_t)length;
+    entry->mode = track->mode;
+    entry->cyl = track->cyl;
+    entry->head = track->head;
+    entry->hflag = track->hflag;
+    entry->num_sectors = track->num_sectors;
+    entry->sector_size_code = track->sector_size_code;
+    for (uint32_t i = 0; i < track->num_sectors; ++i) {
+        uint8_t sflag = track->sflag[i];
+        if (sflag == IMD_SDR_UNAVAILABLE) {
+            entry->num_unavailable++;
+            continue;
+        }
+        if (IMD_SDR_IS_COMPRESSED(sflag)) entry->num_compressed++;
+        if (IMD_SDR_HAS_DAM(sflag)) entry->num_deleted++;
+        if (IMD_SDR_HAS_ERR(sflag)) entry->num_error++;
+    }
+}
+
+int imd_track_index_build(FILE* fimd, ImdTrackIndex** index_out) {
+    ImdTrackIndex* index;
+    ImdTrackInfo track;
+    ImdTrackIndexEntry entry;
+    long original_pos;
+    long end_pos;
+    int res;
+
+    if (!fimd || !index_out) return IMD_ERR_INVALID_ARG;
+    *index_out = NULL;
+
+    original_pos = ftell(fimd);
+    if (original_pos < 0) return IMD_ERR_SEEK_ERROR;
+    if (imd_stat_fseek(fimd, 0, SEEK_END) != 0 || (end_pos = ftell(fimd)) < 0 || imd_stat_fseek(fimd, 0, SEEK_SET) != 0) {
+        imd_stat_fseek(fimd, original_pos, SEEK_SET);
+        return IMD_ERR_SEEK_ERROR;
+    }
+
+    index = track_index_alloc();
+    if (!index) {
+        imd_stat_fseek(fimd, original_pos, SEEK_SET);
+        return IMD_ERR_ALLOC;
+    }
+    index->image_size = (uint64_t)end_pos;
+
+    res = imd_read_file_header(fimd, NULL, NULL, 0);
+    if (res == 0) res = imd_skip_comment_block(fimd);
+    if (res == 0) {
+        index->tracks_offset = ftell(fimd);
+        if (index->tracks_offset < 0) res = IMD_ERR_SEEK_ERROR;
+    }
+
+    while (res == 0) {
+        long track_pos = ftell(fimd);
+        long next_pos;
+
+        if (track_pos < 0) { res = IMD_ERR_SEEK_ERROR; break; }
+        res = read_track_record(fimd, &track, 0, PARSE_FLAGS_ONLY); /* Entries span whole records */
+        if (res == 0) break; /* Clean EOF */
+        if (res < 0) break;
+        next_pos = ftell(fimd);
+        if (next_pos < 0) { res = IMD_ERR_SEEK_ERROR; break; }
+        fill_track_index_entry(&entry, &track, track_pos, (size_t)(next_pos - track_pos));
+        res = track_index_append(index, &entry);
+    }
+
+    if (imd_stat_fseek(fimd, original_pos, SEEK_SET) != 0) {
+        DEBUG_PRINTF("DEBUG: imd_track_index_build: fseek to restore original_pos failed.\n");
+    }
+    if (res < 0) {
+        DEBUG_PRINTF("DEBUG: imd_track_index_build: Scan failed (%d) after %zu tracks.\n", res, index->count);
+        imd_track_index_free(index);
+        return res;
+    }
+    *index_out = index;
+    return 0;
+}
+
+int imd_track_index_build_buffer(const uint8_t* buf, size_t len, ImdTrackIndex** index_out) {
+    ImdTrackIndex* index;
+    ImdTrackInfo track;
+    ImdTrackIndexEntry entry;
+    const uint8_t* marker;
+    size_t pos;
+    size_t consumed;
+    int res;
+
+    if ((!buf && len > 0) || !index_out) return IMD_ERR_INVALID_ARG;
+    *index_out = NULL;
+
+    res = imd_read_file_header_buffer(buf, len, NULL, &consumed);
+    if (res != 0) return res;
+    pos = consumed;
+    marker = (const uint8_t*)memchr(buf + pos, LIBIMD_COMMENT_EOF_MARKER, len - pos);
+    if (!marker) return IMD_ERR_READ_ERROR;
+    pos = (size_t)(marker - buf) + 1;
+
+    index = track_index_alloc();
+    if (!index) return IMD_ERR_ALLOC;
+    index->image_size = (uint64_t)len;
+    index->tracks_offset = (long)pos;
+
+    while (pos < len) {
+        res = parse_track_buffer(buf + pos, len - pos, &track, 0, PARSE_FLAGS_ONLY, NULL, 0, &consumed);
+        if (res <= 0) break;
+        fill_track_index_entry(&entry, &track, (long)pos, consumed);
+        res = track_index_append(index, &entry);
+        if (res < 0) break;
+        pos += consumed;
+    }
+
+    if (res < 0) {
+        DEBUG_PRINTF("DEBUG: imd_track_index_build_buffer: Scan failed (%d) at offset %zu.\n", res, pos);
+        imd_track_index_free(index);
+        return res;
+    }
+    *index_out = index;
+    return 0;
+}
+
+void imd_track_index_free(ImdTrackIndex* index) {
+    if (!index) return;
+    imd_free(index->entries);
+    imd_free(index);
+}
+
+const ImdTrackIndexEntry* imd_track_index_find(const ImdTrackIndex* index, uint8_t cyl, uint8_t head) {
+    int32_t idx;
+
+    if (!index || head >= LIBIMD_MAX_HEADS) return NULL;
+    idx = index->lut[cyl][head];
+    return (idx >= 0) ? &index->entries[idx] : NULL;
+}
+
+int imd_track_index_has_valid_sectors(const ImdTrackIndex* index, uint8_t cyl, uint8_t head) {
+    const ImdTrackIndexEntry* entry;
+
+    if (!index) return IMD_ERR_INVALID_ARG;
+    entry = imd_track_index_find(index, cyl, head);
+    if (!entry) return IMD_ERR_TRACK_NOT_FOUND;
+    return (entry->num_unavailable < entry->num_sectors) ? 1 : 0;
+}
+
+static void put_le16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    put_le16(p, (uint16_t)v);
+    put_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put_le64(uint8_t* p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get_le16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+    return (uint32_t)get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static uint64_t get_le64(const uint8_t* p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+int imd_track_index_save(const ImdTrackIndex* index, FILE* fout) {
+    uint8_t rec[TRACK_INDEX_HEADER_SIZE];
+
+    if (!index || !fout || index->count > UINT32_MAX) return IMD_ERR_INVALID_ARG;
+
+    memcpy(rec, TRACK_INDEX_MAGIC, 4);
+    put_le16(rec + 4, TRACK_INDEX_VERSION);
+    put_le16(rec + 6, 0);
+    put_le32(rec + 8, (uint32_t)index->count);
+    put_le64(rec + 12, (uint64_t)index->tracks_offset);
+    put_le64(rec + 20, index->image_size);
+    if (write_bytes(rec, TRACK_INDEX_HEADER_SIZE, fout) != 0) return IMD_ERR_WRITE_ERROR;
+
+    for (size_t i = 0; i < index->count; ++i) {
+        const ImdTrackIndexEntry* e = &index->entries[i];
+        put_le64(rec, (uint64_t)e->offset);
+        put_le32(rec + 8, e->length);
+        rec[12] = e->mode;
+        rec[13] = e->cyl;
+        rec[14] = e->head;
+        rec[15] = e->hflag;
+        rec[16] = e->num_sectors;
+        rec[17] = e->sector_size_code;
+        rec[18] = e->num_unavailable;
+        rec[19] = e->num_compressed;
+        rec[20] = e->num_deleted;
+        rec[21] = e->num_error;
+        if (write_bytes(rec, TRACK_INDEX_ENTRY_SIZE, fout) != 0) return IMD_ERR_WRITE_ERROR;
+    }
+    return 0;
+}
+
+int imd_track_index_load(FILE* fin, uint64_t expected_image_size, ImdTrackIndex** index_out) {
+    uint8_t rec[TRACK_INDEX_HEADER_SIZE];
+    ImdTrackIndex* index;
+    ImdTrackIndexEntry entry;
+    uint32_t count;
+    uint64_t tracks_offset;
+    uint64_t next_offset;
+
+    if (!fin || !index_out) return IMD_ERR_INVALID_ARG;
+    *index_out = NULL;
+
+    if (imd_stat_fread(rec, 1, TRACK_INDEX_HEADER_SIZE, fin) != TRACK_INDEX_HEADER_SIZE) return IMD_ERR_READ_ERROR;
+    if (memcmp(rec, TRACK_INDEX_MAGIC, 4) != 0 || get_le16(rec + 4) != TRACK_INDEX_VERSION) {
+        DEBUG_PRINTF("DEBUG: imd_track_index_load: Bad magic or version.\n");
+        return IMD_ERR_READ_ERROR;
+    }
+    count = get_le32(rec + 8);
+    tracks_offset = get_le64(rec + 12);
+    if (tracks_offset > (uint64_t)LONG_MAX) return IMD_ERR_READ_ERROR;
+
+    index = track_index_alloc();
+    if (!index) return IMD_ERR_ALLOC;
+    index->tracks_offset = (long)tracks_offset;
+    index->image_size = get_le64(rec + 20);
+    if (expected_image_size != 0 && index->image_size != expected_image_size) {
+        DEBUG_PRINTF("DEBUG: imd_track_index_load: Stale sidecar (image size %llu, expected %llu).\n",
+            (unsigned long long)index->image_size, (unsigned long long)expected_image_size);
+        imd_track_index_free(index);
+        return IMD_ERR_READ_ERROR;
+    }
+
+    /* Records must be contiguous, in range, and describe well-formed track headers */
+    next_offset = tracks_offset;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (imd_stat_fread(rec, 1, TRACK_INDEX_ENTRY_SIZE, fin) != TRACK_INDEX_ENTRY_SIZE) break;
+        memset(&entry, 0, sizeof(entry));
+        entry.length = get_le32(rec + 8);
+        entry.mode = rec[12];
+        entry.cyl = rec[13];
+        entry.head = rec[14];
+        entry.hflag = rec[15];
+        entry.num_sectors = rec[16];
+        entry.sector_size_code = rec[17];
+        entry.num_unavailable = rec[18];
+        entry.num_compressed = rec[19];
+        entry.num_deleted = rec[20];
+        entry.num_error = rec[21];
+        if (get_le64(rec) != next_offset || entry.length < 5 ||
+            next_offset + entry.length > index->image_size ||
+            entry.mode >= LIBIMD_NUM_MODES || entry.head >= LIBIMD_MAX_HEADS ||
+            entry.sector_size_code >= SECTOR_SIZE_LOOKUP_COUNT ||
+            entry.num_unavailable > entry.num_sectors) {
+            break;
+        }
+        entry.offset = (long)next_offset;
+        if (track_index_append(index, &entry) != 0) {
+            imd_track_index_free(index);
+            return IMD_ERR_ALLOC;
+        }
+        next_offset += entry.length;
+    }
+
+    if (index->count != count) {
+        DEBUG_PRINTF("DEBUG: imd_track_index_load: Corrupt sidecar at entry %zu of %u.\n", index->count, (unsigned)count);
+        imd_track_index_free(index);
+        return IMD_ERR_READ_ERROR;
+    }
+    *index_out = index;
+    return 0;
+}
+
+
+/* --- Compact Track Arena --- */
+
+/* Bytes of map and flag storage a track occupies in an arena */
+static size_t compact_track_bytes(uint8_t num_sectors, uint8_t hflag) {
+    size_t maps = 2; /* smap and sflag */
+    if (hflag & IMD_HFLAG_CMAP_PRES) maps++;
+    if (hflag & IMD_HFLAG_HMAP_PRES) maps++;
+    return maps * num_sectors;
+}
+
+void imd_track_arena_init(ImdTrackArena* arena) {
+    if (arena) memset(arena, 0, sizeof(*arena));
+}
+
+void imd_track_arena_free(ImdTrackArena* arena) {
+    if (!arena) return;
+    imd_free(arena->tracks);
+    imd_free(arena->bytes);
+    memset(arena, 0, sizeof(*arena));
+}
+
+long imd_track_arena_append(ImdTrackArena* arena, const ImdTrackInfo* track, long offset) {
+    ImdCompactTrack* ct;
+    uint8_t* p;
+    size_t n;
+    size_t needed;
+
+    if (!arena || !track || arena->count >= (size_t)LONG_MAX) return IMD_ERR_INVALID_ARG;
+    n = track->num_sectors;
+    needed = compact_track_bytes(track->num_sectors, track->hflag);
+    if (arena->bytes_used + needed > UINT32_MAX) return IMD_ERR_ALLOC;
+
+    if (arena->count == arena->capacity) {
+        size_t new_capacity = arena->capacity ? arena->capacity * 2 : 160;
+        ImdCompactTrack* grown = (ImdCompactTrack*)imd_realloc(arena->tracks, new_capacity * sizeof(ImdCompactTrack));
+        if (!grown) return IMD_ERR_ALLOC;
+        arena->tracks = grown;
+        arena->capacity = new_capacity;
+    }
+    if (arena->bytes_used + needed > arena->bytes_capacity) {
+        size_t new_capacity = arena->bytes_capacity ? arena->bytes_capacity * 2 : 4096;
+        while (new_capacity < arena->bytes_used + needed) new_capacity *= 2;
+        uint8_t* grown = (uint8_t*)imd_realloc(arena->bytes, new_capacity);
+        if (!grown) return IMD_ERR_ALLOC;
+        arena->bytes = grown;
+        arena->bytes_capacity = new_capacity;
+    }
+
+    ct = &arena->tracks[arena->count];
+    ct->offset = offset;
+    ct->maps_offset = (uint32_t)arena->bytes_used;
+    ct->mode = track->mode;
+    ct->cyl = track->cyl;
+    ct->head = track->head;
+    ct->hflag = track->hflag;
+    ct->num_sectors = track->num_sectors;
+    ct->sector_size_code = track->sector_size_code;
+
+    p = arena->bytes + arena->bytes_used;
+    if (n > 0) {
+        memcpy(p, track->smap, n);
+        p += n;
+        if (track->hflag & IMD_HFLAG_CMAP_PRES) { memcpy(p, track->cmap, n); p += n; }
+        if (track->hflag & IMD_HFLAG_HMAP_PRES) { memcpy(p, track->hmap, n); p += n; }
+        memcpy(p, track->sflag, n);
+    }
+    arena->bytes_used += needed;
+    return (long)arena->count++;
+}
+
+int imd_track_arena_build(FILE* fimd, ImdTrackArena* arena) {
+    ImdTrackInfo track;
+    long original_pos;
+    int res;
+
+    if (!fimd || !arena) return IMD_ERR_INVALID_ARG;
+
+    original_pos = ftell(fimd);
+    if (original_pos < 0) return IMD_ERR_SEEK_ERROR;
+    if (imd_stat_fseek(fimd, 0, SEEK_SET) != 0) return IMD_ERR_SEEK_ERROR;
+
+    res = imd_read_file_header(fimd, NULL, NULL, 0);
+    if (res == 0) res = imd_skip_comment_block(fimd);
+
+    while (res == 0) {
+        long track_pos = ftell(fimd);
+        long idx;
+
+        if (track_pos < 0) { res = IMD_ERR_SEEK_ERROR; break; }
+        res = read_track_record(fimd, &track, 0, PARSE_FLAGS_ONLY);
+        if (res <= 0) break; /* Clean EOF or error */
+        idx = imd_track_arena_append(arena, &track, track_pos);
+        res = (idx < 0) ? (int)idx : 0;
+    }
+
+    if (imd_stat_fseek(fimd, original_pos, SEEK_SET) != 0) {
+        DEBUG_PRINTF("DEBUG: imd_track_arena_build: fseek to restore original_pos failed.\n");
+    }
+    return (res < 0) ? res : 0;
+}
+
+int imd_track_arena_get_maps(const ImdTrackArena* arena, size_t index, const uint8_t** smap_out,
+    const uint8_t** cmap_out, const uint8_t** hmap_out, const uint8_t** sflag_out) {
+    const ImdCompactTrack* ct;
+    const uint8_t* p;
+    size_t n;
+
+    if (!arena || index >= arena->count) return IMD_ERR_INVALID_ARG;
+    ct = &arena->tracks[index];
+    n = ct->num_sectors;
+    p = arena->bytes ? arena->bytes + ct->maps_offset : NULL;
+
+    if (smap_out) *smap_out = p;
+    if (p) p += n;
+    if (cmap_out) *cmap_out = (ct->hflag & IMD_HFLAG_CMAP_PRES) ? p : NULL;
+    if (p && (ct->hflag & IMD_HFLAG_CMAP_PRES)) p += n;
+    if (hmap_out) *hmap_out = (ct->hflag & IMD_HFLAG_HMAP_PRES) ? p : NULL;
+    if (p && (ct->hflag & IMD_HFLAG_HMAP_PRES)) p += n;
+    if (sflag_out) *sflag_out = p;
+    return 0;
+}
+
+int imd_track_arena_get_view(const ImdTrackArena* arena, size_t index, ImdTrackInfo* view) {
+    const ImdCompactTrack* ct;
+    const uint8_t* smap;
+    const uint8_t* cmap;
+    const uint8_t* hmap;
+    const uint8_t* sflag;
+    size_t n;
+
+    if (!view || imd_track_arena_get_maps(arena, index, &smap, &cmap, &hmap, &sflag) != 0) return IMD_ERR_INVALID_ARG;
+    ct = &arena->tracks[index];
+    n = ct->num_sectors;
+
+    memset(view, 0, sizeof(*view));
+    view->mode = ct->mode;
+    view->cyl = ct->cyl;
+    view->head = ct->head;
+    view->hflag = ct->hflag;
+    view->num_sectors = ct->num_sectors;
+    view->sector_size_code = ct->sector_size_code;
+    view->sector_size = (ct->sector_size_code < SECTOR_SIZE_LOOKUP_COUNT) ? SECTOR_SIZE_LOOKUP[ct->sector_size_code] : 0;
+    if (n == 0) return 0;
+
+    memcpy(view->smap, smap, n);
+    if (cmap) memcpy(view->cmap, cmap, n);
+    else memset(view->cmap, ct->cyl, n);
+    if (hmap) memcpy(view->hmap, hmap, n);
+    else memset(view->hmap, ct->head, n);
+    memcpy(view->sflag, sflag, n);
+    for (size_t i = 0; i < n; ++i) {
+        if (sflag[i] == IMD_SDR_UNAVAILABLE || IMD_SDR_IS_COMPRESSED(sflag[i])) IMD_TRACK_SET_UNIFORM(view, i, 1);
+    }
+    return 0;
+}
+
+/* --- Uniformity Kernels --- */
+
+/*
+ * imd_is_uniform() and imd_classify_sectors() compare every byte of a buffer
+ * against a single value. The scan is dispatched once to the widest kernel the
+ * CPU supports: AVX2 (selected at run time) or SSE2 on x86, NEON on AArch64,
+ * and a portable 64-bit word-at-a-time loop everywhere else.
+ * Define LIBIMD_DISABLE_SIMD to build only the portable kernel.
+ */
+typedef int (*uniform_scan_fn)(const uint8_t* data, size_t size, uint8_t value);
+
+/* Portable kernel: XOR 64-bit words against the repeated value, 32 bytes per iteration */
+static int uniform_scan_word(const uint8_t* data, size_t size, uint8_t value) {
+    const uint64_t pattern = UINT64_C(0x0101010101010101) * value;
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        uint64_t w[4];
+        memcpy(w, data + i, sizeof(w));
+        if (((w[0] ^ pattern) | (w[1] ^ pattern) | (w[2] ^ pattern) | (w[3] ^ pattern)) != 0) return 0;
+    }
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        if ((w ^ pattern) != 0) return 0;
+    }
+    for (; i < size; ++i) {
+        if (data[i] != value) return 0;
+    }
+    return 1;
+}
+
+#if LIBIMD_HAVE_SSE2
+static int uniform_scan_sse2(const uint8_t* data, size_t size, uint8_t value) {
+    const __m128i pattern = _mm_set1_epi8((char)value);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 64 <= size; i += 64) {
+        __m128i acc = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(const void*)(data + i)), pattern);
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(const void*)(data + i + 16)), pattern));
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(const void*)(data + i + 32)), pattern));
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(const void*)(data + i + 48)), pattern));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) return 0;
+    }
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(const void*)(data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern)) != 0xFFFF) return 0;
+    }
+    return uniform_scan_word(data + i, size - i, value);
+}
+#endif /* LIBIMD_HAVE_SSE2 */
+
+#if LIBIMD_HAVE_AVX2
+LIBIMD_TARGET_AVX2
+static int uniform_scan_avx2(const uint8_t* data, size_t size, uint8_t value) {
+    const __m256i pattern = _mm256_set1_epi8((char)value);
+    size_t i = 0;
+
+    for (; i + 128 <= size; i += 128) {
+        __m256i acc = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(const void*)(data + i)), pattern);
+        acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(const void*)(data + i + 32)), pattern));
+        acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(const void*)(data + i + 64)), pattern));
+        acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(const void*)(data + i + 96)), pattern));
+        if (!_mm256_testz_si256(acc, acc)) return 0;
+    }
+    for (; i + 32 <= size; i += 32) {
+        __m256i acc = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(const void*)(data + i)), pattern);
+        if (!_mm256_testz_si256(acc, acc)) return 0;
+    }
+    return uniform_scan_word(data + i, size - i, value);
+}
+
+/* AVX2 needs both the CPU feature and OS support for saving the YMM registers */
+static int cpu_has_avx2(void) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return 0;
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return 0; /* OSXSAVE, AVX */
+    if ((_xgetbv(0) & 0x6) != 0x6) return 0; /* XMM and YMM state enabled */
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif /* LIBIMD_HAVE_AVX2 */
+
+#if LIBIMD_HAVE_NEON
+static int uniform_scan_neon(const uint8_t* data, size_t size, uint8_t value) {
+    const uint8x16_t pattern = vdupq_n_u8(value);
+    size_t i = 0;
+
+    for (; i + 64 <= size; i += 64) {
+        uint8x16_t acc = veorq_u8(vld1q_u8(data + i), pattern);
+        acc = vorrq_u8(acc, veorq_u8(vld1q_u8(data + i + 16), pattern));
+        acc = vorrq_u8(acc, veorq_u8(vld1q_u8(data + i + 32), pattern));
+        acc = vorrq_u8(acc, veorq_u8(vld1q_u8(data + i + 48), pattern));
+        if (vmaxvq_u8(acc) != 0) return 0;
+    }
+    for (; i + 16 <= size; i += 16) {
+        if (vmaxvq_u8(veorq_u8(vld1q_u8(data + i), pattern)) != 0) return 0;
     }
+    return uniform_scan_word(data + i, size - i, value);
+}
+#endif /* LIBIMD_HAVE_NEON */
 
-    return final_result; /* Return the determined result */
+static uniform_scan_fn select_uniform_scan(void) {
+#if LIBIMD_HAVE_AVX2
+    if (cpu_has_avx2()) return uniform_scan_avx2;
+#endif
+#if LIBIMD_HAVE_SSE2
+    return uniform_scan_sse2;
+#elif LIBIMD_HAVE_NEON
+    return uniform_scan_neon;
+#else
+    return uniform_scan_word;
+#endif
 }
 
+/* Selected on first use; concurrent first calls store the same pointer */
+static volatile uniform_scan_fn uniform_scan_impl = NULL;
+
+static int uniform_scan(const uint8_t* data, size_t size, uint8_t value) {
+    uniform_scan_fn fn = uniform_scan_impl;
+    if (!fn) {
+        fn = select_uniform_scan();
+        uniform_scan_impl = fn;
+    }
+    return fn(data, size, value);
+}
 
 int imd_is_uniform(const uint8_t* data, size_t size, uint8_t* fill_byte_out) {
     if (size == 0) return 1; /* Empty is considered uniform */
     if (!data || !fill_byte_out) return 0; /* Invalid args */
     *fill_byte_out = data[0]; /* Store the first byte */
     /* Check if all other bytes match the first one */
-    for (size_t i = 1; i < size; ++i) {
-        if (data[i] != *fill_byte_out) {
-            return 0; /* Found a non-matching byte */
+    return uniform_scan(data + 1, size - 1, data[0]);
+}
+
+int imd_classify_sectors(const ImdTrackInfo* track, uint8_t* uniform_out, uint8_t* fill_out) {
+    int uniform_count = 0;
+
+    if (!track || !uniform_out) return IMD_ERR_INVALID_ARG;
+    if (track->num_sectors > 0 && track->sector_size > 0 &&
+        (!track->data || track->data_size < (size_t)track->num_sectors * track->sector_size)) {
+        return IMD_ERR_INVALID_ARG;
+    }
+
+    for (uint32_t i = 0; i < track->num_sectors; ++i) {
+        const uint8_t* sector_data = track->data + (size_t)i * track->sector_size;
+        int is_uniform = 1;
+        uint8_t fill_byte = 0;
+
+        if (track->sector_size > 0) {
+            fill_byte = sector_data[0];
+            is_uniform = IMD_TRACK_IS_UNIFORM(track, i) || uniform_scan(sector_data + 1, track->sector_size - 1, fill_byte);
         }
+        uniform_out[i] = (uint8_t)is_uniform;
+        if (fill_out) fill_out[i] = is_uniform ? fill_byte : 0;
+        uniform_count += is_uniform;
     }
-    return 1; /* All bytes matched */
+    return uniform_count;
 }
 
 int imd_calculate_best_interleave(ImdTrackInfo* track) {
@@ -1256,6 +2004,63 @@ int imd_calculate_best_interleave(ImdTrackInfo* track) {
     return best_interleave;
 }
 
+/*
+ * Physical slot filled by each logically ordered sector for a given
+ * (num_sectors, interleave) pair. This only depends on the pair, so the last
+ * result is kept per thread; a whole disk normally shares a single layout.
+ */
+static LIBIMD_THREAD_LOCAL struct {
+    uint8_t num_sectors;        /* 0 if the cache is empty */
+    int interleave_factor;
+    uint8_t slots[LIBIMD_MAX_SECTORS_PER_TRACK];
+} interleave_slot_cache;
+
+static const uint8_t* interleave_slots(uint8_t n, int interleave_factor) {
+    if (interleave_slot_cache.num_sectors != n || interleave_slot_cache.interleave_factor != interleave_factor) {
+        uint8_t physical_pos_used[LIBIMD_MAX_SECTORS_PER_TRACK] = { 0 }; /* Tracks which physical slots have been filled */
+        int current_physical_pos = 0; /* Target physical position for the current sector */
+
+        for (int i = 0; i < n; ++i) { /* Iterate through sectors in logical order (index 'i') */
+            /* Find the next available physical slot */
+            while (physical_pos_used[current_physical_pos]) {
+                current_physical_pos = (current_physical_pos + 1) % n;
+            }
+            interleave_slot_cache.slots[i] = (uint8_t)current_physical_pos;
+            physical_pos_used[current_physical_pos] = 1; /* Mark this physical slot as filled */
+
+            /* Advance the target physical position pointer by the interleave factor for the *next* logical sector */
+            current_physical_pos = (int)(((long)current_physical_pos + interleave_factor) % n);
+        }
+        interleave_slot_cache.num_sectors = n;
+        interleave_slot_cache.interleave_factor = interleave_factor;
+    }
+    return interleave_slot_cache.slots;
+}
+
+int imd_compute_interleave_permutation(const ImdTrackInfo* track, int interleave_factor, uint8_t* perm_out) {
+    if (!track || !perm_out || track->num_sectors < 2 || interleave_factor < 1) {
+        return IMD_ERR_INVALID_ARG;
+    }
+
+    uint8_t n = track->num_sectors;
+    uint8_t id_count[256] = { 0 }; /* Occurrences of each sector ID */
+    uint8_t id_first[256];         /* Physical index of the first sector with each ID */
+    const uint8_t* slots = interleave_slots(n, interleave_factor);
+    int logical = 0;
+
+    /* Counting sort of the sector IDs; repeated IDs resolve to their first sector */
+    for (int k = n - 1; k >= 0; --k) {
+        id_count[track->smap[k]]++;
+        id_first[track->smap[k]] = (uint8_t)k;
+    }
+    for (int id = 0; id < 256; ++id) {
+        for (uint8_t c = id_count[id]; c > 0; --c) {
+            perm_out[slots[logical++]] = id_first[id];
+        }
+    }
+    return 0;
+}
+
 int imd_apply_interleave(ImdTrackInfo* track, int interleave_factor) {
     if (!track || !track->loaded || !track->data || track->num_sectors < 2 || interleave_factor < 1) {
         DEBUG_PRINTF("DEBUG: imd_apply_interleave: Invalid argument or track state (loaded=%d, data=%p, nsec=%d, il=%d).\n",
@@ -1264,151 +2069,77 @@ int imd_apply_interleave(ImdTrackInfo* track, int interleave_factor) {
     }
 
     uint8_t n = track->num_sectors;
+    uint8_t perm[LIBIMD_MAX_SECTORS_PER_TRACK];
     uint8_t original_smap[LIBIMD_MAX_SECTORS_PER_TRACK];
     uint8_t original_cmap[LIBIMD_MAX_SECTORS_PER_TRACK];
     uint8_t original_hmap[LIBIMD_MAX_SECTORS_PER_TRACK];
     uint8_t original_sflag[LIBIMD_MAX_SECTORS_PER_TRACK];
+    uint8_t original_uniform_map[LIBIMD_MAX_SECTORS_PER_TRACK / 8];
     uint8_t* original_data = NULL;
-    uint8_t logical_to_physical[LIBIMD_MAX_SECTORS_PER_TRACK]; /* Maps sorted logical ID index to original physical index */
-    uint8_t physical_pos_used[LIBIMD_MAX_SECTORS_PER_TRACK] = { 0 }; /* Tracks which physical slots have been filled */
-    int current_physical_pos = 0; /* Target physical position for the current sector */
 
     DEBUG_PRINTF("DEBUG: imd_apply_interleave: Applying interleave %d to C%u H%u (%u sectors).\n", interleave_factor, track->cyl, track->head, n);
 
-    /* 1. Backup original track state (maps and data) */
+    int ret_status = imd_compute_interleave_permutation(track, interleave_factor, perm);
+    if (ret_status != 0) return ret_status;
+
+    /* Backup original track state (maps and data) */
     memcpy(original_smap, track->smap, n);
     memcpy(original_cmap, track->cmap, n);
     memcpy(original_hmap, track->hmap, n);
     memcpy(original_sflag, track->sflag, n);
-    original_data = (uint8_t*)malloc(track->data_size);
+    memcpy(original_uniform_map, track->uniform_map, sizeof(original_uniform_map));
+    original_data = (uint8_t*)imd_malloc(track->data_size);
     if (!original_data) {
         DEBUG_PRINTF("ERROR: imd_apply_interleave: Failed to allocate buffer for original data backup.\n");
         return IMD_ERR_ALLOC; /* Allocation failed */
     }
     memcpy(original_data, track->data, track->data_size);
 
-    /* 2. Create sorted list of logical sector IDs */
-    uint8_t sorted_smap[LIBIMD_MAX_SECTORS_PER_TRACK];
-    memcpy(sorted_smap, original_smap, n);
-    /* Simple bubble sort for small N */
-    for (int i = 0; i < n - 1; ++i) {
-        for (int j = 0; j < n - i - 1; ++j) {
-            if (sorted_smap[j] > sorted_smap[j + 1]) {
-                uint8_t temp = sorted_smap[j]; sorted_smap[j] = sorted_smap[j + 1]; sorted_smap[j + 1] = temp;
-            }
-        }
-    }
-    /* Find original physical index for each sorted logical sector ID */
-    /* logical_to_physical[i] = original physical index of the i-th logically sorted sector */
-    for (int i = 0; i < n; ++i) {
-        logical_to_physical[i] = LIBIMD_INVALID_SECTOR_POS; /* Use sentinel */
-        for (int k = 0; k < n; ++k) {
-            if (original_smap[k] == sorted_smap[i]) {
-                logical_to_physical[i] = (uint8_t)k; /* Found original index */
-                break;
-            }
-        }
-        if (logical_to_physical[i] == LIBIMD_INVALID_SECTOR_POS) {
-            /* Error: Sector ID from sorted list not found in original map (should not happen if input is valid) */
-            DEBUG_PRINTF("ERROR: imd_apply_interleave: Logical sector ID %u not found in original smap.\n", sorted_smap[i]);
-            free(original_data);
-            return IMD_ERR_SECTOR_NOT_FOUND; /* Logical error, map invalid */
-        }
-    }
-
-    /* 3. Place sectors into new physical positions based on interleave */
-    for (int i = 0; i < n; ++i) { /* Iterate through sectors in logical order (index 'i') */
-        /* Find the next available physical slot */
-        while (physical_pos_used[current_physical_pos]) {
-            current_physical_pos = (current_physical_pos + 1) % n;
-        }
-
-        /* Get the original physical index of the current logical sector (sorted_smap[i]) */
-        uint8_t original_index = logical_to_physical[i];
-
-        /* Place the data and maps from the 'original_index' into the 'current_physical_pos' */
-        track->smap[current_physical_pos] = original_smap[original_index];
-        track->cmap[current_physical_pos] = original_cmap[original_index];
-        track->hmap[current_physical_pos] = original_hmap[original_index];
-        track->sflag[current_physical_pos] = original_sflag[original_index];
+    /* Place the data and maps of sector perm[p] into physical position p */
+    for (int p = 0; p < n; ++p) {
+        uint8_t original_index = perm[p];
+        track->smap[p] = original_smap[original_index];
+        track->cmap[p] = original_cmap[original_index];
+        track->hmap[p] = original_hmap[original_index];
+        track->sflag[p] = original_sflag[original_index];
+        IMD_TRACK_SET_UNIFORM(track, p, (original_uniform_map[original_index >> 3] >> (original_index & 7)) & 1);
         if (track->sector_size > 0) { /* Avoid memcpy with size 0 */
-            memcpy(track->data + ((size_t)current_physical_pos * track->sector_size),
+            memcpy(track->data + ((size_t)p * track->sector_size),
                 original_data + ((size_t)original_index * track->sector_size),
                 track->sector_size);
         }
-        physical_pos_used[current_physical_pos] = 1; /* Mark this physical slot as filled */
-
-        /* Advance the target physical position pointer by the interleave factor for the *next* logical sector */
-        current_physical_pos = (current_physical_pos + interleave_factor) % n;
     }
 
-    free(original_data); /* Free the backup buffer */
+    imd_free(original_data); /* Free the backup buffer */
     return 0; /* Success */
 }
 
-/* Updated imd_write_track_imd to use compression_mode */
-int imd_write_track_imd(FILE* fout, ImdTrackInfo* track, const ImdWriteOpts* opts) {
-    if (!fout || !track || !opts) return IMD_ERR_INVALID_ARG; /* Check args */
-    if (!track->loaded) {
-        DEBUG_PRINTF("DEBUG: imd_write_track_imd: Error - Track data not loaded for C%u H%u.\n", track->cyl, track->head);
-        return IMD_ERR_INVALID_ARG; /* Cannot write unloaded track */
-    }
-
-    /* --- Prepare data and flags for writing --- */
-    uint8_t final_sflag[LIBIMD_MAX_SECTORS_PER_TRACK]; /* Flags to actually write */
-    uint8_t final_mode = track->mode;
-    ImdTrackInfo track_to_write = *track; /* Work on a copy to allow modification (interleave) */
-    uint8_t* interleaved_data = NULL; /* Buffer for interleaved data if needed */
-    int ret_status = 0; /* Assume success initially */
-
-    /* Create a copy of data if interleaving is requested and there's data */
-    if (opts->interleave_factor != LIBIMD_IL_AS_READ && track->num_sectors > 1 && track->data_size > 0) {
-        DEBUG_PRINTF("DEBUG: imd_write_track_imd: Allocating buffer for interleave copy (%zu bytes).\n", track->data_size);
-        interleaved_data = (uint8_t*)malloc(track->data_size);
-        if (!interleaved_data) return IMD_ERR_ALLOC;
-        memcpy(interleaved_data, track->data, track->data_size);
-        track_to_write.data = interleaved_data; /* Point copy to copied data */
-    }
-    else {
-        /* No interleaving or no data, point copy to original data */
-        track_to_write.data = track->data;
-    }
-
-    /* Apply Interleave (modifies track_to_write maps and data in place) */
+/*
+ * Resolves the output order of a track for the writers. Returns 1 and fills
+ * perm (see imd_compute_interleave_permutation) if the sectors are reordered,
+ * 0 if they are written in their current order, or a negative IMD_ERR_*.
+ */
+static int resolve_write_order(ImdTrackInfo* track, const ImdWriteOpts* opts, uint8_t* perm) {
     int il_factor = opts->interleave_factor;
-    if (il_factor != LIBIMD_IL_AS_READ && track_to_write.num_sectors > 1) {
-        if (il_factor == LIBIMD_IL_BEST_GUESS) {
-            /* Calculate best guess based on the possibly modified track_to_write (maps are still original here) */
-            il_factor = imd_calculate_best_interleave(&track_to_write);
-            DEBUG_PRINTF("DEBUG: imd_write_track_imd: Best guess interleave calculated as %d.\n", il_factor);
-        }
-        /* Apply the determined interleave factor */
-        ret_status = imd_apply_interleave(&track_to_write, il_factor);
-        if (ret_status != 0) {
-            DEBUG_PRINTF("ERROR: imd_write_track_imd: Failed to apply interleave %d (status %d).\n", il_factor, ret_status);
-            if (interleaved_data) free(interleaved_data);
-            return ret_status; /* Failed to apply interleave, return specific error */
-        }
-        /* track_to_write now contains interleaved maps and data */
-    }
-
-    /* Apply Mode Translation */
-    if (track_to_write.mode < LIBIMD_NUM_MODES) {
-        final_mode = opts->tmode[track_to_write.mode];
-        if (final_mode != track_to_write.mode) {
-            DEBUG_PRINTF("DEBUG: imd_write_track_imd: Translating mode %u to %u for C%u H%u.\n", track_to_write.mode, final_mode, track_to_write.cyl, track_to_write.head);
-        }
+    if (il_factor == LIBIMD_IL_AS_READ || track->num_sectors < 2) return 0;
+    if (il_factor == LIBIMD_IL_BEST_GUESS) {
+        il_factor = imd_calculate_best_interleave(track);
+        DEBUG_PRINTF("DEBUG: resolve_write_order: Best guess interleave calculated as %d.\n", il_factor);
     }
-    else {
-        DEBUG_PRINTF("WARNING: imd_write_track_imd: Original mode %u is invalid, writing as is.\n", track_to_write.mode);
-        final_mode = track_to_write.mode; /* Write invalid mode as is */
+    int ret_status = imd_compute_interleave_permutation(track, il_factor, perm);
+    if (ret_status != 0) {
+        DEBUG_PRINTF("ERROR: resolve_write_order: Failed to compute interleave %d (status %d).\n", il_factor, ret_status);
+        return ret_status;
     }
+    return 1;
+}
 
+/* Determines the sector flags imd_write_track_imd() will emit for a track */
+int imd_compute_write_sflags(const ImdTrackInfo* track, const ImdWriteOpts* opts, uint8_t* sflag_out) {
+    if (!track || !opts || !sflag_out) return IMD_ERR_INVALID_ARG;
 
-    /* Sector Flag/Type Processing (Determine flags to write based on data and options) */
-    for (uint8_t i = 0; i < track_to_write.num_sectors; ++i) {
-        /* Get the original flag from the (potentially interleaved) track copy */
-        uint8_t original_flag = track_to_write.sflag[i];
+    for (uint8_t i = 0; i < track->num_sectors; ++i) {
+        uint8_t original_flag = track->sflag[i];
         uint8_t target_base_type; /* IMD_SDR_NORMAL or IMD_SDR_COMPRESSED */
         int target_has_dam = 0;
         int target_has_err = 0;
@@ -1416,30 +2147,32 @@ int imd_write_track_imd(FILE* fout, ImdTrackInfo* track, const ImdWriteOpts* opt
         /* Handle Unavailable sectors first */
         if (original_flag == IMD_SDR_UNAVAILABLE) {
             /* If original sector is unavailable, keep it that way */
-            final_sflag[i] = IMD_SDR_UNAVAILABLE;
-            DEBUG_PRINTF("DEBUG:   imd_write_track_imd: Sector %u: Original=UNAVAILABLE -> Final=UNAVAILABLE\n", i);
+            sflag_out[i] = IMD_SDR_UNAVAILABLE;
+            DEBUG_PRINTF("DEBUG:   imd_compute_write_sflags: Sector %u: Original=UNAVAILABLE -> Final=UNAVAILABLE\n", i);
             continue; /* Move to next sector */
         }
 
         /* Sector has data (or was flagged as having data), check uniformity */
-        uint8_t* sector_data = NULL;
-        if (track_to_write.data && track_to_write.data_size >= ((size_t)(i + 1) * track_to_write.sector_size)) {
+        const uint8_t* sector_data = NULL;
+        if (track->data && track->data_size >= ((size_t)(i + 1) * track->sector_size)) {
             /* Ensure offset calculation is safe */
-            sector_data = track_to_write.data + ((size_t)i * track_to_write.sector_size);
+            sector_data = track->data + ((size_t)i * track->sector_size);
         }
-        else if (track_to_write.sector_size > 0) {
+        else if (track->sector_size > 0) {
             /* This case indicates an inconsistency: flag suggests data, but buffer is too small or null */
-            DEBUG_PRINTF("ERROR:   imd_write_track_imd: Data buffer inconsistent for sector %u (flag=0x%02X, size=%zu, offset=%zu, data_ptr=%p)\n",
-                i, original_flag, track_to_write.data_size, (size_t)i * track_to_write.sector_size, track_to_write.data);
-            ret_status = IMD_ERR_INVALID_ARG; /* Or a more specific internal error? */
-            if (interleaved_data) free(interleaved_data);
-            return ret_status;
+            DEBUG_PRINTF("ERROR:   imd_compute_write_sflags: Data buffer inconsistent for sector %u (flag=0x%02X, size=%zu, offset=%zu, data_ptr=%p)\n",
+                i, original_flag, track->data_size, (size_t)i * track->sector_size, (void*)track->data);
+            return IMD_ERR_INVALID_ARG; /* Or a more specific internal error? */
         }
 
+        /* Only FORCE_COMPRESS, and AS_READ on an originally compressed sector, depend on uniformity */
         int is_uniform_sector = 0;
-        uint8_t fill_byte = 0; /* Used later if compressing */
-        if (sector_data && track_to_write.sector_size > 0) {
-            is_uniform_sector = imd_is_uniform(sector_data, track_to_write.sector_size, &fill_byte);
+        uint8_t fill_byte = 0;
+        int needs_uniformity = (opts->compression_mode == IMD_COMPRESSION_FORCE_COMPRESS) ||
+            (opts->compression_mode != IMD_COMPRESSION_FORCE_DECOMPRESS && IMD_SDR_IS_COMPRESSED(original_flag));
+        if (needs_uniformity && sector_data && track->sector_size > 0) {
+            /* Sectors known to be uniform since load need no scan */
+            is_uniform_sector = IMD_TRACK_IS_UNIFORM(track, i) || imd_is_uniform(sector_data, track->sector_size, &fill_byte);
         }
 
         /* Determine target base type based on uniformity and compression_mode option */
@@ -1473,107 +2206,252 @@ int imd_write_track_imd(FILE* fout, ImdTrackInfo* track, const ImdWriteOpts* opt
 
         /* Combine base type and status bits to get the final sector flag */
         if (target_base_type == IMD_SDR_NORMAL) {
-            if (target_has_dam && target_has_err) final_sflag[i] = IMD_SDR_DELETED_ERR;
-            else if (target_has_err) final_sflag[i] = IMD_SDR_NORMAL_ERR;
-            else if (target_has_dam) final_sflag[i] = IMD_SDR_NORMAL_DAM;
-            else final_sflag[i] = IMD_SDR_NORMAL;
+            if (target_has_dam && target_has_err) sflag_out[i] = IMD_SDR_DELETED_ERR;
+            else if (target_has_err) sflag_out[i] = IMD_SDR_NORMAL_ERR;
+            else if (target_has_dam) sflag_out[i] = IMD_SDR_NORMAL_DAM;
+            else sflag_out[i] = IMD_SDR_NORMAL;
         }
         else { /* target_base_type == IMD_SDR_COMPRESSED */
-            if (target_has_dam && target_has_err) final_sflag[i] = IMD_SDR_COMPRESSED_DEL_ERR;
-            else if (target_has_err) final_sflag[i] = IMD_SDR_COMPRESSED_ERR;
-            else if (target_has_dam) final_sflag[i] = IMD_SDR_COMPRESSED_DAM;
-            else final_sflag[i] = IMD_SDR_COMPRESSED;
+            if (target_has_dam && target_has_err) sflag_out[i] = IMD_SDR_COMPRESSED_DEL_ERR;
+            else if (target_has_err) sflag_out[i] = IMD_SDR_COMPRESSED_ERR;
+            else if (target_has_dam) sflag_out[i] = IMD_SDR_COMPRESSED_DAM;
+            else sflag_out[i] = IMD_SDR_COMPRESSED;
         }
-        DEBUG_PRINTF("DEBUG:   imd_write_track_imd: Sector %u: Orig=0x%02X, Opts(C:%d,NB:%d,ND:%d), Uniform=%d -> Final=0x%02X\n",
-            i, original_flag, opts->compression_mode, opts->force_non_bad, opts->force_non_deleted, is_uniform_sector, final_sflag[i]);
+        DEBUG_PRINTF("DEBUG:   imd_compute_write_sflags: Sector %u: Orig=0x%02X, Opts(C:%d,NB:%d,ND:%d), Uniform=%d -> Final=0x%02X\n",
+            i, original_flag, opts->compression_mode, opts->force_non_bad, opts->force_non_deleted, is_uniform_sector, sflag_out[i]);
+    }
+    return 0;
+}
+
+int imd_write_opts_is_identity(const ImdWriteOpts* opts) {
+    if (!opts) return 0;
+    if (opts->compression_mode != IMD_COMPRESSION_AS_READ || opts->force_non_bad || opts->force_non_deleted ||
+        opts->interleave_factor != LIBIMD_IL_AS_READ) {
+        return 0;
+    }
+    for (uint8_t m = 0; m < LIBIMD_NUM_MODES; ++m) {
+        if (opts->tmode[m] != m) return 0;
     }
+    return 1;
+}
 
+/* Appends bytes to an encode buffer, failing instead of overflowing it */
+static int put_bytes(uint8_t* buf, size_t buf_size, size_t* pos, const void* src, size_t len) {
+    if (len > buf_size - *pos) return IMD_ERR_BUFFER_TOO_SMALL;
+    if (len > 0) memcpy(buf + *pos, src, len);
+    *pos += len;
+    return 0;
+}
 
-    /* --- Write IMD Output --- */
-    DEBUG_PRINTF("DEBUG: imd_write_track_imd: Writing track C%u H%u header.\n", track_to_write.cyl, track_to_write.head);
-    if (fputc(final_mode, fout) == EOF ||
-        fputc(track_to_write.cyl, fout) == EOF ||
-        fputc(track_to_write.head | track_to_write.hflag, fout) == EOF || /* Combine head number and flags */
-        fputc(track_to_write.num_sectors, fout) == EOF ||
-        fputc(track_to_write.sector_size_code, fout) == EOF) {
-        DEBUG_PRINTF("ERROR: imd_write_track_imd: Error writing track header bytes.\n");
-        if (interleaved_data) free(interleaved_data);
-        return IMD_ERR_WRITE_ERROR;
+static int put_byte(uint8_t* buf, size_t buf_size, size_t* pos, uint8_t value) {
+    if (*pos >= buf_size) return IMD_ERR_BUFFER_TOO_SMALL;
+    buf[(*pos)++] = value;
+    return 0;
+}
+
+size_t imd_track_encoded_size_bound(const ImdTrackInfo* track) {
+    size_t maps = 1;
+    if (!track) return 0;
+    if (track->hflag & IMD_HFLAG_CMAP_PRES) maps++;
+    if (track->hflag & IMD_HFLAG_HMAP_PRES) maps++;
+    /* Header, maps, then one flag byte and at most a full sector per record */
+    return 5 + (size_t)track->num_sectors * (maps + 1 + track->sector_size);
+}
+
+static int encode_track_to_buffer(ImdTrackInfo* track, const ImdWriteOpts* opts, uint8_t* buf, size_t buf_size, size_t* written_out) {
+    if (!track || !opts || !buf || !written_out) return IMD_ERR_INVALID_ARG; /* Check args */
+    *written_out = 0;
+    if (!track->loaded) {
+        DEBUG_PRINTF("DEBUG: imd_encode_track_to_buffer: Error - Track data not loaded for C%u H%u.\n", track->cyl, track->head);
+        return IMD_ERR_INVALID_ARG; /* Cannot write unloaded track */
+    }
+
+    /* --- Prepare data and flags for writing --- */
+    uint8_t sflag[LIBIMD_MAX_SECTORS_PER_TRACK];       /* Flags to write, by source sector */
+    uint8_t perm[LIBIMD_MAX_SECTORS_PER_TRACK];        /* Output position -> source sector */
+    uint8_t final_mode = track->mode;
+    size_t pos = 0;
+    int ret_status = 0; /* Assume success initially */
+
+    /* Interleaving only changes the order the sectors are written in */
+    int reordered = resolve_write_order(track, opts, perm);
+    if (reordered < 0) return reordered;
+    if (!reordered) {
+        for (int i = 0; i < track->num_sectors; ++i) perm[i] = (uint8_t)i;
     }
 
-    /* Write Maps (only if sectors exist) */
-    if (track_to_write.num_sectors > 0) {
-        DEBUG_PRINTF("DEBUG:   imd_write_track_imd: Writing smap (%u bytes).\n", track_to_write.num_sectors);
-        if (write_bytes(track_to_write.smap, track_to_write.num_sectors, fout) != 0) { goto write_error; }
-        if (track_to_write.hflag & IMD_HFLAG_CMAP_PRES) {
-            DEBUG_PRINTF("DEBUG:   imd_write_track_imd: Writing cmap (%u bytes).\n", track_to_write.num_sectors);
-            if (write_bytes(track_to_write.cmap, track_to_write.num_sectors, fout) != 0) { goto write_error; }
+    /* Apply Mode Translation */
+    if (track->mode < LIBIMD_NUM_MODES) {
+        final_mode = opts->tmode[track->mode];
+        if (final_mode != track->mode) {
+            DEBUG_PRINTF("DEBUG: imd_encode_track_to_buffer: Translating mode %u to %u for C%u H%u.\n", track->mode, final_mode, track->cyl, track->head);
         }
-        if (track_to_write.hflag & IMD_HFLAG_HMAP_PRES) {
-            DEBUG_PRINTF("DEBUG:   imd_write_track_imd: Writing hmap (%u bytes).\n", track_to_write.num_sectors);
-            if (write_bytes(track_to_write.hmap, track_to_write.num_sectors, fout) != 0) { goto write_error; }
+    }
+    else {
+        DEBUG_PRINTF("WARNING: imd_encode_track_to_buffer: Original mode %u is invalid, writing as is.\n", track->mode);
+        final_mode = track->mode; /* Write invalid mode as is */
+    }
+
+
+    /* Sector Flag/Type Processing (Determine flags to write based on data and options) */
+    ret_status = imd_compute_write_sflags(track, opts, sflag);
+    if (ret_status != 0) {
+        return ret_status;
+    }
+
+
+    /* --- Encode IMD Output --- */
+    DEBUG_PRINTF("DEBUG: imd_encode_track_to_buffer: Encoding track C%u H%u header.\n", track->cyl, track->head);
+    {
+        const uint8_t header[5] = {
+            final_mode, track->cyl, (uint8_t)(track->head | track->hflag), /* Combine head number and flags */
+            track->num_sectors, track->sector_size_code
+        };
+        if ((ret_status = put_bytes(buf, buf_size, &pos, header, sizeof(header))) != 0) return ret_status;
+    }
+
+    /* Maps (only if sectors exist), gathered in output order */
+    if (track->num_sectors > 0) {
+        const uint8_t* maps[3] = { track->smap, NULL, NULL };
+        if (track->hflag & IMD_HFLAG_CMAP_PRES) maps[1] = track->cmap;
+        if (track->hflag & IMD_HFLAG_HMAP_PRES) maps[2] = track->hmap;
+        for (int m = 0; m < 3; ++m) {
+            if (!maps[m]) continue;
+            if (track->num_sectors > buf_size - pos) return IMD_ERR_BUFFER_TOO_SMALL;
+            for (int p = 0; p < track->num_sectors; ++p) buf[pos + p] = maps[m][perm[p]];
+            pos += track->num_sectors;
         }
     }
 
-    /* Write Sector Data Records */
-    for (uint8_t i = 0; i < track_to_write.num_sectors; ++i) {
-        uint8_t write_flag = final_sflag[i];
-        DEBUG_PRINTF("DEBUG:   imd_write_track_imd: Writing flag 0x%02X for sector index %u\n", write_flag, i);
-        if (fputc(write_flag, fout) == EOF) { goto write_error; }
+    /* Sector Data Records */
+    for (uint8_t p = 0; p < track->num_sectors; ++p) {
+        uint8_t i = perm[p]; /* Source sector written at position p */
+        uint8_t write_flag = sflag[i];
+        if ((ret_status = put_byte(buf, buf_size, &pos, write_flag)) != 0) return ret_status;
 
         uint8_t* sector_data = NULL;
         /* Calculate pointer only if data exists and is large enough */
-        if (track_to_write.data && track_to_write.data_size >= ((size_t)(i + 1) * track_to_write.sector_size)) {
-            sector_data = track_to_write.data + ((size_t)i * track_to_write.sector_size);
-        }
-
-        /* Write data based on the final flag */
-        if (IMD_SDR_HAS_DATA(write_flag)) {
-            if (IMD_SDR_IS_COMPRESSED(write_flag)) { /* Compressed */
-                uint8_t current_fill_byte = 0;
-                /* We must have data if the flag indicates compression is possible */
-                if (!sector_data) {
-                    DEBUG_PRINTF("ERROR:   imd_write_track_imd: NULL data pointer for compressed sector %u\n", i);
-                    ret_status = IMD_ERR_INVALID_ARG; /* Internal inconsistency */
-                    goto write_error;
-                }
-                /* Re-check uniformity just before writing to get the fill byte */
-                /* This assumes imd_is_uniform is efficient enough */
-                (void)imd_is_uniform(sector_data, track_to_write.sector_size, &current_fill_byte);
-                DEBUG_PRINTF("DEBUG:     imd_write_track_imd: Writing compressed fill byte 0x%02X\n", current_fill_byte);
-                if (fputc(current_fill_byte, fout) == EOF) { goto write_error; }
-            }
-            else { /* Normal */
-                if (track_to_write.sector_size > 0) {
-                    /* Check we have data if size > 0 */
-                    if (!sector_data) {
-                        DEBUG_PRINTF("ERROR:   imd_write_track_imd: NULL data pointer for normal sector %u\n", i);
-                        ret_status = IMD_ERR_INVALID_ARG; /* Internal inconsistency */
-                        goto write_error;
-                    }
-                    DEBUG_PRINTF("DEBUG:     imd_write_track_imd: Writing %u bytes of normal data\n", track_to_write.sector_size);
-                    if (write_bytes(sector_data, track_to_write.sector_size, fout) != 0) { goto write_error; }
-                }
-                else {
-                    /* Normal flag but zero sector size - write nothing */
-                    DEBUG_PRINTF("DEBUG:     imd_write_track_imd: Normal flag with zero sector size, writing no data.\n");
-                }
-            }
+        if (track->data && track->data_size >= ((size_t)(i + 1) * track->sector_size)) {
+            sector_data = track->data + ((size_t)i * track->sector_size);
+        }
+
+        /* Data based on the final flag; no data follows Unavailable records */
+        if (!IMD_SDR_HAS_DATA(write_flag) || track->sector_size == 0) continue;
+        if (!sector_data) {
+            DEBUG_PRINTF("ERROR:   imd_encode_track_to_buffer: NULL data pointer for sector %u (flag 0x%02X)\n", i, write_flag);
+            return IMD_ERR_INVALID_ARG; /* Internal inconsistency */
+        }
+        if (IMD_SDR_IS_COMPRESSED(write_flag)) {
+            /* The sector was found uniform when its flag was computed, so any byte is the fill byte */
+            ret_status = put_byte(buf, buf_size, &pos, sector_data[0]);
         }
         else {
-            /* No data follows (Unavailable or invalid flag handled earlier) */
-            DEBUG_PRINTF("DEBUG:     imd_write_track_imd: Flag 0x%02X indicates no data follows.\n", write_flag);
+            ret_status = put_bytes(buf, buf_size, &pos, sector_data, track->sector_size);
         }
+        if (ret_status != 0) return ret_status;
     }
 
-
-    if (interleaved_data) free(interleaved_data); /* Clean up copied data */
+    *written_out = pos;
     return 0; /* Success */
+}
+
+int imd_encode_track_to_buffer(ImdTrackInfo* track, const ImdWriteOpts* opts, uint8_t* buf, size_t buf_size, size_t* written_out) {
+    uint64_t start = imd_stats_clock();
+    int res = encode_track_to_buffer(track, opts, buf, buf_size, written_out);
+
+    if (start != 0) {
+        if (res == 0) imd_stat_add(IMD_STAT_TRACKS_ENCODED, 1);
+        imd_stat_time(IMD_STAT_ENCODE_NS, start);
+    }
+    return res;
+}
+
+int imd_write_track_imd(FILE* fout, ImdTrackInfo* track, const ImdWriteOpts* opts) {
+    uint8_t stack_buffer[LIBIMD_ENCODE_STACK_BUFFER]; /* Holds most tracks without an allocation */
+    uint8_t* buffer = stack_buffer;
+    size_t bound;
+    size_t written = 0;
+    int ret_status;
+
+    if (!fout || !track || !opts) return IMD_ERR_INVALID_ARG; /* Check args */
+
+    /* Encode the whole record, then hand it to stdio in a single write */
+    bound = imd_track_encoded_size_bound(track);
+    if (bound > sizeof(stack_buffer)) {
+        buffer = (uint8_t*)imd_malloc(bound);
+        if (!buffer) return IMD_ERR_ALLOC;
+    }
+    ret_status = imd_encode_track_to_buffer(track, opts, buffer, bound, &written);
+    if (ret_status == 0 && write_bytes(buffer, written, fout) != 0) {
+        DEBUG_PRINTF("ERROR: imd_write_track_imd: Write error occurred for C%u H%u.\n", track->cyl, track->head);
+        ret_status = IMD_ERR_WRITE_ERROR;
+    }
+    if (buffer != stack_buffer) imd_free(buffer);
+    return ret_status;
+}
 
-write_error:
-    DEBUG_PRINTF("ERROR: imd_write_track_imd: Write error occurred for C%u H%u.\n", track_to_write.cyl, track_to_write.head);
-    if (interleaved_data) free(interleaved_data);
-    return (ret_status != 0) ? ret_status : IMD_ERR_WRITE_ERROR; /* Return internal error code if set, else write error */
+/* One track of a bulk write: its encoded record, built by a worker thread */
+typedef struct {
+    ImdTrackInfo* track;
+    const ImdWriteOpts* opts;
+    uint8_t* bytes;
+    size_t size;
+    int status;
+} ImdEncodeJob;
+
+static void encode_job(size_t index, void* ctx) {
+    ImdEncodeJob* job = &((ImdEncodeJob*)ctx)[index];
+    size_t bound = imd_track_encoded_size_bound(job->track);
+
+    job->bytes = (uint8_t*)imd_malloc(bound > 0 ? bound : 1);
+    if (!job->bytes) {
+        job->status = IMD_ERR_ALLOC;
+        return;
+    }
+    job->status = imd_encode_track_to_buffer(job->track, job->opts, job->bytes, bound, &job->size);
+}
+
+int imd_write_tracks_imd(FILE* fout, ImdTrackInfo* tracks, size_t count, const ImdWriteOpts* opts, unsigned num_threads) {
+    ImdEncodeJob jobs[LIBIMD_MAX_WORKER_THREADS * 4];
+    size_t window;
+    int ret_status = 0;
+
+    if (!fout || (!tracks && count > 0) || !opts) return IMD_ERR_INVALID_ARG;
+    if (num_threads == 0) num_threads = imd_cpu_count();
+    if (num_threads <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            ret_status = imd_write_track_imd(fout, &tracks[i], opts);
+            if (ret_status != 0) return ret_status;
+        }
+        return 0;
+    }
+
+    /* Encode a window of tracks in parallel, then write them in order; memory stays bounded */
+    window = (size_t)num_threads * 4;
+    if (window > sizeof(jobs) / sizeof(jobs[0])) window = sizeof(jobs) / sizeof(jobs[0]);
+    for (size_t first = 0; first < count && ret_status == 0; first += window) {
+        size_t n = (count - first < window) ? count - first : window;
+
+        for (size_t j = 0; j < n; ++j) {
+            jobs[j].track = &tracks[first + j];
+            jobs[j].opts = opts;
+            jobs[j].bytes = NULL;
+            jobs[j].size = 0;
+            jobs[j].status = 0;
+        }
+        imd_parallel_for(n, num_threads, encode_job, jobs);
+
+        for (size_t j = 0; j < n; ++j) {
+            if (ret_status == 0) {
+                ret_status = jobs[j].status;
+                if (ret_status == 0 && write_bytes(jobs[j].bytes, jobs[j].size, fout) != 0) {
+                    ret_status = IMD_ERR_WRITE_ERROR;
+                }
+            }
+            imd_free(jobs[j].bytes);
+        }
+    }
+    return ret_status;
 }
 
 int imd_write_track_bin(FILE* fout, ImdTrackInfo* track, const ImdWriteOpts* opts) {
@@ -1583,66 +2461,43 @@ int imd_write_track_bin(FILE* fout, ImdTrackInfo* track, const ImdWriteOpts* opt
         return IMD_ERR_INVALID_ARG; /* Cannot write unloaded track */
     }
 
-    ImdTrackInfo track_copy = *track; /* Work on a copy */
-    uint8_t* data_copy = NULL; /* Buffer for interleaved data */
-    int ret_status = 0; /* Assume success initially */
+    uint8_t perm[LIBIMD_MAX_SECTORS_PER_TRACK]; /* Output position -> source sector */
 
-    /* Create a copy of data if interleaving is requested and data exists */
-    if (opts->interleave_factor != LIBIMD_IL_AS_READ && track->num_sectors > 1 && track->data_size > 0) {
-        DEBUG_PRINTF("DEBUG: imd_write_track_bin: Allocating buffer for interleave copy (%zu bytes).\n", track->data_size);
-        data_copy = (uint8_t*)malloc(track->data_size);
-        if (!data_copy) return IMD_ERR_ALLOC;
-        memcpy(data_copy, track->data, track->data_size);
-        track_copy.data = data_copy; /* Point copy to copied data */
+    if (track->num_sectors == 0) {
+        /* Zero sectors - nothing to write, considered success */
+        DEBUG_PRINTF("DEBUG: imd_write_track_bin: Track C%u H%u has 0 sectors. Writing nothing.\n", track->cyl, track->head);
+        return 0;
     }
-    else {
-        /* No interleaving or no data, point copy to original data */
-        track_copy.data = track->data;
+    if (!track->data || track->data_size == 0) {
+        /* We have sectors, but data pointer is NULL or data_size is 0 */
+        DEBUG_PRINTF("ERROR: imd_write_track_bin: Track C%u H%u has %u sectors but data pointer is %p or data_size is %zu. Returning IMD_ERR_INVALID_ARG.\n",
+            track->cyl, track->head, track->num_sectors, track->data, track->data_size);
+        return IMD_ERR_INVALID_ARG;
     }
 
-    /* Apply interleave if requested (modifies track_copy maps and data in place) */
-    int il_factor = opts->interleave_factor;
-    if (il_factor != LIBIMD_IL_AS_READ && track_copy.num_sectors > 1) {
-        if (il_factor == LIBIMD_IL_BEST_GUESS) {
-            /* Calculate best guess based on original track map */
-            il_factor = imd_calculate_best_interleave(track); /* Use original track for guess */
-            DEBUG_PRINTF("DEBUG: imd_write_track_bin: Best guess interleave calculated as %d.\n", il_factor);
-        }
-        /* Apply the determined interleave factor to the copy */
-        ret_status = imd_apply_interleave(&track_copy, il_factor);
-        if (ret_status != 0) {
-            DEBUG_PRINTF("ERROR: imd_write_track_bin: Failed to apply interleave %d (status %d).\n", il_factor, ret_status);
-            if (data_copy) free(data_copy);
-            return ret_status; /* Failed to apply interleave, return specific error */
-        }
-    }
-
-    /* Write raw data (potentially reordered from track_copy.data) */
-    if (track_copy.num_sectors > 0 && track_copy.data && track_copy.data_size > 0) {
-        /* Condition: We have sectors, a valid data pointer, and positive data size */
-        DEBUG_PRINTF("DEBUG: imd_write_track_bin: Writing %zu bytes of track data for C%u H%u.\n", track_copy.data_size, track_copy.cyl, track_copy.head);
-        if (write_bytes(track_copy.data, track_copy.data_size, fout) != 0) {
+    int reordered = resolve_write_order(track, opts, perm);
+    if (reordered < 0) return reordered;
+
+    DEBUG_PRINTF("DEBUG: imd_write_track_bin: Writing %zu bytes of track data for C%u H%u.\n", track->data_size, track->cyl, track->head);
+    if (!reordered) {
+        if (write_bytes(track->data, track->data_size, fout) != 0) {
             DEBUG_PRINTF("ERROR: imd_write_track_bin: Error writing track data.\n");
-            if (data_copy) free(data_copy);
             return IMD_ERR_WRITE_ERROR; /* Error writing data */
         }
-    }
-    /* ----- FIX START ----- */
-    else if (track_copy.num_sectors > 0 && (!track_copy.data || track_copy.data_size == 0)) {
-        /* Condition: We have sectors, but data pointer is NULL or data_size is 0 */
-        DEBUG_PRINTF("ERROR: imd_write_track_bin: Track C%u H%u has %u sectors but data pointer is %p or data_size is %zu. Returning IMD_ERR_INVALID_ARG.\n",
-            track_copy.cyl, track_copy.head, track_copy.num_sectors, track_copy.data, track_copy.data_size);
-        if (data_copy) free(data_copy); /* Clean up if allocated */
-        return IMD_ERR_INVALID_ARG; /* Return error as expected by test */
-    }
-    /* ----- FIX END ----- */
-    else {
-        /* Condition: Zero sectors - nothing to write */
-        DEBUG_PRINTF("DEBUG: imd_write_track_bin: Track C%u H%u has 0 sectors. Writing nothing.\n", track_copy.cyl, track_copy.head);
-        /* This is considered success */
+        return 0;
     }
 
-    if (data_copy) free(data_copy); /* Clean up copied data */
+    /* Gather the sectors in output order, one write per run of consecutive source sectors */
+    if (track->data_size < (size_t)track->num_sectors * track->sector_size) return IMD_ERR_INVALID_ARG;
+    for (int p = 0; p < track->num_sectors; ) {
+        int run = 1;
+        while (p + run < track->num_sectors && perm[p + run] == perm[p] + run) run++;
+        if (write_bytes(track->data + (size_t)perm[p] * track->sector_size, (size_t)run * track->sector_size, fout) != 0) {
+            DEBUG_PRINTF("ERROR: imd_write_track_bin: Error writing track data.\n");
+            return IMD_ERR_WRITE_ERROR; /* Error writing data */
+        }
+        p += run;
+    }
     return 0; /* Success */
 }
 
@@ -1651,3 +2506,432 @@ int imd_write_bytes(const void* buffer, size_t size, FILE* file) {
     /* Use internal helper which returns IMD_ERR_WRITE_ERROR */
     return write_bytes(buffer, size, file);
 }
+
+/* --- Content Hashing --- */
+
+/*
+ * XXH64: 32-byte stripes in four lanes, then the tail, then a final avalanche.
+ * Words are read little-endian so that hashes match across platforms.
+ */
+#define HASH_PRIME1 UINT64_C(0x9E3779B185EBCA87)
+#define HASH_PRIME2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define HASH_PRIME3 UINT64_C(0x165667B19E3779F9)
+#define HASH_PRIME4 UINT64_C(0x85EBCA77C2B2AE63)
+#define HASH_PRIME5 UINT64_C(0x27D4EB2F165667C5)
+
+static uint64_t hash_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t hash_read64(const uint8_t* p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint64_t hash_read32(const uint8_t* p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * HASH_PRIME2;
+    return hash_rotl(acc, 31) * HASH_PRIME1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t lane) {
+    acc ^= hash_round(0, lane);
+    return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+uint64_t imd_hash_bytes(const void* data, size_t len, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if (!p) return imd_hash_bytes("", 0, seed);
+    if (len >= 32) {
+        uint64_t v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+        uint64_t v2 = seed + HASH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH_PRIME1;
+        do {
+            v1 = hash_round(v1, hash_read64(p));
+            v2 = hash_round(v2, hash_read64(p + 8));
+            v3 = hash_round(v3, hash_read64(p + 16));
+            v4 = hash_round(v4, hash_read64(p + 24));
+            p += 32;
+        } while ((size_t)(end - p) >= 32);
+        h = hash_rotl(v1, 1) + hash_rotl(v2, 7) + hash_rotl(v3, 12) + hash_rotl(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    }
+    else {
+        h = seed + HASH_PRIME5;
+    }
+    h += (uint64_t)len;
+
+    for (; end - p >= 8; p += 8) {
+        h ^= hash_round(0, hash_read64(p));
+        h = hash_rotl(h, 27) * HASH_PRIME1 + HASH_PRIME4;
+    }
+    if (end - p >= 4) {
+        h ^= hash_read32(p) * HASH_PRIME1;
+        h = hash_rotl(h, 23) * HASH_PRIME2 + HASH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= (uint64_t)*p * HASH_PRIME5;
+        h = hash_rotl(h, 11) * HASH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t imd_hash_sector(const ImdTrackInfo* track, uint8_t index) {
+    if (!track || !track->data || index >= track->num_sectors ||
+        track->data_size < ((size_t)index + 1) * track->sector_size) {
+        return imd_hash_bytes(NULL, 0, IMD_HASH_SEED);
+    }
+    return imd_hash_bytes(track->data + (size_t)index * track->sector_size, track->sector_size, IMD_HASH_SEED);
+}
+
+uint64_t imd_hash_track(const ImdTrackInfo* track, const uint64_t* sector_hashes) {
+    /* Header bytes, up to four per-sector byte arrays, then eight bytes per sector hash */
+    uint8_t buf[5 + 4 * LIBIMD_MAX_SECTORS_PER_TRACK + 8 * LIBIMD_MAX_SECTORS_PER_TRACK];
+    uint8_t n;
+    size_t pos = 0;
+
+    if (!track) return imd_hash_bytes(NULL, 0, IMD_HASH_SEED);
+    n = track->num_sectors;
+    buf[pos++] = track->mode;
+    buf[pos++] = (uint8_t)(track->hflag & (IMD_HFLAG_CMAP_PRES | IMD_HFLAG_HMAP_PRES));
+    buf[pos++] = n;
+    buf[pos++] = track->sector_size_code;
+    buf[pos++] = 0; /* Format version of this layout */
+    memcpy(buf + pos, track->smap, n);
+    pos += n;
+    if (track->hflag & IMD_HFLAG_CMAP_PRES) {
+        memcpy(buf + pos, track->cmap, n);
+        pos += n;
+    }
+    if (track->hflag & IMD_HFLAG_HMAP_PRES) {
+        memcpy(buf + pos, track->hmap, n);
+        pos += n;
+    }
+    memcpy(buf + pos, track->sflag, n);
+    pos += n;
+    for (uint8_t i = 0; i < n; ++i) {
+        uint64_t sector_hash = sector_hashes ? sector_hashes[i] : imd_hash_sector(track, i);
+        for (int b = 0; b < 8; ++b) buf[pos++] = (uint8_t)(sector_hash >> (8 * b));
+    }
+    return imd_hash_bytes(buf, pos, IMD_HASH_SEED);
+}
+
+/* --- Conversion Pipeline --- */
+
+/* One reusable track buffer of the conversion ring */
+typedef struct {
+    ImdTrackInfo track;         /* Parsed track; its data points into 'data' */
+    uint8_t* data;              /* Sector data storage, reused for every track through the slot */
+    size_t data_capacity;
+    uint8_t* out;               /* Encoded output storage, reused likewise */
+    size_t out_capacity;
+    const uint8_t* out_bytes;   /* Bytes to write: 'out', or the track data itself */
+    size_t out_size;
+} ConvertSlot;
+
+/* Shared state of one imd_convert_stream() call */
+typedef struct {
+    const ImdIo* in;
+    FILE* fout;
+    int format;                 /* IMD_CONVERT_IMD or IMD_CONVERT_BIN */
+    const ImdWriteOpts* opts;
+    ConvertSlot* slots;
+    size_t num_slots;
+    int threaded;               /* Stages run on their own threads */
+    ImdMutex lock;              /* Protects the counters and flags below */
+    ImdCond changed;            /* Broadcast whenever any of them changes */
+    size_t parsed;              /* Tracks handed over by the read stage */
+    size_t encoded;             /* Tracks finished by the transform stage */
+    size_t written;             /* Tracks finished by the write stage */
+    int reader_done;
+    int encoder_done;
+    int error;                  /* First error of any stage; stops the others */
+    long track_count;           /* Result of the parser */
+} ConvertPipeline;
+
+/* Grows a slot buffer to at least size bytes (never zero, so a slot always has storage) */
+static int convert_reserve(uint8_t** buf, size_t* capacity, size_t size) {
+    if (size == 0) size = 1;
+    if (*capacity >= size) return 0;
+    uint8_t* grown = (uint8_t*)imd_realloc(*buf, size);
+    if (!grown) return IMD_ERR_ALLOC;
+    *buf = grown;
+    *capacity = size;
+    return 0;
+}
+
+/* Records the first error of any stage and wakes the others so they stop */
+static void convert_fail(ConvertPipeline* p, int status) {
+    if (p->threaded) imd_mutex_lock(&p->lock);
+    if (p->error == 0) p->error = status;
+    if (p->threaded) {
+        imd_cond_broadcast(&p->changed);
+        imd_mutex_unlock(&p->lock);
+    }
+}
+
+/* Transform stage: encodes a parsed track into the bytes the write stage emits */
+static int convert_transform(ConvertPipeline* p, ConvertSlot* slot) {
+    ImdTrackInfo* track = &slot->track;
+    uint8_t perm[LIBIMD_MAX_SECTORS_PER_TRACK];
+    int res;
+
+    slot->out_bytes = slot->out;
+    slot->out_size = 0;
+
+    if (p->format == IMD_CONVERT_IMD) {
+        size_t bound = imd_track_encoded_size_bound(track);
+        res = convert_reserve(&slot->out, &slot->out_capacity, bound);
+        if (res != 0) return res;
+        slot->out_bytes = slot->out;
+        return imd_encode_track_to_buffer(track, p->opts, slot->out, bound, &slot->out_size);
+    }
+
+    /* Raw binary, as imd_write_track_bin() writes it */
+    if (track->num_sectors == 0) return 0;
+    if (!track->data || track->data_size < (size_t)track->num_sectors * track->sector_size) return IMD_ERR_INVALID_ARG;
+    res = resolve_write_order(track, p->opts, perm);
+    if (res < 0) return res;
+    if (!res) {
+        slot->out_bytes = track->data; /* Already in output order */
+        slot->out_size = track->data_size;
+        return 0;
+    }
+    res = convert_reserve(&slot->out, &slot->out_capacity, track->data_size);
+    if (res != 0) return res;
+    for (int pos = 0; pos < track->num_sectors; ++pos) {
+        memcpy(slot->out + (size_t)pos * track->sector_size,
+            track->data + (size_t)perm[pos] * track->sector_size, track->sector_size);
+    }
+    slot->out_bytes = slot->out;
+    slot->out_size = track->data_size;
+    return 0;
+}
+
+/* Write stage */
+static int convert_write(ConvertPipeline* p, const ConvertSlot* slot) {
+    if (slot->out_size == 0) return 0;
+    if (write_bytes(slot->out_bytes, slot->out_size, p->fout) != 0) {
+        DEBUG_PRINTF("ERROR: imd_convert_stream: Write error occurred for C%u H%u.\n", slot->track.cyl, slot->track.head);
+        return IMD_ERR_WRITE_ERROR;
+    }
+    return 0;
+}
+
+/*
+ * Read stage hooks. The IMD header and comment are written as soon as they are
+ * parsed: no track has been handed over yet, so the write stage cannot race them.
+ */
+static int convert_on_header(const ImdHeaderInfo* header, const uint8_t* comment, size_t comment_len, void* user_data) {
+    ConvertPipeline* p = (ConvertPipeline*)user_data;
+    int res;
+
+    if (p->format != IMD_CONVERT_IMD) return 0;
+    res = imd_write_file_header(p->fout, header->version);
+    if (res == 0) res = imd_write_comment_block(p->fout, (const char*)comment, comment_len);
+    return res;
+}
+
+static uint8_t* convert_get_data(size_t size, void* user_data) {
+    ConvertPipeline* p = (ConvertPipeline*)user_data;
+    ConvertSlot* slot;
+
+    if (p->threaded) {
+        /* Wait for the write stage to free the oldest slot */
+        imd_mutex_lock(&p->lock);
+        while (p->error == 0 && p->parsed - p->written >= p->num_slots) {
+            imd_cond_wait(&p->changed, &p->lock);
+        }
+        if (p->error != 0) {
+            imd_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        slot = &p->slots[p->parsed % p->num_slots];
+        imd_mutex_unlock(&p->lock);
+    }
+    else {
+        slot = &p->slots[0];
+    }
+
+    if (convert_reserve(&slot->data, &slot->data_capacity, size) != 0) {
+        convert_fail(p, IMD_ERR_ALLOC);
+        return NULL;
+    }
+    return slot->data;
+}
+
+static int convert_on_track(const ImdTrackInfo* track, long long record_offset, void* user_data) {
+    ConvertPipeline* p = (ConvertPipeline*)user_data;
+    int stop;
+    (void)record_offset;
+
+    if (!p->threaded) {
+        ConvertSlot* slot = &p->slots[0];
+        int res;
+        slot->track = *track;
+        res = convert_transform(p, slot);
+        if (res == 0) res = convert_write(p, slot);
+        if (res != 0) convert_fail(p, res);
+        return res;
+    }
+
+    /* The slot was claimed in convert_get_data and is owned by this stage until parsed moves on */
+    imd_mutex_lock(&p->lock);
+    p->slots[p->parsed % p->num_slots].track = *track;
+    p->parsed++;
+    stop = (p->error != 0);
+    imd_cond_broadcast(&p->changed);
+    imd_mutex_unlock(&p->lock);
+    return stop;
+}
+
+static long convert_parse(ConvertPipeline* p) {
+    StreamHooks hooks = { convert_on_header, convert_get_data, convert_on_track, p };
+    return parse_stream_internal(p->in, 0, NULL, NULL, NULL, &hooks);
+}
+
+static void convert_reader_thread(void* arg) {
+    ConvertPipeline* p = (ConvertPipeline*)arg;
+    long res = convert_parse(p);
+
+    imd_mutex_lock(&p->lock);
+    if (res < 0 && p->error == 0) p->error = (int)res;
+    p->track_count = res;
+    p->reader_done = 1;
+    imd_cond_broadcast(&p->changed);
+    imd_mutex_unlock(&p->lock);
+}
+
+static void convert_encoder_thread(void* arg) {
+    ConvertPipeline* p = (ConvertPipeline*)arg;
+
+    for (;;) {
+        ConvertSlot* slot;
+        int res;
+
+        imd_mutex_lock(&p->lock);
+        while (p->error == 0 && p->encoded == p->parsed && !p->reader_done) {
+            imd_cond_wait(&p->changed, &p->lock);
+        }
+        if (p->error != 0 || p->encoded == p->parsed) break; /* Lock still held */
+        slot = &p->slots[p->encoded % p->num_slots];
+        imd_mutex_unlock(&p->lock);
+
+        res = convert_transform(p, slot);
+
+        imd_mutex_lock(&p->lock);
+        if (res != 0 && p->error == 0) p->error = res;
+        if (res == 0) p->encoded++;
+        imd_cond_broadcast(&p->changed);
+        imd_mutex_unlock(&p->lock);
+    }
+    p->encoder_done = 1;
+    imd_cond_broadcast(&p->changed);
+    imd_mutex_unlock(&p->lock);
+}
+
+/* Write stage loop, run on the calling thread */
+static void convert_writer_loop(ConvertPipeline* p) {
+    for (;;) {
+        ConvertSlot* slot;
+        int res;
+
+        imd_mutex_lock(&p->lock);
+        while (p->error == 0 && p->written == p->encoded && !p->encoder_done) {
+            imd_cond_wait(&p->changed, &p->lock);
+        }
+        if (p->error != 0 || p->written == p->encoded) {
+            imd_mutex_unlock(&p->lock);
+            break;
+        }
+        slot = &p->slots[p->written % p->num_slots];
+        imd_mutex_unlock(&p->lock);
+
+        res = convert_write(p, slot);
+
+        imd_mutex_lock(&p->lock);
+        if (res != 0 && p->error == 0) p->error = res;
+        if (res == 0) p->written++;
+        imd_cond_broadcast(&p->changed);
+        imd_mutex_unlock(&p->lock);
+    }
+}
+
+/* Starts the read and transform threads; 0 if the pipeline runs threaded */
+static int convert_start_threads(ConvertPipeline* p, ImdThread* reader, ImdThread* encoder) {
+    if (imd_mutex_init(&p->lock) != 0) return IMD_ERR_ALLOC;
+    if (imd_cond_init(&p->changed) != 0) {
+        imd_mutex_destroy(&p->lock);
+        return IMD_ERR_ALLOC;
+    }
+    p->threaded = 1;
+    if (imd_thread_create(encoder, convert_encoder_thread, p) == 0) {
+        if (imd_thread_create(reader, convert_reader_thread, p) == 0) return 0;
+        /* Nothing was parsed yet: stop the transform thread and fall back to serial */
+        convert_fail(p, IMD_ERR_ALLOC);
+        imd_thread_join(encoder);
+        p->error = 0;
+        p->encoder_done = 0;
+    }
+    p->threaded = 0;
+    imd_cond_destroy(&p->changed);
+    imd_mutex_destroy(&p->lock);
+    return IMD_ERR_ALLOC;
+}
+
+long imd_convert_stream(const ImdIo* in, FILE* fout, int format, const ImdWriteOpts* opts, unsigned ring_slots) {
+    ConvertPipeline p;
+    ImdThread reader;
+    ImdThread encoder;
+
+    if (!in || !fout || !opts || (format != IMD_CONVERT_IMD && format != IMD_CONVERT_BIN)) return IMD_ERR_INVALID_ARG;
+    if (ring_slots == 0) ring_slots = LIBIMD_CONVERT_RING_SLOTS;
+    if (ring_slots > LIBIMD_CONVERT_MAX_RING_SLOTS) ring_slots = LIBIMD_CONVERT_MAX_RING_SLOTS;
+
+    memset(&p, 0, sizeof(p));
+    p.in = in;
+    p.fout = fout;
+    p.format = format;
+    p.opts = opts;
+    p.num_slots = ring_slots;
+    p.slots = (ConvertSlot*)imd_calloc(ring_slots, sizeof(ConvertSlot));
+    if (!p.slots) return IMD_ERR_ALLOC;
+
+    if (ring_slots > 1 && convert_start_threads(&p, &reader, &encoder) == 0) {
+        convert_writer_loop(&p);
+        imd_thread_join(&reader);
+        imd_thread_join(&encoder);
+        imd_cond_destroy(&p.changed);
+        imd_mutex_destroy(&p.lock);
+    }
+    else {
+        /* One slot: every track is parsed, transformed and written in turn on this thread */
+        p.track_count = convert_parse(&p);
+        if (p.track_count < 0 && p.error == 0) p.error = (int)p.track_count;
+    }
+
+    for (size_t i = 0; i < ring_slots; ++i) {
+        imd_free(p.slots[i].data);
+        imd_free(p.slots[i].out);
+    }
+    imd_free(p.slots);
+
+    return (p.error != 0) ? p.error : p.track_count;
+}
@@ -32,6 +32,8 @@ extern "C" {
 #define LIBIMD_MAX_HEADER_LINE 256
 #define LIBIMD_COMMENT_EOF_MARKER 0x1A
 #define LIBIMD_NUM_MODES 6
+#define LIBIMD_MAX_CYLINDERS 256 /* Cylinder numbers are stored in one byte */
+#define LIBIMD_MAX_HEADS 2       /* Physical heads 0 and 1 */
 
 /* IMD Mode Definitions (Index for mode field) */
 #define IMD_MODE_FM_500     0   /* 500 kbps FM (Single Density) */
@@ -72,6 +74,12 @@ extern "C" {
 /* Checks if the record type indicates a data error occurred during read */
 #define IMD_SDR_HAS_ERR(type) ((type - 1) & 0x04)
 
+/* Access the "virtually uniform" bit of physical sector i in ImdTrackInfo.uniform_map */
+#define IMD_TRACK_IS_UNIFORM(track, i) (((track)->uniform_map[(i) >> 3] >> ((i) & 7)) & 1)
+#define IMD_TRACK_SET_UNIFORM(track, i, uniform) \
+    ((track)->uniform_map[(i) >> 3] = (uint8_t)(((track)->uniform_map[(i) >> 3] & ~(1u << ((i) & 7))) | \
+        ((uniform) ? (1u << ((i) & 7)) : 0u)))
+
 /* Side Mask Defines (Used for track exclusion etc. - Application level) */
 #define IMD_SIDE_0_MASK     1  /* Bitmask for side 0 */
 #define IMD_SIDE_1_MASK     2  /* Bitmask for side 1 */
@@ -93,6 +101,7 @@ extern "C" {
 #define IMD_ERR_SIZE_MISMATCH    -17 /* Data size provided does not match sector size for write */
 #define IMD_ERR_UNAVAILABLE      -18 /* Sector is marked as unavailable (Type 0x00) */
 #define IMD_ERR_ALLOC            -19 /* Memory allocation failed */
+#define IMD_ERR_OPEN             -20 /* File could not be opened */
 
 /* --- Enums --- */
 
@@ -123,6 +132,10 @@ typedef struct {
 
     /* Sector Status/Data (Read from IMD file) */
     uint8_t  sflag[LIBIMD_MAX_SECTORS_PER_TRACK];/* Original IMD Sector Data Record byte read (0x00-0x08) */
+    /* Bit i set: sector i is known to be uniform (loaded from a compressed or unavailable record),
+     * so every byte equals its first byte. Code that modifies sector data in place must update the
+     * bit with IMD_TRACK_SET_UNIFORM; a clear bit only means the sector has not been classified. */
+    uint8_t  uniform_map[LIBIMD_MAX_SECTORS_PER_TRACK / 8];
     uint8_t* data;             /* Pointer to buffer holding all sector data (expanded) */
     size_t   data_size;        /* Total size of the allocated data buffer */
     int      loaded;           /* Flag: 1 if track data is loaded, 0 otherwise */
@@ -140,6 +153,95 @@ typedef struct {
     int interleave_factor;  /* Interleave to apply before writing (LIBIMD_IL_AS_READ, LIBIMD_IL_BEST_GUESS, 1-n) */
 } ImdWriteOpts;
 
+/* Per-track summary stored in an ImdTrackIndex */
+typedef struct {
+    long     offset;           /* File offset of the track record */
+    uint32_t length;           /* Length of the track record in bytes */
+    uint8_t  mode;             /* Data rate/density (0-5) */
+    uint8_t  cyl;              /* Physical cylinder number (0-255) */
+    uint8_t  head;             /* Physical head number (0-1) */
+    uint8_t  hflag;            /* Head flags (IMD_HFLAG_CMAP_PRES, IMD_HFLAG_HMAP_PRES) */
+    uint8_t  num_sectors;      /* Number of sectors in this track (0-255) */
+    uint8_t  sector_size_code; /* Sector size code (0-6) */
+    uint8_t  num_unavailable;  /* Sectors with IMD_SDR_UNAVAILABLE */
+    uint8_t  num_compressed;   /* Sectors with a compressed SDR type */
+    uint8_t  num_deleted;      /* Sectors with a Deleted-Data address mark */
+    uint8_t  num_error;        /* Sectors read with a data error */
+} ImdTrackIndexEntry;
+
+/* Offsets and sector flag summaries for every track of an image, built by a single scan */
+typedef struct {
+    ImdTrackIndexEntry* entries; /* Entries in file order */
+    size_t   count;            /* Number of valid entries */
+    size_t   capacity;         /* Allocated number of entries */
+    long     tracks_offset;    /* File offset of the first track record */
+    uint64_t image_size;       /* Size of the indexed image in bytes */
+    int32_t  lut[LIBIMD_MAX_CYLINDERS][LIBIMD_MAX_HEADS]; /* (cyl, head) -> entry index, -1 if absent */
+} ImdTrackIndex;
+
+/* Compact per-track metadata stored in an ImdTrackArena */
+typedef struct {
+    long     offset;           /* File offset of the track record, -1 if unknown */
+    uint32_t maps_offset;      /* Offset in ImdTrackArena.bytes of smap[num_sectors], followed by
+                                * cmap and hmap (only if flagged in hflag), then sflag */
+    uint8_t  mode;             /* Data rate/density (0-5) */
+    uint8_t  cyl;              /* Physical cylinder number (0-255) */
+    uint8_t  head;             /* Physical head number (0-1) */
+    uint8_t  hflag;            /* Head flags (IMD_HFLAG_CMAP_PRES, IMD_HFLAG_HMAP_PRES) */
+    uint8_t  num_sectors;      /* Number of sectors in this track (0-255) */
+    uint8_t  sector_size_code; /* Sector size code (0-6) */
+} ImdCompactTrack;
+
+/*
+ * Track metadata of a whole image in two contiguous allocations, holding only num_sectors
+ * entries per map and omitting absent cylinder/head maps. Sector data is not stored.
+ * Initialize with imd_track_arena_init, release with imd_track_arena_free.
+ */
+typedef struct {
+    ImdCompactTrack* tracks;   /* Tracks in insertion order */
+    size_t   count;            /* Number of tracks */
+    size_t   capacity;         /* Allocated number of tracks */
+    uint8_t* bytes;            /* Map and flag storage for all tracks */
+    size_t   bytes_used;       /* Bytes in use */
+    size_t   bytes_capacity;   /* Bytes allocated */
+} ImdTrackArena;
+
+/* Allocator callbacks used for all memory that libimd, libimdf and libimdchk allocate and free themselves */
+typedef struct {
+    void* (*malloc_fn)(size_t size, void* ctx);              /* Same contract as malloc */
+    void* (*realloc_fn)(void* ptr, size_t size, void* ctx);  /* Same contract as realloc */
+    void  (*free_fn)(void* ptr, void* ctx);                  /* Same contract as free (never called with NULL) */
+    void* ctx;                                               /* Passed to every callback */
+} ImdAllocator;
+
+/*
+ * Pluggable byte source for the streaming parser (imd_parse_stream). The parser only ever
+ * moves forward, so the source need not be seekable: a pipe, socket or decompressor works.
+ * Initialize for a FILE* with imd_io_init_file or for memory with imd_io_init_memory.
+ */
+typedef struct {
+    /* Reads up to size bytes into buf; returns the number read, 0 at end of input or on error */
+    size_t (*read)(void* ctx, void* buf, size_t size);
+    /* Consumes size bytes; returns 0 on success. Required if peek is set, unused otherwise */
+    int (*skip)(void* ctx, size_t size);
+    /* Current position of the source, or -1 if unknown. Optional (NULL) */
+    long long (*tell)(void* ctx);
+    /*
+     * Optional (NULL) zero-copy access: returns a pointer to the next size bytes without
+     * consuming them, valid until the next call on the source, and stores in *avail_out how
+     * many are valid (fewer than size only at the end of input). Consume them with skip.
+     */
+    const uint8_t* (*peek)(void* ctx, size_t size, size_t* avail_out);
+    void* ctx;                 /* Passed to every callback */
+} ImdIo;
+
+/* State of an in-memory ImdIo source (imd_io_init_memory) */
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+} ImdIoMemory;
+
 /* Structure to hold parsed IMD file header info */
 typedef struct {
     char version[32];       /* Version string from header */
@@ -147,9 +249,98 @@ typedef struct {
     int hour, minute, second; /* Time components */
 } ImdHeaderInfo;
 
+/* Performance counters (imd_get_stats, imdf_get_stats); all times are in nanoseconds */
+typedef struct {
+    uint64_t bytes_read;        /* Bytes read through stdio */
+    uint64_t bytes_written;     /* Bytes written through stdio */
+    uint64_t read_calls;        /* stdio read calls (fread, fgets, fgetc) */
+    uint64_t write_calls;       /* stdio write calls (fwrite, fputc) */
+    uint64_t seeks;             /* fseek calls */
+    uint64_t allocations;       /* imd_malloc, imd_calloc and imd_realloc calls */
+    uint64_t bytes_allocated;   /* Bytes requested by those calls */
+    uint64_t image_rewrites;    /* Image rewrites by libimdf (whole file or from a track on) */
+    uint64_t tracks_decoded;    /* Track records expanded into sector data */
+    uint64_t sectors_expanded;  /* Compressed sectors filled out while decoding */
+    uint64_t tracks_encoded;    /* Track records encoded for writing */
+    uint64_t open_ns;           /* Time in libimdf image opens (includes load_ns spent in them) */
+    uint64_t load_ns;           /* Time loading track data in libimdf */
+    uint64_t encode_ns;         /* Time encoding track records */
+    uint64_t rewrite_ns;        /* Time in libimdf image rewrites (includes their encode_ns) */
+} ImdStats;
+
 
 /* --- Public Function Prototypes --- */
 
+/* --- Memory Allocation --- */
+
+/**
+ * Installs the allocator used by the libraries, e.g. for memory accounting.
+ * Must be called before any library memory is allocated (or after all of it has been freed),
+ * and not concurrently with other library calls. Track data buffers passed to
+ * imd_free_track_data() must come from imd_alloc_track_data() or imd_malloc().
+ * Buffers the caller must release with free() (e.g. from imd_read_comment_block()) still use malloc.
+ * @param allocator Callbacks to install (copied), or NULL to restore malloc/realloc/free.
+ * @return 0 on success, IMD_ERR_INVALID_ARG if a callback is missing.
+ */
+int imd_set_allocator(const ImdAllocator* allocator);
+
+/**
+ * Allocates memory through the installed allocator.
+ * @param size Number of bytes.
+ * @return Pointer to the memory, or NULL on failure. Release with imd_free().
+ */
+void* imd_malloc(size_t size);
+
+/**
+ * Allocates zeroed memory for an array through the installed allocator.
+ * @param count Number of elements.
+ * @param size Size of each element.
+ * @return Pointer to the memory, or NULL on failure or overflow. Release with imd_free().
+ */
+void* imd_calloc(size_t count, size_t size);
+
+/**
+ * Resizes memory obtained from imd_malloc() or imd_calloc() through the installed allocator.
+ * @param ptr Memory to resize, or NULL.
+ * @param size New size in bytes.
+ * @return Pointer to the resized memory, or NULL on failure (ptr is then unchanged).
+ */
+void* imd_realloc(void* ptr, size_t size);
+
+/**
+ * Releases memory obtained from imd_malloc(), imd_calloc() or imd_realloc().
+ * @param ptr Memory to release. Can be NULL.
+ */
+void imd_free(void* ptr);
+
+/* --- Statistics --- */
+
+/**
+ * Turns the performance counters on or off (they start off). Counting is cheap enough
+ * to leave on: each thread updates its own counters, which are only summed when read.
+ * Work done while counting is off is not recorded.
+ * @param enable Non-zero to count, 0 to stop.
+ */
+void imd_stats_enable(int enable);
+
+/**
+ * Returns non-zero if the performance counters are on.
+ */
+int imd_stats_is_enabled(void);
+
+/**
+ * Sums the counters of all threads since counting started or imd_reset_stats() was called.
+ * Safe to call while other threads are working; their latest updates may be missing.
+ * @param stats_out Receives the totals. Must not be NULL.
+ */
+void imd_get_stats(ImdStats* stats_out);
+
+/**
+ * Restarts the totals reported by imd_get_stats() from zero. Per-image counters
+ * (imdf_get_stats) are not affected.
+ */
+void imd_reset_stats(void);
+
 /* --- Header and Comment Handling --- */
 
 /**
@@ -186,6 +377,17 @@ int imd_skip_comment_block(FILE* fimd);
  */
 int imd_write_file_header(FILE* fout, const char* version_string);
 
+/**
+ * Formats the standard IMD text header line with the current date/time into a buffer,
+ * exactly as imd_write_file_header() writes it. The line is NUL-terminated.
+ * @param buf Destination buffer. LIBIMD_MAX_HEADER_LINE bytes are always enough for a short version string.
+ * @param buf_size Size of buf in bytes.
+ * @param version_string Version string of the creating program (e.g., "1.19"). Must not be NULL.
+ * @param written_out Pointer to receive the length of the line, excluding the NUL.
+ * @return 0 on success, IMD_ERR_BUFFER_TOO_SMALL if the line does not fit, other negative IMD_ERR_* on error.
+ */
+int imd_format_file_header(char* buf, size_t buf_size, const char* version_string, size_t* written_out);
+
 /**
  * Writes the comment block and the terminating EOF marker (0x1A).
  * @param fout Output file stream.
@@ -239,6 +441,7 @@ int imd_load_track(FILE* fimd, ImdTrackInfo* track, uint8_t fill_byte);
  * Reads only the track header and maps from an IMD file stream.
  * Does NOT allocate or read sector data. Sets track->data to NULL and track->loaded to 0.
  * Skips over the sector data records in the file stream.
+ * Absent cylinder/head maps are filled with the track's cylinder/head number.
  * Useful for quickly scanning track metadata.
  * @param fimd Input file stream, positioned at the start of a track record.
  * @param track Pointer to the ImdTrackInfo structure to fill (header/maps only). Must not be NULL.
@@ -252,8 +455,10 @@ int imd_read_track_header(FILE* fimd, ImdTrackInfo* track);
  * Reads track header, maps, and sector flags from an IMD file stream.
  * Does NOT allocate or read sector data. Sets track->data to NULL and track->loaded to 0.
  * Skips over the sector data records in the file stream based on flags read.
- * Populates the sflag array in the track structure.
+ * Populates the sflag array in the track structure. Absent cylinder/head maps are
+ * filled with the track's cylinder/head number.
  * Useful for scanning metadata including sector status.
+ * The data of the final sector may run past the end of the file (its flags are complete).
  * @param fimd Input file stream, positioned at the start of a track record.
  * @param track Pointer to the ImdTrackInfo structure to fill (header/maps/flags only). Must not be NULL.
  * @return 1 if a track header/flags were read successfully.
@@ -265,7 +470,8 @@ int imd_read_track_header_and_flags(FILE* fimd, ImdTrackInfo* track);
 /**
  * Checks if a specific track (cylinder/head) in an IMD file contains any "valid" sectors.
  * A sector is considered valid if its base type is not IMD_SDR_UNAVAILABLE.
- * This function scans the file without loading full track data.
+ * This function scans the file without loading full track data. To query many tracks,
+ * build an ImdTrackIndex once and use imd_track_index_has_valid_sectors() instead.
  * Preserves the original file position on success or failure.
  * @param fimd Input file stream. Assumed to be open and valid. Must be seekable.
  * @param cyl Target cylinder number.
@@ -277,6 +483,287 @@ int imd_read_track_header_and_flags(FILE* fimd, ImdTrackInfo* track);
  */
 int imd_track_has_valid_sectors(FILE* fimd, uint8_t cyl, uint8_t head);
 
+/* --- Buffer Parsing --- */
+
+/**
+ * Reads and parses the IMD text header line from a memory buffer.
+ * Same semantics as imd_read_file_header, for an image held in memory (e.g. a file mapping).
+ * @param buf Buffer holding the image, starting at the header line.
+ * @param len Number of valid bytes in buf.
+ * @param header_info Optional pointer to structure to store parsed info. Can be NULL.
+ * @param consumed_out Optional pointer to store the length of the header line, including its line terminator.
+ * @return 0 on success, negative IMD_ERR_* on error.
+ */
+int imd_read_file_header_buffer(const uint8_t* buf, size_t len, ImdHeaderInfo* header_info, size_t* consumed_out);
+
+/**
+ * Reads the comment block from a memory buffer, up to the EOF marker (0x1A).
+ * Allocates memory for the comment. Caller must free the returned buffer.
+ * @param buf Buffer positioned immediately after the header line.
+ * @param len Number of valid bytes in buf.
+ * @param comment_size_out Pointer to store the size of the comment (excluding null terminator). Must not be NULL.
+ * @param consumed_out Optional pointer to store the number of bytes consumed, including the marker.
+ * @return Pointer to the allocated null-terminated comment string, or NULL on error or if no marker is found.
+ */
+char* imd_read_comment_block_buffer(const uint8_t* buf, size_t len, size_t* comment_size_out, size_t* consumed_out);
+
+/**
+ * Loads a single track (header, maps, and data) from a memory buffer.
+ * Same semantics as imd_load_track. Memory must be freed using imd_free_track_data().
+ * @param buf Buffer positioned at the start of a track record.
+ * @param len Number of valid bytes in buf.
+ * @param track Pointer to the ImdTrackInfo structure to fill. Must not be NULL.
+ * @param fill_byte Byte value used to fill the data buffer for sectors marked as unavailable (IMD_SDR_UNAVAILABLE).
+ * @param consumed_out Optional pointer to store the length of the track record.
+ * @return 1 if a track was loaded successfully.
+ * @return 0 if len is 0 (end of image).
+ * @return Negative value (IMD_ERR_*) on error (e.g., truncated record, invalid data, memory allocation failure).
+ */
+int imd_load_track_buffer(const uint8_t* buf, size_t len, ImdTrackInfo* track, uint8_t fill_byte, size_t* consumed_out);
+
+/**
+ * Loads a single track from a memory buffer into caller-provided data storage, e.g. a slice
+ * of one allocation shared by all tracks of an image. On success track->data points into
+ * data_buf; it must not be released with imd_free_track_data().
+ * @param buf Buffer positioned at the start of a track record.
+ * @param len Number of valid bytes in buf.
+ * @param track Pointer to the ImdTrackInfo structure to fill. Must not be NULL.
+ * @param fill_byte Byte value used to fill the data buffer for sectors marked as unavailable (IMD_SDR_UNAVAILABLE).
+ * @param data_buf Storage for the sector data (num_sectors * sector_size bytes). Can be NULL only if the track has no data.
+ * @param data_buf_size Size of data_buf in bytes.
+ * @param consumed_out Optional pointer to store the length of the track record.
+ * @return 1 if a track was loaded successfully.
+ * @return 0 if len is 0 (end of image).
+ * @return IMD_ERR_BUFFER_TOO_SMALL if data_buf cannot hold the track data.
+ * @return Other negative IMD_ERR_* on error (e.g., truncated record, invalid data).
+ */
+int imd_load_track_buffer_into(const uint8_t* buf, size_t len, ImdTrackInfo* track, uint8_t fill_byte,
+    uint8_t* data_buf, size_t data_buf_size, size_t* consumed_out);
+
+/**
+ * Reads track header, maps, and sector flags from a memory buffer without loading sector data.
+ * Sets track->data to NULL and track->loaded to 0. Absent cylinder/head maps are filled
+ * with the track's cylinder/head number.
+ * As imd_read_track_header_and_flags(), the data of the final sector may run past len.
+ * @param buf Buffer positioned at the start of a track record.
+ * @param len Number of valid bytes in buf.
+ * @param track Pointer to the ImdTrackInfo structure to fill (header/maps/flags only). Must not be NULL.
+ * @param consumed_out Optional pointer to store the length of the track record (up to len).
+ * @return 1 if a track header/flags were read successfully.
+ * @return 0 if len is 0 (end of image).
+ * @return Negative value (IMD_ERR_*) on error (e.g., truncated record, invalid data).
+ */
+int imd_read_track_header_and_flags_buffer(const uint8_t* buf, size_t len, ImdTrackInfo* track, size_t* consumed_out);
+
+/* --- Stream Parsing --- */
+
+/* imd_parse_stream flags */
+#define IMD_STREAM_FLAGS_ONLY 0x01 /* Do not expand sector data (track->data is NULL) */
+
+/**
+ * Called by imd_parse_stream for each track record, in file order.
+ * The track and its data are owned by the parser and valid only during the call.
+ * @param track The parsed track. Loaded (with data) unless IMD_STREAM_FLAGS_ONLY was given.
+ * @param record_offset Offset of the track record from the start of the image.
+ * @param user_data The user_data pointer passed to imd_parse_stream.
+ * @return 0 to continue, any other value to stop parsing.
+ */
+typedef int (*ImdStreamTrackFn)(const ImdTrackInfo* track, long long record_offset, void* user_data);
+
+/**
+ * Sets up an ImdIo that reads from a FILE*. skip uses a forward fseek where the stream
+ * supports it and reads otherwise. The caller keeps ownership of the stream.
+ * @param io ImdIo to initialize. Must not be NULL.
+ * @param f Source stream. Must not be NULL.
+ */
+void imd_io_init_file(ImdIo* io, FILE* f);
+
+/**
+ * Sets up an ImdIo that reads from memory, with zero-copy peek support.
+ * @param io ImdIo to initialize. Must not be NULL.
+ * @param mem State of the source, initialized here; must outlive io. Must not be NULL.
+ * @param data Image bytes.
+ * @param size Number of bytes in data.
+ */
+void imd_io_init_memory(ImdIo* io, ImdIoMemory* mem, const uint8_t* data, size_t size);
+
+/**
+ * Parses a complete IMD image from an ImdIo source in a single forward pass.
+ * The source is read through a window that holds at most one track record
+ * (sources with peek are parsed in place), so memory stays bounded by the largest track.
+ * @param io Byte source, positioned at the header line. Must not be NULL.
+ * @param flags Bitwise OR of IMD_STREAM_* flags.
+ * @param header_info Optional pointer to receive the parsed header. Can be NULL.
+ * @param comment_out Optional pointer to receive the comment block, allocated with imd_malloc;
+ *        the caller frees it with imd_free. Can be NULL to skip the comment.
+ * @param comment_len_out Optional pointer to receive the comment length. Can be NULL.
+ * @param on_track Callback for each track. Can be NULL to validate only.
+ * @param user_data Passed through to on_track.
+ * @return The number of tracks parsed (>= 0) at the end of the image or when on_track stops,
+ *         negative IMD_ERR_* on error (invalid header, missing comment terminator,
+ *         truncated or invalid record, allocation failure).
+ */
+long imd_parse_stream(const ImdIo* io, unsigned flags, ImdHeaderInfo* header_info,
+                      char** comment_out, size_t* comment_len_out,
+                      ImdStreamTrackFn on_track, void* user_data);
+
+/* --- Conversion Pipeline --- */
+
+/* imd_convert_stream output formats */
+#define IMD_CONVERT_IMD 0   /* IMD image: header, comment and re-encoded track records */
+#define IMD_CONVERT_BIN 1   /* Raw sector data, as imd_write_track_bin() writes it */
+
+#define LIBIMD_CONVERT_RING_SLOTS     4  /* Default number of track buffers in flight */
+#define LIBIMD_CONVERT_MAX_RING_SLOTS 64
+
+/**
+ * Converts an IMD image from a stream source to IMD or raw binary in one forward pass.
+ * Three stages - parse, transform (mode translation, interleave and compression from
+ * opts) and write - run on their own threads and hand tracks over through a ring of
+ * reusable track buffers, so reading, encoding and writing overlap while memory stays
+ * bounded by ring_slots times the largest track, whatever the size of the image.
+ * Output is identical to loading each track with imd_load_track() and writing it with
+ * imd_write_track_imd() or imd_write_track_bin(). For IMD output the header (keeping
+ * the input's version string) and comment block are written first.
+ * @param in Byte source, positioned at the header line. Must not be NULL.
+ * @param fout Output stream. Must not be NULL.
+ * @param format IMD_CONVERT_IMD or IMD_CONVERT_BIN.
+ * @param opts Write options applied to every track. Must not be NULL.
+ * @param ring_slots Track buffers in the ring (0 = LIBIMD_CONVERT_RING_SLOTS, capped at
+ *        LIBIMD_CONVERT_MAX_RING_SLOTS). 1 runs all stages in turn on the calling thread,
+ *        as does any failure to start the stage threads.
+ * @return The number of tracks converted (>= 0), or a negative IMD_ERR_* code from the
+ *         first stage that failed (invalid input, encoding error, write error, allocation failure).
+ */
+long imd_convert_stream(const ImdIo* in, FILE* fout, int format, const ImdWriteOpts* opts, unsigned ring_slots);
+
+/* --- Track Index --- */
+
+/**
+ * Builds a track index by scanning an entire IMD file once.
+ * The file position is preserved. Free the index with imd_track_index_free().
+ * If the same (cyl, head) appears more than once, lookups resolve to the first record.
+ * @param fimd Input file stream.
+ * @param index_out Pointer to receive the allocated index. Must not be NULL.
+ * @return 0 on success, negative IMD_ERR_* on error (read error, invalid data, allocation failure).
+ */
+int imd_track_index_build(FILE* fimd, ImdTrackIndex** index_out);
+
+/**
+ * Builds a track index from an IMD image held in memory (e.g. a file mapping).
+ * Entry offsets are relative to the start of buf.
+ * @param buf Buffer holding the complete image, starting at the header line.
+ * @param len Number of valid bytes in buf.
+ * @param index_out Pointer to receive the allocated index. Must not be NULL.
+ * @return 0 on success, negative IMD_ERR_* on error (truncated record, invalid data, allocation failure).
+ */
+int imd_track_index_build_buffer(const uint8_t* buf, size_t len, ImdTrackIndex** index_out);
+
+/**
+ * Frees a track index and its entries.
+ * @param index Index to free. Can be NULL.
+ */
+void imd_track_index_free(ImdTrackIndex* index);
+
+/**
+ * Looks up the entry for a physical track in O(1).
+ * @param index Track index. Must not be NULL.
+ * @param cyl Physical cylinder number.
+ * @param head Physical head number.
+ * @return Pointer to the entry (owned by the index), or NULL if the track is not present.
+ */
+const ImdTrackIndexEntry* imd_track_index_find(const ImdTrackIndex* index, uint8_t cyl, uint8_t head);
+
+/**
+ * Index-based equivalent of imd_track_has_valid_sectors().
+ * @param index Track index. Must not be NULL.
+ * @param cyl Physical cylinder number.
+ * @param head Physical head number.
+ * @return 1 if the track has at least one sector whose flag is not IMD_SDR_UNAVAILABLE.
+ * @return 0 if the track exists but all of its sectors are unavailable (or it has none).
+ * @return IMD_ERR_TRACK_NOT_FOUND if the track is not in the index.
+ * @return IMD_ERR_INVALID_ARG if index is NULL.
+ */
+int imd_track_index_has_valid_sectors(const ImdTrackIndex* index, uint8_t cyl, uint8_t head);
+
+/**
+ * Writes a track index to a sidecar file in a portable little-endian format.
+ * @param index Track index to save. Must not be NULL.
+ * @param fout Output file stream, opened in binary mode.
+ * @return 0 on success, negative IMD_ERR_* on error.
+ */
+int imd_track_index_save(const ImdTrackIndex* index, FILE* fout);
+
+/**
+ * Reads a track index previously written by imd_track_index_save().
+ * The sidecar records the size of the indexed image; a sidecar whose size does not
+ * match expected_image_size is rejected as stale.
+ * @param fin Input file stream, opened in binary mode.
+ * @param expected_image_size Current size of the image in bytes, or 0 to skip the check.
+ * @param index_out Pointer to receive the allocated index. Must not be NULL.
+ * @return 0 on success, IMD_ERR_READ_ERROR on a truncated, corrupt or stale sidecar,
+ *         other negative IMD_ERR_* on error.
+ */
+int imd_track_index_load(FILE* fin, uint64_t expected_image_size, ImdTrackIndex** index_out);
+
+/* --- Compact Track Arena --- */
+
+/**
+ * Initializes an empty track arena.
+ * @param arena Arena to initialize. Must not be NULL.
+ */
+void imd_track_arena_init(ImdTrackArena* arena);
+
+/**
+ * Frees the storage of a track arena and leaves it empty. Safe to call repeatedly.
+ * @param arena Arena to free. Can be NULL.
+ */
+void imd_track_arena_free(ImdTrackArena* arena);
+
+/**
+ * Appends the metadata (header, maps and sector flags) of a track to an arena.
+ * Sector data is not copied.
+ * @param arena Initialized arena. Must not be NULL.
+ * @param track Track to append. Must not be NULL.
+ * @param offset File offset of the track record, or -1 if unknown.
+ * @return Index of the new track (>= 0), or negative IMD_ERR_* on error.
+ */
+long imd_track_arena_append(ImdTrackArena* arena, const ImdTrackInfo* track, long offset);
+
+/**
+ * Builds an arena from the track headers of an entire IMD file, recording the file offset
+ * of each track record. The file position is preserved.
+ * @param fimd Input file stream.
+ * @param arena Initialized arena to append to. Must not be NULL.
+ * @return 0 on success, negative IMD_ERR_* on error (tracks read before the error stay in the arena).
+ */
+int imd_track_arena_build(FILE* fimd, ImdTrackArena* arena);
+
+/**
+ * Gets direct pointers to the maps and sector flags of a track in an arena.
+ * Pointers stay valid until the arena is appended to or freed.
+ * @param arena Arena. Must not be NULL.
+ * @param index Track index (0 to count-1).
+ * @param smap_out Optional pointer to receive the sector map. Can be NULL.
+ * @param cmap_out Optional pointer to receive the cylinder map, NULL if the track has none. Can be NULL.
+ * @param hmap_out Optional pointer to receive the head map, NULL if the track has none. Can be NULL.
+ * @param sflag_out Optional pointer to receive the sector flags. Can be NULL.
+ * @return 0 on success, IMD_ERR_INVALID_ARG if arena is NULL or index is out of range.
+ */
+int imd_track_arena_get_maps(const ImdTrackArena* arena, size_t index, const uint8_t** smap_out,
+    const uint8_t** cmap_out, const uint8_t** hmap_out, const uint8_t** sflag_out);
+
+/**
+ * Expands a track of an arena into an ImdTrackInfo compatibility view, as
+ * imd_read_track_header_and_flags() would have returned it: absent cylinder/head maps
+ * are filled with the track's cylinder/head number, data is NULL and loaded is 0.
+ * @param arena Arena. Must not be NULL.
+ * @param index Track index (0 to count-1).
+ * @param view Structure to fill. Must not be NULL.
+ * @return 0 on success, IMD_ERR_INVALID_ARG on invalid arguments.
+ */
+int imd_track_arena_get_view(const ImdTrackArena* arena, size_t index, ImdTrackInfo* view);
+
 /**
  * Frees the sector data buffer allocated within an ImdTrackInfo structure by imd_load_track().
  * Also resets data pointer, data size, and loaded flag in the structure.
@@ -289,7 +776,7 @@ void imd_free_track_data(ImdTrackInfo* track);
  * Writes a track from memory to an output file in IMD format.
  * Applies processing options like compression, flag forcing, mode translation,
  * and interleaving to the track data *before* writing.
- * The input track structure is not modified unless interleaving occurs (temporary internal modification).
+ * The input track structure is not modified; interleaving only changes the order sectors are written in.
  * @param fout Output file stream.
  * @param track Pointer to the loaded ImdTrackInfo structure containing track data. Must be loaded (track->loaded == 1).
  * @param opts Pointer to ImdWriteOpts structure with processing options. Must not be NULL.
@@ -297,10 +784,68 @@ void imd_free_track_data(ImdTrackInfo* track);
  */
 int imd_write_track_imd(FILE* fout, ImdTrackInfo* track, const ImdWriteOpts* opts);
 
+/**
+ * Returns an upper bound on the number of bytes imd_write_track_imd() or
+ * imd_encode_track_to_buffer() emit for a track: every sector stored uncompressed.
+ * @param track Pointer to the ImdTrackInfo structure (header fields only are used).
+ * @return The bound in bytes, or 0 if track is NULL.
+ */
+size_t imd_track_encoded_size_bound(const ImdTrackInfo* track);
+
+/**
+ * Encodes a track into a memory buffer, producing exactly the bytes imd_write_track_imd()
+ * writes for the same options. Nothing is written if the buffer is too small.
+ * @param track Pointer to the loaded ImdTrackInfo structure containing track data. Must be loaded.
+ * @param opts Pointer to ImdWriteOpts structure with processing options. Must not be NULL.
+ * @param buf Destination buffer. imd_track_encoded_size_bound() bytes are always enough.
+ * @param buf_size Size of buf in bytes.
+ * @param written_out Pointer to receive the number of bytes encoded.
+ * @return 0 on success, IMD_ERR_BUFFER_TOO_SMALL if the record does not fit,
+ *         other negative IMD_ERR_* on error (invalid args, inconsistent track data).
+ */
+int imd_encode_track_to_buffer(ImdTrackInfo* track, const ImdWriteOpts* opts, uint8_t* buf, size_t buf_size, size_t* written_out);
+
+/**
+ * Writes a sequence of tracks in IMD format, as repeated imd_write_track_imd() calls would.
+ * With more than one thread, a window of tracks is encoded in parallel into memory
+ * and then written out in order, so the output is identical to the serial case.
+ * The allocator installed with imd_set_allocator() must be thread-safe when num_threads != 1.
+ * @param fout Output file stream.
+ * @param tracks Array of loaded tracks.
+ * @param count Number of tracks in the array.
+ * @param opts Pointer to ImdWriteOpts structure applied to every track. Must not be NULL.
+ * @param num_threads Number of threads to encode with (0 = one per processor, 1 = serial).
+ * @return 0 on success, or the first negative IMD_ERR_* in track order. Tracks before the
+ *         failing one have been written.
+ */
+int imd_write_tracks_imd(FILE* fout, ImdTrackInfo* tracks, size_t count, const ImdWriteOpts* opts, unsigned num_threads);
+
+/**
+ * Determines the Sector Data Record type that imd_write_track_imd() would emit
+ * for each sector of a track, applying the compression and flag forcing options.
+ * The interleave option is ignored; flags are returned in the track's current physical order.
+ * Useful for predicting the exact on-disk layout of a track record before writing it.
+ * @param track Pointer to the loaded ImdTrackInfo structure. Must not be NULL.
+ * @param opts Pointer to ImdWriteOpts structure with processing options. Must not be NULL.
+ * @param sflag_out Array of at least track->num_sectors bytes to receive the output flags. Must not be NULL.
+ * @return 0 on success, IMD_ERR_INVALID_ARG on invalid arguments or inconsistent track data.
+ */
+int imd_compute_write_sflags(const ImdTrackInfo* track, const ImdWriteOpts* opts, uint8_t* sflag_out);
+
+/**
+ * Checks whether write options leave a track's encoding unchanged: AS_READ
+ * compression, identity mode translation, no flag forcing, and LIBIMD_IL_AS_READ.
+ * With such options imd_write_track_imd() re-emits an unmodified track exactly
+ * as it was read, so callers may copy the original record bytes instead.
+ * @param opts Pointer to ImdWriteOpts structure. Can be NULL.
+ * @return 1 if the options are the identity, 0 otherwise (or if opts is NULL).
+ */
+int imd_write_opts_is_identity(const ImdWriteOpts* opts);
+
 /**
  * Writes the raw sector data of a track (potentially reordered by interleave option)
  * to an output file in flat binary format. No IMD formatting is written.
- * The input track structure is not modified unless interleaving occurs (temporary internal modification).
+ * The input track structure is not modified; interleaving only changes the order sectors are written in.
  * @param fout Output file stream.
  * @param track Pointer to the loaded ImdTrackInfo structure containing track data. Must be loaded.
  * @param opts Pointer to ImdWriteOpts structure (only interleave_factor is used). Must not be NULL.
@@ -326,6 +871,18 @@ int imd_calculate_best_interleave(ImdTrackInfo* track);
  */
 int imd_apply_interleave(ImdTrackInfo* track, int interleave_factor);
 
+/**
+ * Computes the sector order imd_apply_interleave() would produce, without
+ * touching the track. perm_out[p] receives the current physical index of the
+ * sector that would be placed at physical position p. Sectors that share an
+ * ID all resolve to the first of them, as in imd_apply_interleave().
+ * @param track Pointer to the ImdTrackInfo structure (only num_sectors and smap are used).
+ * @param interleave_factor The desired interleave factor (must be >= 1).
+ * @param perm_out Array of at least track->num_sectors bytes to receive the order.
+ * @return 0 on success, IMD_ERR_INVALID_ARG for invalid arguments or fewer than 2 sectors.
+ */
+int imd_compute_interleave_permutation(const ImdTrackInfo* track, int interleave_factor, uint8_t* perm_out);
+
 /**
  * Checks if all bytes in a buffer have the same value (uniform).
  * @param data Pointer to the data buffer.
@@ -335,6 +892,135 @@ int imd_apply_interleave(ImdTrackInfo* track, int interleave_factor);
  */
 int imd_is_uniform(const uint8_t* data, size_t size, uint8_t* fill_byte_out);
 
+/**
+ * Classifies every sector of a loaded track as uniform or not in a single pass over its data.
+ * Uses the same vectorized scan as imd_is_uniform().
+ * @param track Pointer to the loaded ImdTrackInfo structure. Must not be NULL.
+ * @param uniform_out Array of at least track->num_sectors bytes; entry i is set to 1 if
+ *        physical sector i is uniform, 0 otherwise. Must not be NULL.
+ * @param fill_out Optional array of at least track->num_sectors bytes receiving the fill byte
+ *        of each uniform sector (0 for non-uniform sectors). Can be NULL.
+ * @return Number of uniform sectors (0 to num_sectors), or IMD_ERR_INVALID_ARG on invalid
+ *         arguments or a data buffer too small for the track.
+ */
+int imd_classify_sectors(const ImdTrackInfo* track, uint8_t* uniform_out, uint8_t* fill_out);
+
+/* --- Content Hashing --- */
+
+/* Seed of the sector and track hashes */
+#define IMD_HASH_SEED 0
+
+/**
+ * Computes a fast 64-bit hash of a byte range (the XXH64 algorithm; not cryptographic).
+ * Words are read little-endian, so the hash of the same bytes is the same on every platform.
+ * @param data Bytes to hash. Can be NULL if len is 0.
+ * @param len Number of bytes.
+ * @param seed Seed value; each seed gives an unrelated hash function.
+ * @return The hash.
+ */
+uint64_t imd_hash_bytes(const void* data, size_t len, uint64_t seed);
+
+/**
+ * Computes the content hash of one sector: imd_hash_bytes over its data with IMD_HASH_SEED.
+ * Unavailable sectors hash their fill bytes.
+ * @param track Pointer to the loaded ImdTrackInfo structure.
+ * @param index Physical sector index (0 to num_sectors-1).
+ * @return The hash, or the hash of no bytes if the track or index is invalid.
+ */
+uint64_t imd_hash_sector(const ImdTrackInfo* track, uint8_t index);
+
+/**
+ * Computes the content hash of a track over its mode, sector count and size, sector maps
+ * (the optional maps only when present), Sector Data Record types and sector hashes.
+ * The physical cylinder and head are not included: equal tracks at different positions
+ * hash equally. A sector stored compressed and the same data stored normal hash differently.
+ * @param track Pointer to the loaded ImdTrackInfo structure.
+ * @param sector_hashes Optional array of num_sectors hashes from imd_hash_sector;
+ *        NULL to hash the sector data here.
+ * @return The hash.
+ */
+uint64_t imd_hash_track(const ImdTrackInfo* track, const uint64_t* sector_hashes);
+
+/* --- Asynchronous Reading --- */
+
+/*
+ * A prefetch session reads whole files ahead of their consumers. Reader threads keep
+ * up to queue_depth reads in flight, which is what hides the latency of network
+ * storage; each completed file is handed out as an in-memory buffer for the buffer
+ * parsers (imd_read_file_header_buffer and friends).
+ */
+
+/* Reading session of imd_prefetch_start() */
+typedef struct ImdPrefetch ImdPrefetch; /* Opaque structure */
+
+/* A file read by a prefetch session */
+typedef struct {
+    size_t index;               /* Index of the file in the paths array */
+    const char* path;           /* Path of the file */
+    int status;                 /* 0 if read, IMD_ERR_OPEN, IMD_ERR_READ_ERROR, IMD_ERR_SEEK_ERROR or IMD_ERR_ALLOC */
+    const uint8_t* data;        /* Contents of the file when status is 0 */
+    size_t size;                /* Number of bytes in data */
+} ImdPrefetchItem;
+
+/**
+ * Decides on a reader thread whether a file is read at all, e.g. to answer it from a cache.
+ * Runs concurrently for different files, so it must be thread-safe.
+ * @param index Index of the file in the paths array.
+ * @param path Path of the file.
+ * @param user_data The user_data pointer passed to imd_prefetch_start().
+ * @return Non-zero to read the file, 0 to skip it (it is then never delivered).
+ */
+typedef int (*ImdPrefetchFilterFn)(size_t index, const char* path, void* user_data);
+
+/**
+ * Starts reading files in the background, roughly in paths order.
+ * At most 2 * queue_depth file buffers exist at a time, so readers wait for slow consumers.
+ * If a custom allocator is installed with imd_set_allocator, it must be thread-safe.
+ * @param paths Array of count file paths; must stay valid until imd_prefetch_stop().
+ * @param count Number of files.
+ * @param queue_depth Number of reads in flight (0 = 1, at most LIBIMD_MAX_WORKER_THREADS).
+ * @param filter Called before each file is read, or NULL to read every file.
+ * @param user_data Passed through to filter.
+ * @param prefetch_out Pointer to store the session.
+ * @return 0 on success, IMD_ERR_INVALID_ARG, or IMD_ERR_ALLOC if no reader could be started.
+ */
+int imd_prefetch_start(const char* const* paths, size_t count, unsigned queue_depth,
+                       ImdPrefetchFilterFn filter, void* user_data, ImdPrefetch** prefetch_out);
+
+/**
+ * Waits for the next completed file, in completion order. Any number of threads may
+ * consume from one session, but a thread must hand its item back (imd_prefetch_done or
+ * imd_prefetch_take) before asking for the next one.
+ * @param prefetch Pointer to the session.
+ * @param item_out Pointer to store the item, valid until it is handed back.
+ * @return 1 if an item was stored, 0 once every file has been delivered or skipped,
+ * IMD_ERR_INVALID_ARG on invalid arguments.
+ */
+int imd_prefetch_next(ImdPrefetch* prefetch, ImdPrefetchItem** item_out);
+
+/**
+ * Hands an item back, so its buffer can be reused for another file.
+ * @param prefetch Pointer to the session.
+ * @param item Item from imd_prefetch_next(). Can be NULL.
+ */
+void imd_prefetch_done(ImdPrefetch* prefetch, ImdPrefetchItem* item);
+
+/**
+ * Hands an item back but keeps its buffer, saving a copy when the data outlives the item.
+ * @param prefetch Pointer to the session.
+ * @param item Item from imd_prefetch_next().
+ * @return The item's data (at least size bytes), to be released with imd_free(); NULL if item is
+ *         NULL or no buffer was allocated for it.
+ */
+uint8_t* imd_prefetch_take(ImdPrefetch* prefetch, ImdPrefetchItem* item);
+
+/**
+ * Stops the readers, waits for reads in progress and frees the session. Items not yet
+ * handed back become invalid. Does nothing if prefetch is NULL.
+ * @param prefetch Pointer to the session.
+ */
+void imd_prefetch_stop(ImdPrefetch* prefetch);
+
 /**
  * Public helper function to write a specified number of bytes to a file stream.
  * Provides direct access to the internal byte writing logic.
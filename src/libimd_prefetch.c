@@ -0,0 +1,302 @@
+/*
+ * Asynchronous File Reading for libimd.
+ * A pool of reader threads keeps up to queue_depth whole-file reads in flight and
+ * hands the completed buffers to the consumers in completion order.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+ /* Define _DEFAULT_SOURCE to enable POSIX features like posix_fadvise */
+#define _DEFAULT_SOURCE
+
+#include "libimd.h"
+#include "libimd_stats.h"
+#include "libimd_thread.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>      /* For posix_fadvise */
+#endif
+
+/* --- Debug Macro --- */
+#ifdef DEBUG_LIBIMD
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...) do { } while (0)
+#endif
+
+/* A read buffer: the public item, followed by the engine's bookkeeping */
+typedef struct ImdPrefetchSlot {
+    ImdPrefetchItem item;       /* Must be first: items handed out are slots */
+    uint8_t* bytes;             /* Read buffer, reused for the next file */
+    size_t capacity;            /* Allocated size of bytes */
+    struct ImdPrefetchSlot* next; /* Free list or ready queue */
+} ImdPrefetchSlot;
+
+struct ImdPrefetch {
+    const char* const* paths;
+    size_t count;
+    ImdPrefetchFilterFn filter; /* NULL to read every file */
+    void* user_data;
+
+    ImdMutex lock;              /* Protects everything below */
+    ImdCond slot_freed;         /* Signalled when a slot returns to the free list */
+    ImdCond item_ready;         /* Signalled when an item is queued or the last reader exits */
+    size_t next_path;           /* Next path for a reader to claim */
+    ImdPrefetchSlot* free_slots;
+    ImdPrefetchSlot* ready_head; /* Completed reads, oldest first */
+    ImdPrefetchSlot* ready_tail;
+    unsigned readers_running;   /* Reader threads that have not exited yet */
+    int stopping;               /* imd_prefetch_stop has been called */
+
+    ImdPrefetchSlot* slots;     /* num_slots slots */
+    unsigned num_slots;
+    ImdThread* threads;
+    unsigned num_threads;       /* Reader threads started */
+};
+
+/*
+ * Reads a whole file into a slot, growing its buffer as needed. Returns 0 or a
+ * negative IMD_ERR_* code.
+ */
+static int read_file_into_slot(const char* path, ImdPrefetchSlot* slot) {
+    size_t len = 0;
+    size_t wanted = 0;
+    long end;
+    FILE* f = fopen(path, "rb");
+
+    if (!f) return IMD_ERR_OPEN;
+    setvbuf(f, NULL, _IONBF, 0); /* The file is read straight into the slot */
+#if !defined(_WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+    /* Let the kernel (or the NFS client) read ahead at full size */
+    (void)posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    /* Size the file up front, so it is read with a single fread */
+    if (imd_stat_fseek(f, 0, SEEK_END) == 0) {
+        end = ftell(f);
+        if (end > 0) wanted = (size_t)end;
+        if (imd_stat_fseek(f, 0, SEEK_SET) != 0) {
+            fclose(f);
+            return IMD_ERR_SEEK_ERROR;
+        }
+    }
+    wanted++; /* Room to notice EOF without another allocation */
+
+    for (;;) {
+        if (slot->capacity - len < wanted) {
+            size_t new_capacity = len + wanted;
+            uint8_t* new_bytes = (uint8_t*)imd_realloc(slot->bytes, new_capacity);
+            if (!new_bytes) {
+                fclose(f);
+                return IMD_ERR_ALLOC;
+            }
+            slot->bytes = new_bytes;
+            slot->capacity = new_capacity;
+        }
+        len += imd_stat_fread(slot->bytes + len, 1, slot->capacity - len, f);
+        if (len < slot->capacity) break;
+        wanted = (slot->capacity < 65536) ? 65536 : slot->capacity; /* Grew while being read */
+    }
+    if (ferror(f)) {
+        fclose(f);
+        return IMD_ERR_READ_ERROR;
+    }
+    fclose(f);
+    slot->item.size = len;
+    return 0;
+}
+
+static void prefetch_reader(void* arg) {
+    ImdPrefetch* pf = (ImdPrefetch*)arg;
+    ImdPrefetchSlot* slot = NULL;
+
+    imd_mutex_lock(&pf->lock);
+    for (;;) {
+        size_t index;
+
+        while (!slot && !pf->stopping && pf->next_path < pf->count) {
+            if (pf->free_slots) {
+                slot = pf->free_slots;
+                pf->free_slots = slot->next;
+            }
+            else {
+                imd_cond_wait(&pf->slot_freed, &pf->lock);
+            }
+        }
+        if (pf->stopping || pf->next_path >= pf->count) break;
+        index = pf->next_path++;
+        imd_mutex_unlock(&pf->lock);
+
+        /* The filter and the read run unlocked, so many files are in flight at once */
+        if (pf->filter && !pf->filter(index, pf->paths[index], pf->user_data)) {
+            imd_mutex_lock(&pf->lock);
+            continue; /* Not wanted: keep the slot for the next file */
+        }
+        slot->item.index = index;
+        slot->item.path = pf->paths[index];
+        slot->item.size = 0;
+        slot->item.status = read_file_into_slot(pf->paths[index], slot);
+        slot->item.data = slot->bytes;
+
+        imd_mutex_lock(&pf->lock);
+        slot->next = NULL;
+        if (pf->ready_tail) pf->ready_tail->next = slot;
+        else pf->ready_head = slot;
+        pf->ready_tail = slot;
+        slot = NULL;
+        imd_cond_signal(&pf->item_ready);
+    }
+    if (slot) {
+        slot->next = pf->free_slots;
+        pf->free_slots = slot;
+    }
+    if (--pf->readers_running == 0) imd_cond_broadcast(&pf->item_ready);
+    imd_mutex_unlock(&pf->lock);
+}
+
+/* Frees a session whose reader threads have all been joined */
+static void free_prefetch(ImdPrefetch* pf) {
+    if (pf->slots) {
+        for (unsigned i = 0; i < pf->num_slots; ++i) imd_free(pf->slots[i].bytes);
+        imd_free(pf->slots);
+    }
+    imd_free(pf->threads);
+    imd_free(pf);
+}
+
+/* --- Public API --- */
+
+int imd_prefetch_start(const char* const* paths, size_t count, unsigned queue_depth,
+                       ImdPrefetchFilterFn filter, void* user_data, ImdPrefetch** prefetch_out) {
+    ImdPrefetch* pf;
+
+    if ((!paths && count > 0) || !prefetch_out) return IMD_ERR_INVALID_ARG;
+    *prefetch_out = NULL;
+
+    if (queue_depth == 0) queue_depth = 1;
+    if (queue_depth > LIBIMD_MAX_WORKER_THREADS) queue_depth = LIBIMD_MAX_WORKER_THREADS;
+    if ((size_t)queue_depth > count) queue_depth = count ? (unsigned)count : 1;
+
+    pf = (ImdPrefetch*)imd_calloc(1, sizeof(ImdPrefetch));
+    if (!pf) return IMD_ERR_ALLOC;
+    pf->paths = paths;
+    pf->count = count;
+    pf->filter = filter;
+    pf->user_data = user_data;
+
+    /* Twice the queue depth: one buffer being read and one waiting for a consumer per reader */
+    pf->num_slots = queue_depth * 2;
+    pf->slots = (ImdPrefetchSlot*)imd_calloc(pf->num_slots, sizeof(ImdPrefetchSlot));
+    pf->threads = (ImdThread*)imd_calloc(queue_depth, sizeof(ImdThread));
+    if (!pf->slots || !pf->threads) {
+        free_prefetch(pf);
+        return IMD_ERR_ALLOC;
+    }
+    for (unsigned i = 0; i < pf->num_slots; ++i) {
+        pf->slots[i].next = pf->free_slots;
+        pf->free_slots = &pf->slots[i];
+    }
+
+    if (imd_mutex_init(&pf->lock) != 0) {
+        free_prefetch(pf);
+        return IMD_ERR_ALLOC;
+    }
+    if (imd_cond_init(&pf->slot_freed) != 0) {
+        imd_mutex_destroy(&pf->lock);
+        free_prefetch(pf);
+        return IMD_ERR_ALLOC;
+    }
+    if (imd_cond_init(&pf->item_ready) != 0) {
+        imd_cond_destroy(&pf->slot_freed);
+        imd_mutex_destroy(&pf->lock);
+        free_prefetch(pf);
+        return IMD_ERR_ALLOC;
+    }
+
+    imd_mutex_lock(&pf->lock);
+    for (unsigned t = 0; t < queue_depth; ++t) {
+        if (imd_thread_create(&pf->threads[pf->num_threads], prefetch_reader, pf) != 0) break;
+        pf->num_threads++;
+        pf->readers_running++;
+    }
+    imd_mutex_unlock(&pf->lock);
+
+    if (pf->num_threads == 0) {
+        imd_cond_destroy(&pf->item_ready);
+        imd_cond_destroy(&pf->slot_freed);
+        imd_mutex_destroy(&pf->lock);
+        free_prefetch(pf);
+        return IMD_ERR_ALLOC;
+    }
+    DEBUG_PRINTF("LIBIMD: Prefetching %zu files with %u readers\n", count, pf->num_threads);
+    *prefetch_out = pf;
+    return 0;
+}
+
+int imd_prefetch_next(ImdPrefetch* prefetch, ImdPrefetchItem** item_out) {
+    ImdPrefetchSlot* slot;
+
+    if (!prefetch || !item_out) return IMD_ERR_INVALID_ARG;
+    *item_out = NULL;
+
+    imd_mutex_lock(&prefetch->lock);
+    while (!prefetch->ready_head && prefetch->readers_running > 0) {
+        imd_cond_wait(&prefetch->item_ready, &prefetch->lock);
+    }
+    slot = prefetch->ready_head;
+    if (slot) {
+        prefetch->ready_head = slot->next;
+        if (!prefetch->ready_head) prefetch->ready_tail = NULL;
+    }
+    imd_mutex_unlock(&prefetch->lock);
+
+    if (!slot) return 0; /* Every file has been delivered (or skipped) */
+    *item_out = &slot->item;
+    return 1;
+}
+
+void imd_prefetch_done(ImdPrefetch* prefetch, ImdPrefetchItem* item) {
+    ImdPrefetchSlot* slot = (ImdPrefetchSlot*)item;
+
+    if (!prefetch || !item) return;
+    imd_mutex_lock(&prefetch->lock);
+    slot->item.data = NULL;
+    slot->next = prefetch->free_slots;
+    prefetch->free_slots = slot;
+    imd_cond_signal(&prefetch->slot_freed);
+    imd_mutex_unlock(&prefetch->lock);
+}
+
+uint8_t* imd_prefetch_take(ImdPrefetch* prefetch, ImdPrefetchItem* item) {
+    ImdPrefetchSlot* slot = (ImdPrefetchSlot*)item;
+    uint8_t* bytes;
+
+    if (!prefetch || !item) return NULL;
+    bytes = slot->bytes;
+    slot->bytes = NULL; /* The slot allocates a new buffer for its next file */
+    slot->capacity = 0;
+    imd_prefetch_done(prefetch, item);
+    return bytes;
+}
+
+void imd_prefetch_stop(ImdPrefetch* prefetch) {
+    if (!prefetch) return;
+
+    imd_mutex_lock(&prefetch->lock);
+    prefetch->stopping = 1;
+    imd_cond_broadcast(&prefetch->slot_freed);
+    imd_mutex_unlock(&prefetch->lock);
+
+    for (unsigned t = 0; t < prefetch->num_threads; ++t) {
+        imd_thread_join(&prefetch->threads[t]);
+    }
+    imd_cond_destroy(&prefetch->item_ready);
+    imd_cond_destroy(&prefetch->slot_freed);
+    imd_mutex_destroy(&prefetch->lock);
+    free_prefetch(prefetch);
+}
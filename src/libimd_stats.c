@@ -0,0 +1,262 @@
+/*
+ * Performance Counters for libimd.
+ * Each thread counts into its own block; imd_get_stats() sums the blocks.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+ /* Define _DEFAULT_SOURCE to enable POSIX features like clock_gettime */
+#define _DEFAULT_SOURCE
+
+#include "libimd_stats.h"
+#include "libimd_thread.h"
+#include <stdlib.h> /* For calloc */
+#include <string.h> /* For memset */
+#include <time.h>   /* For clock_gettime */
+
+/*
+ * Relaxed atomic access to counters written by their owner and read by imd_get_stats(),
+ * and atomic adds to sinks, which threads sharing an image update together.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define STAT_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STAT_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define STAT_ADD(p, v) ((void)__atomic_fetch_add((p), (v), __ATOMIC_RELAXED))
+#elif defined(_WIN32)
+#define STAT_LOAD(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+#define STAT_STORE(p, v) ((void)InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v)))
+#define STAT_ADD(p, v) ((void)InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v)))
+#else
+#define STAT_LOAD(p) (*(volatile uint64_t*)(p))
+#define STAT_STORE(p, v) (*(volatile uint64_t*)(p) = (v))
+#define STAT_ADD(p, v) (*(volatile uint64_t*)(p) += (v))
+#endif
+
+/*
+ * Counters of one thread. A block is released for reuse when its thread exits but
+ * never freed or cleared, so the totals never go backwards.
+ */
+typedef struct ImdThreadStats {
+    uint64_t value[IMD_STAT_COUNT]; /* Written by the owning thread only */
+    ImdStatCounters* sink;      /* Owning thread only, see imd_stats_set_sink() */
+    int in_use;                 /* Owned by a live thread; protected by registry_lock */
+    struct ImdThreadStats* next; /* Registry list */
+} ImdThreadStats;
+
+volatile int imd_stats_enabled_flag = 0;
+
+static ImdOnce stats_once = IMD_ONCE_INIT;
+static int stats_ready;         /* The registry lock and thread key exist */
+static ImdMutex registry_lock;  /* Protects registry, in_use and baseline */
+static ImdThreadStats* registry;
+static uint64_t baseline[IMD_STAT_COUNT]; /* Totals at the last imd_reset_stats() */
+
+/* --- Per-Thread Blocks --- */
+
+static void release_thread_stats(ImdThreadStats* block) {
+    imd_mutex_lock(&registry_lock);
+    block->in_use = 0;
+    block->sink = NULL;
+    imd_mutex_unlock(&registry_lock);
+}
+
+#ifdef _WIN32
+static DWORD stats_key = FLS_OUT_OF_INDEXES;
+
+static VOID NTAPI stats_key_destructor(PVOID value) {
+    if (value) release_thread_stats((ImdThreadStats*)value);
+}
+
+static int stats_key_create(void) {
+    stats_key = FlsAlloc(stats_key_destructor);
+    return (stats_key == FLS_OUT_OF_INDEXES) ? IMD_ERR_ALLOC : 0;
+}
+
+static ImdThreadStats* stats_key_get(void) {
+    return (ImdThreadStats*)FlsGetValue(stats_key);
+}
+
+static void stats_key_set(ImdThreadStats* block) {
+    FlsSetValue(stats_key, block);
+}
+#else
+static pthread_key_t stats_key;
+
+static void stats_key_destructor(void* value) {
+    if (value) release_thread_stats((ImdThreadStats*)value);
+}
+
+static int stats_key_create(void) {
+    return (pthread_key_create(&stats_key, stats_key_destructor) == 0) ? 0 : IMD_ERR_ALLOC;
+}
+
+static ImdThreadStats* stats_key_get(void) {
+    return (ImdThreadStats*)pthread_getspecific(stats_key);
+}
+
+static void stats_key_set(ImdThreadStats* block) {
+    pthread_setspecific(stats_key, block);
+}
+#endif
+
+static void stats_init(void) {
+    if (imd_mutex_init(&registry_lock) != 0) return;
+    if (stats_key_create() != 0) {
+        imd_mutex_destroy(&registry_lock);
+        return;
+    }
+    stats_ready = 1;
+}
+
+/* Returns the calling thread's block, claiming a free one (or a new one) on first use */
+static ImdThreadStats* thread_stats(void) {
+    ImdThreadStats* block;
+
+    imd_once(&stats_once, stats_init);
+    if (!stats_ready) return NULL;
+
+    block = stats_key_get();
+    if (block) return block;
+
+    imd_mutex_lock(&registry_lock);
+    for (block = registry; block && block->in_use; block = block->next) {
+    }
+    if (!block) {
+        /* Plain calloc: the blocks must not show up in the allocation counters */
+        block = (ImdThreadStats*)calloc(1, sizeof(ImdThreadStats));
+        if (block) {
+            block->next = registry;
+            registry = block;
+        }
+    }
+    if (block) block->in_use = 1;
+    imd_mutex_unlock(&registry_lock);
+
+    if (block) stats_key_set(block);
+    return block;
+}
+
+/* --- Counting --- */
+
+void imd_stat_add(ImdStatId id, uint64_t n) {
+    ImdThreadStats* block = thread_stats();
+
+    if (!block) return;
+    STAT_STORE(&block->value[id], STAT_LOAD(&block->value[id]) + n);
+    if (block->sink) STAT_ADD(&block->sink->value[id], n);
+}
+
+ImdStatCounters* imd_stats_set_sink(ImdStatCounters* sink) {
+    ImdThreadStats* block = thread_stats();
+    ImdStatCounters* previous;
+
+    if (!block) return NULL;
+    previous = block->sink;
+    block->sink = sink;
+    return previous;
+}
+
+static uint64_t now_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000u +
+        (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000u / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+uint64_t imd_stats_clock(void) {
+    uint64_t now;
+
+    if (!imd_stats_active()) return 0;
+    now = now_ns();
+    return now ? now : 1; /* 0 means "not timing" */
+}
+
+void imd_stat_time(ImdStatId id, uint64_t start) {
+    uint64_t now;
+
+    if (start == 0 || !imd_stats_active()) return;
+    now = now_ns();
+    if (now > start) imd_stat_add(id, now - start);
+}
+
+void imd_stats_merge(ImdStatCounters* dst, const ImdStatCounters* src) {
+    for (int i = 0; i < IMD_STAT_COUNT; ++i) dst->value[i] += src->value[i];
+}
+
+void imd_stats_export(const ImdStatCounters* counters, ImdStats* stats_out) {
+    const uint64_t* v = counters->value;
+
+    stats_out->bytes_read = v[IMD_STAT_BYTES_READ];
+    stats_out->bytes_written = v[IMD_STAT_BYTES_WRITTEN];
+    stats_out->read_calls = v[IMD_STAT_READ_CALLS];
+    stats_out->write_calls = v[IMD_STAT_WRITE_CALLS];
+    stats_out->seeks = v[IMD_STAT_SEEKS];
+    stats_out->allocations = v[IMD_STAT_ALLOCATIONS];
+    stats_out->bytes_allocated = v[IMD_STAT_BYTES_ALLOCATED];
+    stats_out->image_rewrites = v[IMD_STAT_IMAGE_REWRITES];
+    stats_out->tracks_decoded = v[IMD_STAT_TRACKS_DECODED];
+    stats_out->sectors_expanded = v[IMD_STAT_SECTORS_EXPANDED];
+    stats_out->tracks_encoded = v[IMD_STAT_TRACKS_ENCODED];
+    stats_out->open_ns = v[IMD_STAT_OPEN_NS];
+    stats_out->load_ns = v[IMD_STAT_LOAD_NS];
+    stats_out->encode_ns = v[IMD_STAT_ENCODE_NS];
+    stats_out->rewrite_ns = v[IMD_STAT_REWRITE_NS];
+}
+
+/* --- Public API --- */
+
+void imd_stats_enable(int enable) {
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(&imd_stats_enabled_flag, enable ? 1 : 0, __ATOMIC_RELAXED);
+#else
+    imd_stats_enabled_flag = enable ? 1 : 0;
+#endif
+}
+
+int imd_stats_is_enabled(void) {
+    return imd_stats_active();
+}
+
+/* Sums all blocks into totals; caller holds registry_lock */
+static void sum_thread_stats(uint64_t* totals) {
+    memset(totals, 0, sizeof(uint64_t) * IMD_STAT_COUNT);
+    for (const ImdThreadStats* block = registry; block; block = block->next) {
+        for (int i = 0; i < IMD_STAT_COUNT; ++i) totals[i] += STAT_LOAD(&block->value[i]);
+    }
+}
+
+void imd_get_stats(ImdStats* stats_out) {
+    ImdStatCounters counters;
+
+    if (!stats_out) return;
+    memset(&counters, 0, sizeof(counters));
+    imd_once(&stats_once, stats_init);
+    if (stats_ready) {
+        imd_mutex_lock(&registry_lock);
+        sum_thread_stats(counters.value);
+        for (int i = 0; i < IMD_STAT_COUNT; ++i) {
+            /* A reader racing with reset may see a total just below the baseline */
+            counters.value[i] = (counters.value[i] > baseline[i]) ? counters.value[i] - baseline[i] : 0;
+        }
+        imd_mutex_unlock(&registry_lock);
+    }
+    imd_stats_export(&counters, stats_out);
+}
+
+void imd_reset_stats(void) {
+    imd_once(&stats_once, stats_init);
+    if (!stats_ready) return;
+    imd_mutex_lock(&registry_lock);
+    sum_thread_stats(baseline);
+    imd_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,151 @@
+/*
+ * Internal Performance Counters for libimd.
+ * Per-thread counters behind imd_get_stats() and imdf_get_stats(), and the
+ * counted stdio wrappers the libraries use for their file I/O.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+#ifndef LIBIMD_STATS_H
+#define LIBIMD_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "libimd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Counter identifiers, in ImdStats field order */
+typedef enum {
+    IMD_STAT_BYTES_READ,
+    IMD_STAT_BYTES_WRITTEN,
+    IMD_STAT_READ_CALLS,
+    IMD_STAT_WRITE_CALLS,
+    IMD_STAT_SEEKS,
+    IMD_STAT_ALLOCATIONS,
+    IMD_STAT_BYTES_ALLOCATED,
+    IMD_STAT_IMAGE_REWRITES,
+    IMD_STAT_TRACKS_DECODED,
+    IMD_STAT_SECTORS_EXPANDED,
+    IMD_STAT_TRACKS_ENCODED,
+    IMD_STAT_OPEN_NS,
+    IMD_STAT_LOAD_NS,
+    IMD_STAT_ENCODE_NS,
+    IMD_STAT_REWRITE_NS,
+    IMD_STAT_COUNT
+} ImdStatId;
+
+/* A set of counters, e.g. those attributed to one image */
+typedef struct {
+    uint64_t value[IMD_STAT_COUNT];
+} ImdStatCounters;
+
+/* Set by imd_stats_enable(); read through imd_stats_active() only */
+extern volatile int imd_stats_enabled_flag;
+
+static inline int imd_stats_active(void) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(&imd_stats_enabled_flag, __ATOMIC_RELAXED);
+#else
+    return imd_stats_enabled_flag;
+#endif
+}
+
+/**
+ * Adds n to a counter of the calling thread, and to its sink if one is set.
+ * Callers check imd_stats_active() first (see IMD_STAT).
+ */
+void imd_stat_add(ImdStatId id, uint64_t n);
+
+/**
+ * Directs the calling thread's counts to also be added to sink (e.g. an image's
+ * counters) until the previous sink is restored. Returns the previous sink.
+ * @param sink Counters to add to, or NULL for none.
+ */
+ImdStatCounters* imd_stats_set_sink(ImdStatCounters* sink);
+
+/**
+ * Returns a monotonic timestamp in nanoseconds to pass to imd_stat_time(),
+ * or 0 when counting is off.
+ */
+uint64_t imd_stats_clock(void);
+
+/**
+ * Adds the time elapsed since start (from imd_stats_clock()) to a counter.
+ * Does nothing if start is 0.
+ */
+void imd_stat_time(ImdStatId id, uint64_t start);
+
+/* Adds every counter of src to dst */
+void imd_stats_merge(ImdStatCounters* dst, const ImdStatCounters* src);
+
+/* Copies counters into the public ImdStats layout */
+void imd_stats_export(const ImdStatCounters* counters, ImdStats* stats_out);
+
+#define IMD_STAT(id, n) do { if (imd_stats_active()) imd_stat_add((id), (uint64_t)(n)); } while (0)
+
+/* --- Counted stdio --- */
+
+/* Same arguments and results as the stdio functions they wrap */
+
+static inline size_t imd_stat_fread(void* buf, size_t size, size_t count, FILE* f) {
+    size_t got = fread(buf, size, count, f);
+    if (imd_stats_active()) {
+        imd_stat_add(IMD_STAT_READ_CALLS, 1);
+        imd_stat_add(IMD_STAT_BYTES_READ, (uint64_t)got * size);
+    }
+    return got;
+}
+
+static inline size_t imd_stat_fwrite(const void* buf, size_t size, size_t count, FILE* f) {
+    size_t put = fwrite(buf, size, count, f);
+    if (imd_stats_active()) {
+        imd_stat_add(IMD_STAT_WRITE_CALLS, 1);
+        imd_stat_add(IMD_STAT_BYTES_WRITTEN, (uint64_t)put * size);
+    }
+    return put;
+}
+
+static inline int imd_stat_fgetc(FILE* f) {
+    int c = fgetc(f);
+    if (imd_stats_active()) {
+        imd_stat_add(IMD_STAT_READ_CALLS, 1);
+        if (c != EOF) imd_stat_add(IMD_STAT_BYTES_READ, 1);
+    }
+    return c;
+}
+
+static inline int imd_stat_fputc(int c, FILE* f) {
+    int res = fputc(c, f);
+    if (imd_stats_active()) {
+        imd_stat_add(IMD_STAT_WRITE_CALLS, 1);
+        if (res != EOF) imd_stat_add(IMD_STAT_BYTES_WRITTEN, 1);
+    }
+    return res;
+}
+
+static inline char* imd_stat_fgets(char* buf, int size, FILE* f) {
+    char* res = fgets(buf, size, f);
+    if (imd_stats_active()) {
+        size_t len = 0;
+        if (res) while (buf[len] != '\0') len++;
+        imd_stat_add(IMD_STAT_READ_CALLS, 1);
+        imd_stat_add(IMD_STAT_BYTES_READ, len);
+    }
+    return res;
+}
+
+static inline int imd_stat_fseek(FILE* f, long offset, int whence) {
+    IMD_STAT(IMD_STAT_SEEKS, 1);
+    return fseek(f, offset, whence);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBIMD_STATS_H */
@@ -0,0 +1,287 @@
+/*
+ * Portable Threading Primitives for libimd.
+ * Implementation on top of POSIX threads or the Win32 API.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+ /* Define _DEFAULT_SOURCE to enable POSIX features like sysconf */
+#define _DEFAULT_SOURCE
+
+#include "libimd_thread.h"
+#include "libimd.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* --- Threads --- */
+
+/* Entry point and argument handed to the native thread trampoline */
+typedef struct {
+    ImdThreadFn fn;
+    void* arg;
+} ImdThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_trampoline(LPVOID param) {
+#else
+static void* thread_trampoline(void* param) {
+#endif
+    ImdThreadStart start = *(ImdThreadStart*)param;
+    imd_free(param);
+    start.fn(start.arg);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+int imd_thread_create(ImdThread* thread, ImdThreadFn fn, void* arg) {
+    ImdThreadStart* start;
+
+    if (!thread || !fn) return IMD_ERR_INVALID_ARG;
+
+    start = (ImdThreadStart*)imd_malloc(sizeof(ImdThreadStart));
+    if (!start) return IMD_ERR_ALLOC;
+    start->fn = fn;
+    start->arg = arg;
+
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+    if (thread->handle == NULL) {
+        imd_free(start);
+        return IMD_ERR_ALLOC;
+    }
+#else
+    if (pthread_create(&thread->handle, NULL, thread_trampoline, start) != 0) {
+        imd_free(start);
+        return IMD_ERR_ALLOC;
+    }
+#endif
+    return 0;
+}
+
+void imd_thread_join(ImdThread* thread) {
+    if (!thread) return;
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+}
+
+unsigned imd_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0) ? (unsigned)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (unsigned)n : 1;
+#endif
+}
+
+/* --- Mutexes, Reader-Writer Locks and Condition Variables --- */
+
+int imd_mutex_init(ImdMutex* mutex) {
+#ifdef _WIN32
+    InitializeCriticalSection(&mutex->cs);
+    return 0;
+#else
+    return (pthread_mutex_init(&mutex->mutex, NULL) == 0) ? 0 : IMD_ERR_ALLOC;
+#endif
+}
+
+void imd_mutex_destroy(ImdMutex* mutex) {
+#ifdef _WIN32
+    DeleteCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_destroy(&mutex->mutex);
+#endif
+}
+
+void imd_mutex_lock(ImdMutex* mutex) {
+#ifdef _WIN32
+    EnterCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+
+void imd_mutex_unlock(ImdMutex* mutex) {
+#ifdef _WIN32
+    LeaveCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_unlock(&mutex->mutex);
+#endif
+}
+
+int imd_rwlock_init(ImdRwLock* lock) {
+#ifdef _WIN32
+    InitializeSRWLock(&lock->lock);
+    return 0;
+#else
+    return (pthread_rwlock_init(&lock->lock, NULL) == 0) ? 0 : IMD_ERR_ALLOC;
+#endif
+}
+
+void imd_rwlock_destroy(ImdRwLock* lock) {
+#ifdef _WIN32
+    (void)lock; /* SRW locks need no cleanup */
+#else
+    pthread_rwlock_destroy(&lock->lock);
+#endif
+}
+
+void imd_rwlock_lock_shared(ImdRwLock* lock) {
+#ifdef _WIN32
+    AcquireSRWLockShared(&lock->lock);
+#else
+    pthread_rwlock_rdlock(&lock->lock);
+#endif
+}
+
+void imd_rwlock_unlock_shared(ImdRwLock* lock) {
+#ifdef _WIN32
+    ReleaseSRWLockShared(&lock->lock);
+#else
+    pthread_rwlock_unlock(&lock->lock);
+#endif
+}
+
+void imd_rwlock_lock_exclusive(ImdRwLock* lock) {
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&lock->lock);
+#else
+    pthread_rwlock_wrlock(&lock->lock);
+#endif
+}
+
+void imd_rwlock_unlock_exclusive(ImdRwLock* lock) {
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&lock->lock);
+#else
+    pthread_rwlock_unlock(&lock->lock);
+#endif
+}
+
+int imd_cond_init(ImdCond* cond) {
+#ifdef _WIN32
+    InitializeConditionVariable(&cond->cv);
+    return 0;
+#else
+    return (pthread_cond_init(&cond->cond, NULL) == 0) ? 0 : IMD_ERR_ALLOC;
+#endif
+}
+
+void imd_cond_destroy(ImdCond* cond) {
+#ifdef _WIN32
+    (void)cond; /* Win32 condition variables need no cleanup */
+#else
+    pthread_cond_destroy(&cond->cond);
+#endif
+}
+
+void imd_cond_wait(ImdCond* cond, ImdMutex* mutex) {
+#ifdef _WIN32
+    SleepConditionVariableCS(&cond->cv, &mutex->cs, INFINITE);
+#else
+    pthread_cond_wait(&cond->cond, &mutex->mutex);
+#endif
+}
+
+void imd_cond_signal(ImdCond* cond) {
+#ifdef _WIN32
+    WakeConditionVariable(&cond->cv);
+#else
+    pthread_cond_signal(&cond->cond);
+#endif
+}
+
+void imd_cond_broadcast(ImdCond* cond) {
+#ifdef _WIN32
+    WakeAllConditionVariable(&cond->cv);
+#else
+    pthread_cond_broadcast(&cond->cond);
+#endif
+}
+
+#ifdef _WIN32
+static BOOL CALLBACK once_trampoline(PINIT_ONCE once, PVOID param, PVOID* context) {
+    (void)once;
+    (void)context;
+    (*(ImdOnceFn*)param)();
+    return TRUE;
+}
+#endif
+
+void imd_once(ImdOnce* once, ImdOnceFn fn) {
+#ifdef _WIN32
+    InitOnceExecuteOnce(&once->once, once_trampoline, &fn, NULL);
+#else
+    pthread_once(&once->once, fn);
+#endif
+}
+
+/* --- Parallel Loop --- */
+
+/* Shared state of one imd_parallel_for() call */
+typedef struct {
+    ImdMutex lock;              /* Protects next */
+    size_t next;                /* Next index to hand out */
+    size_t count;
+    ImdParallelFn fn;
+    void* ctx;
+} ImdParallelLoop;
+
+static void parallel_worker(void* arg) {
+    ImdParallelLoop* loop = (ImdParallelLoop*)arg;
+
+    for (;;) {
+        size_t index;
+        imd_mutex_lock(&loop->lock);
+        index = loop->next;
+        if (index < loop->count) loop->next++;
+        imd_mutex_unlock(&loop->lock);
+        if (index >= loop->count) break;
+        loop->fn(index, loop->ctx);
+    }
+}
+
+int imd_parallel_for(size_t count, unsigned num_threads, ImdParallelFn fn, void* ctx) {
+    ImdThread threads[LIBIMD_MAX_WORKER_THREADS];
+    ImdParallelLoop loop;
+    unsigned started = 0;
+
+    if (!fn) return IMD_ERR_INVALID_ARG;
+    if (num_threads == 0) num_threads = imd_cpu_count();
+    if (num_threads > LIBIMD_MAX_WORKER_THREADS) num_threads = LIBIMD_MAX_WORKER_THREADS;
+    if ((size_t)num_threads > count) num_threads = (unsigned)count;
+
+    if (num_threads <= 1 || imd_mutex_init(&loop.lock) != 0) {
+        for (size_t i = 0; i < count; ++i) fn(i, ctx);
+        return 0;
+    }
+
+    loop.next = 0;
+    loop.count = count;
+    loop.fn = fn;
+    loop.ctx = ctx;
+
+    /* The calling thread is one of the workers */
+    while (started < num_threads - 1 && imd_thread_create(&threads[started], parallel_worker, &loop) == 0) {
+        started++;
+    }
+    parallel_worker(&loop);
+    for (unsigned t = 0; t < started; ++t) {
+        imd_thread_join(&threads[t]);
+    }
+
+    imd_mutex_destroy(&loop.lock);
+    return 0;
+}
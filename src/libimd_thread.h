@@ -0,0 +1,147 @@
+/*
+ * Portable Threading Primitives for libimd.
+ * Threads, mutexes, reader-writer locks, condition variables and a parallel
+ * loop helper used by the libraries to spread independent track work over cores.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+#ifndef LIBIMD_THREAD_H
+#define LIBIMD_THREAD_H
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else /* Assume POSIX */
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Upper limit on the threads a single parallel operation starts */
+#define LIBIMD_MAX_WORKER_THREADS 64
+
+/* --- Types --- */
+
+#ifdef _WIN32
+typedef struct { HANDLE handle; } ImdThread;
+typedef struct { CRITICAL_SECTION cs; } ImdMutex;
+typedef struct { CONDITION_VARIABLE cv; } ImdCond;
+typedef struct { SRWLOCK lock; } ImdRwLock;
+#else
+typedef struct { pthread_t handle; } ImdThread;
+typedef struct { pthread_mutex_t mutex; } ImdMutex;
+typedef struct { pthread_cond_t cond; } ImdCond;
+typedef struct { pthread_rwlock_t lock; } ImdRwLock;
+#endif
+
+#ifdef _WIN32
+typedef struct { INIT_ONCE once; } ImdOnce;
+#define IMD_ONCE_INIT { INIT_ONCE_STATIC_INIT }
+#else
+typedef struct { pthread_once_t once; } ImdOnce;
+#define IMD_ONCE_INIT { PTHREAD_ONCE_INIT }
+#endif
+
+/* One-time initializer run by imd_once() */
+typedef void (*ImdOnceFn)(void);
+
+/* Thread entry point */
+typedef void (*ImdThreadFn)(void* arg);
+
+/* Body of a parallel loop, called once for each index in [0, count) */
+typedef void (*ImdParallelFn)(size_t index, void* ctx);
+
+/* --- Threads --- */
+
+/**
+ * Starts a new thread running fn(arg).
+ * @param thread Pointer to the thread handle to initialize. Must not be NULL.
+ * @param fn Thread entry point. Must not be NULL.
+ * @param arg Argument passed to fn.
+ * @return 0 on success, IMD_ERR_ALLOC if the thread could not be created.
+ */
+int imd_thread_create(ImdThread* thread, ImdThreadFn fn, void* arg);
+
+/**
+ * Waits for a thread started with imd_thread_create() to finish and releases it.
+ * @param thread Pointer to the thread handle.
+ */
+void imd_thread_join(ImdThread* thread);
+
+/**
+ * Returns the number of processors available to the process (at least 1).
+ */
+unsigned imd_cpu_count(void);
+
+/* --- Mutexes, Reader-Writer Locks and Condition Variables --- */
+
+/**
+ * Initializes a (non-recursive) mutex.
+ * @return 0 on success, IMD_ERR_ALLOC on failure.
+ */
+int imd_mutex_init(ImdMutex* mutex);
+void imd_mutex_destroy(ImdMutex* mutex);
+void imd_mutex_lock(ImdMutex* mutex);
+void imd_mutex_unlock(ImdMutex* mutex);
+
+/**
+ * Initializes a reader-writer lock: any number of shared holders, or one exclusive holder.
+ * The lock is not recursive; a thread must not take it again while holding it, even shared.
+ * @return 0 on success, IMD_ERR_ALLOC on failure.
+ */
+int imd_rwlock_init(ImdRwLock* lock);
+void imd_rwlock_destroy(ImdRwLock* lock);
+void imd_rwlock_lock_shared(ImdRwLock* lock);
+void imd_rwlock_unlock_shared(ImdRwLock* lock);
+void imd_rwlock_lock_exclusive(ImdRwLock* lock);
+void imd_rwlock_unlock_exclusive(ImdRwLock* lock);
+
+/**
+ * Initializes a condition variable.
+ * @return 0 on success, IMD_ERR_ALLOC on failure.
+ */
+int imd_cond_init(ImdCond* cond);
+void imd_cond_destroy(ImdCond* cond);
+
+/**
+ * Atomically releases mutex and waits for cond to be signalled; the mutex is
+ * held again on return. Spurious wake-ups are possible, so callers re-check
+ * their condition in a loop.
+ */
+void imd_cond_wait(ImdCond* cond, ImdMutex* mutex);
+void imd_cond_signal(ImdCond* cond);
+void imd_cond_broadcast(ImdCond* cond);
+
+/**
+ * Runs fn exactly once for a given ImdOnce (initialized with IMD_ONCE_INIT), however
+ * many threads call this; every caller returns only after fn has completed.
+ */
+void imd_once(ImdOnce* once, ImdOnceFn fn);
+
+/* --- Parallel Loop --- */
+
+/**
+ * Calls fn(index, ctx) for every index in [0, count), spread over up to
+ * num_threads threads including the calling one. Indices are handed out one at
+ * a time, so uneven work per index balances itself. Runs serially when
+ * num_threads <= 1, count <= 1, or no extra thread can be started.
+ * fn must be safe to call concurrently for different indices.
+ * @param count Number of indices.
+ * @param num_threads Maximum number of threads to use (0 = imd_cpu_count()).
+ * @param fn Loop body. Must not be NULL.
+ * @param ctx Context passed to fn.
+ * @return 0 on success, IMD_ERR_INVALID_ARG if fn is NULL.
+ */
+int imd_parallel_for(size_t count, unsigned num_threads, ImdParallelFn fn, void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBIMD_THREAD_H */
@@ -7,6 +7,9 @@
  * Copyright (c) 2025, Howard M. Harte
  */
 
+/* Define _DEFAULT_SOURCE to enable POSIX features like pthread_rwlock_t */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,10 +17,13 @@
 #include <ctype.h>
 
 #include "libimd.h"
+#include "libimd_thread.h"
 
 /* --- Static Global Variables for Reporting State --- */
 static int g_quiet_mode = 0;
 static int g_verbose_mode = 0;
+static ImdReportSinkFn g_sink = NULL;   /* Sink of threads without a context, NULL for stdio */
+static void* g_sink_user_data = NULL;
 
 /* --- Verbosity/Quiet Control Implementation --- */
 
@@ -26,50 +32,346 @@ void imd_set_verbosity(int quiet, int verbose) {
     g_verbose_mode = verbose;
 }
 
-/* --- Reporting Function Implementation --- */
+/* --- Report Contexts --- */
 
-void imd_report(ImdReportLevel level, const char* format, ...) {
-    va_list args;
-    FILE* output_stream = stderr; /* Default to stderr for errors/warnings */
-    const char* prefix = "";
-    int print_message = 0;
+static ImdOnce context_once = IMD_ONCE_INIT;
+static int context_ready;       /* The thread key exists */
+
+#ifdef _WIN32
+static DWORD context_key = TLS_OUT_OF_INDEXES;
+
+static void context_init(void) {
+    context_key = TlsAlloc();
+    context_ready = (context_key != TLS_OUT_OF_INDEXES);
+}
+
+static ImdReportContext* context_get(void) {
+    return (ImdReportContext*)TlsGetValue(context_key);
+}
+
+static void context_set(ImdReportContext* context) {
+    TlsSetValue(context_key, context);
+}
+#else
+static pthread_key_t context_key;
+
+static void context_init(void) {
+    context_ready = (pthread_key_create(&context_key, NULL) == 0);
+}
+
+static ImdReportContext* context_get(void) {
+    return (ImdReportContext*)pthread_getspecific(context_key);
+}
+
+static void context_set(ImdReportContext* context) {
+    pthread_setspecific(context_key, context);
+}
+#endif
+
+/* Context of the calling thread, NULL if it uses the process-wide settings */
+static ImdReportContext* thread_context(void) {
+    imd_once(&context_once, context_init);
+    return context_ready ? context_get() : NULL;
+}
+
+void imd_report_set_sink(ImdReportSinkFn sink, void* user_data) {
+    g_sink = sink;
+    g_sink_user_data = user_data;
+}
+
+ImdReportContext* imd_report_set_context(ImdReportContext* context) {
+    ImdReportContext* previous = thread_context();
+
+    if (context_ready) context_set(context);
+    return previous;
+}
+
+/* Levels outside the enum are reported as "Unknown Msg" and filtered like warnings */
+static int level_passes(const ImdReportContext* context, ImdReportLevel level) {
+    int known = (level >= IMD_REPORT_LEVEL_DEBUG && level <= IMD_REPORT_LEVEL_ERROR);
+
+    if (context) {
+        return (known ? level : IMD_REPORT_LEVEL_WARNING) >= context->min_level;
+    }
+    switch (level) {
+        case IMD_REPORT_LEVEL_DEBUG:
+        case IMD_REPORT_LEVEL_INFO:
+            return g_verbose_mode;
+        case IMD_REPORT_LEVEL_ERROR:
+            /* Errors are always printed, regardless of quiet/verbose */
+            return 1;
+        default:
+            return !g_quiet_mode;
+    }
+}
+
+int imd_report_enabled(ImdReportLevel level) {
+    return level_passes(thread_context(), level);
+}
 
+/* Prefix and stream of a message printed by the default output */
+static const char* default_prefix(ImdReportLevel level, FILE** stream_out) {
+    *stream_out = stderr; /* Default to stderr for errors/warnings */
     switch (level) {
         case IMD_REPORT_LEVEL_DEBUG:
-            if (g_verbose_mode) {
-                prefix = "Debug: ";
-                output_stream = stdout; /* Debug often goes to stdout */
-                print_message = 1;
-            }
-            break;
+            *stream_out = stdout; /* Debug often goes to stdout */
+            return "Debug: ";
         case IMD_REPORT_LEVEL_INFO:
-            if (g_verbose_mode) {
-                prefix = ""; /* Info often doesn't need a prefix */
-                output_stream = stdout;
-                print_message = 1;
-            }
-            break;
+            *stream_out = stdout;
+            return ""; /* Info often doesn't need a prefix */
         case IMD_REPORT_LEVEL_WARNING:
-            if (!g_quiet_mode) {
-                prefix = "Warning: ";
-                print_message = 1;
-            }
-            break;
+            return "Warning: ";
         case IMD_REPORT_LEVEL_ERROR:
-            /* Errors are always printed, regardless of quiet/verbose */
-            prefix = "Error: ";
-            print_message = 1;
-            break;
+            return "Error: ";
         default:
-            /* Unknown level, treat as warning? Or error? */
-            if (!g_quiet_mode) {
-                prefix = "Unknown Msg: ";
-                print_message = 1;
+            return "Unknown Msg: ";
+    }
+}
+
+/* --- Report Queue --- */
+
+/*
+ * Sequentially consistent access to the ring positions, slot sequence numbers and the
+ * sleeping flag: a producer that publishes a message and then finds the background
+ * thread awake is sure to have its message seen. Without atomic operations there is
+ * no queue (imd_report_queue_start fails).
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define RING_ATOMICS 1
+#define RING_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define RING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define RING_CAS(p, expected, desired) \
+    __atomic_compare_exchange_n((p), &(expected), (desired), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define RING_INC(p) ((void)__atomic_fetch_add((p), 1, __ATOMIC_RELAXED))
+#elif defined(_WIN32)
+#define RING_ATOMICS 1
+#define RING_LOAD(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+#define RING_STORE(p, v) ((void)InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v)))
+/* Like the GCC builtin, stores the current value in expected on failure */
+#define RING_CAS(p, expected, desired) \
+    ring_cas_win32((volatile LONG64*)(p), &(expected), (desired))
+#define RING_INC(p) ((void)InterlockedIncrement64((volatile LONG64*)(p)))
+static int ring_cas_win32(volatile LONG64* p, uint64_t* expected, uint64_t desired) {
+    uint64_t seen = (uint64_t)InterlockedCompareExchange64(p, (LONG64)desired, (LONG64)*expected);
+    if (seen == *expected) return 1;
+    *expected = seen;
+    return 0;
+}
+#else
+#define RING_ATOMICS 0
+#endif
+
+/* One message in the ring */
+typedef struct {
+    uint64_t seq;               /* Position the slot is free for, or that position + 1 once filled */
+    ImdReportLevel level;
+    char text[IMD_REPORT_MESSAGE_MAX];
+} ImdReportSlot;
+
+struct ImdReportQueue {
+    ImdReportSlot* slots;
+    uint64_t mask;              /* Slot count - 1 (a power of two) */
+    uint64_t enqueue_pos;       /* Next position to fill, claimed by producers */
+    uint64_t dequeue_pos;       /* Next position to pass on; background thread only */
+    uint64_t dropped;           /* Messages that found the ring full */
+    ImdReportSinkFn sink;       /* Downstream sink, NULL for stdio */
+    void* user_data;
+    ImdThread thread;
+    ImdMutex lock;              /* Protects the waits of the background thread */
+    ImdCond wake;               /* Signalled when a message arrives while the thread sleeps */
+    uint64_t sleeping;          /* Non-zero while the background thread waits, or is about to */
+    int stopping;               /* imd_report_queue_stop has been called; under lock */
+};
+
+#if RING_ATOMICS
+/* Passes on every filled slot in order; returns the number of messages */
+static size_t drain_ring(ImdReportQueue* queue) {
+    size_t drained = 0;
+
+    for (;;) {
+        ImdReportSlot* slot = &queue->slots[queue->dequeue_pos & queue->mask];
+        if (RING_LOAD(&slot->seq) != queue->dequeue_pos + 1) break; /* Empty, or still being filled */
+
+        if (queue->sink) {
+            queue->sink(slot->level, slot->text, queue->user_data);
+        }
+        else {
+            FILE* stream;
+            const char* prefix = default_prefix(slot->level, &stream);
+            fprintf(stream, "%s%s\n", prefix, slot->text);
+        }
+        RING_STORE(&slot->seq, queue->dequeue_pos + queue->mask + 1);
+        queue->dequeue_pos++;
+        drained++;
+    }
+    if (drained && !queue->sink) {
+        /* One flush per batch rather than per message */
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return drained;
+}
+
+static void queue_thread(void* arg) {
+    ImdReportQueue* queue = (ImdReportQueue*)arg;
+
+    for (;;) {
+        int stopping;
+
+        if (drain_ring(queue) > 0) continue;
+
+        imd_mutex_lock(&queue->lock);
+        RING_STORE(&queue->sleeping, 1); /* From here on, a new message is either seen below or signalled */
+        stopping = queue->stopping;
+        {
+            ImdReportSlot* slot = &queue->slots[queue->dequeue_pos & queue->mask];
+            if (!stopping && RING_LOAD(&slot->seq) != queue->dequeue_pos + 1) {
+                imd_cond_wait(&queue->wake, &queue->lock);
             }
+        }
+        RING_STORE(&queue->sleeping, 0);
+        imd_mutex_unlock(&queue->lock);
+
+        if (stopping) {
+            drain_ring(queue); /* Messages queued before the stop */
             break;
+        }
     }
+}
+#endif
+
+int imd_report_queue_start(size_t capacity, ImdReportSinkFn sink, void* user_data, ImdReportQueue** queue_out) {
+#if RING_ATOMICS
+    ImdReportQueue* queue;
+    size_t slots = 2;
+
+    if (!queue_out || capacity > ((size_t)1 << (sizeof(size_t) * 8 - 2))) return IMD_ERR_INVALID_ARG;
+    *queue_out = NULL;
+    while (slots < capacity) slots *= 2;
+
+    queue = (ImdReportQueue*)imd_calloc(1, sizeof(ImdReportQueue));
+    if (!queue) return IMD_ERR_ALLOC;
+    queue->slots = (ImdReportSlot*)imd_malloc(slots * sizeof(ImdReportSlot));
+    if (!queue->slots) {
+        imd_free(queue);
+        return IMD_ERR_ALLOC;
+    }
+    for (size_t i = 0; i < slots; ++i) queue->slots[i].seq = i;
+    queue->mask = slots - 1;
+    queue->sink = sink;
+    queue->user_data = user_data;
+
+    if (imd_mutex_init(&queue->lock) != 0) {
+        imd_free(queue->slots);
+        imd_free(queue);
+        return IMD_ERR_ALLOC;
+    }
+    if (imd_cond_init(&queue->wake) != 0 || imd_thread_create(&queue->thread, queue_thread, queue) != 0) {
+        imd_cond_destroy(&queue->wake);
+        imd_mutex_destroy(&queue->lock);
+        imd_free(queue->slots);
+        imd_free(queue);
+        return IMD_ERR_ALLOC;
+    }
+    *queue_out = queue;
+    return 0;
+#else
+    (void)capacity;
+    (void)sink;
+    (void)user_data;
+    if (queue_out) *queue_out = NULL;
+    return IMD_ERR_INVALID_ARG;
+#endif
+}
 
-    if (print_message) {
+void imd_report_queue_sink(ImdReportLevel level, const char* message, void* user_data) {
+#if RING_ATOMICS
+    ImdReportQueue* queue = (ImdReportQueue*)user_data;
+    ImdReportSlot* slot;
+    uint64_t pos;
+
+    if (!queue || !message) return;
+    pos = RING_LOAD(&queue->enqueue_pos);
+    for (;;) {
+        uint64_t seq;
+        slot = &queue->slots[pos & queue->mask];
+        seq = RING_LOAD(&slot->seq);
+        if (seq == pos) {
+            if (RING_CAS(&queue->enqueue_pos, pos, pos + 1)) break; /* Slot claimed */
+        }
+        else if (seq < pos) {
+            RING_INC(&queue->dropped); /* Full: the slot still holds a message from the last lap */
+            return;
+        }
+        else {
+            pos = RING_LOAD(&queue->enqueue_pos); /* Another thread claimed it first */
+        }
+    }
+
+    slot->level = level;
+    strncpy(slot->text, message, sizeof(slot->text) - 1);
+    slot->text[sizeof(slot->text) - 1] = '\0';
+    RING_STORE(&slot->seq, pos + 1);
+
+    if (RING_LOAD(&queue->sleeping)) {
+        /* Only taken when the background thread has run out of messages */
+        imd_mutex_lock(&queue->lock);
+        imd_cond_signal(&queue->wake);
+        imd_mutex_unlock(&queue->lock);
+    }
+#else
+    (void)level;
+    (void)message;
+    (void)user_data;
+#endif
+}
+
+uint64_t imd_report_queue_dropped(ImdReportQueue* queue) {
+#if RING_ATOMICS
+    return queue ? RING_LOAD(&queue->dropped) : 0;
+#else
+    (void)queue;
+    return 0;
+#endif
+}
+
+void imd_report_queue_stop(ImdReportQueue* queue) {
+    if (!queue) return;
+#if RING_ATOMICS
+    imd_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    imd_cond_signal(&queue->wake);
+    imd_mutex_unlock(&queue->lock);
+    imd_thread_join(&queue->thread);
+
+    imd_cond_destroy(&queue->wake);
+    imd_mutex_destroy(&queue->lock);
+    imd_free(queue->slots);
+    imd_free(queue);
+#endif
+}
+
+/* --- Reporting Function Implementation --- */
+
+void imd_report(ImdReportLevel level, const char* format, ...) {
+    const ImdReportContext* context = thread_context();
+    ImdReportSinkFn sink = context ? context->sink : g_sink;
+    void* user_data = context ? context->user_data : g_sink_user_data;
+    va_list args;
+
+    /* Filtered messages are dropped before any formatting */
+    if (!level_passes(context, level)) return;
+
+    if (sink) {
+        char message[IMD_REPORT_MESSAGE_MAX];
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+        sink(level, message, user_data);
+    }
+    else {
+        FILE* output_stream;
+        const char* prefix = default_prefix(level, &output_stream);
         fprintf(output_stream, "%s", prefix);
         va_start(args, format);
         vfprintf(output_stream, format, args);
@@ -11,6 +11,7 @@
 #define LIBIMD_UTILS_H
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -36,13 +37,100 @@ typedef enum {
  */
 void imd_set_verbosity(int quiet, int verbose);
 
+/* --- Report Sinks and Contexts --- */
+
+/* Longest message handed to a sink, including the terminating NUL; longer ones are truncated */
+#define IMD_REPORT_MESSAGE_MAX 512
+
+/**
+ * Receives each reported message that passes the level filter.
+ * @param level The reporting level of the message.
+ * @param message The formatted message, without level prefix or trailing newline.
+ * @param user_data The user_data pointer of the context.
+ */
+typedef void (*ImdReportSinkFn)(ImdReportLevel level, const char* message, void* user_data);
+
+/*
+ * Where the messages of a thread go, see imd_report_set_context(). Owned by the caller,
+ * and may be shared by several threads. Messages below min_level are dropped before
+ * they are formatted.
+ */
+typedef struct {
+    ImdReportLevel min_level;   /* Lowest level reported */
+    ImdReportSinkFn sink;       /* NULL for the default output to stdout/stderr */
+    void* user_data;            /* Passed through to sink */
+} ImdReportContext;
+
+/**
+ * @brief Sends the messages of threads without a context of their own to a sink.
+ * The quiet/verbose filter of imd_set_verbosity() still applies. Set before other
+ * threads start reporting.
+ * @param sink Sink to receive the messages, or NULL for the default stdout/stderr output.
+ * @param user_data Passed through to sink.
+ */
+void imd_report_set_sink(ImdReportSinkFn sink, void* user_data);
+
+/**
+ * @brief Sets the context used by imd_report() on the calling thread.
+ * @param context Context to use, or NULL to return to the process-wide settings.
+ *        Must stay valid for as long as it is set.
+ * @return The previous context of the thread, or NULL if it had none.
+ */
+ImdReportContext* imd_report_set_context(ImdReportContext* context);
+
+/**
+ * @brief Returns non-zero if imd_report() on the calling thread would pass a message of
+ * this level on, so callers can skip gathering the arguments of a dropped message.
+ */
+int imd_report_enabled(ImdReportLevel level);
+
+/* --- Report Queue --- */
+
+/*
+ * A report queue takes messages off the reporting threads: its sink,
+ * imd_report_queue_sink(), copies each message into a fixed ring of slots without
+ * taking a lock, and a background thread passes them on to the downstream sink.
+ * When the ring is full, messages are dropped and counted rather than waited for.
+ */
+typedef struct ImdReportQueue ImdReportQueue; /* Opaque structure */
+
+/**
+ * @brief Creates a report queue and starts its background thread.
+ * @param capacity Number of messages the ring holds (rounded up to a power of two, at least 2).
+ * @param sink Downstream sink, called on the background thread only, or NULL for
+ *        the default stdout/stderr output.
+ * @param user_data Passed through to sink.
+ * @param queue_out Pointer to store the queue.
+ * @return 0 on success, IMD_ERR_INVALID_ARG on invalid arguments or if the compiler provides
+ *         no atomic operations, IMD_ERR_ALLOC if the ring or the thread cannot be created.
+ */
+int imd_report_queue_start(size_t capacity, ImdReportSinkFn sink, void* user_data, ImdReportQueue** queue_out);
+
+/**
+ * @brief Sink that queues a message; use it with the queue as user_data.
+ * Never blocks on the background thread; safe to call from any number of threads.
+ */
+void imd_report_queue_sink(ImdReportLevel level, const char* message, void* user_data);
+
+/**
+ * @brief Returns the number of messages dropped because the ring was full.
+ */
+uint64_t imd_report_queue_dropped(ImdReportQueue* queue);
+
+/**
+ * @brief Passes on the queued messages, stops the background thread and frees the queue.
+ * No thread may report to the queue any more. Does nothing if queue is NULL.
+ */
+void imd_report_queue_stop(ImdReportQueue* queue);
+
 /* --- Reporting Functions --- */
 
 /**
  * @brief Reports a message (error, warning, info, debug) based on the level
  * and current verbosity settings. Uses printf-style formatting.
- * Error messages are printed to stderr, others typically to stdout or stderr
- * depending on the level.
+ * The message goes to the calling thread's context if it has one, otherwise to the
+ * sink of imd_report_set_sink(). By default, error messages are printed to stderr,
+ * others typically to stdout or stderr depending on the level.
  * @param level The reporting level (IMD_REPORT_LEVEL_*).
  * @param format The printf-style format string.
  * @param ... Variable arguments for the format string.
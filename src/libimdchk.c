@@ -8,16 +8,33 @@
  * Copyright (c) 2025, Howard M. Harte
  */
 
+ /* Define _DEFAULT_SOURCE to enable POSIX features like pthread_rwlock_t */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <limits.h>
 
 /* Define to enable debug printf statements */
 //#define DEBUG_LIBIMDCHK
 
 #include "libimdchk.h" /* Include our public header */
+#include "libimd_stats.h"
+#include "libimd_thread.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <sys/stat.h>
+#else /* Assume POSIX */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 /* --- Debug Macro --- */
 #ifdef DEBUG_LIBIMDCHK
@@ -111,77 +128,70 @@ static int determine_interleave_internal(const uint8_t* smap, int num_sectors) {
 }
 
 
-/* --- Public Function Implementation --- */
-
-int imdchk_check_file(const char* filename, const ImdChkOptions* options, ImdChkResults* results) {
-    FILE* f_imd = NULL;
-    ImdHeaderInfo header_info; /* Use struct from libimd.h */
-    ImdTrackInfo track;        /* Use struct from libimd.h */
-    int result;
-    uint8_t last_cyl = 0;
-    uint8_t last_head = 1;     /* Initialize to invalid state */
-    int first_track = 1;
-
-    if (!filename || !options || !results) {
-        return -1; /* Invalid arguments */
-    }
-
-    /* Initialize results structure */
+/* Clears the results to the state before any track has been read */
+static void init_results_internal(ImdChkResults* results) {
     memset(results, 0, sizeof(ImdChkResults));
     results->max_cyl_side0 = -1;
     results->max_cyl_side1 = -1;
     results->max_head_seen = -1;
     results->detected_interleave = -1;
+}
 
-    f_imd = fopen(filename, "rb");
-    if (!f_imd) {
-        /* Cannot report failure through results struct, return error */
-        return -1;
-    }
+/*
+ * Checks an image held in memory. This is the parsing core shared by the
+ * buffer, stream and file variants; it uses no stdio.
+ */
+static int check_image_internal(const uint8_t* buf, size_t len, const ImdChkOptions* options, ImdChkResults* results) {
+    ImdTrackInfo track;        /* Use struct from libimd.h */
+    const uint8_t* marker;
+    size_t pos = 0;
+    size_t consumed = 0;
+    int result;
+    uint8_t last_cyl = 0;
+    uint8_t last_head = 1;     /* Initialize to invalid state */
+    int first_track = 1;
 
     /* Read Header using libimd */
-    result = imd_read_file_header(f_imd, &header_info, NULL, 0);
+    result = imd_read_file_header_buffer(buf, len, NULL, &consumed);
     if (result != 0) {
         results->check_failures_mask |= CHECK_BIT_HEADER;
         if (options->error_mask & CHECK_BIT_HEADER) {
-            fclose(f_imd);
             return -1; /* Treat as critical file error if required by mask */
         }
+        /* Skip the line anyway, as fgets() would: up to '\n' or LIBIMD_MAX_HEADER_LINE - 1 bytes */
+        while (consumed < len && consumed < LIBIMD_MAX_HEADER_LINE - 1) {
+            if (buf[consumed++] == '\n') break;
+        }
     }
+    pos = consumed;
 
-    /* Skip Comment Block using libimd */
-    result = imd_skip_comment_block(f_imd);
-    if (result != 0) {
+    /* Skip Comment Block */
+    marker = (pos < len) ? (const uint8_t*)memchr(buf + pos, LIBIMD_COMMENT_EOF_MARKER, len - pos) : NULL;
+    if (!marker) {
         results->check_failures_mask |= CHECK_BIT_COMMENT_TERM;
         if (options->error_mask & CHECK_BIT_COMMENT_TERM) {
-            fclose(f_imd);
             return -1; /* Treat as critical file error if required by mask */
         }
+        pos = len;
+    }
+    else {
+        pos = (size_t)(marker - buf) + 1;
     }
 
     /* Loop reading tracks using libimd */
     while (1) {
-        long track_start_pos = ftell(f_imd);
-        if (track_start_pos < 0) {
-            results->check_failures_mask |= CHECK_BIT_FTELL;
-            if (options->error_mask & CHECK_BIT_FTELL) break; /* Stop loop if fatal */
-            else continue; /* Otherwise try next track? Better to break. */
-            break;
-        }
+        result = imd_read_track_header_and_flags_buffer(buf + pos, len - pos, &track, &consumed);
 
-        memset(&track, 0, sizeof(ImdTrackInfo)); /* Clear track struct */
-        result = imd_read_track_header_and_flags(f_imd, &track);
-
-        if (result == 0) break; /* Clean EOF */
+        if (result == 0) break; /* Clean end of image */
         if (result < 0) {
+            /* The record length is unknown, so there is no next track to resynchronize on */
             results->check_failures_mask |= CHECK_BIT_TRACK_READ;
-            if (options->error_mask & CHECK_BIT_TRACK_READ) break; /* Stop processing */
-            else continue; /* Skip this track if non-fatal */
+            break;
         }
+        pos += consumed;
 
         /* Track read successful */
         results->track_read_count++;
-
         /* Apply Command Line Constraints */
         int constraint_failed = 0;
         if (options->max_allowed_cyl != -1 && track.cyl > options->max_allowed_cyl) {
@@ -229,8 +239,6 @@ int imdchk_check_file(const char* filename, const ImdChkOptions* options, ImdChk
 
     } /* End while loop */
 
-    fclose(f_imd);
-
     /* Final check for Diff Max Cyl */
     if (results->max_head_seen > 0) {
         if (results->max_cyl_side0 != -1 && results->max_cyl_side1 != -1 && results->max_cyl_side0 != results->max_cyl_side1) {
@@ -238,5 +246,1148 @@ int imdchk_check_file(const char* filename, const ImdChkOptions* options, ImdChk
         }
     }
 
-    return 0; /* Indicates file was processed */
+    return 0; /* Indicates the image was processed */
+}
+
+/* Memory a stream is read into; reused across images by a batch worker */
+typedef struct {
+    uint8_t* bytes;
+    size_t capacity;
+} ImdChkBuffer;
+
+/*
+ * Reads a stream from its current position to EOF into buffer, growing it as
+ * needed. Returns the number of bytes read, or -1 on read or allocation error.
+ */
+static long long read_stream_internal(FILE* f, ImdChkBuffer* buffer) {
+    size_t len = 0;
+    size_t wanted = 0;
+    long start = ftell(f);
+
+    /* Size seekable streams up front, so a file is read with a single fread */
+    if (start >= 0 && imd_stat_fseek(f, 0, SEEK_END) == 0) {
+        long end = ftell(f);
+        if (end > start) wanted = (size_t)(end - start);
+        if (imd_stat_fseek(f, start, SEEK_SET) != 0) return -1;
+    }
+    wanted++; /* Room to notice EOF without another allocation */
+
+    for (;;) {
+        if (buffer->capacity - len < wanted) {
+            size_t new_capacity = len + wanted;
+            uint8_t* new_bytes = (uint8_t*)imd_realloc(buffer->bytes, new_capacity);
+            if (!new_bytes) return -1;
+            buffer->bytes = new_bytes;
+            buffer->capacity = new_capacity;
+        }
+        len += imd_stat_fread(buffer->bytes + len, 1, buffer->capacity - len, f);
+        if (len < buffer->capacity) break;
+        wanted = (buffer->capacity < 65536) ? 65536 : buffer->capacity; /* Double for unsized streams */
+    }
+    if (ferror(f)) return -1;
+    return (long long)len;
+}
+
+/* Checks the rest of a stream, reading it into buffer */
+static int check_stream_internal(FILE* f, const ImdChkOptions* options, ImdChkResults* results, ImdChkBuffer* buffer) {
+    long long len = read_stream_internal(f, buffer);
+    if (len < 0) {
+        results->check_failures_mask |= CHECK_BIT_TRACK_READ;
+        return -1; /* Critical read error */
+    }
+    return check_image_internal(buffer->bytes, (size_t)len, options, results);
+}
+
+/* Opens and checks one file, reading it into buffer */
+static int check_file_internal(const char* filename, const ImdChkOptions* options, ImdChkResults* results, ImdChkBuffer* buffer) {
+    FILE* f_imd = fopen(filename, "rb");
+    int result;
+
+    if (!f_imd) {
+        /* Cannot report failure through results struct, return error */
+        return -1;
+    }
+    setvbuf(f_imd, NULL, _IONBF, 0); /* The file is read straight into buffer */
+    result = check_stream_internal(f_imd, options, results, buffer);
+    fclose(f_imd);
+    return result;
+}
+
+
+/* --- Public Function Implementation --- */
+
+int imdchk_check_file(const char* filename, const ImdChkOptions* options, ImdChkResults* results) {
+    ImdChkBuffer buffer = { NULL, 0 };
+    int result;
+
+    if (!filename || !options || !results) {
+        return -1; /* Invalid arguments */
+    }
+    init_results_internal(results);
+    result = check_file_internal(filename, options, results, &buffer);
+    imd_free(buffer.bytes);
+    return result;
+}
+
+int imdchk_check_stream(FILE* f, const ImdChkOptions* options, ImdChkResults* results) {
+    ImdChkBuffer buffer = { NULL, 0 };
+    int result;
+
+    if (!f || !options || !results) {
+        return -1; /* Invalid arguments */
+    }
+    init_results_internal(results);
+    result = check_stream_internal(f, options, results, &buffer);
+    imd_free(buffer.bytes);
+    return result;
+}
+
+int imdchk_check_buffer(const uint8_t* buf, size_t len, const ImdChkOptions* options, ImdChkResults* results) {
+    if ((!buf && len > 0) || !options || !results) {
+        return -1; /* Invalid arguments */
+    }
+    init_results_internal(results);
+    return check_image_internal(buf, len, options, results);
+}
+
+/* --- Result Cache --- */
+
+/*
+ * Cache file layout, all integers little-endian so the file can be mapped and read in place:
+ *   Header (IMDCHK_CACHE_HEADER_SIZE bytes): magic, format, record size, record count,
+ *     string table size, then the library version the results were produced by.
+ *   Records (IMDCHK_CACHE_RECORD_SIZE bytes each), sorted by path hash.
+ *   String table: the paths of the records, not terminated.
+ */
+#define IMDCHK_CACHE_MAGIC        "IMDCHKC\x1a"
+#define IMDCHK_CACHE_FORMAT       1
+#define IMDCHK_CACHE_HEADER_SIZE  64
+#define IMDCHK_CACHE_VERSION_OFF  24   /* Library version, NUL padded to the end of the header */
+#define IMDCHK_CACHE_RECORD_SIZE  144
+#define IMDCHK_CACHE_INITIAL_BUCKETS 1024
+
+#ifndef GIT_VERSION_STR
+#define GIT_VERSION_STR "unknown"
+#endif
+/* Results of another library build may differ: a cache written by one is ignored by the others */
+#define IMDCHK_CACHE_LIBRARY_VERSION "libimdchk " GIT_VERSION_STR
+
+/* States of a mapped record */
+#define MAP_RECORD_USED     0x01 /* Looked up since the cache was opened */
+#define MAP_RECORD_REPLACED 0x02 /* Superseded by an entry in the table */
+
+/* Size and modification time of a file, as compared on a lookup */
+typedef struct {
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+} ImdChkFileStamp;
+
+/* One cached check, decoded from a record or added since the cache was opened */
+typedef struct ImdChkCacheEntry {
+    uint64_t path_hash;         /* imd_hash_bytes of the path */
+    const char* path;           /* Not terminated: path_len bytes */
+    size_t path_len;
+    ImdChkFileStamp stamp;      /* File the results belong to */
+    uint64_t content_hash;      /* imd_hash_bytes of the file contents */
+    ImdChkOptions options;      /* Options the file was checked with */
+    int status;                 /* Return value of the check */
+    ImdChkResults results;
+    size_t map_index;           /* Record the entry was decoded from, SIZE_MAX if none */
+    unsigned map_generation;    /* Mapping map_index refers to */
+    struct ImdChkCacheEntry* next; /* Next entry of the same bucket */
+} ImdChkCacheEntry;
+
+struct ImdChkCache {
+    char* path;                 /* Cache file */
+    unsigned flags;             /* IMDCHK_CACHE_* */
+    ImdMutex lock;              /* Protects everything below */
+
+    /* Mapped cache file, NULL if it was missing, invalid or from another library build */
+    const uint8_t* map_base;
+    size_t map_size;
+    size_t map_count;           /* Records in the mapping */
+    const uint8_t* map_strings; /* String table */
+    size_t map_strings_size;
+    uint8_t* map_state;         /* MAP_RECORD_* of each record */
+    size_t map_replaced;        /* Records marked MAP_RECORD_REPLACED */
+    unsigned map_generation;    /* Bumped whenever the mapping goes away: record indices go stale */
+
+    /* Entries added or updated since the file was mapped */
+    ImdChkCacheEntry** buckets; /* Entries by path_hash & (num_buckets - 1) */
+    size_t num_buckets;         /* Power of two */
+    size_t num_entries;
+
+    uint64_t hits;              /* Lookups answered from the cache */
+    uint64_t misses;            /* Lookups that checked the file */
+};
+
+static void put_le(uint8_t** p, uint64_t value, int n) {
+    for (int i = 0; i < n; ++i) (*p)[i] = (uint8_t)(value >> (8 * i));
+    *p += n;
+}
+
+static uint64_t take_le(const uint8_t** p, int n) {
+    uint64_t value = 0;
+    for (int i = n; i-- > 0;) value = (value << 8) | (*p)[i];
+    *p += n;
+    return value;
+}
+
+/* Encodes an entry as a record whose path starts at path_offset in the string table */
+static void encode_record(uint8_t* record, const ImdChkCacheEntry* entry, uint32_t path_offset) {
+    const ImdChkResults* r = &entry->results;
+    uint8_t* p = record;
+
+    put_le(&p, entry->path_hash, 8);
+    put_le(&p, path_offset, 4);
+    put_le(&p, (uint32_t)entry->path_len, 4);
+    put_le(&p, entry->stamp.size, 8);
+    put_le(&p, (uint64_t)entry->stamp.mtime_sec, 8);
+    put_le(&p, entry->stamp.mtime_nsec, 4);
+    put_le(&p, (uint32_t)entry->status, 4);
+    put_le(&p, entry->content_hash, 8);
+    put_le(&p, entry->options.error_mask, 4);
+    put_le(&p, r->check_failures_mask, 4);
+    put_le(&p, (uint64_t)(int64_t)entry->options.max_allowed_cyl, 8);
+    put_le(&p, (uint64_t)(int64_t)entry->options.required_head, 8);
+    put_le(&p, (uint64_t)(int64_t)entry->options.max_allowed_sectors, 8);
+    put_le(&p, (uint64_t)r->total_sector_count, 8);
+    put_le(&p, (uint64_t)r->unavailable_sector_count, 8);
+    put_le(&p, (uint64_t)r->deleted_sector_count, 8);
+    put_le(&p, (uint64_t)r->compressed_sector_count, 8);
+    put_le(&p, (uint64_t)r->data_error_sector_count, 8);
+    put_le(&p, (uint32_t)r->track_read_count, 4);
+    put_le(&p, (uint32_t)r->max_cyl_side0, 4);
+    put_le(&p, (uint32_t)r->max_cyl_side1, 4);
+    put_le(&p, (uint32_t)r->max_head_seen, 4);
+    put_le(&p, (uint32_t)r->detected_interleave, 4);
+    put_le(&p, 0, 4); /* Reserved */
+}
+
+/*
+ * Decodes mapped record 'index'. Returns 0 if its path lies outside the string table,
+ * in which case the record is treated as absent.
+ */
+static int decode_record(const ImdChkCache* cache, size_t index, ImdChkCacheEntry* entry) {
+    const uint8_t* p = cache->map_base + IMDCHK_CACHE_HEADER_SIZE + index * IMDCHK_CACHE_RECORD_SIZE;
+    ImdChkResults* r = &entry->results;
+    uint32_t path_offset;
+
+    memset(entry, 0, sizeof(ImdChkCacheEntry));
+    entry->path_hash = take_le(&p, 8);
+    path_offset = (uint32_t)take_le(&p, 4);
+    entry->path_len = (uint32_t)take_le(&p, 4);
+    if (path_offset > cache->map_strings_size || entry->path_len > cache->map_strings_size - path_offset) return 0;
+    entry->path = (const char*)cache->map_strings + path_offset;
+    entry->stamp.size = take_le(&p, 8);
+    entry->stamp.mtime_sec = (int64_t)take_le(&p, 8);
+    entry->stamp.mtime_nsec = (uint32_t)take_le(&p, 4);
+    entry->status = (int)(int32_t)take_le(&p, 4);
+    entry->content_hash = take_le(&p, 8);
+    entry->options.error_mask = (uint32_t)take_le(&p, 4);
+    r->check_failures_mask = (uint32_t)take_le(&p, 4);
+    entry->options.max_allowed_cyl = (long)(int64_t)take_le(&p, 8);
+    entry->options.required_head = (long)(int64_t)take_le(&p, 8);
+    entry->options.max_allowed_sectors = (long)(int64_t)take_le(&p, 8);
+    r->total_sector_count = (long long)take_le(&p, 8);
+    r->unavailable_sector_count = (long long)take_le(&p, 8);
+    r->deleted_sector_count = (long long)take_le(&p, 8);
+    r->compressed_sector_count = (long long)take_le(&p, 8);
+    r->data_error_sector_count = (long long)take_le(&p, 8);
+    r->track_read_count = (int)(int32_t)take_le(&p, 4);
+    r->max_cyl_side0 = (int)(int32_t)take_le(&p, 4);
+    r->max_cyl_side1 = (int)(int32_t)take_le(&p, 4);
+    r->max_head_seen = (int)(int32_t)take_le(&p, 4);
+    r->detected_interleave = (int)(int32_t)take_le(&p, 4);
+    entry->map_index = index;
+    entry->map_generation = cache->map_generation;
+    entry->next = NULL;
+    return 1;
+}
+
+/* Path hash of mapped record 'index' */
+static uint64_t record_path_hash(const ImdChkCache* cache, size_t index) {
+    const uint8_t* p = cache->map_base + IMDCHK_CACHE_HEADER_SIZE + index * IMDCHK_CACHE_RECORD_SIZE;
+    return take_le(&p, 8);
+}
+
+static int options_equal(const ImdChkOptions* a, const ImdChkOptions* b) {
+    return a->error_mask == b->error_mask && a->max_allowed_cyl == b->max_allowed_cyl &&
+           a->required_head == b->required_head && a->max_allowed_sectors == b->max_allowed_sectors;
+}
+
+/* Whether an entry caches the check of path with options */
+static int entry_matches(const ImdChkCacheEntry* entry, uint64_t path_hash, const char* path, size_t path_len, const ImdChkOptions* options) {
+    return entry->path_hash == path_hash && entry->path_len == path_len &&
+           memcmp(entry->path, path, path_len) == 0 && options_equal(&entry->options, options);
+}
+
+static int stamps_equal(const ImdChkFileStamp* a, const ImdChkFileStamp* b) {
+    return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/* Gets the size and modification time of a file. Returns 0 on success, -1 if it cannot be read. */
+static int stat_file_internal(const char* path, ImdChkFileStamp* stamp) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path, &st) != 0) return -1;
+    stamp->mtime_nsec = 0;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+#if defined(__APPLE__)
+    stamp->mtime_nsec = (uint32_t)st.st_mtimespec.tv_nsec;
+#else
+    stamp->mtime_nsec = (uint32_t)st.st_mtim.tv_nsec;
+#endif
+#endif
+    stamp->size = (uint64_t)st.st_size;
+    stamp->mtime_sec = (int64_t)st.st_mtime;
+    return 0;
+}
+
+/* Maps the cache file read-only. A missing or empty file leaves the mapping empty. */
+static void map_cache_file(ImdChkCache* cache) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(cache->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    HANDLE mapping;
+    void* view;
+
+    if (file == INVALID_HANDLE_VALUE) return;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || (unsigned long long)size.QuadPart > (unsigned long long)SIZE_MAX) {
+        CloseHandle(file);
+        return;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) return;
+    view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); /* The view keeps the mapping alive */
+    if (!view) return;
+    cache->map_base = (const uint8_t*)view;
+    cache->map_size = (size_t)size.QuadPart;
+#else
+    struct stat st;
+    void* view;
+    int fd = open(cache->path, O_RDONLY);
+
+    if (fd < 0) return;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (unsigned long long)st.st_size > (unsigned long long)SIZE_MAX) {
+        close(fd);
+        return;
+    }
+    view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /* The mapping stays valid after the descriptor is closed */
+    if (view == MAP_FAILED) return;
+    cache->map_base = (const uint8_t*)view;
+    cache->map_size = (size_t)st.st_size;
+#endif
+}
+
+static void unmap_cache_file(ImdChkCache* cache) {
+    if (cache->map_base) {
+#ifdef _WIN32
+        UnmapViewOfFile((LPCVOID)cache->map_base);
+#else
+        munmap((void*)cache->map_base, cache->map_size);
+#endif
+    }
+    imd_free(cache->map_state);
+    cache->map_base = NULL;
+    cache->map_size = 0;
+    cache->map_count = 0;
+    cache->map_strings = NULL;
+    cache->map_strings_size = 0;
+    cache->map_state = NULL;
+    cache->map_replaced = 0;
+    cache->map_generation++;
+}
+
+/* Maps the cache file and validates its header; anything unusable leaves the cache empty */
+static void load_cache_file(ImdChkCache* cache) {
+    char version[IMDCHK_CACHE_HEADER_SIZE - IMDCHK_CACHE_VERSION_OFF];
+    const uint8_t* p;
+    uint64_t record_size;
+    uint64_t count;
+    uint64_t strings_size;
+
+    map_cache_file(cache);
+    if (!cache->map_base) return;
+
+    p = cache->map_base + 8;
+    if (cache->map_size < IMDCHK_CACHE_HEADER_SIZE || memcmp(cache->map_base, IMDCHK_CACHE_MAGIC, 8) != 0 ||
+        take_le(&p, 4) != IMDCHK_CACHE_FORMAT) {
+        DEBUG_PRINTF("LIBIMDCHK: %s is not a result cache, ignored\n", cache->path);
+        unmap_cache_file(cache);
+        return;
+    }
+    record_size = take_le(&p, 4);
+    count = take_le(&p, 4);
+    strings_size = take_le(&p, 4);
+    memset(version, 0, sizeof(version));
+    strncpy(version, IMDCHK_CACHE_LIBRARY_VERSION, sizeof(version) - 1);
+    if (record_size != IMDCHK_CACHE_RECORD_SIZE ||
+        memcmp(cache->map_base + IMDCHK_CACHE_VERSION_OFF, version, sizeof(version)) != 0 ||
+        (uint64_t)cache->map_size != IMDCHK_CACHE_HEADER_SIZE + count * IMDCHK_CACHE_RECORD_SIZE + strings_size) {
+        DEBUG_PRINTF("LIBIMDCHK: %s is from another library build or damaged, ignored\n", cache->path);
+        unmap_cache_file(cache);
+        return;
+    }
+    cache->map_state = (uint8_t*)imd_calloc(count ? (size_t)count : 1, 1);
+    if (!cache->map_state) {
+        unmap_cache_file(cache);
+        return;
+    }
+    cache->map_count = (size_t)count;
+    cache->map_strings = cache->map_base + IMDCHK_CACHE_HEADER_SIZE + cache->map_count * IMDCHK_CACHE_RECORD_SIZE;
+    cache->map_strings_size = (size_t)strings_size;
+}
+
+/* Frees the entries added since the file was mapped */
+static void free_cache_entries(ImdChkCache* cache) {
+    for (size_t b = 0; b < cache->num_buckets; ++b) {
+        ImdChkCacheEntry* entry = cache->buckets[b];
+        while (entry) {
+            ImdChkCacheEntry* next = entry->next;
+            imd_free(entry);
+            entry = next;
+        }
+        cache->buckets[b] = NULL;
+    }
+    cache->num_entries = 0;
+}
+
+/*
+ * Finds the cached check of path with options, added entries first, then the mapping.
+ * Copies it to entry_out; the caller holds cache->lock. Returns 1 if found.
+ */
+static int cache_find(ImdChkCache* cache, uint64_t path_hash, const char* path, size_t path_len,
+                      const ImdChkOptions* options, ImdChkCacheEntry* entry_out) {
+    size_t lo = 0;
+    size_t hi = cache->map_count;
+
+    for (const ImdChkCacheEntry* entry = cache->buckets[path_hash & (cache->num_buckets - 1)]; entry; entry = entry->next) {
+        if (entry_matches(entry, path_hash, path, path_len, options)) {
+            *entry_out = *entry;
+            return 1;
+        }
+    }
+
+    /* First record with this path hash */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (record_path_hash(cache, mid) < path_hash) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < cache->map_count && record_path_hash(cache, lo) == path_hash; ++lo) {
+        if (cache->map_state[lo] & MAP_RECORD_REPLACED) continue;
+        if (decode_record(cache, lo, entry_out) && entry_matches(entry_out, path_hash, path, path_len, options)) {
+            cache->map_state[lo] |= MAP_RECORD_USED;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Doubles the bucket count; without memory the chains just grow longer */
+static void grow_cache_buckets(ImdChkCache* cache) {
+    size_t num_buckets = cache->num_buckets * 2;
+    ImdChkCacheEntry** buckets = (ImdChkCacheEntry**)imd_calloc(num_buckets, sizeof(ImdChkCacheEntry*));
+
+    if (!buckets) return;
+    for (size_t b = 0; b < cache->num_buckets; ++b) {
+        ImdChkCacheEntry* entry = cache->buckets[b];
+        while (entry) {
+            ImdChkCacheEntry* next = entry->next;
+            entry->next = buckets[entry->path_hash & (num_buckets - 1)];
+            buckets[entry->path_hash & (num_buckets - 1)] = entry;
+            entry = next;
+        }
+    }
+    imd_free(cache->buckets);
+    cache->buckets = buckets;
+    cache->num_buckets = num_buckets;
+}
+
+/* Marks the mapped records holding the check of entry's path and options as superseded */
+static void mark_replaced_record(ImdChkCache* cache, const ImdChkCacheEntry* entry) {
+    ImdChkCacheEntry mapped;
+    size_t lo = 0;
+    size_t hi = cache->map_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (record_path_hash(cache, mid) < entry->path_hash) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < cache->map_count && record_path_hash(cache, lo) == entry->path_hash; ++lo) {
+        if (!(cache->map_state[lo] & MAP_RECORD_REPLACED) && decode_record(cache, lo, &mapped) &&
+            entry_matches(&mapped, entry->path_hash, entry->path, entry->path_len, &entry->options)) {
+            cache->map_state[lo] |= MAP_RECORD_REPLACED;
+            cache->map_replaced++;
+        }
+    }
+}
+
+/* Adds or updates the cached check in entry (path taken from entry); the caller holds cache->lock */
+static void cache_put(ImdChkCache* cache, const ImdChkCacheEntry* entry) {
+    ImdChkCacheEntry** bucket = &cache->buckets[entry->path_hash & (cache->num_buckets - 1)];
+    ImdChkCacheEntry* added;
+
+    if (entry->map_index != SIZE_MAX) {
+        if (entry->map_generation != cache->map_generation) {
+            /* The cache was saved since the entry was found: its record index is stale */
+            mark_replaced_record(cache, entry);
+        }
+        else if (!(cache->map_state[entry->map_index] & MAP_RECORD_REPLACED)) {
+            cache->map_state[entry->map_index] |= MAP_RECORD_REPLACED;
+            cache->map_replaced++;
+        }
+    }
+    for (added = *bucket; added; added = added->next) {
+        if (entry_matches(added, entry->path_hash, entry->path, entry->path_len, &entry->options)) {
+            added->stamp = entry->stamp;
+            added->content_hash = entry->content_hash;
+            added->status = entry->status;
+            added->results = entry->results;
+            return;
+        }
+    }
+
+    /* The path is stored right after the entry */
+    added = (ImdChkCacheEntry*)imd_malloc(sizeof(ImdChkCacheEntry) + entry->path_len);
+    if (!added) return; /* Not cached: the file is simply checked again next time */
+    *added = *entry;
+    memcpy(added + 1, entry->path, entry->path_len);
+    added->path = (const char*)(added + 1);
+    added->map_index = SIZE_MAX;
+    if (cache->num_entries >= cache->num_buckets) {
+        grow_cache_buckets(cache);
+        bucket = &cache->buckets[entry->path_hash & (cache->num_buckets - 1)];
+    }
+    added->next = *bucket;
+    *bucket = added;
+    cache->num_entries++;
+}
+
+/*
+ * Answers a file from the cache if its size and modification time match its entry.
+ * Returns 1 with results and status_out filled in, or 0 if the file must be read.
+ */
+static int cache_lookup_internal(ImdChkCache* cache, const char* filename, const ImdChkOptions* options,
+                                 const ImdChkFileStamp* stamp, ImdChkResults* results, int* status_out) {
+    ImdChkCacheEntry entry;
+    size_t path_len = strlen(filename);
+    uint64_t path_hash = imd_hash_bytes(filename, path_len, IMD_HASH_SEED);
+    int answered = 0;
+
+    if (cache->flags & IMDCHK_CACHE_VERIFY) return 0;
+    imd_mutex_lock(&cache->lock);
+    if (cache_find(cache, path_hash, filename, path_len, options, &entry) && stamps_equal(&entry.stamp, stamp)) {
+        cache->hits++;
+        *results = entry.results;
+        *status_out = entry.status;
+        answered = 1;
+    }
+    imd_mutex_unlock(&cache->lock);
+    return answered;
+}
+
+/*
+ * Checks the contents of a file, read into buf after its stamp was taken, through the
+ * cache: contents that hash the same as the cached ones are not checked again.
+ */
+static int check_buffer_cached_internal(ImdChkCache* cache, const char* filename, const ImdChkOptions* options,
+                                        const ImdChkFileStamp* stamp, const uint8_t* buf, size_t len,
+                                        ImdChkResults* results, int* hit_out) {
+    ImdChkCacheEntry entry;
+    size_t path_len = strlen(filename);
+    uint64_t path_hash = imd_hash_bytes(filename, path_len, IMD_HASH_SEED);
+    uint64_t content_hash = imd_hash_bytes(buf, len, IMD_HASH_SEED);
+    int found;
+    int hit;
+    int status;
+
+    imd_mutex_lock(&cache->lock);
+    found = cache_find(cache, path_hash, filename, path_len, options, &entry);
+    imd_mutex_unlock(&cache->lock);
+    if (!found) entry.map_index = SIZE_MAX;
+
+    hit = found && entry.content_hash == content_hash;
+    if (hit) {
+        /* Touched or copied, but unchanged */
+        *results = entry.results;
+        status = entry.status;
+        if (hit_out) *hit_out = 1;
+    }
+    else {
+        status = check_image_internal(buf, len, options, results);
+    }
+
+    imd_mutex_lock(&cache->lock);
+    if (hit) cache->hits++;
+    else cache->misses++;
+    /* A file that changed while it was read is not cached under the older stamp */
+    if ((uint64_t)len == stamp->size) {
+        entry.path_hash = path_hash;
+        entry.path = filename;
+        entry.path_len = path_len;
+        entry.stamp = *stamp;
+        entry.content_hash = content_hash;
+        entry.options = *options;
+        entry.status = status;
+        entry.results = *results;
+        cache_put(cache, &entry);
+    }
+    imd_mutex_unlock(&cache->lock);
+    return status;
+}
+
+/*
+ * Checks a file through the cache. A file whose size and modification time match its
+ * entry is answered from the cache; otherwise it is read, and its contents are checked
+ * unless they hash the same as the cached ones.
+ */
+static int check_file_cached_internal(ImdChkCache* cache, const char* filename, const ImdChkOptions* options,
+                                      ImdChkResults* results, ImdChkBuffer* buffer, int* hit_out) {
+    ImdChkFileStamp stamp;
+    long long len;
+    int status;
+    FILE* f;
+
+    if (hit_out) *hit_out = 0;
+    if (stat_file_internal(filename, &stamp) != 0) return -1; /* As if the file could not be opened */
+
+    if (cache_lookup_internal(cache, filename, options, &stamp, results, &status)) {
+        if (hit_out) *hit_out = 1;
+        return status;
+    }
+
+    f = fopen(filename, "rb");
+    if (!f) return -1;
+    setvbuf(f, NULL, _IONBF, 0); /* The file is read straight into buffer */
+    len = read_stream_internal(f, buffer);
+    fclose(f);
+    if (len < 0) {
+        results->check_failures_mask |= CHECK_BIT_TRACK_READ;
+        return -1; /* Read errors are not cached */
+    }
+    return check_buffer_cached_internal(cache, filename, options, &stamp, buffer->bytes, (size_t)len, results, hit_out);
+}
+
+/* A record to write when saving: a mapped record or an added entry */
+typedef struct {
+    uint64_t path_hash;
+    size_t map_index;           /* SIZE_MAX for an added entry */
+    const ImdChkCacheEntry* entry;
+} ImdChkSaveItem;
+
+static int compare_save_items(const void* a, const void* b) {
+    uint64_t ha = ((const ImdChkSaveItem*)a)->path_hash;
+    uint64_t hb = ((const ImdChkSaveItem*)b)->path_hash;
+    return (ha > hb) - (ha < hb);
+}
+
+/* Writes the records of items to path; the caller holds cache->lock */
+static int write_cache_file(ImdChkCache* cache, const char* path, ImdChkSaveItem* items, size_t count) {
+    size_t strings_size = 0;
+    size_t file_size;
+    uint8_t* bytes;
+    uint8_t* p;
+    uint8_t* record;
+    uint8_t* strings;
+    FILE* f;
+    int result = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        ImdChkCacheEntry decoded;
+        if (items[i].map_index != SIZE_MAX) {
+            decode_record(cache, items[i].map_index, &decoded);
+            strings_size += decoded.path_len;
+        }
+        else {
+            strings_size += items[i].entry->path_len;
+        }
+    }
+    if (count > UINT32_MAX || strings_size > UINT32_MAX) return -1;
+    file_size = IMDCHK_CACHE_HEADER_SIZE + count * IMDCHK_CACHE_RECORD_SIZE + strings_size;
+    bytes = (uint8_t*)imd_calloc(file_size, 1);
+    if (!bytes) return -1;
+
+    memcpy(bytes, IMDCHK_CACHE_MAGIC, 8);
+    p = bytes + 8;
+    put_le(&p, IMDCHK_CACHE_FORMAT, 4);
+    put_le(&p, IMDCHK_CACHE_RECORD_SIZE, 4);
+    put_le(&p, count, 4);
+    put_le(&p, strings_size, 4);
+    strncpy((char*)bytes + IMDCHK_CACHE_VERSION_OFF, IMDCHK_CACHE_LIBRARY_VERSION, IMDCHK_CACHE_HEADER_SIZE - IMDCHK_CACHE_VERSION_OFF - 1);
+
+    record = bytes + IMDCHK_CACHE_HEADER_SIZE;
+    strings = record + count * IMDCHK_CACHE_RECORD_SIZE;
+    for (size_t i = 0, path_offset = 0; i < count; ++i, record += IMDCHK_CACHE_RECORD_SIZE) {
+        ImdChkCacheEntry decoded;
+        const ImdChkCacheEntry* entry = items[i].entry;
+        if (items[i].map_index != SIZE_MAX) {
+            decode_record(cache, items[i].map_index, &decoded);
+            entry = &decoded;
+        }
+        encode_record(record, entry, (uint32_t)path_offset);
+        memcpy(strings + path_offset, entry->path, entry->path_len);
+        path_offset += entry->path_len;
+    }
+
+    f = fopen(path, "wb");
+    if (!f) {
+        perror("libimdchk: cannot create result cache");
+        imd_free(bytes);
+        return -1;
+    }
+    if (imd_stat_fwrite(bytes, 1, file_size, f) != file_size) {
+        perror("libimdchk: result cache write failed");
+        result = -1;
+    }
+    if (fclose(f) != 0) result = -1;
+    imd_free(bytes);
+    return result;
+}
+
+/* Marks the mapped records superseded by added entries, after the file was mapped again */
+static void mark_replaced_records(ImdChkCache* cache) {
+    for (size_t b = 0; b < cache->num_buckets; ++b) {
+        for (const ImdChkCacheEntry* added = cache->buckets[b]; added; added = added->next) {
+            mark_replaced_record(cache, added);
+        }
+    }
+}
+
+/* Replaces the cache file with the one just written to temp_path */
+static int replace_cache_file(const char* temp_path, const char* path) {
+#ifdef _WIN32
+    return MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(temp_path, path);
+#endif
+}
+
+int imdchk_cache_open(const char* path, unsigned flags, ImdChkCache** cache_out) {
+    ImdChkCache* cache;
+    size_t path_len;
+
+    if (!path || !cache_out) {
+        return -1; /* Invalid arguments */
+    }
+    *cache_out = NULL;
+    path_len = strlen(path);
+    cache = (ImdChkCache*)imd_calloc(1, sizeof(ImdChkCache));
+    if (!cache) return -1;
+    cache->path = (char*)imd_malloc(path_len + 1);
+    cache->buckets = (ImdChkCacheEntry**)imd_calloc(IMDCHK_CACHE_INITIAL_BUCKETS, sizeof(ImdChkCacheEntry*));
+    if (!cache->path || !cache->buckets || imd_mutex_init(&cache->lock) != 0) {
+        imd_free(cache->buckets);
+        imd_free(cache->path);
+        imd_free(cache);
+        return -1;
+    }
+    memcpy(cache->path, path, path_len + 1);
+    cache->num_buckets = IMDCHK_CACHE_INITIAL_BUCKETS;
+    cache->flags = flags;
+    load_cache_file(cache);
+    DEBUG_PRINTF("LIBIMDCHK: Result cache %s holds %zu records\n", path, cache->map_count);
+    *cache_out = cache;
+    return 0;
+}
+
+int imdchk_cache_save(ImdChkCache* cache, int prune_unused) {
+    ImdChkSaveItem* items;
+    ImdChkCacheEntry decoded;
+    char* temp_path;
+    size_t path_len;
+    size_t count = 0;
+    int result;
+
+    if (!cache) {
+        return -1; /* Invalid arguments */
+    }
+    imd_mutex_lock(&cache->lock);
+    if (cache->num_entries == 0 && cache->map_replaced == 0 && !prune_unused) {
+        imd_mutex_unlock(&cache->lock);
+        return 0; /* Nothing changed */
+    }
+
+    path_len = strlen(cache->path);
+    temp_path = (char*)imd_malloc(path_len + sizeof(".tmp"));
+    items = (ImdChkSaveItem*)imd_malloc((cache->map_count + cache->num_entries + 1) * sizeof(ImdChkSaveItem));
+    if (!temp_path || !items) {
+        imd_free(temp_path);
+        imd_free(items);
+        imd_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    memcpy(temp_path, cache->path, path_len);
+    memcpy(temp_path + path_len, ".tmp", sizeof(".tmp"));
+
+    for (size_t i = 0; i < cache->map_count; ++i) {
+        if (cache->map_state[i] & MAP_RECORD_REPLACED) continue;
+        if (prune_unused && !(cache->map_state[i] & MAP_RECORD_USED)) continue;
+        if (!decode_record(cache, i, &decoded)) continue;
+        items[count].path_hash = decoded.path_hash;
+        items[count].map_index = i;
+        items[count].entry = NULL;
+        count++;
+    }
+    for (size_t b = 0; b < cache->num_buckets; ++b) {
+        for (const ImdChkCacheEntry* added = cache->buckets[b]; added; added = added->next) {
+            items[count].path_hash = added->path_hash;
+            items[count].map_index = SIZE_MAX;
+            items[count].entry = added;
+            count++;
+        }
+    }
+    qsort(items, count, sizeof(ImdChkSaveItem), compare_save_items);
+
+    result = write_cache_file(cache, temp_path, items, count);
+    imd_free(items);
+    if (result == 0) {
+        /* The new file holds everything: drop the old mapping and the added entries, then map it */
+        unmap_cache_file(cache);
+        if (replace_cache_file(temp_path, cache->path) == 0) {
+            free_cache_entries(cache);
+        }
+        else {
+            perror("libimdchk: cannot replace result cache");
+            result = -1;
+        }
+        load_cache_file(cache);
+        if (result != 0) mark_replaced_records(cache);
+    }
+    if (result != 0) remove(temp_path);
+    imd_free(temp_path);
+    imd_mutex_unlock(&cache->lock);
+    return result;
+}
+
+void imdchk_cache_close(ImdChkCache* cache) {
+    if (!cache) return;
+    free_cache_entries(cache);
+    imd_free(cache->buckets);
+    unmap_cache_file(cache);
+    imd_mutex_destroy(&cache->lock);
+    imd_free(cache->path);
+    imd_free(cache);
+}
+
+int imdchk_cache_get_stats(ImdChkCache* cache, ImdChkCacheStats* stats_out) {
+    if (!cache || !stats_out) {
+        return -1; /* Invalid arguments */
+    }
+    imd_mutex_lock(&cache->lock);
+    stats_out->entries = cache->map_count - cache->map_replaced + cache->num_entries;
+    stats_out->hits = cache->hits;
+    stats_out->misses = cache->misses;
+    imd_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+int imdchk_check_file_cached(ImdChkCache* cache, const char* filename, const ImdChkOptions* options,
+                             ImdChkResults* results, int* hit_out) {
+    ImdChkBuffer buffer = { NULL, 0 };
+    int result;
+
+    if (hit_out) *hit_out = 0;
+    if (!cache) {
+        return imdchk_check_file(filename, options, results);
+    }
+    if (!filename || !options || !results) {
+        return -1; /* Invalid arguments */
+    }
+    init_results_internal(results);
+    result = check_file_cached_internal(cache, filename, options, results, &buffer, hit_out);
+    imd_free(buffer.bytes);
+    return result;
+}
+
+/* --- Batch Checking --- */
+
+/* Files still to be checked by one worker: indices [begin, end) of the batch */
+typedef struct {
+    ImdMutex lock;              /* Protects begin and end */
+    size_t begin;
+    size_t end;
+    ImdChkBuffer buffer;        /* Read buffer reused for every file */
+} ImdChkWorker;
+
+/* Shared state of one imdchk_check_files() call */
+typedef struct {
+    const char* const* paths;
+    const ImdChkOptions* options;
+    ImdChkCache* cache;         /* Result cache, NULL to check every file */
+    ImdChkResults* results;     /* Per-file results, NULL if only reported through on_done */
+    int* statuses;              /* Per-file return values, NULL if not wanted */
+    ImdChkFileDoneFn on_done;
+    void* user_data;
+    ImdMutex done_lock;         /* Serializes on_done calls */
+    ImdChkWorker* workers;
+    unsigned num_workers;
+    size_t failed_count;        /* Files that could not be processed, under done_lock */
+    ImdPrefetch* prefetch;      /* Reads files ahead of the workers, NULL for synchronous reads */
+    ImdChkFileStamp* stamps;    /* Stamp of each file taken before it was prefetched, with a cache */
+} ImdChkBatch;
+
+/* Argument of a batch worker thread */
+typedef struct {
+    ImdChkBatch* batch;
+    unsigned self;
+} ImdChkWorkerArg;
+
+/* Takes the next file from the front of a worker's own range */
+static int take_own_file(ImdChkWorker* worker, size_t* index_out) {
+    int found = 0;
+    imd_mutex_lock(&worker->lock);
+    if (worker->begin < worker->end) {
+        *index_out = worker->begin++;
+        found = 1;
+    }
+    imd_mutex_unlock(&worker->lock);
+    return found;
+}
+
+/*
+ * Moves the back half of another worker's remaining files to an idle worker.
+ * Returns 0 if every other worker has run out of files.
+ */
+static int steal_files(ImdChkBatch* batch, unsigned self) {
+    ImdChkWorker* thief = &batch->workers[self];
+
+    for (unsigned n = 1; n < batch->num_workers; ++n) {
+        ImdChkWorker* victim = &batch->workers[(self + n) % batch->num_workers];
+        size_t begin = 0;
+        size_t end = 0;
+
+        imd_mutex_lock(&victim->lock);
+        if (victim->begin < victim->end) {
+            end = victim->end;
+            begin = end - (end - victim->begin + 1) / 2;
+            victim->end = begin;
+        }
+        imd_mutex_unlock(&victim->lock);
+
+        if (begin < end) {
+            imd_mutex_lock(&thief->lock);
+            thief->begin = begin;
+            thief->end = end;
+            imd_mutex_unlock(&thief->lock);
+            DEBUG_PRINTF("LIBIMDCHK: Worker %u took files %zu-%zu\n", self, begin, end - 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Records the outcome of one file and reports it */
+static void finish_file(ImdChkBatch* batch, size_t index, int status, const ImdChkResults* results) {
+    if (batch->statuses) batch->statuses[index] = status;
+
+    imd_mutex_lock(&batch->done_lock);
+    if (status != 0) batch->failed_count++;
+    if (batch->on_done) batch->on_done(index, batch->paths[index], status, results, batch->user_data);
+    imd_mutex_unlock(&batch->done_lock);
+}
+
+static void batch_worker(void* arg) {
+    ImdChkWorkerArg* worker_arg = (ImdChkWorkerArg*)arg;
+    ImdChkBatch* batch = worker_arg->batch;
+    ImdChkWorker* worker = &batch->workers[worker_arg->self];
+    ImdChkResults local_results;
+    size_t index;
+
+    for (;;) {
+        if (!take_own_file(worker, &index)) {
+            if (!steal_files(batch, worker_arg->self)) break;
+            continue;
+        }
+
+        ImdChkResults* results = batch->results ? &batch->results[index] : &local_results;
+        init_results_internal(results);
+        int status = batch->cache ?
+            check_file_cached_internal(batch->cache, batch->paths[index], batch->options, results, &worker->buffer, NULL) :
+            check_file_internal(batch->paths[index], batch->options, results, &worker->buffer);
+        finish_file(batch, index, status, results);
+    }
+}
+
+/*
+ * Runs on a prefetch reader before a file is read: answers it from the cache when its
+ * stamp is unchanged, so only changed files are read at all.
+ */
+static int prefetch_filter(size_t index, const char* path, void* user_data) {
+    ImdChkBatch* batch = (ImdChkBatch*)user_data;
+    ImdChkResults local_results;
+    ImdChkResults* results = batch->results ? &batch->results[index] : &local_results;
+    int status;
+
+    if (!batch->cache) return 1;
+    init_results_internal(results);
+    if (stat_file_internal(path, &batch->stamps[index]) != 0) {
+        finish_file(batch, index, -1, results); /* As if the file could not be opened */
+        return 0;
+    }
+    if (!cache_lookup_internal(batch->cache, path, batch->options, &batch->stamps[index], results, &status)) return 1;
+    finish_file(batch, index, status, results);
+    return 0;
+}
+
+/* Checks files as the prefetch session delivers them */
+static void prefetch_worker(void* arg) {
+    ImdChkBatch* batch = (ImdChkBatch*)arg;
+    ImdChkResults local_results;
+    ImdPrefetchItem* item;
+
+    while (imd_prefetch_next(batch->prefetch, &item) == 1) {
+        size_t index = item->index;
+        ImdChkResults* results = batch->results ? &batch->results[index] : &local_results;
+        int status;
+
+        init_results_internal(results);
+        if (item->status != 0) {
+            /* Cannot report an open failure through results; a failed read is a track read failure */
+            if (item->status != IMD_ERR_OPEN) results->check_failures_mask |= CHECK_BIT_TRACK_READ;
+            status = -1;
+        }
+        else if (batch->cache) {
+            status = check_buffer_cached_internal(batch->cache, item->path, batch->options, &batch->stamps[index],
+                                                  item->data, item->size, results, NULL);
+        }
+        else {
+            status = check_image_internal(item->data, item->size, batch->options, results);
+        }
+        imd_prefetch_done(batch->prefetch, item);
+        finish_file(batch, index, status, results);
+    }
+}
+
+/* Checks a batch with io_depth reads in flight, feeding the read buffers to num_threads workers */
+static int check_prefetched_files(ImdChkBatch* batch, size_t count, unsigned num_threads, unsigned io_depth) {
+    ImdThread threads[LIBIMD_MAX_WORKER_THREADS];
+    unsigned started = 0;
+
+    if (batch->cache) {
+        batch->stamps = (ImdChkFileStamp*)imd_calloc(count, sizeof(ImdChkFileStamp));
+        if (!batch->stamps) return -1;
+    }
+    if (imd_prefetch_start(batch->paths, count, io_depth, prefetch_filter, batch, &batch->prefetch) != 0) {
+        imd_free(batch->stamps);
+        return -1;
+    }
+
+    /* The calling thread is one of the workers */
+    while (started < num_threads - 1 && imd_thread_create(&threads[started], prefetch_worker, batch) == 0) {
+        started++;
+    }
+    prefetch_worker(batch);
+    for (unsigned t = 0; t < started; ++t) {
+        imd_thread_join(&threads[t]);
+    }
+    batch->num_workers = started + 1;
+
+    imd_prefetch_stop(batch->prefetch);
+    imd_free(batch->stamps);
+    return 0;
+}
+
+int imdchk_check_files(const char* const* paths, size_t count, const ImdChkOptions* options,
+                       ImdChkResults* results, int* statuses, unsigned num_threads,
+                       ImdChkFileDoneFn on_done, void* user_data) {
+    return imdchk_check_files_cached(NULL, paths, count, options, results, statuses, num_threads, on_done, user_data);
+}
+
+int imdchk_check_files_cached(ImdChkCache* cache, const char* const* paths, size_t count, const ImdChkOptions* options,
+                              ImdChkResults* results, int* statuses, unsigned num_threads,
+                              ImdChkFileDoneFn on_done, void* user_data) {
+    return imdchk_check_files_async(cache, paths, count, options, results, statuses, num_threads, 0, on_done, user_data);
+}
+
+int imdchk_check_files_async(ImdChkCache* cache, const char* const* paths, size_t count, const ImdChkOptions* options,
+                             ImdChkResults* results, int* statuses, unsigned num_threads, unsigned io_depth,
+                             ImdChkFileDoneFn on_done, void* user_data) {
+    ImdChkWorker workers[LIBIMD_MAX_WORKER_THREADS];
+    ImdChkWorkerArg args[LIBIMD_MAX_WORKER_THREADS];
+    ImdThread threads[LIBIMD_MAX_WORKER_THREADS];
+    ImdChkBatch batch;
+    unsigned started = 0;
+    unsigned initialized = 0;
+
+    if ((!paths && count > 0) || !options) {
+        return -1; /* Invalid arguments */
+    }
+    if (count == 0) return 0;
+
+    if (num_threads == 0) num_threads = imd_cpu_count();
+    if (num_threads > LIBIMD_MAX_WORKER_THREADS) num_threads = LIBIMD_MAX_WORKER_THREADS;
+    if ((size_t)num_threads > count) num_threads = (unsigned)count;
+
+    batch.paths = paths;
+    batch.options = options;
+    batch.cache = cache;
+    batch.results = results;
+    batch.statuses = statuses;
+    batch.on_done = on_done;
+    batch.user_data = user_data;
+    batch.workers = workers;
+    batch.failed_count = 0;
+    batch.prefetch = NULL;
+    batch.stamps = NULL;
+    if (imd_mutex_init(&batch.done_lock) != 0) return -1;
+
+    if (io_depth > 0) {
+        if (check_prefetched_files(&batch, count, num_threads, io_depth) != 0) {
+            imd_mutex_destroy(&batch.done_lock);
+            return -1;
+        }
+        imd_mutex_destroy(&batch.done_lock);
+        DEBUG_PRINTF("LIBIMDCHK: Checked %zu files on %u threads with %u reads in flight, %zu failed\n",
+                     count, batch.num_workers, io_depth, batch.failed_count);
+        return (batch.failed_count > (size_t)INT_MAX) ? INT_MAX : (int)batch.failed_count;
+    }
+
+    /* Start every worker on an equal slice; idle workers steal from busy ones */
+    for (initialized = 0; initialized < num_threads; ++initialized) {
+        ImdChkWorker* worker = &workers[initialized];
+        if (imd_mutex_init(&worker->lock) != 0) break;
+        worker->begin = count * initialized / num_threads;
+        worker->end = count * (initialized + 1) / num_threads;
+        worker->buffer.bytes = NULL;
+        worker->buffer.capacity = 0;
+        args[initialized].batch = &batch;
+        args[initialized].self = initialized;
+    }
+    if (initialized < num_threads) {
+        /* Hand the slices of the missing workers to the last one */
+        if (initialized == 0) {
+            imd_mutex_destroy(&batch.done_lock);
+            return -1;
+        }
+        workers[initialized - 1].end = count;
+    }
+    batch.num_workers = initialized;
+
+    /* The calling thread is worker 0 */
+    for (unsigned t = 1; t < batch.num_workers; ++t) {
+        if (imd_thread_create(&threads[started], batch_worker, &args[t]) == 0) started++;
+        /* A worker that fails to start still has its slice stolen by the others */
+    }
+    batch_worker(&args[0]);
+    for (unsigned t = 0; t < started; ++t) {
+        imd_thread_join(&threads[t]);
+    }
+
+    for (unsigned t = 0; t < batch.num_workers; ++t) {
+        imd_mutex_destroy(&workers[t].lock);
+        imd_free(workers[t].buffer.bytes);
+    }
+    imd_mutex_destroy(&batch.done_lock);
+
+    DEBUG_PRINTF("LIBIMDCHK: Checked %zu files on %u threads, %zu failed\n", count, batch.num_workers, batch.failed_count);
+    return (batch.failed_count > (size_t)INT_MAX) ? INT_MAX : (int)batch.failed_count;
 }
@@ -69,6 +69,32 @@ typedef struct {
     /* Optionally add more detailed info if needed, e.g., list of failed tracks */
 } ImdChkResults;
 
+/**
+ * Called by imdchk_check_files() as each file completes, in completion order.
+ * Calls are serialized, so the callback need not be thread-safe, but it runs on a
+ * worker thread and should return quickly.
+ * @param index Index of the file in the paths array.
+ * @param path Path of the file.
+ * @param status Return value of the check, as from imdchk_check_file().
+ * @param results Results of the check, valid only for the duration of the call
+ *        unless a results array was passed.
+ * @param user_data The user_data pointer passed to imdchk_check_files().
+ */
+typedef void (*ImdChkFileDoneFn)(size_t index, const char* path, int status, const ImdChkResults* results, void* user_data);
+
+/* Result cache flags, see imdchk_cache_open() */
+#define IMDCHK_CACHE_VERIFY 0x01U /* Also compare the content hash on a hit (reads every file) */
+
+/* Persistent cache of check results, see imdchk_cache_open() */
+typedef struct ImdChkCache ImdChkCache; /* Opaque structure */
+
+/* Usage of a result cache */
+typedef struct {
+    size_t entries;             /* Cached checks */
+    uint64_t hits;              /* Checks answered from the cache since it was opened */
+    uint64_t misses;            /* Files checked since it was opened */
+} ImdChkCacheStats;
+
 /* --- Public Function Prototypes --- */
 
 /**
@@ -81,6 +107,133 @@ typedef struct {
  */
 int imdchk_check_file(const char* filename, const ImdChkOptions* options, ImdChkResults* results);
 
+/**
+ * @brief Checks an IMD image read from a caller-supplied stream.
+ * The stream is read from its current position to EOF; it may be a pipe.
+ * The caller keeps ownership of the stream.
+ * @param f Stream positioned at the start of the image.
+ * @param options Pointer to the ImdChkOptions structure containing check parameters.
+ * @param results Pointer to the ImdChkResults structure to store the outcome.
+ * @return 0 if the image was processed (even if checks failed),
+ * -1 on read error or critical error preventing processing.
+ */
+int imdchk_check_stream(FILE* f, const ImdChkOptions* options, ImdChkResults* results);
+
+/**
+ * @brief Checks an IMD image held in memory, without any stdio.
+ * Same checks and results as imdchk_check_file() on a file with the same contents.
+ * @param buf Buffer holding the complete image.
+ * @param len Number of bytes in buf.
+ * @param options Pointer to the ImdChkOptions structure containing check parameters.
+ * @param results Pointer to the ImdChkResults structure to store the outcome.
+ * @return 0 if the image was processed (even if checks failed),
+ * -1 on invalid arguments or a critical error preventing processing.
+ */
+int imdchk_check_buffer(const uint8_t* buf, size_t len, const ImdChkOptions* options, ImdChkResults* results);
+
+/**
+ * @brief Checks many IMD files in parallel, as repeated imdchk_check_file() calls would.
+ * Each worker thread starts with an equal share of the files and steals from the
+ * busiest remaining share when its own runs out, so a few large images do not
+ * hold up the batch. Each worker reads its files into one buffer that it reuses.
+ * If a custom allocator is installed with imd_set_allocator, it must be thread-safe.
+ * @param paths Array of count file paths.
+ * @param count Number of files.
+ * @param options Pointer to the ImdChkOptions structure applied to every file.
+ * @param results Array of count ImdChkResults to receive the per-file outcome, or NULL.
+ * @param statuses Array of count ints to receive the per-file return value of the check
+ *        (0 if processed, -1 on open or critical read error), or NULL.
+ * @param num_threads Maximum number of threads (0 = one per processor, 1 = serial).
+ * @param on_done Callback invoked as each file completes, or NULL.
+ * @param user_data Passed through to on_done.
+ * @return The number of files that could not be processed (0 if all were),
+ * -1 on invalid arguments or if no worker could be set up.
+ */
+int imdchk_check_files(const char* const* paths, size_t count, const ImdChkOptions* options,
+                       ImdChkResults* results, int* statuses, unsigned num_threads,
+                       ImdChkFileDoneFn on_done, void* user_data);
+
+/* --- Result Cache --- */
+
+/*
+ * A result cache remembers the results of checked files, keyed by path and options,
+ * together with the file's size, modification time and content hash. A file whose size
+ * and modification time are unchanged is answered without being read; one that was only
+ * touched or copied is read and hashed, but not checked again. Results of another
+ * library build are never used. The cache file is compact and is read in place from a
+ * memory mapping. A cache may be used from several threads, as imdchk_check_files_cached() does.
+ */
+
+/**
+ * @brief Opens a result cache, loading the cache file if it exists.
+ * A missing, damaged or outdated cache file yields an empty cache; it is replaced by
+ * imdchk_cache_save().
+ * @param path Path of the cache file.
+ * @param flags Bitwise OR of IMDCHK_CACHE_* flags (0 for none).
+ * @param cache_out Pointer to store the cache.
+ * @return 0 on success, -1 on invalid arguments or allocation failure.
+ */
+int imdchk_cache_open(const char* path, unsigned flags, ImdChkCache** cache_out);
+
+/**
+ * @brief Writes the cache to its file, if anything changed since it was opened or saved.
+ * The new file is written next to the old one (as path.tmp) and then replaces it.
+ * @param cache Pointer to the cache.
+ * @param prune_unused If non-zero, drops the entries of files not checked since the cache was opened.
+ * @return 0 on success, -1 on invalid arguments or write error (the cache is unchanged).
+ */
+int imdchk_cache_save(ImdChkCache* cache, int prune_unused);
+
+/**
+ * @brief Closes a cache without saving it. Does nothing if cache is NULL.
+ * @param cache Pointer to the cache.
+ */
+void imdchk_cache_close(ImdChkCache* cache);
+
+/**
+ * @brief Gets the number of cached checks and the hits and misses since the cache was opened.
+ * @param cache Pointer to the cache.
+ * @param stats_out Pointer to the structure to fill in.
+ * @return 0 on success, -1 on invalid arguments.
+ */
+int imdchk_cache_get_stats(ImdChkCache* cache, ImdChkCacheStats* stats_out);
+
+/**
+ * @brief Checks a file as imdchk_check_file() does, answering from the cache when the file is unchanged.
+ * @param cache Pointer to the cache, or NULL to check the file without it.
+ * @param filename The path to the IMD file to check.
+ * @param options Pointer to the ImdChkOptions structure containing check parameters.
+ * @param results Pointer to the ImdChkResults structure to store the outcome.
+ * @param hit_out Optional pointer to store 1 if the results came from the cache, 0 otherwise.
+ * @return As imdchk_check_file(). Files that cannot be read are not cached.
+ */
+int imdchk_check_file_cached(ImdChkCache* cache, const char* filename, const ImdChkOptions* options,
+                             ImdChkResults* results, int* hit_out);
+
+/**
+ * @brief Checks many IMD files in parallel as imdchk_check_files() does, through a result cache.
+ * @param cache Pointer to the cache, or NULL to check every file.
+ * @return As imdchk_check_files(). The other parameters are as for imdchk_check_files().
+ */
+int imdchk_check_files_cached(ImdChkCache* cache, const char* const* paths, size_t count, const ImdChkOptions* options,
+                              ImdChkResults* results, int* statuses, unsigned num_threads,
+                              ImdChkFileDoneFn on_done, void* user_data);
+
+/**
+ * @brief Checks many IMD files in parallel as imdchk_check_files_cached() does, reading
+ * them ahead of the workers (see imd_prefetch_start).
+ * Reader threads keep io_depth file reads in flight and hand the read buffers to
+ * num_threads checking workers, in completion order. This is what gets throughput out
+ * of network storage, where a file read mostly waits. With a cache, the readers stat
+ * each file first: an unchanged file is answered from the cache without being read,
+ * and on_done may then be called from a reader thread.
+ * @param io_depth Number of file reads in flight; 0 reads each file on its worker,
+ *        as imdchk_check_files_cached() does.
+ * @return As imdchk_check_files(). The other parameters are as for imdchk_check_files_cached().
+ */
+int imdchk_check_files_async(ImdChkCache* cache, const char* const* paths, size_t count, const ImdChkOptions* options,
+                             ImdChkResults* results, int* statuses, unsigned num_threads, unsigned io_depth,
+                             ImdChkFileDoneFn on_done, void* user_data);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -10,17 +10,24 @@
 #define _DEFAULT_SOURCE
 
 #include "libimdf.h"
+#include "libimd_thread.h"
+#include "libimd_stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 
 /* Check if strdup is available (needed for POSIX compliance) */
 #ifdef _WIN32
 #define strdup _strdup
+#include <windows.h>
 #else /* Assume POSIX */
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #endif
 
@@ -34,9 +41,24 @@
 #define DEBUG_PRINTF(...) do { } while (0)
 #endif
 
+/* IMD version written to the header of new images or when the loaded one is invalid */
+#define LIBIMDF_DEFAULT_VERSION "1.19"
+
 /* Initial capacity for the tracks array */
 #define IMDF_INITIAL_TRACK_CAPACITY 80 /* Default to 80 tracks (e.g. 40 cyl, 2 heads) */
 
+/* Heads covered by the (cyl, head) lookup table; other heads fall back to a linear scan */
+#define IMDF_LUT_HEADS 2
+
+/* Sector lookup table entry for a logical ID not present on the track */
+#define IMDF_NO_SECTOR 0xFF
+
+/* Track locks of a concurrent image: one per (cyl, head & 1) */
+#define IMDF_TRACK_LOCKS 512
+
+/* Internal result: repeat the call holding the lock it names exclusively (never returned to callers) */
+#define IMDF_RETRY_EXCLUSIVE 1
+
 /* Default WriteOpts for internal use in libimdf when writing tracks */
 static const ImdWriteOpts default_libimdf_write_opts = {
     IMD_COMPRESSION_AS_READ, /* Default to AS_READ for general rewrites */
@@ -48,20 +70,141 @@ static const ImdWriteOpts default_libimdf_write_opts = {
 
 
 /* --- Internal Data Structure --- */
+
+/* Location of one Sector Data Record within the image file */
+typedef struct {
+    long offset;                /* File offset of the record payload (just past the flag byte) */
+    uint8_t sflag;              /* Sector Data Record type as stored in the file */
+    uint8_t dirty;              /* In-memory data not yet written to this record (write-back mode) */
+} ImdfSectorLoc;
+
+/* Write-back state of a track */
+#define IMDF_TRACK_CLEAN    0   /* File matches memory */
+#define IMDF_TRACK_PATCHED  1   /* Only normal sectors changed, record length is unchanged */
+#define IMDF_TRACK_DIRTY    2   /* Track record must be re-encoded */
+
+/* A track expanded in memory: the ImdTrackInfo handed out for it, with its sector lookup */
+typedef struct {
+    ImdTrackInfo info;          /* Header, maps, flags and sector data of the track */
+    uint8_t sector_lut[256];    /* Logical sector ID -> physical index, IMDF_NO_SECTOR if absent */
+} ImdfTrackView;
+
+/* File layout and lookup state of one track record, one per track in image order */
+typedef struct {
+    long offset;                /* File offset of the track record, -1 if unknown */
+    long length;                /* Length of the track record in bytes */
+    ImdfSectorLoc* sectors;     /* num_sectors entries, NULL if the track has no sectors */
+    int state;                  /* IMDF_TRACK_CLEAN, IMDF_TRACK_PATCHED or IMDF_TRACK_DIRTY */
+    /*
+     * Header fields of the track, which only change with the table held exclusively:
+     * calls holding the table shared read them without the track's lock.
+     */
+    uint8_t cyl;                /* Physical cylinder number */
+    uint8_t head;               /* Physical head number */
+    uint8_t num_sectors;        /* Number of sectors */
+    uint32_t sector_size;       /* Sector size in bytes */
+    /*
+     * Maps and flags of a track indexed at open stay in imdf->track_meta until the track
+     * is first loaded or changed. The view then holds them, and the entry is unused.
+     */
+    size_t meta_index;          /* Entry in imdf->track_meta, valid while view is NULL */
+    ImdfTrackView* view;        /* Expanded track, NULL until needed; read and set under the track's lock */
+    uint8_t* logical_data;      /* Track data in logical sector order (imdf_get_track_data_ptr), NULL if not built */
+    uint64_t* sector_hashes;    /* imd_hash_sector of each sector, NULL until first needed */
+    uint64_t track_hash;        /* imd_hash_track of the track, valid when hashed is set */
+    uint64_t clean_hash;        /* track_hash when the track last matched the file (hash tracking) */
+    uint8_t hashed;             /* sector_hashes and track_hash are up to date */
+    uint8_t clean_hash_valid;   /* clean_hash is set */
+    struct ImdfStoreEntry* shared; /* Store entry holding the track data, NULL if the data is private */
+} ImdfTrackLayout;
+
+/* One buffer of a data store, referenced by every track whose data equals it */
+typedef struct ImdfStoreEntry {
+    uint64_t key;               /* Content key, see track_store_key */
+    size_t size;                /* Size of data in bytes */
+    size_t refs;                /* Tracks whose data is this buffer */
+    uint8_t* data;              /* Track data, never changed while in the store */
+    struct ImdfStoreEntry* next; /* Next entry of the same bucket */
+} ImdfStoreEntry;
+
+/* Content-addressed track data shared by several images (imdf_set_data_store) */
+struct ImdfDataStore {
+    ImdMutex lock;              /* Protects everything below */
+    ImdfStoreEntry** buckets;   /* Entries by key & (num_buckets - 1) */
+    size_t num_buckets;         /* Power of two */
+    size_t num_entries;         /* Buffers held */
+    size_t num_refs;            /* Sum of the entries' refs */
+    uint64_t bytes_stored;      /* Sum of the entries' sizes */
+    uint64_t bytes_referenced;  /* Sum of size * refs over the entries */
+    size_t users;               /* The imdf_store_create reference plus one per attached image */
+};
+
+/*
+ * Locks of an image shared between threads (IMDF_OPEN_CONCURRENT). Lock order:
+ * table, then one track, then io. Calls that change the track table, rewrite the
+ * whole file or change settings hold table exclusively and need no other lock.
+ */
+typedef struct {
+    ImdRwLock table;            /* Shared by all other calls */
+    ImdRwLock track[IMDF_TRACK_LOCKS]; /* Shared to read a track, exclusive to change or load it */
+    ImdMutex io;                /* File position and pending_writes */
+} ImdfLocks;
+
+/* Locks held by a call that works on one track, see track_access_begin */
+typedef struct {
+    ImdRwLock* track_lock;      /* Track lock held, NULL if none */
+    int exclusive;              /* The track may be loaded or changed */
+    int whole_image;            /* Table held exclusively (or no locking): the whole image may change */
+} ImdfTrackAccess;
+
+/* One logical block of the LBA view (imdf_build_lba_map) */
+typedef struct {
+    uint32_t track_index;       /* Track holding the block */
+    uint32_t data_offset;       /* Byte offset of the sector in the track's data */
+    uint16_t run;               /* Blocks from this one on that follow each other in the track's data */
+    uint8_t phys;               /* Physical sector index */
+} ImdfLbaEntry;
+
 struct ImdImageFile {
     FILE* file_ptr;             /* Handle to the open IMD file */
     char* file_path;            /* Stored path for potential reopening */
     int write_protected;        /* Write protection status */
     int read_only_open;         /* Was the file opened with read_only flag? */
     int file_owner;             /* 1 if libimdf should close the file, 0 otherwise */
+    int write_back;             /* Defer writes until imdf_flush/imdf_close */
+    int pending_writes;         /* At least one track is not CLEAN */
+    int hash_tracking;          /* Flushes skip tracks whose changes were undone (imdf_set_hash_tracking) */
+    ImdfDataStore* store;       /* Store sharing the data of loaded tracks (imdf_set_data_store), NULL if none */
 
     ImdHeaderInfo header_info;  /* Parsed header info */
     char* comment;              /* Comment block */
     size_t comment_len;         /* Length of comment */
+    long tracks_offset;         /* File offset of the first track record, -1 if unknown */
+    int header_dirty;           /* Header or comment changed since the last rewrite */
 
-    ImdTrackInfo* tracks;       /* Dynamic array of loaded tracks */
+    ImdfTrackLayout* layouts;   /* Dynamic array of the tracks, in image order */
     size_t num_tracks;          /* Number of tracks currently loaded */
-    size_t track_capacity;      /* Allocated capacity of the tracks array */
+    size_t track_capacity;      /* Allocated capacity of the layouts array */
+    ImdTrackArena track_meta;   /* Maps and flags of the tracks indexed at open, never changed after open */
+    int track_lut[256][IMDF_LUT_HEADS]; /* (cyl, head) -> track index, -1 if absent */
+    uint8_t* data_arena;        /* Sector data of the tracks loaded at open, NULL if none */
+    size_t data_arena_size;     /* Size of data_arena in bytes */
+    unsigned worker_threads;    /* Threads for track decoding and encoding (1 = serial) */
+    ImdStatCounters stats;      /* Counts of the work done for this image (imdf_get_stats) */
+
+    /* Logical block view, NULL until imdf_build_lba_map */
+    ImdfLbaEntry* lba_map;      /* Block number -> sector */
+    size_t lba_count;           /* Number of blocks in lba_map */
+    uint8_t lba_first_sector_id; /* Sector ID numbered as the first block of each track */
+    int lba_built;              /* imdf_build_lba_map has been called */
+    int lba_stale;              /* Tracks or geometry changed since lba_map was built */
+
+    ImdfLocks* locks;           /* NULL unless the image is shared between threads (imdf_set_concurrent) */
+
+    /* Read-only image in memory (imdf_open_mapped, imdf_open_buffer), NULL otherwise */
+    const uint8_t* map_base;    /* Start of the mapped image */
+    size_t map_size;            /* Size of the mapping in bytes */
+    uint8_t* map_buffer;        /* Owned buffer holding the image instead of a file mapping, or NULL */
 
     /* Geometry limits */
     uint8_t max_cyl;            /* Set to 0xFF if unused */
@@ -74,8 +217,11 @@ struct ImdImageFile {
 /* Finds track index by C/H. Returns -1 if not found. */
 static int find_track_index_internal(const ImdImageFile* imdf, uint8_t cyl, uint8_t head) {
     if (!imdf) return -1;
+    if (head < IMDF_LUT_HEADS) {
+        return imdf->track_lut[cyl][head];
+    }
     for (size_t i = 0; i < imdf->num_tracks; ++i) {
-        if (imdf->tracks[i].cyl == cyl && imdf->tracks[i].head == head) {
+        if (imdf->layouts[i].cyl == cyl && imdf->layouts[i].head == head) {
             return (int)i;
         }
     }
@@ -93,6 +239,258 @@ int find_sector_index_internal(const ImdTrackInfo* track, uint8_t logical_sector
     return -1;
 }
 
+/*
+ * Track metadata. The view of a track is read and set by calls holding the track's lock
+ * (set only exclusively) or the whole image; the header fields in the layout are readable
+ * under the table lock alone.
+ */
+
+/* Whether a track's sector data is in memory (which implies it has a view) */
+static int track_is_loaded(const ImdfTrackLayout* layout) {
+    return layout->view && layout->view->info.loaded;
+}
+
+/* Sector map of a track, from its view or its entry in the metadata arena */
+static const uint8_t* track_smap(const ImdImageFile* imdf, size_t track_index) {
+    const ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    const uint8_t* smap = NULL;
+
+    if (layout->view) return layout->view->info.smap;
+    imd_track_arena_get_maps(&imdf->track_meta, layout->meta_index, &smap, NULL, NULL, NULL);
+    return smap;
+}
+
+/* Sector Data Record types of a track, from its view or its entry in the metadata arena */
+static const uint8_t* track_sflags(const ImdImageFile* imdf, size_t track_index) {
+    const ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    const uint8_t* sflag = NULL;
+
+    if (layout->view) return layout->view->info.sflag;
+    imd_track_arena_get_maps(&imdf->track_meta, layout->meta_index, NULL, NULL, NULL, &sflag);
+    return sflag;
+}
+
+/*
+ * A track as an ImdTrackInfo without its data: the view if the track has one,
+ * otherwise its arena entry expanded into scratch.
+ */
+static const ImdTrackInfo* track_info_of(const ImdImageFile* imdf, size_t track_index, ImdTrackInfo* scratch) {
+    const ImdfTrackLayout* layout = &imdf->layouts[track_index];
+
+    if (layout->view) return &layout->view->info;
+    if (imd_track_arena_get_view(&imdf->track_meta, layout->meta_index, scratch) != 0) memset(scratch, 0, sizeof(*scratch));
+    return scratch;
+}
+
+/* Copies the header fields of a track into its layout; called whenever they are set */
+static void set_track_header(ImdfTrackLayout* layout, const ImdTrackInfo* track) {
+    layout->cyl = track->cyl;
+    layout->head = track->head;
+    layout->num_sectors = track->num_sectors;
+    layout->sector_size = track->sector_size;
+}
+
+/* Builds a logical ID -> physical index table from a sector map */
+static void build_sector_lut(uint8_t* lut, const uint8_t* smap, uint8_t num_sectors) {
+    memset(lut, IMDF_NO_SECTOR, 256);
+    /* Walk backwards so the first of any duplicate IDs wins, like find_sector_index_internal */
+    for (uint8_t i = num_sectors; i-- > 0; ) {
+        lut[smap[i]] = i;
+    }
+}
+
+/* Rebuilds the sector lookup table of a view from its smap */
+static void rebuild_view_lut(ImdfTrackView* view) {
+    build_sector_lut(view->sector_lut, view->info.smap, view->info.num_sectors);
+}
+
+/*
+ * Expands a track indexed at open into a view, unless it has one. The caller holds
+ * the track's lock exclusively or the whole image.
+ */
+static int ensure_track_view(ImdImageFile* imdf, size_t track_index) {
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    ImdfTrackView* view;
+
+    if (layout->view) return IMDF_ERR_OK;
+    view = (ImdfTrackView*)imd_malloc(sizeof(ImdfTrackView));
+    if (!view) return IMDF_ERR_ALLOC;
+    if (imd_track_arena_get_view(&imdf->track_meta, layout->meta_index, &view->info) != 0) {
+        imd_free(view);
+        return IMDF_ERR_LIBIMD_ERR;
+    }
+    rebuild_view_lut(view);
+    layout->view = view;
+    return IMDF_ERR_OK;
+}
+
+/* Finds the physical index of a sector using the track's lookup table or its arena entry. Returns -1 if not found. */
+static int find_sector_index_cached(const ImdImageFile* imdf, size_t track_index, uint8_t logical_sector_id) {
+    const ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    const uint8_t* smap;
+    uint8_t phys;
+
+    if (!layout->view) {
+        smap = track_smap(imdf, track_index);
+        for (uint8_t i = 0; i < layout->num_sectors; ++i) {
+            if (smap[i] == logical_sector_id) return i;
+        }
+        return -1;
+    }
+    phys = layout->view->sector_lut[logical_sector_id];
+    return (phys == IMDF_NO_SECTOR) ? -1 : phys;
+}
+
+/* Rebuilds the (cyl, head) -> track index table. Must be called whenever track indices shift. */
+static void rebuild_track_lut(ImdImageFile* imdf) {
+    memset(imdf->track_lut, 0xFF, sizeof(imdf->track_lut)); /* All entries -1 */
+    /* Walk backwards so the first of any duplicate C/H tracks wins, like the linear scan */
+    for (size_t i = imdf->num_tracks; i-- > 0; ) {
+        const ImdfTrackLayout* layout = &imdf->layouts[i];
+        if (layout->head < IMDF_LUT_HEADS) {
+            imdf->track_lut[layout->cyl][layout->head] = (int)i;
+        }
+    }
+}
+
+/* Attribution of the calling thread's counters to an image, see stats_scope_begin */
+typedef struct {
+    int active;                 /* Counting was on at stats_scope_begin */
+    ImdStatCounters* previous;  /* Sink to restore */
+    uint64_t start;             /* imd_stats_clock() at stats_scope_begin */
+} ImdfStatsScope;
+
+/* Adds what the calling thread counts from here to stats_scope_end to the image as well */
+static void stats_scope_begin(ImdImageFile* imdf, ImdfStatsScope* scope) {
+    scope->active = imd_stats_active();
+    scope->previous = scope->active ? imd_stats_set_sink(&imdf->stats) : NULL;
+    scope->start = scope->active ? imd_stats_clock() : 0;
+}
+
+/* Ends a scope, adding its duration to time_id (IMD_STAT_COUNT for none) */
+static void stats_scope_end(ImdfStatsScope* scope, ImdStatId time_id) {
+    if (!scope->active) return;
+    if (time_id < IMD_STAT_COUNT) imd_stat_time(time_id, scope->start);
+    imd_stats_set_sink(scope->previous);
+}
+
+/* --- Locking --- */
+
+/* Access of a call that holds the table exclusively, or of any call on an unshared image */
+static const ImdfTrackAccess whole_image_access = { NULL, 1, 1 };
+
+static void table_lock_shared(ImdImageFile* imdf) {
+    if (imdf->locks) imd_rwlock_lock_shared(&imdf->locks->table);
+}
+
+static void table_unlock_shared(ImdImageFile* imdf) {
+    if (imdf->locks) imd_rwlock_unlock_shared(&imdf->locks->table);
+}
+
+static void table_lock_exclusive(const ImdImageFile* imdf) {
+    if (imdf->locks) imd_rwlock_lock_exclusive(&imdf->locks->table);
+}
+
+static void table_unlock_exclusive(const ImdImageFile* imdf) {
+    if (imdf->locks) imd_rwlock_unlock_exclusive(&imdf->locks->table);
+}
+
+static void io_lock(ImdImageFile* imdf) {
+    if (imdf->locks) imd_mutex_lock(&imdf->locks->io);
+}
+
+static void io_unlock(ImdImageFile* imdf) {
+    if (imdf->locks) imd_mutex_unlock(&imdf->locks->io);
+}
+
+static ImdRwLock* track_lock_of(ImdImageFile* imdf, uint8_t cyl, uint8_t head) {
+    return imdf->locks ? &imdf->locks->track[((unsigned)cyl << 1) | (head & 1)] : NULL;
+}
+
+/* Takes the lock of the track at (cyl, head); the caller holds the table shared */
+static void track_access_lock(ImdImageFile* imdf, uint8_t cyl, uint8_t head, int exclusive, ImdfTrackAccess* access) {
+    if (!imdf->locks) {
+        *access = whole_image_access;
+        return;
+    }
+    access->track_lock = track_lock_of(imdf, cyl, head);
+    access->exclusive = exclusive;
+    access->whole_image = 0;
+    if (exclusive) imd_rwlock_lock_exclusive(access->track_lock);
+    else imd_rwlock_lock_shared(access->track_lock);
+}
+
+static void track_access_unlock(ImdfTrackAccess* access) {
+    if (!access->track_lock) return;
+    if (access->exclusive) imd_rwlock_unlock_exclusive(access->track_lock);
+    else imd_rwlock_unlock_shared(access->track_lock);
+    access->track_lock = NULL;
+}
+
+/*
+ * Starts a call on the track at (cyl, head): table shared, and the track lock shared
+ * or exclusive. On an unshared image nothing is locked and the whole image may change.
+ */
+static void track_access_begin(ImdImageFile* imdf, uint8_t cyl, uint8_t head, int exclusive, ImdfTrackAccess* access) {
+    table_lock_shared(imdf);
+    track_access_lock(imdf, cyl, head, exclusive, access);
+}
+
+/* Trades a shared track lock for an exclusive one. Other threads may change the track in between. */
+static void track_access_upgrade(ImdfTrackAccess* access) {
+    if (!access->track_lock || access->exclusive) return;
+    imd_rwlock_unlock_shared(access->track_lock);
+    imd_rwlock_lock_exclusive(access->track_lock);
+    access->exclusive = 1;
+}
+
+static void track_access_end(ImdImageFile* imdf, ImdfTrackAccess* access) {
+    track_access_unlock(access);
+    table_unlock_shared(imdf);
+}
+
+/* Records that a track now differs from the file; safe under a track lock alone */
+static void set_pending_writes(ImdImageFile* imdf) {
+    io_lock(imdf);
+    imdf->pending_writes = 1;
+    io_unlock(imdf);
+}
+
+static void free_locks(ImdfLocks* locks) {
+    if (!locks) return;
+    imd_rwlock_destroy(&locks->table);
+    for (size_t i = 0; i < IMDF_TRACK_LOCKS; ++i) imd_rwlock_destroy(&locks->track[i]);
+    imd_mutex_destroy(&locks->io);
+    imd_free(locks);
+}
+
+static ImdfLocks* alloc_locks(void) {
+    ImdfLocks* locks = (ImdfLocks*)imd_malloc(sizeof(ImdfLocks));
+    size_t i;
+
+    if (!locks) return NULL;
+    if (imd_rwlock_init(&locks->table) != 0) {
+        imd_free(locks);
+        return NULL;
+    }
+    if (imd_mutex_init(&locks->io) != 0) {
+        imd_rwlock_destroy(&locks->table);
+        imd_free(locks);
+        return NULL;
+    }
+    for (i = 0; i < IMDF_TRACK_LOCKS; ++i) {
+        if (imd_rwlock_init(&locks->track[i]) != 0) break;
+    }
+    if (i < IMDF_TRACK_LOCKS) {
+        while (i-- > 0) imd_rwlock_destroy(&locks->track[i]);
+        imd_rwlock_destroy(&locks->table);
+        imd_mutex_destroy(&locks->io);
+        imd_free(locks);
+        return NULL;
+    }
+    return locks;
+}
+
 /* Converts libimd error code to libimdf error code */
 static int map_libimd_error(int imd_err) {
     switch (imd_err) {
@@ -104,6 +502,8 @@ static int map_libimd_error(int imd_err) {
         return IMDF_ERR_IO;
     case IMD_ERR_ALLOC:
         return IMDF_ERR_ALLOC;
+    case IMD_ERR_OPEN:
+        return IMDF_ERR_CANNOT_OPEN;
     case IMD_ERR_INVALID_ARG:
         return IMDF_ERR_INVALID_ARG;
     case IMD_ERR_BUFFER_TOO_SMALL:
@@ -121,74 +521,964 @@ static int map_libimd_error(int imd_err) {
     }
 }
 
+/* Releases the per-sector table of a track layout and marks it unknown */
+static void reset_track_layout(ImdfTrackLayout* layout) {
+    if (!layout) return;
+    imd_free(layout->sectors);
+    layout->sectors = NULL;
+    layout->offset = -1;
+    layout->length = 0;
+}
+
+/*
+ * Computes the file layout of a track record starting at 'offset', given the
+ * Sector Data Record types actually present in the file for that track.
+ * If the per-sector table cannot be allocated, only the record offset and
+ * length are kept, which disables in-place sector updates for that track.
+ */
+/*
+ * Length of the track record described by a track's header, maps and flags. Scans that
+ * read the data later reject a record whose final sector is cut short by the end of the
+ * image, which imd_read_track_header_and_flags accepts.
+ */
+static size_t track_record_length(const ImdTrackInfo* track) {
+    size_t len = 5 + track->num_sectors;
+
+    if (track->hflag & IMD_HFLAG_CMAP_PRES) len += track->num_sectors;
+    if (track->hflag & IMD_HFLAG_HMAP_PRES) len += track->num_sectors;
+    for (uint8_t i = 0; i < track->num_sectors; ++i) {
+        len += 1;
+        if (IMD_SDR_HAS_DATA(track->sflag[i])) {
+            len += IMD_SDR_IS_COMPRESSED(track->sflag[i]) ? 1 : track->sector_size;
+        }
+    }
+    return len;
+}
+
+static void build_track_layout(ImdfTrackLayout* layout, const ImdTrackInfo* track, const uint8_t* file_sflag, long offset) {
+    long pos;
+
+    reset_track_layout(layout);
+
+    if (track->num_sectors > 0) {
+        layout->sectors = (ImdfSectorLoc*)imd_malloc(track->num_sectors * sizeof(ImdfSectorLoc));
+        if (!layout->sectors) {
+            DEBUG_PRINTF("build_track_layout: Allocation failed for C%u H%u, in-place updates disabled.\n", track->cyl, track->head);
+        }
+    }
+
+    /* Track header: mode, cyl, head, nsec, size code, then the maps */
+    pos = offset + 5 + track->num_sectors;
+    if (track->hflag & IMD_HFLAG_CMAP_PRES) pos += track->num_sectors;
+    if (track->hflag & IMD_HFLAG_HMAP_PRES) pos += track->num_sectors;
+
+    for (uint8_t i = 0; i < track->num_sectors; ++i) {
+        uint8_t flag = file_sflag[i];
+        if (layout->sectors) {
+            layout->sectors[i].sflag = flag;
+            layout->sectors[i].offset = pos + 1; /* Payload follows the flag byte */
+            layout->sectors[i].dirty = 0;
+        }
+        pos += 1;
+        if (IMD_SDR_HAS_DATA(flag)) {
+            pos += IMD_SDR_IS_COMPRESSED(flag) ? 1 : (long)track->sector_size;
+        }
+    }
+
+    layout->offset = offset;
+    layout->length = pos - offset;
+    layout->state = IMDF_TRACK_CLEAN;
+    layout->clean_hash_valid = 0;
+}
+
+/*
+ * Indexes the next track of an image scanned at open: its maps and flags go to the
+ * metadata arena and the track gets no view until it is first used.
+ */
+static int index_scanned_track(ImdImageFile* imdf, const ImdTrackInfo* track, long offset) {
+    ImdfTrackLayout* layout = &imdf->layouts[imdf->num_tracks];
+    long meta_index = imd_track_arena_append(&imdf->track_meta, track, offset);
+
+    if (meta_index < 0) return map_libimd_error((int)meta_index);
+    build_track_layout(layout, track, track->sflag, offset);
+    set_track_header(layout, track);
+    layout->meta_index = (size_t)meta_index;
+    imdf->num_tracks++;
+    return IMDF_ERR_OK;
+}
+
+/* Gives back the metadata arena's growth slack once the scan at open is done */
+static void trim_track_meta(ImdImageFile* imdf) {
+    ImdTrackArena* arena = &imdf->track_meta;
+
+    if (arena->count > 0 && arena->count < arena->capacity) {
+        ImdCompactTrack* tracks = (ImdCompactTrack*)imd_realloc(arena->tracks, arena->count * sizeof(ImdCompactTrack));
+        if (tracks) {
+            arena->tracks = tracks;
+            arena->capacity = arena->count;
+        }
+    }
+    if (arena->bytes_used > 0 && arena->bytes_used < arena->bytes_capacity) {
+        uint8_t* bytes = (uint8_t*)imd_realloc(arena->bytes, arena->bytes_used);
+        if (bytes) {
+            arena->bytes = bytes;
+            arena->bytes_capacity = arena->bytes_used;
+        }
+    }
+}
+
+/* Drops the logical-order copy of a track's data after the track changed */
+static void invalidate_logical_data(ImdfTrackLayout* layout) {
+    imd_free(layout->logical_data);
+    layout->logical_data = NULL;
+}
+
+/* Drops the content hashes of a track that was replaced or released */
+static void release_track_hashes(ImdfTrackLayout* layout) {
+    imd_free(layout->sector_hashes);
+    layout->sector_hashes = NULL;
+    layout->hashed = 0;
+    layout->clean_hash_valid = 0;
+}
+
+/* Hashes a loaded track's sectors and the track itself, unless they are up to date */
+static int ensure_track_hashed(ImdImageFile* imdf, size_t track_index) {
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    const ImdTrackInfo* track;
+
+    if (layout->hashed) return IMDF_ERR_OK;
+    if (!track_is_loaded(layout)) return IMDF_ERR_LIBIMD_ERR;
+    track = &layout->view->info;
+    if (track->num_sectors > 0 && !layout->sector_hashes) {
+        /* A track keeps its sector count until it is replaced, which releases the array */
+        layout->sector_hashes = (uint64_t*)imd_malloc(track->num_sectors * sizeof(uint64_t));
+        if (!layout->sector_hashes) return IMDF_ERR_ALLOC;
+    }
+    for (uint8_t i = 0; i < track->num_sectors; ++i) {
+        layout->sector_hashes[i] = imd_hash_sector(track, i);
+    }
+    layout->track_hash = imd_hash_track(track, layout->sector_hashes);
+    layout->hashed = 1;
+    return IMDF_ERR_OK;
+}
+
+/* Brings known hashes up to date after sectors first..first+count-1 of a track changed */
+static void rehash_sectors(ImdImageFile* imdf, size_t track_index, size_t first, size_t count) {
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    const ImdTrackInfo* track;
+
+    if (!layout->hashed) return;
+    track = &layout->view->info; /* Hashed tracks were loaded */
+    for (size_t i = first; i < first + count; ++i) {
+        layout->sector_hashes[i] = imd_hash_sector(track, (uint8_t)i);
+    }
+    layout->track_hash = imd_hash_track(track, layout->sector_hashes);
+}
+
+/*
+ * Called before a deferred change to a track. With hash tracking on, a track that still
+ * matches the file has its hash kept, so that a flush can tell whether the change was undone.
+ */
+static void note_clean_hash(ImdImageFile* imdf, size_t track_index) {
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+
+    if (!imdf->hash_tracking || layout->state != IMDF_TRACK_CLEAN || layout->offset < 0) return;
+    layout->clean_hash_valid = (ensure_track_hashed(imdf, track_index) == IMDF_ERR_OK);
+    layout->clean_hash = layout->track_hash;
+}
+
+/* Marks tracks whose content is back to what the file holds as clean again (hash tracking) */
+static void clean_unchanged_tracks(ImdImageFile* imdf) {
+    for (size_t i = 0; i < imdf->num_tracks; ++i) {
+        ImdfTrackLayout* layout = &imdf->layouts[i];
+
+        if (layout->state == IMDF_TRACK_CLEAN || !layout->clean_hash_valid || layout->offset < 0) continue;
+        if (ensure_track_hashed(imdf, i) != IMDF_ERR_OK || layout->track_hash != layout->clean_hash) continue;
+        DEBUG_PRINTF("imdf_flush: Track C%u H%u is unchanged, not rewritten\n", layout->cyl, layout->head);
+        if (layout->sectors) {
+            for (uint8_t s = 0; s < layout->num_sectors; ++s) layout->sectors[s].dirty = 0;
+        }
+        layout->state = IMDF_TRACK_CLEAN;
+        layout->clean_hash_valid = 0;
+    }
+}
+
+/* --- Shared Data Store --- */
+
+#define IMDF_STORE_INITIAL_BUCKETS 256
+
+/* Whether data lives in the arena of the tracks loaded at open */
+static int data_in_arena(const ImdImageFile* imdf, const uint8_t* data) {
+    return data && imdf->data_arena && data >= imdf->data_arena && data < imdf->data_arena + imdf->data_arena_size;
+}
+
+/* Content key of a loaded, hashed track's data: the hash of its sector hashes */
+static uint64_t track_store_key(const ImdfTrackLayout* layout, const ImdTrackInfo* track) {
+    return imd_hash_bytes(layout->sector_hashes, track->num_sectors * sizeof(uint64_t), track->sector_size);
+}
+
+/* Finds the entry holding a copy of data; the caller holds store->lock */
+static ImdfStoreEntry* store_find(const ImdfDataStore* store, uint64_t key, const uint8_t* data, size_t size) {
+    for (ImdfStoreEntry* entry = store->buckets[key & (store->num_buckets - 1)]; entry; entry = entry->next) {
+        if (entry->key == key && entry->size == size && memcmp(entry->data, data, size) == 0) return entry;
+    }
+    return NULL;
+}
+
+/* Adds a reference to an entry; the caller holds store->lock */
+static void store_ref(ImdfDataStore* store, ImdfStoreEntry* entry) {
+    entry->refs++;
+    store->num_refs++;
+    store->bytes_referenced += entry->size;
+}
+
+/* Doubles the bucket count; the caller holds store->lock. Without memory the chains just grow longer. */
+static void store_grow(ImdfDataStore* store) {
+    size_t num_buckets = store->num_buckets * 2;
+    ImdfStoreEntry** buckets = (ImdfStoreEntry**)imd_calloc(num_buckets, sizeof(ImdfStoreEntry*));
+
+    if (!buckets) return;
+    for (size_t b = 0; b < store->num_buckets; ++b) {
+        ImdfStoreEntry* entry = store->buckets[b];
+        while (entry) {
+            ImdfStoreEntry* next = entry->next;
+            entry->next = buckets[entry->key & (num_buckets - 1)];
+            buckets[entry->key & (num_buckets - 1)] = entry;
+            entry = next;
+        }
+    }
+    imd_free(store->buckets);
+    store->buckets = buckets;
+    store->num_buckets = num_buckets;
+}
+
+/* Inserts a new entry holding one reference; the caller holds store->lock */
+static void store_insert(ImdfDataStore* store, ImdfStoreEntry* entry) {
+    ImdfStoreEntry** bucket;
+
+    if (store->num_entries >= store->num_buckets) store_grow(store);
+    bucket = &store->buckets[entry->key & (store->num_buckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    entry->refs = 0;
+    store->num_entries++;
+    store->bytes_stored += entry->size;
+    store_ref(store, entry);
+}
+
+/* Drops a reference; the last one takes the entry out of the store. Returns the entry if it was taken out. */
+static ImdfStoreEntry* store_unref_locked(ImdfDataStore* store, ImdfStoreEntry* entry) {
+    ImdfStoreEntry** link;
+
+    entry->refs--;
+    store->num_refs--;
+    store->bytes_referenced -= entry->size;
+    if (entry->refs > 0) return NULL;
+
+    link = &store->buckets[entry->key & (store->num_buckets - 1)];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    store->num_entries--;
+    store->bytes_stored -= entry->size;
+    return entry;
+}
+
+/* Drops a track's reference to an entry, freeing the buffer with the last reference */
+static void store_unref(ImdfDataStore* store, ImdfStoreEntry* entry) {
+    ImdfStoreEntry* removed;
+
+    imd_mutex_lock(&store->lock);
+    removed = store_unref_locked(store, entry);
+    imd_mutex_unlock(&store->lock);
+    if (removed) {
+        imd_free(removed->data);
+        imd_free(removed);
+    }
+}
+
+/* Drops one user of a store, freeing it with the last one (no images are attached by then) */
+static void store_unuse(ImdfDataStore* store) {
+    size_t users;
+
+    imd_mutex_lock(&store->lock);
+    users = --store->users;
+    imd_mutex_unlock(&store->lock);
+    if (users > 0) return;
+    imd_free(store->buckets);
+    imd_mutex_destroy(&store->lock);
+    imd_free(store);
+}
+
+/*
+ * Points a loaded track at the store's copy of its data, adding the data to the store
+ * if it is not there yet. Best effort: a track that cannot be shared keeps its own data.
+ */
+static void share_track_data(ImdImageFile* imdf, size_t track_index) {
+    ImdfDataStore* store = imdf->store;
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    ImdTrackInfo* track = layout->view ? &layout->view->info : NULL;
+    ImdfStoreEntry* entry;
+    ImdfStoreEntry* fresh;
+    uint64_t key;
+
+    if (!store || layout->shared || !track || !track->loaded || !track->data || track->data_size == 0) return;
+    if (ensure_track_hashed(imdf, track_index) != IMDF_ERR_OK) return;
+    key = track_store_key(layout, track);
+
+    imd_mutex_lock(&store->lock);
+    entry = store_find(store, key, track->data, track->data_size);
+    if (entry) store_ref(store, entry);
+    imd_mutex_unlock(&store->lock);
+
+    if (!entry) {
+        /* New data: the store takes over the track's buffer, or a copy of its part of the arena */
+        fresh = (ImdfStoreEntry*)imd_malloc(sizeof(ImdfStoreEntry));
+        if (!fresh) return;
+        fresh->key = key;
+        fresh->size = track->data_size;
+        fresh->data = track->data;
+        if (data_in_arena(imdf, track->data)) {
+            fresh->data = (uint8_t*)imd_malloc(track->data_size);
+            if (!fresh->data) {
+                imd_free(fresh);
+                return;
+            }
+            memcpy(fresh->data, track->data, track->data_size);
+        }
+
+        imd_mutex_lock(&store->lock);
+        entry = store_find(store, key, track->data, track->data_size); /* Another image may have added it meanwhile */
+        if (entry) store_ref(store, entry);
+        else store_insert(store, fresh);
+        imd_mutex_unlock(&store->lock);
+
+        if (entry) {
+            if (fresh->data != track->data) imd_free(fresh->data);
+            imd_free(fresh);
+        }
+        else {
+            entry = fresh;
+        }
+    }
+
+    if (entry->data != track->data && !data_in_arena(imdf, track->data)) imd_free(track->data);
+    track->data = entry->data;
+    layout->shared = entry;
+}
+
+/* Gives a track its own copy of shared data before the data is changed (copy-on-write) */
+static int own_track_data(ImdImageFile* imdf, size_t track_index) {
+    ImdfDataStore* store = imdf->store;
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    ImdTrackInfo* track;
+    ImdfStoreEntry* removed = NULL;
+    uint8_t* copy;
+
+    if (!layout->shared) return IMDF_ERR_OK;
+    track = &layout->view->info; /* Shared data belongs to a loaded track */
+
+    /* The only user of a buffer takes it back out of the store instead of copying it */
+    imd_mutex_lock(&store->lock);
+    if (layout->shared->refs == 1) removed = store_unref_locked(store, layout->shared);
+    imd_mutex_unlock(&store->lock);
+    if (removed) {
+        imd_free(removed);
+        layout->shared = NULL;
+        return IMDF_ERR_OK;
+    }
+
+    copy = (uint8_t*)imd_malloc(track->data_size);
+    if (!copy) return IMDF_ERR_ALLOC;
+    memcpy(copy, track->data, track->data_size);
+    store_unref(store, layout->shared);
+    layout->shared = NULL;
+    track->data = copy;
+    return IMDF_ERR_OK;
+}
+
+/*
+ * Releases a track's sector data. Data that lives in the image's shared arena
+ * is only detached; the arena itself is freed when the image is closed.
+ * Data in a store loses the track's reference.
+ */
+static void release_track_data(ImdImageFile* imdf, size_t track_index) {
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    ImdTrackInfo* track;
+
+    if (!layout->view) return; /* Never loaded */
+    track = &layout->view->info;
+    if (layout->shared || data_in_arena(imdf, track->data)) {
+        if (layout->shared) store_unref(imdf->store, layout->shared);
+        layout->shared = NULL;
+        track->data = NULL;
+        track->data_size = 0;
+        track->loaded = 0;
+        return;
+    }
+    imd_free_track_data(track);
+}
+
+/* Releases a track's sector data and its view, as when the track is removed or the image closed */
+static void release_track_view(ImdImageFile* imdf, size_t track_index) {
+    release_track_data(imdf, track_index);
+    imd_free(imdf->layouts[track_index].view);
+    imdf->layouts[track_index].view = NULL;
+}
+
+/* Marks a track as needing to be re-encoded on the next flush */
+static void mark_track_dirty(ImdImageFile* imdf, size_t track_index) {
+    imdf->layouts[track_index].state = IMDF_TRACK_DIRTY;
+    set_pending_writes(imdf);
+}
+
+/* File offset where the record of the given track starts, -1 if unknown */
+static long track_record_offset(const ImdImageFile* imdf, size_t track_index) {
+    const ImdfTrackLayout* prev;
+
+    if (track_index == 0) return imdf->tracks_offset;
+    prev = &imdf->layouts[track_index - 1];
+    return (prev->offset >= 0) ? prev->offset + prev->length : -1;
+}
+
+/*
+ * Overwrites a single normal (uncompressed) sector record in place.
+ * Only valid when the record in the file already holds the full sector data,
+ * so the record length cannot change. The caller flushes the stream.
+ */
+static int patch_sector_in_place(ImdImageFile* imdf, const ImdfSectorLoc* loc, const uint8_t* data, uint32_t size) {
+    ImdfStatsScope scope;
+    int res = IMDF_ERR_OK;
+
+    stats_scope_begin(imdf, &scope);
+    if (imd_stat_fseek(imdf->file_ptr, loc->offset, SEEK_SET) != 0) {
+        perror("libimdf: fseek failed before in-place sector write");
+        res = IMDF_ERR_IO;
+    }
+    else if (imd_write_bytes(data, size, imdf->file_ptr) != 0) {
+        perror("libimdf: in-place sector write failed");
+        res = IMDF_ERR_IO;
+    }
+    stats_scope_end(&scope, IMD_STAT_COUNT);
+    return res;
+}
+
+/* Maps an image file read-only into memory. An empty file yields an empty mapping. */
+static int map_image_file(ImdImageFile* imdf, const char* path) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    HANDLE mapping;
+    void* view;
+
+    if (file == INVALID_HANDLE_VALUE) {
+        DEBUG_PRINTF("map_image_file: CreateFileA('%s') failed: %lu\n", path, GetLastError());
+        return IMDF_ERR_CANNOT_OPEN;
+    }
+    if (!GetFileSizeEx(file, &size) || (unsigned long long)size.QuadPart > (unsigned long long)LONG_MAX) {
+        CloseHandle(file);
+        return IMDF_ERR_IO;
+    }
+    if (size.QuadPart == 0) {
+        CloseHandle(file);
+        return IMDF_ERR_OK; /* Nothing to map */
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        DEBUG_PRINTF("map_image_file: CreateFileMappingA failed: %lu\n", GetLastError());
+        return IMDF_ERR_IO;
+    }
+    view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); /* The view keeps the mapping alive */
+    if (!view) {
+        DEBUG_PRINTF("map_image_file: MapViewOfFile failed: %lu\n", GetLastError());
+        return IMDF_ERR_IO;
+    }
+    imdf->map_base = (const uint8_t*)view;
+    imdf->map_size = (size_t)size.QuadPart;
+#else /* Assume POSIX */
+    struct stat st;
+    void* view;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        DEBUG_PRINTF("map_image_file: open('%s') failed: %s\n", path, strerror(errno));
+        return IMDF_ERR_CANNOT_OPEN;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < 0 || (unsigned long long)st.st_size > (unsigned long long)LONG_MAX) {
+        close(fd);
+        return IMDF_ERR_IO;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return IMDF_ERR_OK; /* Nothing to map */
+    }
+    view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /* The mapping stays valid after the descriptor is closed */
+    if (view == MAP_FAILED) {
+        DEBUG_PRINTF("map_image_file: mmap failed: %s\n", strerror(errno));
+        return IMDF_ERR_IO;
+    }
+    imdf->map_base = (const uint8_t*)view;
+    imdf->map_size = (size_t)st.st_size;
+#endif
+    return IMDF_ERR_OK;
+}
+
+/* Releases the mapping created by map_image_file, or the buffer of an image opened from memory */
+static void unmap_image_file(ImdImageFile* imdf) {
+    if (imdf->map_buffer) {
+        imd_free(imdf->map_buffer);
+        imdf->map_buffer = NULL;
+    }
+    else if (imdf->map_base) {
+#ifdef _WIN32
+        UnmapViewOfFile((LPCVOID)imdf->map_base);
+#else
+        munmap((void*)imdf->map_base, imdf->map_size);
+#endif
+    }
+    imdf->map_base = NULL;
+    imdf->map_size = 0;
+}
+
+/* Expands an unloaded track from the mapping or the file */
+static int load_track_from_source(ImdImageFile* imdf, size_t track_index) {
+    const ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    ImdTrackInfo* track;
+    ImdTrackInfo loaded_track;
+    int res;
+
+    if (layout->offset < 0) {
+        DEBUG_PRINTF("ensure_track_loaded: No source for unloaded track %zu (C%u H%u)\n", track_index, layout->cyl, layout->head);
+        return IMDF_ERR_LIBIMD_ERR;
+    }
+    res = ensure_track_view(imdf, track_index);
+    if (res != IMDF_ERR_OK) return res;
+    track = &layout->view->info;
+
+    if (imdf->map_base) {
+        if ((size_t)layout->offset >= imdf->map_size) return IMDF_ERR_LIBIMD_ERR;
+        res = imd_load_track_buffer(imdf->map_base + layout->offset, imdf->map_size - (size_t)layout->offset,
+                                    &loaded_track, LIBIMD_FILL_BYTE_DEFAULT, NULL);
+    }
+    else if (imdf->file_ptr) {
+        io_lock(imdf);
+        if (imd_stat_fseek(imdf->file_ptr, layout->offset, SEEK_SET) != 0) {
+            io_unlock(imdf);
+            perror("libimdf: fseek failed before loading track");
+            return IMDF_ERR_IO;
+        }
+        res = imd_load_track(imdf->file_ptr, &loaded_track, LIBIMD_FILL_BYTE_DEFAULT);
+        io_unlock(imdf);
+    }
+    else {
+        return IMDF_ERR_LIBIMD_ERR;
+    }
+    if (res != 1) {
+        DEBUG_PRINTF("ensure_track_loaded: Loading track %zu returned %d\n", track_index, res);
+        return (res == 0) ? IMDF_ERR_LIBIMD_ERR : map_libimd_error(res);
+    }
+    /* The header and maps were indexed from the same record at open: only the parts the load adds are stored */
+    memcpy(track->sflag, loaded_track.sflag, sizeof(track->sflag));
+    memcpy(track->uniform_map, loaded_track.uniform_map, sizeof(track->uniform_map));
+    track->data = loaded_track.data;
+    track->data_size = loaded_track.data_size;
+    track->loaded = loaded_track.loaded;
+    return IMDF_ERR_OK;
+}
+
+/*
+ * Makes sure the sector data of a track is in memory.
+ * Tracks of a mapped or lazily opened image are only expanded from the mapping
+ * or the file when first needed.
+ */
+static int ensure_track_loaded(ImdImageFile* imdf, size_t track_index) {
+    ImdfStatsScope scope;
+    int res;
+
+    if (track_is_loaded(&imdf->layouts[track_index])) return IMDF_ERR_OK;
+    stats_scope_begin(imdf, &scope);
+    res = load_track_from_source(imdf, track_index);
+    stats_scope_end(&scope, IMD_STAT_LOAD_NS);
+    if (res == IMDF_ERR_OK) share_track_data(imdf, track_index);
+    return res;
+}
+
+/* Version string written to the header line when the image is rewritten or serialized */
+static const char* header_version(const ImdImageFile* imdf) {
+    /* Use a known valid default if the loaded version is empty or the specific "Unknown" placeholder */
+    if (imdf->header_info.version[0] == '\0' ||
+        strcmp(imdf->header_info.version, "Unknown") == 0)
+    {
+        DEBUG_PRINTF("Using default version '%s' because loaded version was invalid/empty ('%s').\n",
+            LIBIMDF_DEFAULT_VERSION, imdf->header_info.version);
+        return LIBIMDF_DEFAULT_VERSION; /* Default valid version */
+    }
+    /* Otherwise, use the version string loaded from the original header */
+    return imdf->header_info.version;
+}
+
+/* Encoded bytes of the clean track records a rewrite copies verbatim */
+typedef struct {
+    uint8_t* bytes;             /* File contents from 'start' to 'end', NULL if none */
+    long start;                 /* File offset of bytes[0] */
+    long end;                   /* File offset just past the last byte held */
+} ImdfRawRecords;
+
+/* Write options a rewrite uses for the given track */
+static const ImdWriteOpts* rewrite_opts_for(size_t track_index, size_t modified_track_index, const ImdWriteOpts* modified_track_opts) {
+    if (track_index == modified_track_index && modified_track_opts != NULL) return modified_track_opts;
+    return &default_libimdf_write_opts;
+}
+
+/* Whether the snapshot holds the complete record of a track */
+static int record_in_snapshot(const ImdfTrackLayout* layout, const ImdfRawRecords* raw) {
+    return raw->bytes && layout->offset >= raw->start && layout->length > 0 &&
+           layout->offset + layout->length <= raw->end;
+}
+
+/*
+ * Whether a rewrite may copy a track record verbatim: the file still matches
+ * memory and the options would re-encode the track to the same bytes.
+ */
+static int can_copy_track_record(const ImdImageFile* imdf, size_t track_index, const ImdWriteOpts* opts, const ImdfRawRecords* raw) {
+    const ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    return layout->state == IMDF_TRACK_CLEAN && record_in_snapshot(layout, raw) && imd_write_opts_is_identity(opts);
+}
+
+/*
+ * Reads the records of the clean tracks from first_track on in one pass, so
+ * they can be copied after earlier records have been overwritten. On any
+ * failure the snapshot stays empty and every track is re-encoded instead.
+ */
+static void snapshot_clean_records(ImdImageFile* imdf, size_t first_track, size_t modified_track_index,
+                                   const ImdWriteOpts* modified_track_opts, ImdfRawRecords* raw) {
+    long start = -1;
+    long end = -1;
+    uint8_t* bytes;
+
+    raw->bytes = NULL;
+    raw->start = -1;
+    raw->end = -1;
+
+    for (size_t i = first_track; i < imdf->num_tracks; ++i) {
+        const ImdfTrackLayout* layout = &imdf->layouts[i];
+        if (layout->state != IMDF_TRACK_CLEAN || layout->offset < 0 || layout->length <= 0) continue;
+        if (!imd_write_opts_is_identity(rewrite_opts_for(i, modified_track_index, modified_track_opts))) continue;
+        if (start < 0 || layout->offset < start) start = layout->offset;
+        if (layout->offset + layout->length > end) end = layout->offset + layout->length;
+    }
+    if (start < 0) return;
+
+    bytes = (uint8_t*)imd_malloc((size_t)(end - start));
+    if (!bytes) {
+        DEBUG_PRINTF("snapshot_clean_records: Allocation of %ld bytes failed, re-encoding all tracks.\n", end - start);
+        return;
+    }
+    if (imd_stat_fseek(imdf->file_ptr, start, SEEK_SET) != 0 ||
+        imd_stat_fread(bytes, 1, (size_t)(end - start), imdf->file_ptr) != (size_t)(end - start)) {
+        DEBUG_PRINTF("snapshot_clean_records: Reading records %ld-%ld failed, re-encoding all tracks.\n", start, end);
+        imd_free(bytes);
+        return;
+    }
+    raw->bytes = bytes;
+    raw->start = start;
+    raw->end = end;
+}
+
+/* Expands an unloaded track from its record in the snapshot */
+static int adopt_track_record(ImdImageFile* imdf, size_t track_index, const ImdfRawRecords* raw) {
+    const ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    ImdTrackInfo loaded_track;
+    int res;
+
+    if (track_is_loaded(layout)) return IMDF_ERR_OK;
+    res = ensure_track_view(imdf, track_index);
+    if (res != IMDF_ERR_OK) return res;
+    res = imd_load_track_buffer(raw->bytes + (layout->offset - raw->start), (size_t)layout->length,
+                                &loaded_track, LIBIMD_FILL_BYTE_DEFAULT, NULL);
+    if (res != 1) {
+        return (res == 0) ? IMDF_ERR_LIBIMD_ERR : map_libimd_error(res);
+    }
+    layout->view->info = loaded_track;
+    return IMDF_ERR_OK;
+}
+
+/*
+ * Writes the snapshot of a track record at the current file position and
+ * moves its layout to *track_pos. The track does not need to be loaded.
+ */
+static int copy_track_record(ImdImageFile* imdf, size_t track_index, const ImdfRawRecords* raw, long* track_pos) {
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    const uint8_t* record = raw->bytes + (layout->offset - raw->start);
+    int res;
+
+    if (*track_pos < 0) {
+        /* The new location of the record will be unknown: keep the data in memory */
+        res = adopt_track_record(imdf, track_index, raw);
+        if (res != IMDF_ERR_OK) return res;
+    }
+
+    res = imd_write_bytes(record, (size_t)layout->length, imdf->file_ptr);
+    if (res != 0) return map_libimd_error(res);
+
+    if (*track_pos >= 0) {
+        long delta = *track_pos - layout->offset;
+        if (layout->sectors) {
+            for (uint8_t s = 0; s < layout->num_sectors; ++s) {
+                layout->sectors[s].offset += delta;
+            }
+        }
+        layout->offset = *track_pos;
+        *track_pos += layout->length;
+    }
+    else {
+        reset_track_layout(layout);
+        layout->state = IMDF_TRACK_CLEAN;
+        layout->clean_hash_valid = 0;
+    }
+    return IMDF_ERR_OK;
+}
+
+/* A track record encoded ahead of a rewrite by a worker thread */
+typedef struct {
+    uint8_t* bytes;             /* Encoded record, NULL if the track is copied instead */
+    size_t size;                /* Length of the record in bytes */
+    int status;                 /* Result of imd_encode_track_to_buffer */
+    int sflag_status;           /* Result of imd_compute_write_sflags */
+    uint8_t sflag[LIBIMD_MAX_SECTORS_PER_TRACK]; /* Record type written for each sector */
+    ImdStatCounters stats;      /* Counted by the worker, added to the image afterwards */
+} ImdfEncodeJob;
+
+/* Shared state of the parallel pre-encoding pass of rewrite_records */
+typedef struct {
+    ImdImageFile* imdf;
+    size_t first_track;         /* Track of jobs[0] */
+    size_t modified_track_index;
+    const ImdWriteOpts* modified_track_opts;
+    const ImdfRawRecords* raw;
+    ImdfEncodeJob* jobs;
+} ImdfEncodeContext;
+
+static void encode_track_job(size_t index, void* ctx) {
+    ImdfEncodeContext* encode = (ImdfEncodeContext*)ctx;
+    ImdfEncodeJob* job = &encode->jobs[index];
+    size_t track_index = encode->first_track + index;
+    ImdTrackInfo* track;
+    const ImdWriteOpts* opts = rewrite_opts_for(track_index, encode->modified_track_index, encode->modified_track_opts);
+    ImdStatCounters* previous_sink = NULL;
+    int counting = imd_stats_active();
+    size_t bound;
+
+    job->bytes = NULL;
+    job->size = 0;
+    job->status = 0;
+    memset(&job->stats, 0, sizeof(job->stats));
+    if (can_copy_track_record(encode->imdf, track_index, opts, encode->raw)) return;
+    track = &encode->imdf->layouts[track_index].view->info; /* Loaded by rewrite_records */
+
+    /* Worker threads count into the job: the image's counters belong to the calling thread */
+    if (counting) previous_sink = imd_stats_set_sink(&job->stats);
+    bound = imd_track_encoded_size_bound(track);
+    job->bytes = (uint8_t*)imd_malloc(bound > 0 ? bound : 1);
+    if (!job->bytes) {
+        job->status = IMD_ERR_ALLOC;
+    }
+    else {
+        job->status = imd_encode_track_to_buffer(track, opts, job->bytes, bound, &job->size);
+        job->sflag_status = imd_compute_write_sflags(track, opts, job->sflag);
+    }
+    if (counting) imd_stats_set_sink(previous_sink);
+}
+
+/* Releases a job array returned by encode_tracks_ahead */
+static void free_encode_jobs(ImdfEncodeJob* jobs, size_t count) {
+    if (!jobs) return;
+    for (size_t i = 0; i < count; ++i) {
+        imd_free(jobs[i].bytes);
+    }
+    imd_free(jobs);
+}
+
 /*
- * Rewrites the entire IMD file from the in-memory structures.
- * This is necessary after modifications to ensure file consistency.
- * Applies specific write options for a potentially modified track.
- * If modified_track_index is >= num_tracks, it implies no specific opts, use default for all.
+ * Encodes the tracks from first_track on that a rewrite cannot copy, on
+ * imdf->worker_threads threads. Returns NULL when running serially or if the
+ * job array cannot be allocated, in which case each track is encoded as it is written.
  */
-static int rewrite_image_file(ImdImageFile* imdf, size_t modified_track_index, const ImdWriteOpts* modified_track_opts) {
-    if (!imdf || !imdf->file_ptr) { /* No write_protected check, caller should do it */
-        return IMDF_ERR_INVALID_ARG;
+static ImdfEncodeJob* encode_tracks_ahead(ImdImageFile* imdf, size_t first_track, size_t modified_track_index,
+                                          const ImdWriteOpts* modified_track_opts, const ImdfRawRecords* raw) {
+    ImdfEncodeContext encode;
+    size_t count = imdf->num_tracks - first_track;
+
+    if (imdf->worker_threads <= 1 || count <= 1) return NULL;
+
+    encode.jobs = (ImdfEncodeJob*)imd_malloc(count * sizeof(ImdfEncodeJob));
+    if (!encode.jobs) return NULL;
+    encode.imdf = imdf;
+    encode.first_track = first_track;
+    encode.modified_track_index = modified_track_index;
+    encode.modified_track_opts = modified_track_opts;
+    encode.raw = raw;
+    imd_parallel_for(count, imdf->worker_threads, encode_track_job, &encode);
+    for (size_t i = 0; i < count; ++i) {
+        imd_stats_merge(&imdf->stats, &encode.jobs[i].stats);
     }
+    return encode.jobs;
+}
 
-    DEBUG_PRINTF("Rewriting image file '%s' (modified index: %zu)\n", imdf->file_path, modified_track_index);
+/*
+ * Writes a loaded track at the current file position and records its layout at
+ * *track_pos. The record is taken from 'encoded' if the track was encoded ahead,
+ * and encoded now if it is NULL.
+ */
+static int write_track_record(ImdImageFile* imdf, size_t track_index, const ImdWriteOpts* opts,
+                              const ImdfEncodeJob* encoded, long* track_pos) {
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    ImdTrackInfo* track;
+    int res;
 
-    /* Seek to beginning to overwrite */
-    if (fseek(imdf->file_ptr, 0, SEEK_SET) != 0) {
-        perror("libimdf: fseek failed before rewrite");
-        return IMDF_ERR_IO;
+    if (!track_is_loaded(layout)) {
+        DEBUG_PRINTF("Rewrite Error: Track %zu (C%u H%u) not marked as loaded!\n", track_index, layout->cyl, layout->head);
+        return IMDF_ERR_LIBIMD_ERR; /* Internal state error */
     }
+    track = &layout->view->info;
 
-    /* Write Header */
-    const char* version_to_write = NULL;
-    /* Use a known valid default if the loaded version is empty or the specific "Unknown" placeholder */
-    if (imdf->header_info.version[0] == '\0' ||
-        strcmp(imdf->header_info.version, "Unknown") == 0)
-    {
-        version_to_write = "1.19"; /* Default valid version */
-        DEBUG_PRINTF("Rewrite: Using default version '%s' because loaded version was invalid/empty ('%s').\n",
-            version_to_write, imdf->header_info.version);
+    if (encoded && !encoded->bytes) encoded = NULL; /* Not encoded ahead (out of memory): encode now */
+    if (encoded && encoded->status != 0) {
+        DEBUG_PRINTF("Rewrite failed: encoding track %zu returned %d\n", track_index, encoded->status);
+        return map_libimd_error(encoded->status);
+    }
+
+    /* Record where each sector lands so later writes can be patched in place */
+    uint8_t written_sflag[LIBIMD_MAX_SECTORS_PER_TRACK];
+    const uint8_t* sflag = written_sflag;
+    int sflag_status;
+    if (encoded) {
+        sflag = encoded->sflag;
+        sflag_status = encoded->sflag_status;
     }
     else {
-        /* Otherwise, use the version string loaded from the original header */
-        version_to_write = imdf->header_info.version;
-        DEBUG_PRINTF("Rewrite: Using loaded version '%s'.\n", version_to_write);
+        sflag_status = (*track_pos >= 0) ? imd_compute_write_sflags(track, opts, written_sflag) : -1;
     }
-    int res = imd_write_file_header(imdf->file_ptr, version_to_write);
-    if (res != 0) {
-        DEBUG_PRINTF("Rewrite failed: imd_write_file_header returned %d\n", res);
-        return map_libimd_error(res);
+    if (*track_pos >= 0 && sflag_status == 0) {
+        build_track_layout(layout, track, sflag, *track_pos);
+        *track_pos += layout->length;
+    }
+    else {
+        reset_track_layout(layout);
+        layout->state = IMDF_TRACK_CLEAN; /* Still written below, just not located */
+        layout->clean_hash_valid = 0;
+        *track_pos = -1; /* Offsets of all following tracks are unknown */
     }
 
-    /* Write Comment */
-    res = imd_write_comment_block(imdf->file_ptr, imdf->comment, imdf->comment_len);
+    if (encoded) {
+        res = imd_write_bytes(encoded->bytes, encoded->size, imdf->file_ptr);
+    }
+    else {
+        res = imd_write_track_imd(imdf->file_ptr, track, opts);
+    }
     if (res != 0) {
-        DEBUG_PRINTF("Rewrite failed: imd_write_comment_block returned %d\n", res);
+        DEBUG_PRINTF("Rewrite failed: imd_write_track_imd for track %zu returned %d\n", track_index, res);
         return map_libimd_error(res);
     }
+    return IMDF_ERR_OK;
+}
 
-    /* Write Tracks */
-    for (size_t i = 0; i < imdf->num_tracks; ++i) {
-        const ImdWriteOpts* opts_to_use = &default_libimdf_write_opts;
-        if (i == modified_track_index && modified_track_opts != NULL) {
-            opts_to_use = modified_track_opts;
-            DEBUG_PRINTF("Using modified opts for track %zu (C%u H%u)\n", i, imdf->tracks[i].cyl, imdf->tracks[i].head);
-        }
-        else {
-            DEBUG_PRINTF("Using default opts for track %zu (C%u H%u)\n", i, imdf->tracks[i].cyl, imdf->tracks[i].head);
+/*
+ * Rewrites the IMD file from the in-memory structures, starting with the
+ * record of track 'first_track'. Earlier records are left untouched, so they
+ * must already match memory. If first_track is 0, or the offset of its record
+ * is unknown, the header and comment are rewritten as well.
+ * Applies specific write options for a potentially modified track.
+ * If modified_track_index is >= num_tracks, it implies no specific opts, use default for all.
+ */
+static int rewrite_records(ImdImageFile* imdf, size_t first_track, size_t modified_track_index,
+                           const ImdWriteOpts* modified_track_opts, const ImdfRawRecords* raw) {
+    long track_pos = -1;
+    ImdfEncodeJob* encoded = NULL;
+    int res;
+
+    if (!imdf || !imdf->file_ptr) { /* No write_protected check, caller should do it */
+        return IMDF_ERR_INVALID_ARG;
+    }
+
+    if (first_track > 0 && first_track < imdf->num_tracks) {
+        track_pos = track_record_offset(imdf, first_track);
+    }
+    if (track_pos < 0) {
+        first_track = 0;
+    }
+
+    DEBUG_PRINTF("Rewriting image file '%s' from track %zu (modified index: %zu)\n", imdf->file_path, first_track, modified_track_index);
+
+    /* Records of unloaded tracks are about to be overwritten: read them all first */
+    for (size_t i = first_track; i < imdf->num_tracks; ++i) {
+        if (can_copy_track_record(imdf, i, rewrite_opts_for(i, modified_track_index, modified_track_opts), raw)) continue;
+        res = ensure_track_loaded(imdf, i);
+        if (res != IMDF_ERR_OK) {
+            DEBUG_PRINTF("Rewrite failed: cannot load track %zu before overwriting it (%d)\n", i, res);
+            return res;
         }
+    }
+
+    /* Encode the tracks on the worker threads; the records are then written in order */
+    encoded = encode_tracks_ahead(imdf, first_track, modified_track_index, modified_track_opts, raw);
+
+    /* Seek to the first record to overwrite */
+    if (imd_stat_fseek(imdf->file_ptr, (first_track > 0) ? track_pos : 0, SEEK_SET) != 0) {
+        perror("libimdf: fseek failed before rewrite");
+        res = IMDF_ERR_IO;
+        goto done;
+    }
 
-        if (!imdf->tracks[i].loaded) {
-            DEBUG_PRINTF("Rewrite Error: Track %zu (C%u H%u) not marked as loaded!\n", i, imdf->tracks[i].cyl, imdf->tracks[i].head);
-            return IMDF_ERR_LIBIMD_ERR; /* Internal state error */
+    if (first_track == 0) {
+        /* Write Header */
+        res = imd_write_file_header(imdf->file_ptr, header_version(imdf));
+        if (res != 0) {
+            DEBUG_PRINTF("Rewrite failed: imd_write_file_header returned %d\n", res);
+            res = map_libimd_error(res);
+            goto done;
         }
 
-        res = imd_write_track_imd(imdf->file_ptr, &imdf->tracks[i], opts_to_use);
+        /* Write Comment */
+        res = imd_write_comment_block(imdf->file_ptr, imdf->comment, imdf->comment_len);
         if (res != 0) {
-            DEBUG_PRINTF("Rewrite failed: imd_write_track_imd for track %zu (C%u H%u) returned %d\n",
-                i, imdf->tracks[i].cyl, imdf->tracks[i].head, res);
-            return map_libimd_error(res);
+            DEBUG_PRINTF("Rewrite failed: imd_write_comment_block returned %d\n", res);
+            res = map_libimd_error(res);
+            goto done;
+        }
+
+        /* Track records start right after the comment terminator */
+        track_pos = ftell(imdf->file_ptr);
+        imdf->tracks_offset = track_pos;
+    }
+
+    /* Write Tracks */
+    for (size_t i = first_track; i < imdf->num_tracks; ++i) {
+        const ImdWriteOpts* opts_to_use = rewrite_opts_for(i, modified_track_index, modified_track_opts);
+        DEBUG_PRINTF("Using %s opts for track %zu (C%u H%u)\n", (opts_to_use == modified_track_opts) ? "modified" : "default",
+            i, imdf->layouts[i].cyl, imdf->layouts[i].head);
+
+        /* Unchanged records are copied as read, without decoding them */
+        if (can_copy_track_record(imdf, i, opts_to_use, raw)) {
+            res = copy_track_record(imdf, i, raw, &track_pos);
+        }
+        else {
+            res = write_track_record(imdf, i, opts_to_use, encoded ? &encoded[i - first_track] : NULL, &track_pos);
+        }
+        if (res != IMDF_ERR_OK) {
+            DEBUG_PRINTF("Rewrite failed: writing track %zu (C%u H%u) returned %d\n",
+                i, imdf->layouts[i].cyl, imdf->layouts[i].head, res);
+            /* The file no longer matches any recorded layout from this track on */
+            for (size_t j = i; j < imdf->num_tracks; ++j) {
+                if (!track_is_loaded(&imdf->layouts[j]) && record_in_snapshot(&imdf->layouts[j], raw)) {
+                    adopt_track_record(imdf, j, raw);
+                }
+                reset_track_layout(&imdf->layouts[j]);
+                mark_track_dirty(imdf, j);
+            }
+            goto done;
         }
     }
 
@@ -196,7 +1486,8 @@ static int rewrite_image_file(ImdImageFile* imdf, size_t modified_track_index, c
     if (fflush(imdf->file_ptr) != 0) {
         perror("libimdf: fflush failed before getting size for truncate");
         DEBUG_PRINTF("Rewrite Error: fflush failed before truncate, error %d\n", errno);
-        return IMDF_ERR_IO; /* Treat this as a fatal error */
+        res = IMDF_ERR_IO; /* Treat this as a fatal error */
+        goto done;
     }
 
     long current_pos = ftell(imdf->file_ptr);
@@ -252,19 +1543,235 @@ static int rewrite_image_file(ImdImageFile* imdf, size_t modified_track_index, c
     if (fflush(imdf->file_ptr) != 0) {
         perror("libimdf: fflush failed after rewrite/truncate attempt");
         DEBUG_PRINTF("Rewrite Error: final fflush failed, error %d\n", errno);
-        return IMDF_ERR_IO;
+        res = IMDF_ERR_IO;
+        goto done;
+    }
+
+    if (first_track == 0) {
+        imdf->pending_writes = 0; /* Every record was just rewritten from memory */
+        imdf->header_dirty = 0;
     }
 
     DEBUG_PRINTF("Image file rewrite successful.\n");
+    res = IMDF_ERR_OK;
+
+done:
+    free_encode_jobs(encoded, imdf->num_tracks - first_track);
+    return res;
+}
+
+/*
+ * Rewrites the IMD file from track 'first_track' on, as rewrite_records does.
+ * Clean tracks whose write options leave the encoding unchanged are copied
+ * from the file as read instead of being decoded and re-encoded.
+ */
+static int rewrite_image_file(ImdImageFile* imdf, size_t first_track, size_t modified_track_index, const ImdWriteOpts* modified_track_opts) {
+    ImdfRawRecords raw;
+    ImdfStatsScope scope;
+    int res;
+
+    if (!imdf || !imdf->file_ptr) {
+        return IMDF_ERR_INVALID_ARG;
+    }
+    if (first_track >= imdf->num_tracks || track_record_offset(imdf, first_track) < 0) {
+        first_track = 0; /* Same fallback as rewrite_records */
+    }
+    if (modified_track_index < imdf->num_tracks) {
+        /* Memory of the modified track is ahead of its record: it must be re-encoded */
+        imdf->layouts[modified_track_index].state = IMDF_TRACK_DIRTY;
+    }
+
+    stats_scope_begin(imdf, &scope);
+    IMD_STAT(IMD_STAT_IMAGE_REWRITES, 1);
+    snapshot_clean_records(imdf, first_track, modified_track_index, modified_track_opts, &raw);
+    res = rewrite_records(imdf, first_track, modified_track_index, modified_track_opts, &raw);
+    imd_free(raw.bytes);
+    stats_scope_end(&scope, IMD_STAT_REWRITE_NS);
+    return res;
+}
+
+/* Resizes the layouts array to hold at least new_capacity tracks */
+static int reserve_track_arrays(ImdImageFile* imdf, size_t new_capacity) {
+    if (new_capacity <= imdf->track_capacity) return IMDF_ERR_OK;
+    if (new_capacity > SIZE_MAX / sizeof(ImdfTrackLayout)) return IMDF_ERR_ALLOC;
+
+    ImdfTrackLayout* new_layouts = (ImdfTrackLayout*)imd_realloc(imdf->layouts, new_capacity * sizeof(ImdfTrackLayout));
+    if (!new_layouts) return IMDF_ERR_ALLOC;
+    memset(&new_layouts[imdf->track_capacity], 0, (new_capacity - imdf->track_capacity) * sizeof(ImdfTrackLayout));
+    imdf->layouts = new_layouts;
+
+    imdf->track_capacity = new_capacity;
+    DEBUG_PRINTF("Reallocated track arrays to %zu\n", new_capacity);
     return IMDF_ERR_OK;
 }
 
+/* Doubles the capacity of the layouts array */
+static int grow_track_arrays(ImdImageFile* imdf) {
+    size_t new_capacity = (imdf->track_capacity == 0) ? IMDF_INITIAL_TRACK_CAPACITY : imdf->track_capacity * 2;
+    if (new_capacity <= imdf->track_capacity) return IMDF_ERR_ALLOC;
+    return reserve_track_arrays(imdf, new_capacity);
+}
+
+/* Where one track record and its share of the data arena lie, for the expansion pass */
+typedef struct {
+    size_t pos;                 /* Offset of the record in the image buffer */
+    size_t data_offset;         /* Offset of the track's data in the arena */
+    size_t data_size;           /* Bytes of sector data the track expands to */
+    int status;                 /* Result of imd_load_track_buffer_into */
+    ImdStatCounters stats;      /* Counted by the worker, added to the image afterwards */
+} ImdfDecodeJob;
+
+/* Shared state of the expansion pass of load_tracks_into_arena */
+typedef struct {
+    ImdImageFile* imdf;
+    const uint8_t* image;
+    size_t image_len;
+    ImdfDecodeJob* jobs;
+} ImdfDecodeContext;
+
+static void decode_track_job(size_t index, void* ctx) {
+    ImdfDecodeContext* decode = (ImdfDecodeContext*)ctx;
+    ImdfDecodeJob* job = &decode->jobs[index];
+    uint8_t* data = decode->imdf->data_arena ? decode->imdf->data_arena + job->data_offset : NULL;
+    ImdStatCounters* previous_sink = NULL;
+    int counting = imd_stats_active();
+
+    /* Worker threads count into the job: the image's counters belong to the calling thread */
+    memset(&job->stats, 0, sizeof(job->stats));
+    if (counting) previous_sink = imd_stats_set_sink(&job->stats);
+    job->status = imd_load_track_buffer_into(decode->image + job->pos, decode->image_len - job->pos,
+        &decode->imdf->layouts[index].view->info, LIBIMD_FILL_BYTE_DEFAULT, data, job->data_size, NULL);
+    if (counting) imd_stats_set_sink(previous_sink);
+}
+
+/*
+ * Loads every track record following the comment block from a single read of
+ * the file. A first serial pass over the record headers sizes the track arrays
+ * and the total sector data exactly; the tracks are then expanded into one
+ * shared arena (imdf->data_arena), on imdf->worker_threads threads. The stream
+ * must be positioned at imdf->tracks_offset.
+ */
+static int load_tracks_into_arena(ImdImageFile* imdf) {
+    FILE* f = imdf->file_ptr;
+    long end_offset;
+    uint8_t* image = NULL;
+    ImdfDecodeJob* jobs = NULL;
+    ImdfDecodeContext decode;
+    size_t image_len;
+    size_t pos;
+    size_t consumed = 0;
+    size_t track_count = 0;
+    size_t jobs_capacity = 0;
+    size_t data_total = 0;
+    ImdTrackInfo scan;
+    int libimd_err;
+    int result = IMDF_ERR_OK;
+
+    if (imdf->tracks_offset < 0 || imd_stat_fseek(f, 0, SEEK_END) != 0 ||
+        (end_offset = ftell(f)) < imdf->tracks_offset ||
+        imd_stat_fseek(f, imdf->tracks_offset, SEEK_SET) != 0) {
+        perror("libimdf: failed to size track records");
+        return IMDF_ERR_IO;
+    }
+
+    image_len = (size_t)(end_offset - imdf->tracks_offset);
+    if (image_len == 0) return IMDF_ERR_OK; /* No tracks */
+
+    image = (uint8_t*)imd_malloc(image_len);
+    if (!image) return IMDF_ERR_ALLOC;
+    if (imd_stat_fread(image, 1, image_len, f) != image_len) {
+        perror("libimdf: failed to read track records");
+        imd_free(image);
+        return IMDF_ERR_IO;
+    }
+
+    /* Pass 1: locate the records and the bytes of sector data they expand to */
+    for (pos = 0; pos < image_len; pos += consumed) {
+        libimd_err = imd_read_track_header_and_flags_buffer(image + pos, image_len - pos, &scan, &consumed);
+        if (libimd_err == 1 && consumed < track_record_length(&scan)) libimd_err = IMD_ERR_READ_ERROR;
+        if (libimd_err != 1) {
+            result = map_libimd_error(libimd_err);
+            goto done;
+        }
+        if (track_count >= jobs_capacity) {
+            size_t new_capacity = jobs_capacity ? jobs_capacity * 2 : IMDF_INITIAL_TRACK_CAPACITY;
+            ImdfDecodeJob* new_jobs = (ImdfDecodeJob*)imd_realloc(jobs, new_capacity * sizeof(ImdfDecodeJob));
+            if (!new_jobs) {
+                result = IMDF_ERR_ALLOC;
+                goto done;
+            }
+            jobs = new_jobs;
+            jobs_capacity = new_capacity;
+        }
+        jobs[track_count].pos = pos;
+        jobs[track_count].data_offset = data_total;
+        jobs[track_count].data_size = (size_t)scan.num_sectors * scan.sector_size;
+        data_total += jobs[track_count].data_size;
+        track_count++;
+    }
+
+    result = reserve_track_arrays(imdf, track_count);
+    if (result != IMDF_ERR_OK) goto done;
+    /* Every track is loaded, so each one gets its view now */
+    for (size_t i = 0; i < track_count; ++i) {
+        imdf->layouts[i].view = (ImdfTrackView*)imd_calloc(1, sizeof(ImdfTrackView));
+        if (!imdf->layouts[i].view) {
+            result = IMDF_ERR_ALLOC;
+            goto done;
+        }
+    }
+
+    if (data_total > 0) {
+        imdf->data_arena = (uint8_t*)imd_malloc(data_total);
+        if (!imdf->data_arena) {
+            result = IMDF_ERR_ALLOC;
+            goto done;
+        }
+        imdf->data_arena_size = data_total;
+    }
+
+    /* Pass 2: expand each track into its slice of the arena; tracks are independent */
+    decode.imdf = imdf;
+    decode.image = image;
+    decode.image_len = image_len;
+    decode.jobs = jobs;
+    imd_parallel_for(track_count, imdf->worker_threads, decode_track_job, &decode);
+    for (size_t i = 0; i < track_count; ++i) {
+        imd_stats_merge(&imdf->stats, &jobs[i].stats);
+    }
+
+    for (size_t i = 0; i < track_count; ++i) {
+        ImdfTrackLayout* layout = &imdf->layouts[i];
+        ImdTrackInfo* current_track = &layout->view->info;
+
+        if (jobs[i].status != 1) {
+            result = map_libimd_error(jobs[i].status);
+            break;
+        }
+        build_track_layout(layout, current_track, current_track->sflag, imdf->tracks_offset + (long)jobs[i].pos);
+        set_track_header(layout, current_track);
+        rebuild_view_lut(layout->view);
+        imdf->num_tracks++;
+    }
+    DEBUG_PRINTF("load_tracks_into_arena: %zu tracks, %zu bytes of sector data\n", track_count, data_total);
+
+done:
+    /* Views of tracks not counted in num_tracks hold nothing but arena data */
+    for (size_t i = imdf->num_tracks; i < track_count && i < imdf->track_capacity; ++i) {
+        imd_free(imdf->layouts[i].view);
+        imdf->layouts[i].view = NULL;
+    }
+    imd_free(jobs);
+    imd_free(image);
+    return result;
+}
+
 /* Finds the correct insertion index for a new track to maintain C/H order */
 static size_t find_insertion_index(const ImdImageFile* imdf, uint8_t cyl, uint8_t head) {
     size_t low = 0, high = imdf->num_tracks;
     while (low < high) {
         size_t mid = low + (high - low) / 2;
-        if (imdf->tracks[mid].cyl < cyl || (imdf->tracks[mid].cyl == cyl && imdf->tracks[mid].head < head)) {
+        if (imdf->layouts[mid].cyl < cyl || (imdf->layouts[mid].cyl == cyl && imdf->layouts[mid].head < head)) {
             low = mid + 1;
         }
         else {
@@ -289,11 +1796,17 @@ int get_sector_size_code(uint32_t sector_size, uint8_t* code_out) {
 }
 
 
+static int flush_unlocked(ImdImageFile* imdf);
+
 /* --- Public Function Implementations --- */
 
 /* --- Image Handling --- */
 
 int imdf_open(const char* path, int read_only, ImdImageFile** imdf_out) {
+    return imdf_open_ex(path, read_only ? IMDF_OPEN_READ_ONLY : 0, imdf_out);
+}
+
+int imdf_open_ex(const char* path, unsigned int flags, ImdImageFile** imdf_out) {
     FILE* f = NULL;
     ImdImageFile* imdf = NULL;
     int result;
@@ -304,15 +1817,15 @@ int imdf_open(const char* path, int read_only, ImdImageFile** imdf_out) {
     *imdf_out = NULL;
 
     /* 1. Open the file. */
-    const char* mode = read_only ? "rb" : "r+b";
+    const char* mode = (flags & IMDF_OPEN_READ_ONLY) ? "rb" : "r+b";
     f = fopen(path, mode);
     if (!f) {
         DEBUG_PRINTF("imdf_open: fopen('%s', '%s') failed: %s\n", path, mode, strerror(errno));
         return IMDF_ERR_CANNOT_OPEN;
     }
 
-    /* 2. Delegate the core reading logic to imdf_open_from_file. */
-    result = imdf_open_from_file(f, read_only, &imdf);
+    /* 2. Delegate the core reading logic to imdf_open_from_file_ex. */
+    result = imdf_open_from_file_ex(f, flags, &imdf);
 
     if (result != IMDF_ERR_OK) {
         /* If the core logic failed, close the file we opened and return the error. */
@@ -339,8 +1852,58 @@ int imdf_open(const char* path, int read_only, ImdImageFile** imdf_out) {
     return IMDF_ERR_OK;
 }
 
+int imdf_create(const char* path, const char* comment, ImdImageFile** imdf_out) {
+    FILE* f = NULL;
+    ImdImageFile* imdf = NULL;
+    int result;
+
+    if (!path || !imdf_out) {
+        return IMDF_ERR_INVALID_ARG;
+    }
+    *imdf_out = NULL;
+
+    f = fopen(path, "w+b");
+    if (!f) {
+        DEBUG_PRINTF("imdf_create: fopen('%s', 'w+b') failed: %s\n", path, strerror(errno));
+        return IMDF_ERR_CANNOT_OPEN;
+    }
+
+    /* An image with no tracks: header line and comment block only */
+    if (imd_write_file_header(f, LIBIMDF_DEFAULT_VERSION) != 0 ||
+        imd_write_comment_block(f, comment, comment ? strlen(comment) : 0) != 0 ||
+        fflush(f) != 0 || imd_stat_fseek(f, 0, SEEK_SET) != 0) {
+        perror("libimdf: failed to write new image header");
+        fclose(f);
+        return IMDF_ERR_IO;
+    }
+
+    result = imdf_open_from_file_ex(f, 0, &imdf);
+    if (result != IMDF_ERR_OK) {
+        fclose(f);
+        return result;
+    }
+
+    imdf->file_owner = 1;
+    imdf->file_path = strdup(path);
+    if (!imdf->file_path) {
+        imdf_close(imdf);
+        return IMDF_ERR_ALLOC;
+    }
+
+    *imdf_out = imdf;
+    return IMDF_ERR_OK;
+}
+
 int imdf_open_from_file(FILE* f, int read_only, ImdImageFile** imdf_out) {
+    return imdf_open_from_file_ex(f, read_only ? IMDF_OPEN_READ_ONLY : 0, imdf_out);
+}
+
+int imdf_open_from_file_ex(FILE* f, unsigned int flags, ImdImageFile** imdf_out) {
     ImdImageFile* imdf = NULL;
+    ImdfStatsScope scope;
+    int read_only = (flags & IMDF_OPEN_READ_ONLY) != 0;
+    int lazy = (flags & IMDF_OPEN_LAZY) != 0;
+    ImdTrackInfo scan;
     int libimd_err;
     int result;
 
@@ -352,20 +1915,24 @@ int imdf_open_from_file(FILE* f, int read_only, ImdImageFile** imdf_out) {
     /*
      * Rewind the stream to the beginning. The stream must be seekable.
      */
-    if (fseek(f, 0, SEEK_SET) != 0) {
+    if (imd_stat_fseek(f, 0, SEEK_SET) != 0) {
         return IMDF_ERR_IO;
     }
 
-    imdf = (ImdImageFile*)calloc(1, sizeof(ImdImageFile));
+    imdf = (ImdImageFile*)imd_calloc(1, sizeof(ImdImageFile));
     if (!imdf) {
         return IMDF_ERR_ALLOC;
     }
+    stats_scope_begin(imdf, &scope);
 
     imdf->file_ptr = f;
     imdf->read_only_open = (read_only != 0);
     imdf->write_protected = (read_only != 0);
     imdf->file_owner = 0; /* The caller owns the file handle. */
     imdf->file_path = NULL; /* No path is associated with the stream. */
+    imdf->write_back = (flags & IMDF_OPEN_WRITE_BACK) != 0;
+    imdf->hash_tracking = (flags & IMDF_OPEN_HASH_TRACKING) != 0;
+    imdf->worker_threads = (flags & IMDF_OPEN_PARALLEL) ? imd_cpu_count() : 1;
 
     /*
      * Initialize geometry limits.
@@ -388,61 +1955,268 @@ int imdf_open_from_file(FILE* f, int read_only, ImdImageFile** imdf_out) {
         result = ferror(imdf->file_ptr) ? IMDF_ERR_IO : IMDF_ERR_LIBIMD_ERR;
         goto cleanup_error;
     }
+    imdf->tracks_offset = ftell(imdf->file_ptr);
 
     imdf->num_tracks = 0;
     imdf->track_capacity = IMDF_INITIAL_TRACK_CAPACITY;
-    imdf->tracks = (ImdTrackInfo*)malloc(imdf->track_capacity * sizeof(ImdTrackInfo));
-    if (!imdf->tracks) {
+    imd_track_arena_init(&imdf->track_meta);
+    imdf->layouts = (ImdfTrackLayout*)imd_calloc(imdf->track_capacity, sizeof(ImdfTrackLayout));
+    if (!imdf->layouts) {
         result = IMDF_ERR_ALLOC;
         goto cleanup_error;
     }
-    memset(imdf->tracks, 0, imdf->track_capacity * sizeof(ImdTrackInfo));
 
 
     DEBUG_PRINTF("imdf_open_from_file: Reading tracks...\n");
+    if (!lazy) {
+        uint64_t load_start = imd_stats_clock();
+        result = load_tracks_into_arena(imdf);
+        imd_stat_time(IMD_STAT_LOAD_NS, load_start);
+        if (result != IMDF_ERR_OK) goto cleanup_error;
+    }
+    while (lazy) {
+        if (imdf->num_tracks >= imdf->track_capacity) {
+            result = grow_track_arrays(imdf);
+            if (result != IMDF_ERR_OK) goto cleanup_error;
+        }
+
+        long track_offset = ftell(imdf->file_ptr);
+        /* Index only: header, maps and flags; the data is read on first access */
+        if (track_offset < 0) {
+            result = IMDF_ERR_IO;
+            goto cleanup_error;
+        }
+        libimd_err = imd_read_track_header_and_flags(imdf->file_ptr, &scan);
+        if (libimd_err == 1 && ftell(imdf->file_ptr) - track_offset < (long)track_record_length(&scan)) {
+            libimd_err = IMD_ERR_READ_ERROR; /* Data cut short by the end of the file */
+        }
+
+        if (libimd_err == 1) { /* Success */
+            result = index_scanned_track(imdf, &scan, track_offset);
+            if (result != IMDF_ERR_OK) goto cleanup_error;
+        } else if (libimd_err == 0) { /* Clean EOF */
+            break;
+        } else { /* Error */
+            result = map_libimd_error(libimd_err);
+            goto cleanup_error;
+        }
+    }
+
+    trim_track_meta(imdf);
+    rebuild_track_lut(imdf);
+    if (flags & IMDF_OPEN_CONCURRENT) {
+        imdf->locks = alloc_locks();
+        if (!imdf->locks) {
+            result = IMDF_ERR_ALLOC;
+            goto cleanup_error;
+        }
+    }
+    stats_scope_end(&scope, IMD_STAT_OPEN_NS);
+
+    *imdf_out = imdf;
+    return IMDF_ERR_OK;
+
+cleanup_error:
+    DEBUG_PRINTF("imdf_open_from_file: Cleaning up after error %d\n", result);
+    stats_scope_end(&scope, IMD_STAT_OPEN_NS);
+    if (imdf) {
+        if (imdf->layouts) {
+            for (size_t i = 0; i < imdf->num_tracks; ++i) {
+                release_track_view(imdf, i);
+            }
+        }
+        imd_free(imdf->data_arena);
+        imd_track_arena_free(&imdf->track_meta);
+        if (imdf->layouts) {
+            for (size_t i = 0; i < imdf->num_tracks; ++i) {
+                reset_track_layout(&imdf->layouts[i]);
+                invalidate_logical_data(&imdf->layouts[i]);
+                release_track_hashes(&imdf->layouts[i]);
+            }
+            imd_free(imdf->layouts);
+        }
+        if (imdf->comment) {
+            free(imdf->comment);
+        }
+        imd_free(imdf);
+    }
+    *imdf_out = NULL;
+    return result;
+}
+
+/*
+ * Opens a read-only image over bytes in memory: the file at path mapped with
+ * map_image_file, or (if buffer is not NULL) a buffer whose ownership passes to the
+ * image, even on failure. Only the header, comment and track headers are parsed;
+ * sector data stays in place until needed.
+ */
+static int open_in_memory(const char* path, uint8_t* buffer, size_t size, ImdImageFile** imdf_out) {
+    ImdImageFile* imdf = NULL;
+    ImdfStatsScope scope;
+    size_t pos = 0;
+    size_t consumed = 0;
+    ImdTrackInfo scan;
+    int libimd_err;
+    int result;
+
+    imdf = (ImdImageFile*)imd_calloc(1, sizeof(ImdImageFile));
+    if (!imdf) {
+        imd_free(buffer);
+        return IMDF_ERR_ALLOC;
+    }
+    stats_scope_begin(imdf, &scope);
+
+    /* An image in memory is always read-only; there is no stream to write back to. */
+    imdf->file_ptr = NULL;
+    imdf->read_only_open = 1;
+    imdf->write_protected = 1;
+    imdf->file_owner = 0;
+    imdf->worker_threads = 1;
+    imdf->max_cyl = 0xFF;
+    imdf->max_head = 0xFF;
+    imdf->max_spt = 0xFF;
+
+    if (buffer) {
+        imdf->map_buffer = buffer;
+        imdf->map_base = buffer;
+        imdf->map_size = size;
+    }
+    else {
+        result = map_image_file(imdf, path);
+        if (result != IMDF_ERR_OK) goto cleanup_error;
+    }
+
+    if (path) {
+        imdf->file_path = strdup(path);
+        if (!imdf->file_path) {
+            result = IMDF_ERR_ALLOC;
+            goto cleanup_error;
+        }
+    }
+
+    /* Parse the header, comment and track headers straight from memory. */
+    libimd_err = imd_read_file_header_buffer(imdf->map_base, imdf->map_size, &imdf->header_info, &consumed);
+    if (libimd_err != 0) {
+        result = map_libimd_error(libimd_err);
+        goto cleanup_error;
+    }
+    pos += consumed;
+
+    imdf->comment = imd_read_comment_block_buffer(imdf->map_base + pos, imdf->map_size - pos, &imdf->comment_len, &consumed);
+    if (imdf->comment == NULL) {
+        result = IMDF_ERR_LIBIMD_ERR;
+        goto cleanup_error;
+    }
+    pos += consumed;
+    imdf->tracks_offset = (long)pos;
+
+    imdf->track_capacity = IMDF_INITIAL_TRACK_CAPACITY;
+    imd_track_arena_init(&imdf->track_meta);
+    imdf->layouts = (ImdfTrackLayout*)imd_calloc(imdf->track_capacity, sizeof(ImdfTrackLayout));
+    if (!imdf->layouts) {
+        result = IMDF_ERR_ALLOC;
+        goto cleanup_error;
+    }
+
+    DEBUG_PRINTF("open_in_memory: Scanning tracks of '%s' (%zu bytes)...\n", path ? path : "(buffer)", imdf->map_size);
     while (1) {
         if (imdf->num_tracks >= imdf->track_capacity) {
-            size_t new_capacity = imdf->track_capacity * 2;
-            if (new_capacity <= imdf->track_capacity) { result = IMDF_ERR_ALLOC; goto cleanup_error; }
-            ImdTrackInfo* new_tracks = (ImdTrackInfo*)realloc(imdf->tracks, new_capacity * sizeof(ImdTrackInfo));
-            if (!new_tracks) { result = IMDF_ERR_ALLOC; goto cleanup_error; }
-            imdf->tracks = new_tracks;
-            imdf->track_capacity = new_capacity;
+            result = grow_track_arrays(imdf);
+            if (result != IMDF_ERR_OK) goto cleanup_error;
+        }
+
+        /* Only header, maps and flags: sector data stays in memory until needed */
+        libimd_err = imd_read_track_header_and_flags_buffer(imdf->map_base + pos, imdf->map_size - pos, &scan, &consumed);
+        if (libimd_err == 1 && consumed < track_record_length(&scan)) libimd_err = IMD_ERR_READ_ERROR;
+
+        if (libimd_err == 1) { /* Success */
+            result = index_scanned_track(imdf, &scan, (long)pos);
+            if (result != IMDF_ERR_OK) goto cleanup_error;
+            pos += consumed;
+        } else if (libimd_err == 0) { /* End of the image */
+            break;
+        } else { /* Error */
+            result = map_libimd_error(libimd_err);
+            goto cleanup_error;
         }
+    }
+
+    trim_track_meta(imdf);
+    rebuild_track_lut(imdf);
+    stats_scope_end(&scope, IMD_STAT_OPEN_NS);
+
+    *imdf_out = imdf;
+    return IMDF_ERR_OK;
+
+cleanup_error:
+    DEBUG_PRINTF("open_in_memory: Cleaning up after error %d\n", result);
+    stats_scope_end(&scope, IMD_STAT_OPEN_NS);
+    imdf_close(imdf); /* Nothing is pending, so this only releases resources */
+    return result;
+}
+
+int imdf_open_mapped(const char* path, ImdImageFile** imdf_out) {
+    if (!path || !imdf_out) {
+        return IMDF_ERR_INVALID_ARG;
+    }
+    *imdf_out = NULL;
+    return open_in_memory(path, NULL, 0, imdf_out);
+}
 
-        ImdTrackInfo* current_track = &imdf->tracks[imdf->num_tracks];
-        memset(current_track, 0, sizeof(ImdTrackInfo));
-        libimd_err = imd_load_track(imdf->file_ptr, current_track, LIBIMD_FILL_BYTE_DEFAULT);
+int imdf_open_buffer(const uint8_t* data, size_t size, ImdImageFile** imdf_out) {
+    uint8_t* copy;
+
+    if ((!data && size > 0) || !imdf_out) {
+        return IMDF_ERR_INVALID_ARG;
+    }
+    *imdf_out = NULL;
 
-        if (libimd_err == 1) { /* Success */
-            imdf->num_tracks++;
-        } else if (libimd_err == 0) { /* Clean EOF */
-            break;
-        } else { /* Error */
-            result = map_libimd_error(libimd_err);
-            goto cleanup_error;
-        }
+    copy = (uint8_t*)imd_malloc(size ? size : 1);
+    if (!copy) {
+        return IMDF_ERR_ALLOC;
     }
+    if (size > 0) memcpy(copy, data, size);
+    return open_in_memory(NULL, copy, size, imdf_out);
+}
 
-    *imdf_out = imdf;
-    return IMDF_ERR_OK;
+int imdf_open_files(const char* const* paths, size_t count, unsigned queue_depth,
+                    ImdImageFile** images, int* statuses) {
+    ImdPrefetch* prefetch = NULL;
+    ImdPrefetchItem* item;
+    int failed = 0;
 
-cleanup_error:
-    DEBUG_PRINTF("imdf_open_from_file: Cleaning up after error %d\n", result);
-    if (imdf) {
-        if (imdf->tracks) {
-            for (size_t i = 0; i < imdf->num_tracks; ++i) {
-                imd_free_track_data(&imdf->tracks[i]);
-            }
-            free(imdf->tracks);
+    if ((!paths || !images) && count > 0) {
+        return IMDF_ERR_INVALID_ARG;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        images[i] = NULL;
+        if (statuses) statuses[i] = IMDF_ERR_CANNOT_OPEN;
+    }
+    if (count == 0) return 0;
+
+    if (imd_prefetch_start(paths, count, queue_depth, NULL, NULL, &prefetch) != 0) {
+        return IMDF_ERR_ALLOC;
+    }
+    /* Parsing only scans the track headers, so one thread keeps up with the readers */
+    while (imd_prefetch_next(prefetch, &item) == 1) {
+        size_t index = item->index;
+        int result = map_libimd_error(item->status);
+
+        if (result == IMDF_ERR_OK) {
+            const char* path = item->path;
+            size_t size = item->size;
+            /* The image takes over the read buffer instead of copying it; the item is reused at once */
+            uint8_t* data = imd_prefetch_take(prefetch, item);
+            result = open_in_memory(path, data, size, &images[index]);
         }
-        if (imdf->comment) {
-            free(imdf->comment);
+        else {
+            imd_prefetch_done(prefetch, item);
         }
-        free(imdf);
+        if (statuses) statuses[index] = result;
+        if (result != IMDF_ERR_OK) failed++;
     }
-    *imdf_out = NULL;
-    return result;
+    imd_prefetch_stop(prefetch);
+    return failed;
 }
 
 void imdf_close(ImdImageFile* imdf) {
@@ -450,11 +2224,27 @@ void imdf_close(ImdImageFile* imdf) {
         return;
     }
     DEBUG_PRINTF("Closing image file: %s\n", imdf->file_path ? imdf->file_path : "(from stream)");
-    if (imdf->tracks) {
+    if (imdf->pending_writes && flush_unlocked(imdf) != IMDF_ERR_OK) {
+        fprintf(stderr, "libimdf: failed to flush pending writes on close, image may be incomplete\n");
+    }
+    if (imdf->layouts) {
+        for (size_t i = 0; i < imdf->num_tracks; ++i) {
+            release_track_view(imdf, i);
+        }
+    }
+    imd_free(imdf->data_arena);
+    imd_track_arena_free(&imdf->track_meta);
+    if (imdf->store) {
+        store_unuse(imdf->store);
+    }
+    imd_free(imdf->lba_map);
+    if (imdf->layouts) {
         for (size_t i = 0; i < imdf->num_tracks; ++i) {
-            imd_free_track_data(&imdf->tracks[i]);
+            reset_track_layout(&imdf->layouts[i]);
+            invalidate_logical_data(&imdf->layouts[i]);
+            release_track_hashes(&imdf->layouts[i]);
         }
-        free(imdf->tracks);
+        imd_free(imdf->layouts);
     }
     if (imdf->comment) {
         free(imdf->comment);
@@ -462,28 +2252,35 @@ void imdf_close(ImdImageFile* imdf) {
     if (imdf->file_ptr && imdf->file_owner) {
         fclose(imdf->file_ptr);
     }
+    unmap_image_file(imdf);
     if (imdf->file_path) {
         free(imdf->file_path);
     }
-    free(imdf);
+    free_locks(imdf->locks);
+    imd_free(imdf);
 }
 
 /* --- Geometry --- */
 
 int imdf_set_geometry(ImdImageFile* imdf, uint8_t max_cyl, uint8_t max_head, uint8_t max_spt) {
     if (!imdf) return IMDF_ERR_INVALID_ARG;
+    table_lock_exclusive(imdf);
     imdf->max_cyl = max_cyl;
     imdf->max_head = max_head;
     imdf->max_spt = max_spt;
+    imdf->lba_stale = 1; /* Blocks outside the new limits drop out of the LBA view */
+    table_unlock_exclusive(imdf);
     DEBUG_PRINTF("Set geometry: Cmax=%u Hmax=%u SptMax=%u\n", max_cyl, max_head, max_spt);
     return IMDF_ERR_OK;
 }
 
 int imdf_get_geometry(ImdImageFile* imdf, uint8_t* max_cyl_out, uint8_t* max_head_out, uint8_t* max_spt_out) {
     if (!imdf) return IMDF_ERR_INVALID_ARG;
+    table_lock_shared(imdf);
     if (max_cyl_out) *max_cyl_out = imdf->max_cyl;
     if (max_head_out) *max_head_out = imdf->max_head;
     if (max_spt_out) *max_spt_out = imdf->max_spt;
+    table_unlock_shared(imdf);
     return IMDF_ERR_OK;
 }
 
@@ -494,14 +2291,335 @@ int imdf_set_write_protect(ImdImageFile* imdf, int protect) {
     if (!protect && imdf->read_only_open) {
         return IMDF_ERR_WRITE_PROTECTED; /* Cannot unprotect a read-only opened file */
     }
+    table_lock_exclusive(imdf);
     imdf->write_protected = (protect != 0);
-    DEBUG_PRINTF("Set write protect: %d\n", imdf->write_protected);
+    table_unlock_exclusive(imdf);
+    DEBUG_PRINTF("Set write protect: %d\n", protect != 0);
     return IMDF_ERR_OK;
 }
 
 int imdf_get_write_protect(ImdImageFile* imdf, int* protect_out) {
     if (!imdf || !protect_out) return IMDF_ERR_INVALID_ARG;
+    table_lock_shared(imdf);
     *protect_out = imdf->write_protected;
+    table_unlock_shared(imdf);
+    return IMDF_ERR_OK;
+}
+
+/* --- Write-Back Caching --- */
+
+int imdf_set_write_back(ImdImageFile* imdf, int enable) {
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+    table_lock_exclusive(imdf);
+    if (!enable && imdf->write_back) {
+        int res = flush_unlocked(imdf);
+        if (res != IMDF_ERR_OK) {
+            table_unlock_exclusive(imdf);
+            return res; /* Stay in write-back mode, changes are still pending */
+        }
+    }
+    imdf->write_back = (enable != 0);
+    table_unlock_exclusive(imdf);
+    DEBUG_PRINTF("Set write back: %d\n", enable != 0);
+    return IMDF_ERR_OK;
+}
+
+int imdf_get_write_back(ImdImageFile* imdf, int* enable_out) {
+    if (!imdf || !enable_out) return IMDF_ERR_INVALID_ARG;
+    table_lock_shared(imdf);
+    *enable_out = imdf->write_back;
+    table_unlock_shared(imdf);
+    return IMDF_ERR_OK;
+}
+
+/* --- Worker Threads --- */
+
+int imdf_set_worker_threads(ImdImageFile* imdf, unsigned num_threads) {
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+    if (num_threads == 0) num_threads = imd_cpu_count();
+    if (num_threads > LIBIMD_MAX_WORKER_THREADS) num_threads = LIBIMD_MAX_WORKER_THREADS;
+    table_lock_exclusive(imdf);
+    imdf->worker_threads = num_threads;
+    table_unlock_exclusive(imdf);
+    DEBUG_PRINTF("Set worker threads: %u\n", num_threads);
+    return IMDF_ERR_OK;
+}
+
+int imdf_get_worker_threads(ImdImageFile* imdf, unsigned* num_threads_out) {
+    if (!imdf || !num_threads_out) return IMDF_ERR_INVALID_ARG;
+    table_lock_shared(imdf);
+    *num_threads_out = imdf->worker_threads;
+    table_unlock_shared(imdf);
+    return IMDF_ERR_OK;
+}
+
+/* --- Concurrent Access --- */
+
+int imdf_set_concurrent(ImdImageFile* imdf, int enable) {
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+    if (enable && !imdf->locks) {
+        imdf->locks = alloc_locks();
+        if (!imdf->locks) return IMDF_ERR_ALLOC;
+    }
+    else if (!enable && imdf->locks) {
+        free_locks(imdf->locks);
+        imdf->locks = NULL;
+    }
+    return IMDF_ERR_OK;
+}
+
+int imdf_get_concurrent(const ImdImageFile* imdf, int* enable_out) {
+    if (!imdf || !enable_out) return IMDF_ERR_INVALID_ARG;
+    *enable_out = (imdf->locks != NULL);
+    return IMDF_ERR_OK;
+}
+
+/*
+ * Takes the track lock shared with the track's data in memory, loading it under the
+ * exclusive lock first if needed. The caller holds the table lock, shared or exclusive:
+ * a loaded track then stays loaded.
+ */
+static int lock_loaded_track(ImdImageFile* imdf, size_t track_index, ImdRwLock* lock) {
+    int res = IMDF_ERR_OK;
+
+    if (!lock) return ensure_track_loaded(imdf, track_index);
+    imd_rwlock_lock_shared(lock);
+    if (track_is_loaded(&imdf->layouts[track_index])) return IMDF_ERR_OK;
+    imd_rwlock_unlock_shared(lock);
+
+    imd_rwlock_lock_exclusive(lock);
+    res = ensure_track_loaded(imdf, track_index);
+    imd_rwlock_unlock_exclusive(lock);
+    if (res == IMDF_ERR_OK) imd_rwlock_lock_shared(lock);
+    return res;
+}
+
+int imdf_pin_track(ImdImageFile* imdf, uint8_t cyl, uint8_t head, ImdfTrackPin* pin_out) {
+    ImdRwLock* lock;
+    int index;
+    int res;
+
+    if (!pin_out) return IMDF_ERR_INVALID_ARG;
+    memset(pin_out, 0, sizeof(*pin_out));
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+
+    table_lock_shared(imdf);
+    index = find_track_index_internal(imdf, cyl, head);
+    if (index < 0) {
+        table_unlock_shared(imdf);
+        return IMDF_ERR_NOT_FOUND;
+    }
+    lock = track_lock_of(imdf, cyl, head);
+    res = lock_loaded_track(imdf, (size_t)index, lock);
+    if (res != IMDF_ERR_OK) {
+        table_unlock_shared(imdf);
+        return res;
+    }
+    /* Both locks stay held until imdf_unpin_track */
+    pin_out->imdf = imdf;
+    pin_out->track = &imdf->layouts[index].view->info;
+    pin_out->lock = lock;
+    return IMDF_ERR_OK;
+}
+
+void imdf_unpin_track(ImdfTrackPin* pin) {
+    if (!pin || !pin->imdf) return;
+    if (pin->lock) imd_rwlock_unlock_shared((ImdRwLock*)pin->lock);
+    table_unlock_shared(pin->imdf);
+    memset(pin, 0, sizeof(*pin));
+}
+
+/* --- Statistics --- */
+
+int imdf_get_stats(const ImdImageFile* imdf, ImdStats* stats_out) {
+    if (!imdf || !stats_out) return IMDF_ERR_INVALID_ARG;
+    /* Calls holding the table shared may be adding to the counters */
+    table_lock_exclusive(imdf);
+    imd_stats_export(&imdf->stats, stats_out);
+    table_unlock_exclusive(imdf);
+    return IMDF_ERR_OK;
+}
+
+int imdf_reset_stats(ImdImageFile* imdf) {
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+    table_lock_exclusive(imdf);
+    memset(&imdf->stats, 0, sizeof(imdf->stats));
+    table_unlock_exclusive(imdf);
+    return IMDF_ERR_OK;
+}
+
+int imdf_flush(ImdImageFile* imdf) {
+    int res;
+
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+    table_lock_exclusive(imdf);
+    res = flush_unlocked(imdf);
+    table_unlock_exclusive(imdf);
+    return res;
+}
+
+/* Writes pending changes; the caller holds the table exclusively */
+static int flush_unlocked(ImdImageFile* imdf) {
+    size_t first_dirty;
+    int res = IMDF_ERR_OK;
+
+    if (!imdf->pending_writes) return IMDF_ERR_OK;
+    if (!imdf->file_ptr || imdf->read_only_open) return IMDF_ERR_WRITE_PROTECTED;
+    if (imdf->hash_tracking) clean_unchanged_tracks(imdf);
+
+    for (first_dirty = 0; first_dirty < imdf->num_tracks && !imdf->header_dirty; ++first_dirty) {
+        if (imdf->layouts[first_dirty].state == IMDF_TRACK_DIRTY) break;
+    }
+    DEBUG_PRINTF("imdf_flush: First dirty track is %zu of %zu\n", first_dirty, imdf->num_tracks);
+
+    /* Tracks ahead of the first dirty one keep their record length: patch their changed sectors only */
+    for (size_t i = 0; i < first_dirty; ++i) {
+        ImdfTrackLayout* layout = &imdf->layouts[i];
+        const ImdTrackInfo* track;
+
+        if (layout->state != IMDF_TRACK_PATCHED) continue;
+        track = &layout->view->info; /* Patched tracks are loaded */
+        for (uint8_t s = 0; s < track->num_sectors; ++s) {
+            if (!layout->sectors[s].dirty) continue;
+            res = patch_sector_in_place(imdf, &layout->sectors[s], track->data + ((size_t)s * track->sector_size), track->sector_size);
+            if (res != IMDF_ERR_OK) return res;
+            layout->sectors[s].dirty = 0;
+        }
+        layout->state = IMDF_TRACK_CLEAN;
+        layout->clean_hash_valid = 0;
+    }
+
+    if (first_dirty < imdf->num_tracks || imdf->header_dirty) {
+        /* Record lengths may change from here on: rewrite the rest of the file */
+        res = rewrite_image_file(imdf, first_dirty, imdf->num_tracks, NULL);
+    }
+    else if (fflush(imdf->file_ptr) != 0) {
+        perror("libimdf: fflush failed after write-back");
+        res = IMDF_ERR_IO;
+    }
+
+    if (res == IMDF_ERR_OK) {
+        imdf->pending_writes = 0;
+    }
+    return res;
+}
+
+/* --- Serialization --- */
+
+static size_t serialized_size_bound_unlocked(const ImdImageFile* imdf) {
+    size_t bound = LIBIMD_MAX_HEADER_LINE + imdf->comment_len + 1; /* Header line, comment, 0x1A */
+
+    for (size_t i = 0; i < imdf->num_tracks; ++i) {
+        ImdTrackInfo scratch;
+        bound += imd_track_encoded_size_bound(track_info_of(imdf, i, &scratch));
+    }
+    return bound;
+}
+
+size_t imdf_serialized_size_bound(const ImdImageFile* imdf) {
+    size_t bound;
+
+    if (!imdf) return 0;
+    table_lock_exclusive(imdf);
+    bound = serialized_size_bound_unlocked(imdf);
+    table_unlock_exclusive(imdf);
+    return bound;
+}
+
+/*
+ * Copies the record of a clean track from the mapping or the file into dst.
+ * Returns IMDF_ERR_OK, or an error if the record has to be encoded instead.
+ */
+static int read_clean_track_record(ImdImageFile* imdf, size_t track_index, uint8_t* dst, size_t dst_size) {
+    const ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    size_t length = (size_t)layout->length;
+
+    if (layout->state != IMDF_TRACK_CLEAN || layout->offset < 0 || layout->length <= 0) return IMDF_ERR_NOT_FOUND;
+    if (length > dst_size) return IMDF_ERR_BUFFER_SIZE;
+    if (imdf->map_base) {
+        if ((size_t)layout->offset > imdf->map_size || length > imdf->map_size - (size_t)layout->offset) return IMDF_ERR_LIBIMD_ERR;
+        memcpy(dst, imdf->map_base + layout->offset, length);
+        return IMDF_ERR_OK;
+    }
+    if (!imdf->file_ptr || imd_stat_fseek(imdf->file_ptr, layout->offset, SEEK_SET) != 0 ||
+        imd_stat_fread(dst, 1, length, imdf->file_ptr) != length) {
+        return IMDF_ERR_IO;
+    }
+    return IMDF_ERR_OK;
+}
+
+/* Serializes the image; the caller holds the table exclusively */
+static int serialize_unlocked(ImdImageFile* imdf, uint8_t* buf, size_t buf_size, size_t* written_out) {
+    size_t pos = 0;
+    size_t consumed = 0;
+    int res;
+
+    /* Header line and comment block, as a rewrite would produce them */
+    res = imd_format_file_header((char*)buf, buf_size, header_version(imdf), &consumed);
+    if (res != 0) return (res == IMD_ERR_BUFFER_TOO_SMALL) ? IMDF_ERR_BUFFER_SIZE : map_libimd_error(res);
+    pos = consumed;
+    if (imdf->comment_len + 1 > buf_size - pos) return IMDF_ERR_BUFFER_SIZE;
+    if (imdf->comment_len > 0) memcpy(buf + pos, imdf->comment, imdf->comment_len);
+    pos += imdf->comment_len;
+    buf[pos++] = LIBIMD_COMMENT_EOF_MARKER;
+
+    for (size_t i = 0; i < imdf->num_tracks; ++i) {
+        /* Unchanged records are copied as read; everything else is encoded from memory */
+        if (read_clean_track_record(imdf, i, buf + pos, buf_size - pos) == IMDF_ERR_OK) {
+            pos += (size_t)imdf->layouts[i].length;
+            continue;
+        }
+        res = ensure_track_loaded(imdf, i);
+        if (res != IMDF_ERR_OK) return res;
+        res = imd_encode_track_to_buffer(&imdf->layouts[i].view->info, &default_libimdf_write_opts, buf + pos, buf_size - pos, &consumed);
+        if (res != 0) {
+            DEBUG_PRINTF("imdf_serialize_to_buffer: Encoding track %zu failed (%d)\n", i, res);
+            return (res == IMD_ERR_BUFFER_TOO_SMALL) ? IMDF_ERR_BUFFER_SIZE : map_libimd_error(res);
+        }
+        pos += consumed;
+    }
+
+    *written_out = pos;
+    return IMDF_ERR_OK;
+}
+
+int imdf_serialize_to_buffer(ImdImageFile* imdf, uint8_t* buf, size_t buf_size, size_t* written_out) {
+    int res;
+
+    if (!imdf || !buf || !written_out) return IMDF_ERR_INVALID_ARG;
+    *written_out = 0;
+    table_lock_exclusive(imdf);
+    res = serialize_unlocked(imdf, buf, buf_size, written_out);
+    table_unlock_exclusive(imdf);
+    return res;
+}
+
+int imdf_serialize_to_memory(ImdImageFile* imdf, uint8_t** buf_out, size_t* size_out) {
+    uint8_t* buf;
+    uint8_t* shrunk;
+    size_t bound;
+    size_t written = 0;
+    int res;
+
+    if (!imdf || !buf_out || !size_out) return IMDF_ERR_INVALID_ARG;
+    *buf_out = NULL;
+    *size_out = 0;
+
+    /* One critical section, so the bound holds for what is serialized */
+    table_lock_exclusive(imdf);
+    bound = serialized_size_bound_unlocked(imdf);
+    buf = (uint8_t*)imd_malloc(bound);
+    res = buf ? serialize_unlocked(imdf, buf, bound, &written) : IMDF_ERR_ALLOC;
+    table_unlock_exclusive(imdf);
+    if (res != IMDF_ERR_OK) {
+        imd_free(buf);
+        return res;
+    }
+
+    /* Give back the slack of the bound; keep the larger block if that fails */
+    shrunk = (uint8_t*)imd_realloc(buf, written > 0 ? written : 1);
+    *buf_out = shrunk ? shrunk : buf;
+    *size_out = written;
     return IMDF_ERR_OK;
 }
 
@@ -517,22 +2635,69 @@ const char* imdf_get_comment(const ImdImageFile* imdf, size_t* comment_len_out)
     return imdf->comment;
 }
 
+int imdf_set_comment(ImdImageFile* imdf, const char* comment, size_t comment_len) {
+    char* new_comment;
+    int res;
+
+    if (!imdf || (!comment && comment_len > 0)) return IMDF_ERR_INVALID_ARG;
+    if (imdf->write_protected) return IMDF_ERR_WRITE_PROTECTED;
+    if (comment_len > 0 && memchr(comment, 0x1A, comment_len) != NULL) {
+        return IMDF_ERR_INVALID_ARG; /* 0x1A terminates the comment block */
+    }
+
+    /* Allocated like the comment read at open, which is released with free() */
+    new_comment = (char*)malloc(comment_len + 1);
+    if (!new_comment) return IMDF_ERR_ALLOC;
+    if (comment_len > 0) memcpy(new_comment, comment, comment_len);
+    new_comment[comment_len] = '\0';
+
+    table_lock_exclusive(imdf);
+    free(imdf->comment);
+    imdf->comment = new_comment;
+    imdf->comment_len = comment_len;
+    imdf->header_dirty = 1;
+    imdf->pending_writes = 1;
+
+    /* Unchanged tracks are copied through, not re-encoded */
+    res = imdf->write_back ? IMDF_ERR_OK : flush_unlocked(imdf);
+    table_unlock_exclusive(imdf);
+    return res;
+}
+
 int imdf_get_num_tracks(const ImdImageFile* imdf, size_t* num_tracks_out) {
     if (!imdf || !num_tracks_out) return IMDF_ERR_INVALID_ARG;
+    table_lock_shared((ImdImageFile*)imdf);
     *num_tracks_out = imdf->num_tracks;
+    table_unlock_shared((ImdImageFile*)imdf);
     return IMDF_ERR_OK;
 }
 
 const ImdTrackInfo* imdf_get_track_info(const ImdImageFile* imdf, size_t track_index) {
-    if (!imdf || track_index >= imdf->num_tracks) {
-        return NULL;
+    /* Loading on demand only fills a cache: the image is logically unchanged */
+    ImdImageFile* image = (ImdImageFile*)imdf;
+    const ImdTrackInfo* track = NULL;
+    ImdRwLock* lock;
+
+    if (!image) return NULL;
+    table_lock_shared(image);
+    if (track_index < image->num_tracks) {
+        lock = track_lock_of(image, image->layouts[track_index].cyl, image->layouts[track_index].head);
+        if (lock_loaded_track(image, track_index, lock) == IMDF_ERR_OK) {
+            track = &image->layouts[track_index].view->info;
+            if (lock) imd_rwlock_unlock_shared(lock);
+        }
     }
-    return &imdf->tracks[track_index];
+    table_unlock_shared(image);
+    return track;
 }
 
 int imdf_find_track_by_ch(const ImdImageFile* imdf, uint8_t cyl, uint8_t head, size_t* track_index_out) {
+    int index;
+
     if (!imdf || !track_index_out) return IMDF_ERR_INVALID_ARG;
-    int index = find_track_index_internal(imdf, cyl, head);
+    table_lock_shared((ImdImageFile*)imdf);
+    index = find_track_index_internal(imdf, cyl, head);
+    table_unlock_shared((ImdImageFile*)imdf);
     if (index < 0) {
         return IMDF_ERR_NOT_FOUND;
     }
@@ -543,13 +2708,20 @@ int imdf_find_track_by_ch(const ImdImageFile* imdf, uint8_t cyl, uint8_t head, s
 
 /* --- Sector Access --- */
 
-int imdf_read_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, uint8_t* buffer, size_t buffer_size) {
+/*
+ * The sector calls run under an ImdfTrackAccess. A body that needs more than its
+ * access allows (loading a track under a shared lock, rewriting the image under a
+ * track lock) returns IMDF_RETRY_EXCLUSIVE before changing anything, and its public
+ * wrapper runs it again with the stronger access.
+ */
+
+static int read_sector_internal(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, uint8_t* buffer, size_t buffer_size,
+                                const ImdfTrackAccess* access) {
     int track_idx;
     int sector_idx;
+    const ImdfTrackLayout* layout;
     ImdTrackInfo* track;
 
-    if (!imdf || !buffer) return IMDF_ERR_INVALID_ARG;
-
     if ((imdf->max_cyl != 0xFF && cyl > imdf->max_cyl) ||
         (imdf->max_head != 0xFF && head > imdf->max_head) ||
         (imdf->max_spt != 0xFF && logical_sector_id > imdf->max_spt && logical_sector_id != 0)) { /* Allow logical_sector_id 0 if max_spt is 0xFF (unused) or if it's within range */
@@ -560,18 +2732,38 @@ int imdf_read_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logi
 
     track_idx = find_track_index_internal(imdf, cyl, head);
     if (track_idx < 0) return IMDF_ERR_NOT_FOUND;
-    track = &imdf->tracks[track_idx];
+    layout = &imdf->layouts[track_idx];
 
-    sector_idx = find_sector_index_internal(track, logical_sector_id);
+    sector_idx = find_sector_index_cached(imdf, (size_t)track_idx, logical_sector_id);
     if (sector_idx < 0) return IMDF_ERR_NOT_FOUND;
 
-    if (track->sflag[sector_idx] == IMD_SDR_UNAVAILABLE) {
+    if (track_sflags(imdf, (size_t)track_idx)[sector_idx] == IMD_SDR_UNAVAILABLE) {
         return IMDF_ERR_UNAVAILABLE;
     }
 
-    if (buffer_size < track->sector_size) {
+    if (buffer_size < layout->sector_size) {
         return IMDF_ERR_BUFFER_SIZE;
     }
+
+    /* Mapped image: serve the sector straight from the mapping, expanding only compressed records */
+    if (!track_is_loaded(layout) && imdf->map_base && layout->sectors) {
+        const ImdfSectorLoc* loc = &layout->sectors[sector_idx];
+        if (IMD_SDR_IS_COMPRESSED(loc->sflag)) {
+            memset(buffer, imdf->map_base[loc->offset], layout->sector_size);
+        }
+        else {
+            memcpy(buffer, imdf->map_base + loc->offset, layout->sector_size);
+        }
+        return IMDF_ERR_OK;
+    }
+    if (!track_is_loaded(layout)) {
+        int load_res;
+        if (!access->exclusive) return IMDF_RETRY_EXCLUSIVE;
+        load_res = ensure_track_loaded(imdf, (size_t)track_idx);
+        if (load_res != IMDF_ERR_OK) return load_res;
+    }
+    track = &layout->view->info;
+
     if (!track->data || track->data_size < ((size_t)sector_idx * track->sector_size) + track->sector_size) {
         DEBUG_PRINTF("Read Error: Track data inconsistent for C%u H%u LogSectID %u (Phys %d). DataSize %zu, Expected at least %zu\n",
             cyl, head, logical_sector_id, sector_idx, track->data_size, ((size_t)sector_idx * track->sector_size) + track->sector_size);
@@ -583,9 +2775,173 @@ int imdf_read_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logi
     return IMDF_ERR_OK;
 }
 
+int imdf_read_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, uint8_t* buffer, size_t buffer_size) {
+    ImdfTrackAccess access;
+    int res;
+
+    if (!imdf || !buffer) return IMDF_ERR_INVALID_ARG;
+    track_access_begin(imdf, cyl, head, 0, &access);
+    res = read_sector_internal(imdf, cyl, head, logical_sector_id, buffer, buffer_size, &access);
+    if (res == IMDF_RETRY_EXCLUSIVE) {
+        track_access_upgrade(&access);
+        res = read_sector_internal(imdf, cyl, head, logical_sector_id, buffer, buffer_size, &access);
+    }
+    track_access_end(imdf, &access);
+    return res;
+}
+
+static int get_sector_ptr_internal(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id,
+                                   const uint8_t** data_out, size_t* size_out, uint8_t* sflag_out, const ImdfTrackAccess* access) {
+    int track_idx;
+    int sector_idx;
+    const ImdfTrackLayout* layout;
+    const uint8_t* sflag;
+    ImdTrackInfo* track;
+
+    *data_out = NULL;
+
+    if ((imdf->max_cyl != 0xFF && cyl > imdf->max_cyl) ||
+        (imdf->max_head != 0xFF && head > imdf->max_head) ||
+        (imdf->max_spt != 0xFF && logical_sector_id > imdf->max_spt && logical_sector_id != 0)) {
+        return IMDF_ERR_GEOMETRY;
+    }
+
+    track_idx = find_track_index_internal(imdf, cyl, head);
+    if (track_idx < 0) return IMDF_ERR_NOT_FOUND;
+    layout = &imdf->layouts[track_idx];
+
+    sector_idx = find_sector_index_cached(imdf, (size_t)track_idx, logical_sector_id);
+    if (sector_idx < 0) return IMDF_ERR_NOT_FOUND;
+
+    sflag = track_sflags(imdf, (size_t)track_idx);
+    if (sflag_out) *sflag_out = sflag[sector_idx];
+    if (size_out) *size_out = layout->sector_size;
+    if (sflag[sector_idx] == IMD_SDR_UNAVAILABLE) {
+        return IMDF_ERR_UNAVAILABLE;
+    }
+
+    /* Mapped image: normal sectors are borrowed straight from the mapping */
+    if (!track_is_loaded(layout) && imdf->map_base && layout->sectors) {
+        const ImdfSectorLoc* loc = &layout->sectors[sector_idx];
+        if (!IMD_SDR_IS_COMPRESSED(loc->sflag)) {
+            *data_out = imdf->map_base + loc->offset;
+            return IMDF_ERR_OK;
+        }
+    }
+    if (!track_is_loaded(layout)) {
+        int load_res;
+        if (!access->exclusive) return IMDF_RETRY_EXCLUSIVE;
+        load_res = ensure_track_loaded(imdf, (size_t)track_idx);
+        if (load_res != IMDF_ERR_OK) return load_res;
+    }
+    track = &layout->view->info;
+
+    if (!track->data || track->data_size < ((size_t)sector_idx * track->sector_size) + track->sector_size) {
+        return IMDF_ERR_LIBIMD_ERR;
+    }
+    *data_out = track->data + ((size_t)sector_idx * track->sector_size);
+    return IMDF_ERR_OK;
+}
+
+int imdf_get_sector_ptr(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id,
+                        const uint8_t** data_out, size_t* size_out, uint8_t* sflag_out) {
+    ImdfTrackAccess access;
+    int res;
+
+    if (!imdf || !data_out) return IMDF_ERR_INVALID_ARG;
+    track_access_begin(imdf, cyl, head, 0, &access);
+    res = get_sector_ptr_internal(imdf, cyl, head, logical_sector_id, data_out, size_out, sflag_out, &access);
+    if (res == IMDF_RETRY_EXCLUSIVE) {
+        track_access_upgrade(&access);
+        res = get_sector_ptr_internal(imdf, cyl, head, logical_sector_id, data_out, size_out, sflag_out, &access);
+    }
+    track_access_end(imdf, &access);
+    return res;
+}
+
+static int get_track_data_ptr_internal(ImdImageFile* imdf, uint8_t cyl, uint8_t head, const uint8_t** data_out, size_t* size_out,
+                                       const ImdfTrackAccess* access) {
+    int track_idx;
+    ImdTrackInfo* track;
+    ImdfTrackLayout* layout;
+    uint8_t order[LIBIMD_MAX_SECTORS_PER_TRACK];
+    int sorted = 1;
+    int res;
+
+    *data_out = NULL;
+
+    if ((imdf->max_cyl != 0xFF && cyl > imdf->max_cyl) ||
+        (imdf->max_head != 0xFF && head > imdf->max_head)) {
+        return IMDF_ERR_GEOMETRY;
+    }
+
+    track_idx = find_track_index_internal(imdf, cyl, head);
+    if (track_idx < 0) return IMDF_ERR_NOT_FOUND;
+    layout = &imdf->layouts[track_idx];
+
+    if (!track_is_loaded(layout) && !access->exclusive) return IMDF_RETRY_EXCLUSIVE;
+    res = ensure_track_loaded(imdf, (size_t)track_idx);
+    if (res != IMDF_ERR_OK) return res;
+    track = &layout->view->info;
+
+    if (size_out) *size_out = track->data_size;
+    if (track->num_sectors == 0) {
+        return IMDF_ERR_OK; /* Empty track: NULL data, size 0 */
+    }
+
+    for (uint8_t i = 1; i < track->num_sectors; ++i) {
+        if (track->smap[i] < track->smap[i - 1]) {
+            sorted = 0;
+            break;
+        }
+    }
+    if (sorted) {
+        *data_out = track->data; /* Physical order already is logical order */
+        return IMDF_ERR_OK;
+    }
+
+    if (!layout->logical_data) {
+        if (!access->exclusive) return IMDF_RETRY_EXCLUSIVE;
+        /* Stable insertion sort of physical indices by logical ID */
+        for (int i = 0; i < track->num_sectors; ++i) {
+            int j = i;
+            while (j > 0 && track->smap[order[j - 1]] > track->smap[i]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = (uint8_t)i;
+        }
+
+        layout->logical_data = (uint8_t*)imd_malloc(track->data_size);
+        if (!layout->logical_data) return IMDF_ERR_ALLOC;
+        for (int i = 0; i < track->num_sectors; ++i) {
+            memcpy(layout->logical_data + ((size_t)i * track->sector_size),
+                   track->data + ((size_t)order[i] * track->sector_size), track->sector_size);
+        }
+    }
+    *data_out = layout->logical_data;
+    return IMDF_ERR_OK;
+}
+
+int imdf_get_track_data_ptr(ImdImageFile* imdf, uint8_t cyl, uint8_t head, const uint8_t** data_out, size_t* size_out) {
+    ImdfTrackAccess access;
+    int res;
+
+    if (!imdf || !data_out) return IMDF_ERR_INVALID_ARG;
+    track_access_begin(imdf, cyl, head, 0, &access);
+    res = get_track_data_ptr_internal(imdf, cyl, head, data_out, size_out, &access);
+    if (res == IMDF_RETRY_EXCLUSIVE) {
+        track_access_upgrade(&access);
+        res = get_track_data_ptr_internal(imdf, cyl, head, data_out, size_out, &access);
+    }
+    track_access_end(imdf, &access);
+    return res;
+}
+
 /* In libimdf.c */
 
-int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, const uint8_t* buffer, size_t buffer_size) {
+static int write_sector_internal(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, const uint8_t* buffer, size_t buffer_size,
+                                 const ImdfTrackAccess* access) {
     int track_idx_int; /* Renamed to avoid conflict with track_idx size_t */
     size_t track_idx;  /* To store the result from imdf_find_track_by_ch or find_track_index_internal */
     int sector_idx; /* Physical index of the sector being written */
@@ -595,7 +2951,6 @@ int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t log
     int was_edited_sector_compressed;
     int track_rewritten_as_uncompressed = 0; /* Flag to indicate if the entire track was forced uncompressed */
 
-    if (!imdf || !buffer) return IMDF_ERR_INVALID_ARG;
     if (imdf->write_protected) return IMDF_ERR_WRITE_PROTECTED;
 
     /* Validate CHN against geometry if set */
@@ -608,9 +2963,8 @@ int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t log
     track_idx_int = find_track_index_internal(imdf, cyl, head);
     if (track_idx_int < 0) return IMDF_ERR_NOT_FOUND;
     track_idx = (size_t)track_idx_int;
-    track = &imdf->tracks[track_idx];
 
-    sector_idx = find_sector_index_internal(track, logical_sector_id);
+    sector_idx = find_sector_index_cached(imdf, track_idx, logical_sector_id);
     if (sector_idx < 0) return IMDF_ERR_NOT_FOUND;
 
     /* Validate sector ID against max_spt if set */
@@ -619,28 +2973,91 @@ int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t log
         return IMDF_ERR_GEOMETRY;
     }
 
-    if (buffer_size != track->sector_size) {
-        DEBUG_PRINTF("LibIMDF Write Sector Error: Buffer size %zu does not match track sector size %u\n", buffer_size, track->sector_size);
+    if (buffer_size != imdf->layouts[track_idx].sector_size) {
+        DEBUG_PRINTF("LibIMDF Write Sector Error: Buffer size %zu does not match track sector size %u\n", buffer_size, imdf->layouts[track_idx].sector_size);
         return IMDF_ERR_SECTOR_SIZE;
     }
+    rewrite_res = ensure_track_loaded(imdf, track_idx);
+    if (rewrite_res != IMDF_ERR_OK) {
+        return rewrite_res;
+    }
+    track = &imdf->layouts[track_idx].view->info;
     if (!track->data || track->data_size < ((size_t)sector_idx * track->sector_size) + track->sector_size) {
         DEBUG_PRINTF("LibIMDF Write Sector Error: Track data inconsistent for C%u H%u LogSectID %u (Phys %d)\n", cyl, head, logical_sector_id, sector_idx);
         return IMDF_ERR_LIBIMD_ERR; /* Should not happen if track loaded correctly */
     }
 
+    /* The sector already holds this data: nothing to write */
+    if (IMD_SDR_HAS_DATA(track->sflag[sector_idx]) &&
+        memcmp(track->data + ((size_t)sector_idx * track->sector_size), buffer, track->sector_size) == 0) {
+        return IMDF_ERR_OK;
+    }
+    rewrite_res = own_track_data(imdf, track_idx);
+    if (rewrite_res != IMDF_ERR_OK) {
+        return rewrite_res;
+    }
+
+    invalidate_logical_data(&imdf->layouts[track_idx]);
+
+    /*
+     * If the file already holds this sector as a normal record, the record
+     * length cannot change: overwrite just those bytes instead of the image.
+     * In write-back mode the patch is deferred until the next flush.
+     */
+    ImdfTrackLayout* layout = &imdf->layouts[track_idx];
+    if (layout->offset >= 0 && layout->sectors) {
+        ImdfSectorLoc* loc = &layout->sectors[sector_idx];
+        if (IMD_SDR_HAS_DATA(loc->sflag) && !IMD_SDR_IS_COMPRESSED(loc->sflag)) {
+            if (imdf->write_back) {
+                note_clean_hash(imdf, track_idx);
+                loc->dirty = 1;
+                if (layout->state == IMDF_TRACK_CLEAN) {
+                    layout->state = IMDF_TRACK_PATCHED;
+                }
+                set_pending_writes(imdf);
+            }
+            else {
+                DEBUG_PRINTF("LibIMDF: Patching C%u H%u S%u (Phys %d) in place at offset %ld.\n", cyl, head, logical_sector_id, sector_idx, loc->offset);
+                io_lock(imdf);
+                rewrite_res = patch_sector_in_place(imdf, loc, buffer, track->sector_size);
+                if (rewrite_res == IMDF_ERR_OK && fflush(imdf->file_ptr) != 0) {
+                    perror("libimdf: fflush failed after in-place sector write");
+                    rewrite_res = IMDF_ERR_IO;
+                }
+                io_unlock(imdf);
+                if (rewrite_res != IMDF_ERR_OK) {
+                    return rewrite_res;
+                }
+            }
+            memcpy(track->data + ((size_t)sector_idx * track->sector_size), buffer, track->sector_size);
+            IMD_TRACK_SET_UNIFORM(track, sector_idx, 0); /* New data not classified */
+            track->sflag[sector_idx] = loc->sflag; /* In-memory flag matches the record on disk */
+            rehash_sectors(imdf, track_idx, (size_t)sector_idx, 1);
+            return IMDF_ERR_OK;
+        }
+    }
+
+    /* Rewriting the image moves other tracks' records: that needs the whole image */
+    if (!imdf->write_back && !access->whole_image) return IMDF_RETRY_EXCLUSIVE;
+    if (imdf->write_back) note_clean_hash(imdf, track_idx);
+
     original_sflag_of_edited_sector = track->sflag[sector_idx];
     was_edited_sector_compressed = IMD_SDR_IS_COMPRESSED(original_sflag_of_edited_sector);
 
+    /* Uniformity of the new data decides both the compression mode and the predicted flag below */
+    uint8_t fill_byte_check;
+    int is_edited_sector_data_uniform = imd_is_uniform(buffer, track->sector_size, &fill_byte_check);
+
     /* Copy new data into the in-memory track buffer for the specified sector */
     memcpy(track->data + ((size_t)sector_idx * track->sector_size), buffer, track->sector_size);
+    IMD_TRACK_SET_UNIFORM(track, sector_idx, is_edited_sector_data_uniform);
 
     ImdWriteOpts write_opts;
     memcpy(&write_opts, &default_libimdf_write_opts, sizeof(ImdWriteOpts));
 
     /* Determine if this write forces the track to be uncompressed */
     if (was_edited_sector_compressed) {
-        uint8_t fill_byte_check;
-        if (!imd_is_uniform(buffer, track->sector_size, &fill_byte_check)) {
+        if (!is_edited_sector_data_uniform) {
             /* The edited sector was compressed, but its new data is non-uniform.
              * The entire track must now be written uncompressed.
              */
@@ -661,20 +3078,20 @@ int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t log
         write_opts.compression_mode = IMD_COMPRESSION_AS_READ;
     }
 
-    /* Rewrite the entire image file (rewrite_image_file calls imd_write_track_imd for each track) */
-    rewrite_res = rewrite_image_file(imdf, track_idx, &write_opts);
-    if (rewrite_res != IMDF_ERR_OK) {
-        DEBUG_PRINTF("LibIMDF Write Sector: Failed to rewrite image file (%d). In-memory data was changed but not persisted fully.\n", rewrite_res);
-        return rewrite_res;
-    }
-
-    /* After successful rewrite, update sflag(s) in libimdf's memory for the affected track */
+    /*
+     * Predict the sflag(s) the write leaves in libimdf's memory before the track is
+     * encoded, so the record written carries the new data (a sector that was
+     * unavailable is encoded as holding data, not with its old flag).
+     */
     if (track_rewritten_as_uncompressed) {
         DEBUG_PRINTF("LibIMDF: Track C%u H%u rewritten uncompressed. Updating all in-memory sflags for this track.\n", track->cyl, track->head);
         for (uint8_t i = 0; i < track->num_sectors; ++i) {
             uint8_t current_sflag_val = track->sflag[i]; /* Get original DAM/ERR state for this sector i */
             /* Base type is now normal because the whole track was written uncompressed */
 
+            /* Unavailable sectors hold no data and stay unavailable (the DAM/ERR macros do not apply to them) */
+            if (current_sflag_val == IMD_SDR_UNAVAILABLE) continue;
+
             /* Preserve DAM/ERR flags from the original sflag of sector i */
             if (IMD_SDR_HAS_DAM(current_sflag_val) && IMD_SDR_HAS_ERR(current_sflag_val)) {
                 track->sflag[i] = IMD_SDR_DELETED_ERR;
@@ -696,13 +3113,11 @@ int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t log
          * based on its new data and the write options used.
          */
         uint8_t new_predicted_sflag_for_edited_sector = 0;
-        uint8_t fill_byte_dummy;
-        /* Check the data that was actually written (now in track->data for the edited sector) */
-        int is_edited_sector_data_uniform = imd_is_uniform(track->data + ((size_t)sector_idx * track->sector_size), track->sector_size, &fill_byte_dummy);
 
-        /* Use the original sflag of the *edited sector* for DAM/ERR preservation */
-        uint8_t final_dam = IMD_SDR_HAS_DAM(original_sflag_of_edited_sector) && !write_opts.force_non_deleted;
-        uint8_t final_err = IMD_SDR_HAS_ERR(original_sflag_of_edited_sector) && !write_opts.force_non_bad;
+        /* Use the original sflag of the *edited sector* for DAM/ERR preservation; an unavailable sector had neither */
+        int was_unavailable = (original_sflag_of_edited_sector == IMD_SDR_UNAVAILABLE);
+        uint8_t final_dam = !was_unavailable && IMD_SDR_HAS_DAM(original_sflag_of_edited_sector) && !write_opts.force_non_deleted;
+        uint8_t final_err = !was_unavailable && IMD_SDR_HAS_ERR(original_sflag_of_edited_sector) && !write_opts.force_non_bad;
         uint8_t base_sflag_type_for_edited_sector;
 
         /* Determine the base type based on write_opts and actual data post-edit for *this* sector */
@@ -751,13 +3166,627 @@ int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t log
             logical_sector_id, sector_idx, original_sflag_of_edited_sector, new_predicted_sflag_for_edited_sector);
         track->sflag[sector_idx] = new_predicted_sflag_for_edited_sector;
     }
+    rehash_sectors(imdf, track_idx, (size_t)sector_idx, 1);
+
+    if (imdf->write_back) {
+        /*
+         * The flush writes the track AS_READ, so the sflag prediction above
+         * (e.g. all normal when the track is forced uncompressed) carries the
+         * effect of write_opts until then.
+         */
+        mark_track_dirty(imdf, track_idx);
+    }
+    else {
+        /* Rewrite the entire image file (rewrite_image_file calls imd_write_track_imd for each track) */
+        rewrite_res = rewrite_image_file(imdf, 0, track_idx, &write_opts);
+        if (rewrite_res != IMDF_ERR_OK) {
+            DEBUG_PRINTF("LibIMDF Write Sector: Failed to rewrite image file (%d). In-memory data was changed but not persisted fully.\n", rewrite_res);
+            return rewrite_res;
+        }
+
+        /*
+         * If the flags written differ from the predicted ones, the record does not
+         * match memory: re-encode it now from memory, as a flush would, so the
+         * file matches what libimdf reports when this call returns.
+         */
+        for (uint8_t i = 0; i < track->num_sectors; ++i) {
+            if (!layout->sectors || layout->sectors[i].sflag != track->sflag[i]) {
+                rewrite_res = rewrite_image_file(imdf, track_idx, track_idx, NULL);
+                if (rewrite_res != IMDF_ERR_OK) {
+                    DEBUG_PRINTF("LibIMDF Write Sector: Failed to re-encode track %zu from memory (%d).\n", track_idx, rewrite_res);
+                    return rewrite_res;
+                }
+                break;
+            }
+        }
+    }
+
+    return IMDF_ERR_OK;
+}
+
+int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, const uint8_t* buffer, size_t buffer_size) {
+    ImdfTrackAccess access;
+    int res;
+
+    if (!imdf || !buffer) return IMDF_ERR_INVALID_ARG;
+    track_access_begin(imdf, cyl, head, 1, &access);
+    res = write_sector_internal(imdf, cyl, head, logical_sector_id, buffer, buffer_size, &access);
+    track_access_end(imdf, &access);
+    if (res == IMDF_RETRY_EXCLUSIVE) {
+        table_lock_exclusive(imdf);
+        res = write_sector_internal(imdf, cyl, head, logical_sector_id, buffer, buffer_size, &whole_image_access);
+        table_unlock_exclusive(imdf);
+    }
+    return res;
+}
+
+/* --- Block Access --- */
+
+/* Whether a sector lies within the geometry limits, as imdf_read_sector checks them */
+static int sector_in_geometry(const ImdImageFile* imdf, const ImdfTrackLayout* layout, uint8_t logical_sector_id) {
+    return !((imdf->max_cyl != 0xFF && layout->cyl > imdf->max_cyl) ||
+             (imdf->max_head != 0xFF && layout->head > imdf->max_head) ||
+             (imdf->max_spt != 0xFF && logical_sector_id > imdf->max_spt && logical_sector_id != 0));
+}
+
+/*
+ * Fills the LBA table: tracks in ascending (cyl, head) order, and within each
+ * track the sectors in ascending logical ID order from first_sector_id on.
+ */
+static int fill_lba_map(ImdImageFile* imdf, uint8_t first_sector_id) {
+    ImdfLbaEntry* map = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t* order;
+    size_t num_ordered = 0;
+    uint8_t lut_scratch[256];
+
+    /* Track indices in (cyl, head) order; the array is usually in that order already */
+    order = (size_t*)imd_malloc((imdf->num_tracks > 0 ? imdf->num_tracks : 1) * sizeof(size_t));
+    if (!order) return IMDF_ERR_ALLOC;
+    for (size_t i = 0; i < imdf->num_tracks; ++i) {
+        const ImdfTrackLayout* track = &imdf->layouts[i];
+        size_t j = num_ordered;
+        if (find_track_index_internal(imdf, track->cyl, track->head) != (int)i) continue; /* Duplicate C/H */
+        while (j > 0 && (imdf->layouts[order[j - 1]].cyl > track->cyl ||
+               (imdf->layouts[order[j - 1]].cyl == track->cyl && imdf->layouts[order[j - 1]].head > track->head))) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+        num_ordered++;
+        capacity += track->num_sectors;
+    }
+
+    if (capacity > 0) {
+        map = (ImdfLbaEntry*)imd_malloc(capacity * sizeof(ImdfLbaEntry));
+        if (!map) {
+            imd_free(order);
+            return IMDF_ERR_ALLOC;
+        }
+    }
+
+    for (size_t n = 0; n < num_ordered; ++n) {
+        size_t track_index = order[n];
+        const ImdfTrackLayout* layout = &imdf->layouts[track_index];
+        const uint8_t* lut = lut_scratch;
+        size_t track_first = count;
+
+        /* Tracks without a view have no lookup table yet: build one from the arena entry */
+        if (layout->view) lut = layout->view->sector_lut;
+        else build_sector_lut(lut_scratch, track_smap(imdf, track_index), layout->num_sectors);
+        for (unsigned id = first_sector_id; id < 256; ++id) {
+            uint8_t phys = lut[id];
+            if (phys == IMDF_NO_SECTOR || !sector_in_geometry(imdf, layout, (uint8_t)id)) continue;
+            map[count].track_index = (uint32_t)track_index;
+            map[count].data_offset = (uint32_t)phys * layout->sector_size;
+            map[count].phys = phys;
+            map[count].run = 1;
+            count++;
+        }
+        /* Runs of blocks whose sectors are adjacent in the track data, counted from the end */
+        for (size_t b = count; b-- > track_first + 1; ) {
+            if (map[b].phys == map[b - 1].phys + 1) map[b - 1].run = (uint16_t)(map[b].run + 1);
+        }
+    }
+    imd_free(order);
+
+    imd_free(imdf->lba_map);
+    imdf->lba_map = map;
+    imdf->lba_count = count;
+    imdf->lba_first_sector_id = first_sector_id;
+    imdf->lba_built = 1;
+    imdf->lba_stale = 0;
+    DEBUG_PRINTF("LBA map: %zu blocks from %zu tracks, first sector ID %u\n", count, num_ordered, first_sector_id);
+    return IMDF_ERR_OK;
+}
+
+int imdf_build_lba_map(ImdImageFile* imdf, uint8_t first_sector_id, size_t* num_blocks_out) {
+    int res;
+
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+    table_lock_exclusive(imdf);
+    res = fill_lba_map(imdf, first_sector_id);
+    if (res == IMDF_ERR_OK && num_blocks_out) *num_blocks_out = imdf->lba_count;
+    table_unlock_exclusive(imdf);
+    return res;
+}
+
+/*
+ * Checks a block range against the LBA map, rebuilding the map first if the
+ * tracks changed, and returns the total size of the blocks in *bytes_out.
+ * The rebuild needs the whole image.
+ */
+static int prepare_block_range(ImdImageFile* imdf, size_t lba, size_t count, int whole_image, size_t* bytes_out) {
+    size_t bytes = 0;
+
+    if (!imdf->lba_built) return IMDF_ERR_INVALID_ARG;
+    if (imdf->lba_stale) {
+        int res;
+        if (!whole_image) return IMDF_RETRY_EXCLUSIVE;
+        res = fill_lba_map(imdf, imdf->lba_first_sector_id);
+        if (res != IMDF_ERR_OK) return res;
+    }
+    if (lba > imdf->lba_count || count > imdf->lba_count - lba) return IMDF_ERR_GEOMETRY;
+
+    for (size_t b = lba; b < lba + count; ++b) {
+        bytes += imdf->layouts[imdf->lba_map[b].track_index].sector_size;
+    }
+    *bytes_out = bytes;
+    return IMDF_ERR_OK;
+}
+
+/*
+ * The block calls hold the table shared and lock one track at a time. Rebuilding
+ * the map or rewriting the image returns IMDF_RETRY_EXCLUSIVE, and the call is then
+ * run again from the start with the table held exclusively (whole_image set).
+ */
+static int read_blocks_internal(ImdImageFile* imdf, size_t lba, size_t count, uint8_t* buffer, size_t buffer_size, int whole_image) {
+    size_t needed;
+    size_t b = lba;
+    int res;
+
+    res = prepare_block_range(imdf, lba, count, whole_image, &needed);
+    if (res != IMDF_ERR_OK) return res;
+    if (buffer_size < needed) return IMDF_ERR_BUFFER_SIZE;
+
+    while (b < lba + count) {
+        const ImdfLbaEntry* entry = &imdf->lba_map[b];
+        const ImdfTrackLayout* layout = &imdf->layouts[entry->track_index];
+        ImdRwLock* lock = whole_image ? NULL : track_lock_of(imdf, layout->cyl, layout->head);
+        const ImdTrackInfo* track;
+        size_t n = entry->run;
+        size_t available = 0;
+
+        if (n > lba + count - b) n = lba + count - b;
+        res = lock_loaded_track(imdf, entry->track_index, lock);
+        if (res != IMDF_ERR_OK) return res;
+        track = &layout->view->info;
+        while (available < n && track->sflag[entry->phys + available] != IMD_SDR_UNAVAILABLE) available++;
+
+        /* The whole run lies back to back in the track data: a single copy */
+        memcpy(buffer, track->data + entry->data_offset, available * track->sector_size);
+        if (lock) imd_rwlock_unlock_shared(lock);
+        buffer += available * track->sector_size;
+        b += available;
+        if (available < n) {
+            return IMDF_ERR_UNAVAILABLE; /* Blocks before it have been copied */
+        }
+    }
+    return IMDF_ERR_OK;
+}
+
+int imdf_read_blocks(ImdImageFile* imdf, size_t lba, size_t count, uint8_t* buffer, size_t buffer_size) {
+    int res;
+
+    if (!imdf || (!buffer && count > 0)) return IMDF_ERR_INVALID_ARG;
+    table_lock_shared(imdf);
+    res = read_blocks_internal(imdf, lba, count, buffer, buffer_size, imdf->locks == NULL);
+    table_unlock_shared(imdf);
+    if (res == IMDF_RETRY_EXCLUSIVE) {
+        table_lock_exclusive(imdf);
+        res = read_blocks_internal(imdf, lba, count, buffer, buffer_size, 1);
+        table_unlock_exclusive(imdf);
+    }
+    return res;
+}
+
+/*
+ * Writes the blocks of one run, all on the same track, under the given access.
+ * Returns the number of blocks written in *written_out.
+ */
+static int write_block_run(ImdImageFile* imdf, const ImdfLbaEntry* entry, size_t n, const uint8_t* buffer,
+                           const ImdfTrackAccess* access, size_t* written_out) {
+    size_t track_index = entry->track_index;
+    ImdfTrackLayout* layout = &imdf->layouts[track_index];
+    ImdTrackInfo* track;
+    size_t patchable = 0;
+    int res;
+
+    *written_out = 0;
+    res = ensure_track_loaded(imdf, track_index);
+    if (res != IMDF_ERR_OK) return res;
+    track = &layout->view->info;
+
+    /*
+     * In write-back mode, sectors stored as normal records only need their
+     * data replaced and a patch scheduled: the whole run in one copy.
+     */
+    if (imdf->write_back && layout->offset >= 0 && layout->sectors) {
+        while (patchable < n) {
+            uint8_t flag = layout->sectors[entry->phys + patchable].sflag;
+            if (!IMD_SDR_HAS_DATA(flag) || IMD_SDR_IS_COMPRESSED(flag)) break;
+            patchable++;
+        }
+    }
+    if (patchable > 0) {
+        res = own_track_data(imdf, track_index);
+        if (res != IMDF_ERR_OK) return res;
+        note_clean_hash(imdf, track_index);
+        invalidate_logical_data(layout);
+        memcpy(track->data + entry->data_offset, buffer, patchable * track->sector_size);
+        for (size_t i = entry->phys; i < entry->phys + patchable; ++i) {
+            layout->sectors[i].dirty = 1;
+            IMD_TRACK_SET_UNIFORM(track, i, 0); /* New data not classified */
+            track->sflag[i] = layout->sectors[i].sflag;
+        }
+        if (layout->state == IMDF_TRACK_CLEAN) {
+            layout->state = IMDF_TRACK_PATCHED;
+        }
+        rehash_sectors(imdf, track_index, entry->phys, patchable);
+        set_pending_writes(imdf);
+        *written_out = patchable;
+        return IMDF_ERR_OK;
+    }
+
+    /* Anything else may change the record: let the sector write handle it */
+    res = write_sector_internal(imdf, track->cyl, track->head, track->smap[entry->phys], buffer, track->sector_size, access);
+    if (res == IMDF_ERR_OK) *written_out = 1;
+    return res;
+}
+
+static int write_blocks_internal(ImdImageFile* imdf, size_t lba, size_t count, const uint8_t* buffer, size_t buffer_size, int whole_image) {
+    size_t needed;
+    size_t b = lba;
+    int res;
+
+    if (imdf->write_protected) return IMDF_ERR_WRITE_PROTECTED;
+    res = prepare_block_range(imdf, lba, count, whole_image, &needed);
+    if (res != IMDF_ERR_OK) return res;
+    if (buffer_size != needed) return IMDF_ERR_SECTOR_SIZE;
+
+    while (b < lba + count) {
+        const ImdfLbaEntry* entry = &imdf->lba_map[b];
+        const ImdfTrackLayout* track = &imdf->layouts[entry->track_index];
+        ImdfTrackAccess access = whole_image_access;
+        size_t n = entry->run;
+        size_t written;
+
+        if (n > lba + count - b) n = lba + count - b;
+        if (!whole_image) track_access_lock(imdf, track->cyl, track->head, 1, &access);
+        res = write_block_run(imdf, entry, n, buffer, &access, &written);
+        track_access_unlock(&access);
+        if (res != IMDF_ERR_OK) return res;
+        buffer += written * track->sector_size;
+        b += written;
+    }
+    return IMDF_ERR_OK;
+}
+
+int imdf_write_blocks(ImdImageFile* imdf, size_t lba, size_t count, const uint8_t* buffer, size_t buffer_size) {
+    int res;
+
+    if (!imdf || (!buffer && count > 0)) return IMDF_ERR_INVALID_ARG;
+    table_lock_shared(imdf);
+    res = write_blocks_internal(imdf, lba, count, buffer, buffer_size, imdf->locks == NULL);
+    table_unlock_shared(imdf);
+    if (res == IMDF_RETRY_EXCLUSIVE) {
+        /* Blocks written before the retry are written again with the same data */
+        table_lock_exclusive(imdf);
+        res = write_blocks_internal(imdf, lba, count, buffer, buffer_size, 1);
+        table_unlock_exclusive(imdf);
+    }
+    return res;
+}
+
+/* --- Content Hashes --- */
+
+int imdf_set_hash_tracking(ImdImageFile* imdf, int enable) {
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+    table_lock_exclusive(imdf);
+    imdf->hash_tracking = (enable != 0);
+    if (!enable) {
+        for (size_t i = 0; i < imdf->num_tracks; ++i) imdf->layouts[i].clean_hash_valid = 0;
+    }
+    table_unlock_exclusive(imdf);
+    return IMDF_ERR_OK;
+}
+
+int imdf_get_hash_tracking(const ImdImageFile* imdf, int* enable_out) {
+    if (!imdf || !enable_out) return IMDF_ERR_INVALID_ARG;
+    table_lock_shared((ImdImageFile*)imdf);
+    *enable_out = imdf->hash_tracking;
+    table_unlock_shared((ImdImageFile*)imdf);
+    return IMDF_ERR_OK;
+}
+
+/* Finds a track and makes its hashes current; loading or hashing needs exclusive access */
+static int hashed_track_internal(ImdImageFile* imdf, uint8_t cyl, uint8_t head, const ImdfTrackAccess* access, int* track_idx_out) {
+    int track_idx = find_track_index_internal(imdf, cyl, head);
+    int res;
+
+    if (track_idx < 0) return IMDF_ERR_NOT_FOUND;
+    if (!imdf->layouts[track_idx].hashed) {
+        if (!access->exclusive) return IMDF_RETRY_EXCLUSIVE;
+        res = ensure_track_loaded(imdf, (size_t)track_idx);
+        if (res == IMDF_ERR_OK) res = ensure_track_hashed(imdf, (size_t)track_idx);
+        if (res != IMDF_ERR_OK) return res;
+    }
+    *track_idx_out = track_idx;
+    return IMDF_ERR_OK;
+}
+
+static int get_hash_internal(ImdImageFile* imdf, uint8_t cyl, uint8_t head, int sector, uint8_t logical_sector_id,
+                             uint64_t* hash_out, const ImdfTrackAccess* access) {
+    int track_idx;
+    int sector_idx;
+    int res = hashed_track_internal(imdf, cyl, head, access, &track_idx);
+
+    if (res != IMDF_ERR_OK) return res;
+    if (!sector) {
+        *hash_out = imdf->layouts[track_idx].track_hash;
+        return IMDF_ERR_OK;
+    }
+    sector_idx = find_sector_index_cached(imdf, (size_t)track_idx, logical_sector_id);
+    if (sector_idx < 0) return IMDF_ERR_NOT_FOUND;
+    if (track_sflags(imdf, (size_t)track_idx)[sector_idx] == IMD_SDR_UNAVAILABLE) return IMDF_ERR_UNAVAILABLE;
+    *hash_out = imdf->layouts[track_idx].sector_hashes[sector_idx];
+    return IMDF_ERR_OK;
+}
+
+/* Runs get_hash_internal for the track at (cyl, head), retrying with the track held exclusively */
+static int get_hash(ImdImageFile* imdf, uint8_t cyl, uint8_t head, int sector, uint8_t logical_sector_id, uint64_t* hash_out) {
+    ImdfTrackAccess access;
+    int res;
+
+    track_access_begin(imdf, cyl, head, 0, &access);
+    res = get_hash_internal(imdf, cyl, head, sector, logical_sector_id, hash_out, &access);
+    if (res == IMDF_RETRY_EXCLUSIVE) {
+        track_access_upgrade(&access);
+        res = get_hash_internal(imdf, cyl, head, sector, logical_sector_id, hash_out, &access);
+    }
+    track_access_end(imdf, &access);
+    return res;
+}
+
+int imdf_get_track_hash(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint64_t* hash_out) {
+    if (!imdf || !hash_out) return IMDF_ERR_INVALID_ARG;
+    return get_hash(imdf, cyl, head, 0, 0, hash_out);
+}
+
+int imdf_get_sector_hash(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, uint64_t* hash_out) {
+    if (!imdf || !hash_out) return IMDF_ERR_INVALID_ARG;
+    return get_hash(imdf, cyl, head, 1, logical_sector_id, hash_out);
+}
+
+/* Sector status compared by imdf_diff: data present, deleted mark and data error, not the encoding */
+#define DIFF_SECTOR_STATUS(sflag) \
+    (IMD_SDR_HAS_DATA(sflag) ? (1 | (IMD_SDR_HAS_DAM(sflag) ? 2 : 0) | (IMD_SDR_HAS_ERR(sflag) ? 4 : 0)) : 0)
+
+/* Whether two tracks differ in anything but their sector contents */
+static int tracks_differ_in_format(const ImdTrackInfo* ta, const ImdTrackInfo* tb) {
+    uint8_t n = ta->num_sectors;
+
+    if (ta->mode != tb->mode || n != tb->num_sectors || ta->sector_size != tb->sector_size) return 1;
+    if (memcmp(ta->smap, tb->smap, n) != 0) return 1;
+    if ((ta->hflag ^ tb->hflag) & (IMD_HFLAG_CMAP_PRES | IMD_HFLAG_HMAP_PRES)) return 1;
+    if ((ta->hflag & IMD_HFLAG_CMAP_PRES) && memcmp(ta->cmap, tb->cmap, n) != 0) return 1;
+    if ((ta->hflag & IMD_HFLAG_HMAP_PRES) && memcmp(ta->hmap, tb->hmap, n) != 0) return 1;
+    return 0;
+}
+
+/* Reports one difference; returns non-zero if the callback asked to stop */
+static int report_difference(ImdfDiffEntry* entry, ImdfDiffFn on_difference, void* user_data, size_t* count) {
+    (*count)++;
+    return on_difference ? on_difference(entry, user_data) : 0;
+}
+
+/* Compares the tracks at the same position of two images; both are loaded and hashed */
+static int diff_tracks(ImdImageFile* a, size_t ia, ImdImageFile* b, size_t ib,
+                       ImdfDiffFn on_difference, void* user_data, size_t* count) {
+    const ImdTrackInfo* ta = &a->layouts[ia].view->info;
+    const ImdTrackInfo* tb = &b->layouts[ib].view->info;
+    const ImdfTrackLayout* la = &a->layouts[ia];
+    const ImdfTrackLayout* lb = &b->layouts[ib];
+    ImdfDiffEntry entry;
+
+    if (la->track_hash == lb->track_hash) return 0;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.cyl = ta->cyl;
+    entry.head = ta->head;
+    entry.physical_sector = -1;
+    if (tracks_differ_in_format(ta, tb)) {
+        entry.kind = IMDF_DIFF_FORMAT;
+        return report_difference(&entry, on_difference, user_data, count);
+    }
+
+    /* Same layout: only the sectors whose status or data hash differ */
+    for (uint8_t i = 0; i < ta->num_sectors; ++i) {
+        int status_a = DIFF_SECTOR_STATUS(ta->sflag[i]);
+        int status_b = DIFF_SECTOR_STATUS(tb->sflag[i]);
+
+        entry.kind = 0;
+        if (status_a != status_b) entry.kind |= IMDF_DIFF_SECTOR_STATUS;
+        if ((status_a & 1) && (status_b & 1) && la->sector_hashes[i] != lb->sector_hashes[i]) entry.kind |= IMDF_DIFF_SECTOR_DATA;
+        if (entry.kind == 0) continue;
+        entry.physical_sector = i;
+        entry.logical_sector_id = ta->smap[i];
+        if (report_difference(&entry, on_difference, user_data, count)) return 1;
+    }
+    return 0;
+}
+
+/* Loads and hashes every track of an image; the caller holds its table exclusively */
+static int hash_all_tracks(ImdImageFile* imdf) {
+    for (size_t i = 0; i < imdf->num_tracks; ++i) {
+        int res = ensure_track_loaded(imdf, i);
+        if (res == IMDF_ERR_OK) res = ensure_track_hashed(imdf, i);
+        if (res != IMDF_ERR_OK) return res;
+    }
+    return IMDF_ERR_OK;
+}
+
+static int diff_unlocked(ImdImageFile* a, ImdImageFile* b, ImdfDiffFn on_difference, void* user_data, size_t* count) {
+    ImdfDiffEntry entry;
+    int res = hash_all_tracks(a);
+
+    if (res == IMDF_ERR_OK && b != a) res = hash_all_tracks(b);
+    if (res != IMDF_ERR_OK) return res;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.physical_sector = -1;
+    for (unsigned cyl = 0; cyl < 256; ++cyl) {
+        for (unsigned head = 0; head < IMDF_LUT_HEADS; ++head) {
+            int ia = find_track_index_internal(a, (uint8_t)cyl, (uint8_t)head);
+            int ib = find_track_index_internal(b, (uint8_t)cyl, (uint8_t)head);
+            int stop;
+
+            if (ia < 0 && ib < 0) continue;
+            if (ia >= 0 && ib >= 0) {
+                stop = diff_tracks(a, (size_t)ia, b, (size_t)ib, on_difference, user_data, count);
+            }
+            else {
+                entry.cyl = (uint8_t)cyl;
+                entry.head = (uint8_t)head;
+                entry.kind = (ia >= 0) ? IMDF_DIFF_ONLY_IN_A : IMDF_DIFF_ONLY_IN_B;
+                stop = report_difference(&entry, on_difference, user_data, count);
+            }
+            if (stop) return IMDF_ERR_OK;
+        }
+    }
+    return IMDF_ERR_OK;
+}
+
+int imdf_diff(ImdImageFile* a, ImdImageFile* b, ImdfDiffFn on_difference, void* user_data, size_t* num_differences_out) {
+    ImdImageFile* first = a;
+    ImdImageFile* second = b;
+    size_t count = 0;
+    int res;
+
+    if (num_differences_out) *num_differences_out = 0;
+    if (!a || !b) return IMDF_ERR_INVALID_ARG;
+
+    /* Two images are always locked in address order, so crossed diffs cannot deadlock */
+    if ((uintptr_t)first > (uintptr_t)second) {
+        first = b;
+        second = a;
+    }
+    table_lock_exclusive(first);
+    if (second != first) table_lock_exclusive(second);
+    res = diff_unlocked(a, b, on_difference, user_data, &count);
+    if (second != first) table_unlock_exclusive(second);
+    table_unlock_exclusive(first);
+
+    if (num_differences_out) *num_differences_out = count;
+    return res;
+}
+
+/* --- Data Stores --- */
+
+int imdf_store_create(ImdfDataStore** store_out) {
+    ImdfDataStore* store;
+
+    if (!store_out) return IMDF_ERR_INVALID_ARG;
+    *store_out = NULL;
+    store = (ImdfDataStore*)imd_calloc(1, sizeof(ImdfDataStore));
+    if (!store) return IMDF_ERR_ALLOC;
+    store->buckets = (ImdfStoreEntry**)imd_calloc(IMDF_STORE_INITIAL_BUCKETS, sizeof(ImdfStoreEntry*));
+    if (!store->buckets || imd_mutex_init(&store->lock) != 0) {
+        imd_free(store->buckets);
+        imd_free(store);
+        return IMDF_ERR_ALLOC;
+    }
+    store->num_buckets = IMDF_STORE_INITIAL_BUCKETS;
+    store->users = 1;
+    *store_out = store;
+    return IMDF_ERR_OK;
+}
+
+void imdf_store_release(ImdfDataStore* store) {
+    if (store) store_unuse(store);
+}
+
+int imdf_store_get_stats(ImdfDataStore* store, ImdfStoreStats* stats_out) {
+    if (!store || !stats_out) return IMDF_ERR_INVALID_ARG;
+    imd_mutex_lock(&store->lock);
+    stats_out->buffers = store->num_entries;
+    stats_out->references = store->num_refs;
+    stats_out->bytes_stored = store->bytes_stored;
+    stats_out->bytes_saved = store->bytes_referenced - store->bytes_stored;
+    imd_mutex_unlock(&store->lock);
+    return IMDF_ERR_OK;
+}
+
+/* Gives every shared track its own data again and leaves the store; the caller holds the table exclusively */
+static int detach_data_store(ImdImageFile* imdf) {
+    if (!imdf->store) return IMDF_ERR_OK;
+    for (size_t i = 0; i < imdf->num_tracks; ++i) {
+        int res = own_track_data(imdf, i);
+        if (res != IMDF_ERR_OK) return res;
+    }
+    store_unuse(imdf->store);
+    imdf->store = NULL;
+    return IMDF_ERR_OK;
+}
+
+/* Shares every loaded track with the store just attached; the caller holds the table exclusively */
+static void share_loaded_tracks(ImdImageFile* imdf) {
+    int arena_used = 0;
+
+    for (size_t i = 0; i < imdf->num_tracks; ++i) {
+        share_track_data(imdf, i);
+        if (imdf->layouts[i].view && data_in_arena(imdf, imdf->layouts[i].view->info.data)) arena_used = 1;
+    }
+    /* Every track has moved to the store: the arena of the open-time load is no longer needed */
+    if (imdf->data_arena && !arena_used) {
+        imd_free(imdf->data_arena);
+        imdf->data_arena = NULL;
+        imdf->data_arena_size = 0;
+    }
+}
+
+int imdf_set_data_store(ImdImageFile* imdf, ImdfDataStore* store) {
+    int res = IMDF_ERR_OK;
+
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+    table_lock_exclusive(imdf);
+    if (store != imdf->store) {
+        res = detach_data_store(imdf);
+        if (res == IMDF_ERR_OK && store) {
+            imd_mutex_lock(&store->lock);
+            store->users++;
+            imd_mutex_unlock(&store->lock);
+            imdf->store = store;
+            share_loaded_tracks(imdf);
+        }
+    }
+    table_unlock_exclusive(imdf);
+    return res;
+}
 
+int imdf_get_data_store(const ImdImageFile* imdf, ImdfDataStore** store_out) {
+    if (!imdf || !store_out) return IMDF_ERR_INVALID_ARG;
+    table_lock_shared((ImdImageFile*)imdf);
+    *store_out = imdf->store;
+    table_unlock_shared((ImdImageFile*)imdf);
     return IMDF_ERR_OK;
 }
 
 /* --- Track Writing --- */
 
-int imdf_write_track(ImdImageFile* imdf,
+/* Writes a track; the caller holds the table exclusively */
+static int write_track_unlocked(ImdImageFile* imdf,
     uint8_t cyl,
     uint8_t head,
     uint8_t mode,
@@ -770,6 +3799,7 @@ int imdf_write_track(ImdImageFile* imdf,
 {
     int track_idx_int;
     ImdTrackInfo* track_ptr = NULL;
+    ImdfTrackView* view;
     int rewrite_res;
     int result;
     int existing_track = 0;
@@ -797,36 +3827,46 @@ int imdf_write_track(ImdImageFile* imdf,
 
     track_idx_int = find_track_index_internal(imdf, cyl, head);
     existing_track = (track_idx_int >= 0);
+    imdf->lba_stale = 1; /* Track indices or sector maps change below */
 
     if (existing_track) {
         insert_idx = (size_t)track_idx_int;
         DEBUG_PRINTF("Write Track: Overwriting existing track at index %zu (C%u H%u)\n", insert_idx, cyl, head);
-        track_ptr = &imdf->tracks[insert_idx];
-        imd_free_track_data(track_ptr);
+        result = ensure_track_view(imdf, insert_idx);
+        if (result != IMDF_ERR_OK) return result; /* Track unchanged */
+        view = imdf->layouts[insert_idx].view;
+        track_ptr = &view->info;
+        release_track_data(imdf, insert_idx);
         memset(track_ptr, 0, sizeof(ImdTrackInfo));
+        reset_track_layout(&imdf->layouts[insert_idx]); /* Rebuilt by the rewrite below */
+        invalidate_logical_data(&imdf->layouts[insert_idx]);
+        release_track_hashes(&imdf->layouts[insert_idx]);
+        rebuild_view_lut(view); /* No sectors until the maps are set */
     }
     else {
         DEBUG_PRINTF("Write Track: Creating new track for C%u H%u\n", cyl, head);
         insert_idx = find_insertion_index(imdf, cyl, head);
 
         if (imdf->num_tracks >= imdf->track_capacity) {
-            size_t new_capacity = (imdf->track_capacity == 0) ? IMDF_INITIAL_TRACK_CAPACITY : imdf->track_capacity * 2;
-            if (new_capacity <= imdf->track_capacity) { result = IMDF_ERR_ALLOC; goto cleanup_inserterror; }
-            ImdTrackInfo* new_tracks = (ImdTrackInfo*)realloc(imdf->tracks, new_capacity * sizeof(ImdTrackInfo));
-            if (!new_tracks) { result = IMDF_ERR_ALLOC; goto cleanup_inserterror; }
-            imdf->tracks = new_tracks;
-            imdf->track_capacity = new_capacity;
-            DEBUG_PRINTF("Write Track: Reallocated track array to %zu\n", new_capacity);
+            result = grow_track_arrays(imdf);
+            if (result != IMDF_ERR_OK) return result; /* Nothing inserted yet */
         }
 
+        view = (ImdfTrackView*)imd_calloc(1, sizeof(ImdfTrackView));
+        if (!view) return IMDF_ERR_ALLOC; /* Nothing inserted yet */
+
         if (insert_idx < imdf->num_tracks) {
-            memmove(&imdf->tracks[insert_idx + 1],
-                &imdf->tracks[insert_idx],
-                (imdf->num_tracks - insert_idx) * sizeof(ImdTrackInfo));
+            /* Only the layouts move: the views, and pointers into them, stay put */
+            memmove(&imdf->layouts[insert_idx + 1],
+                &imdf->layouts[insert_idx],
+                (imdf->num_tracks - insert_idx) * sizeof(ImdfTrackLayout));
         }
 
-        track_ptr = &imdf->tracks[insert_idx];
-        memset(track_ptr, 0, sizeof(ImdTrackInfo));
+        track_ptr = &view->info;
+        memset(&imdf->layouts[insert_idx], 0, sizeof(ImdfTrackLayout));
+        reset_track_layout(&imdf->layouts[insert_idx]);
+        imdf->layouts[insert_idx].view = view;
+        rebuild_view_lut(view);
         imdf->num_tracks++;
     }
 
@@ -837,6 +3877,10 @@ int imdf_write_track(ImdImageFile* imdf,
     track_ptr->sector_size = sector_size;
     track_ptr->mode = mode;
     track_ptr->loaded = 1;
+    set_track_header(&imdf->layouts[insert_idx], track_ptr);
+    if (!existing_track) {
+        rebuild_track_lut(imdf); /* Indices from insert_idx on have shifted */
+    }
 
     track_ptr->hflag = 0;
     if (num_sectors > 0) { /* Maps only relevant if sectors exist */
@@ -855,6 +3899,7 @@ int imdf_write_track(ImdImageFile* imdf,
             goto cleanup_inserterror;
         }
         memset(track_ptr->data, fill_byte, track_ptr->data_size);
+        memset(track_ptr->uniform_map, 0xFF, sizeof(track_ptr->uniform_map)); /* Every sector holds fill_byte */
 
         for (uint8_t i = 0; i < num_sectors; ++i) {
             track_ptr->sflag[i] = IMD_SDR_NORMAL; /* Will be re-evaluated by imd_write_track_imd based on data and opts */
@@ -871,6 +3916,7 @@ int imdf_write_track(ImdImageFile* imdf,
         if (hmap != NULL) {
             memcpy(track_ptr->hmap, hmap, num_sectors);
         }
+        rebuild_view_lut(view);
     }
     else {
         track_ptr->data = NULL;
@@ -882,13 +3928,19 @@ int imdf_write_track(ImdImageFile* imdf,
     memcpy(&write_opts, &default_libimdf_write_opts, sizeof(ImdWriteOpts));
     write_opts.compression_mode = IMD_COMPRESSION_FORCE_COMPRESS; /* Try to compress if uniform */
 
-    rewrite_res = rewrite_image_file(imdf, insert_idx, &write_opts);
-    if (rewrite_res != IMDF_ERR_OK) {
-        result = rewrite_res;
-        goto cleanup_inserterror;
+    if (imdf->write_back) {
+        /* All sectors hold the fill byte, so an AS_READ flush of the predicted flags compresses them too */
+        mark_track_dirty(imdf, insert_idx);
+    }
+    else {
+        rewrite_res = rewrite_image_file(imdf, 0, insert_idx, &write_opts);
+        if (rewrite_res != IMDF_ERR_OK) {
+            result = rewrite_res;
+            goto cleanup_inserterror;
+        }
     }
 
-    /* After successful rewrite, update the in-memory sflag for the written track */
+    /* After successful rewrite (or deferral), update the in-memory sflag for the written track */
     /* This is a prediction based on the fill_byte and FORCE_COMPRESS option */
     if (num_sectors > 0) {
         for (uint8_t i = 0; i < track_ptr->num_sectors; ++i) {
@@ -904,14 +3956,19 @@ int imdf_write_track(ImdImageFile* imdf,
 
 cleanup_inserterror:
     DEBUG_PRINTF("Write Track: Cleaning up after error %d during %s track\n", result, existing_track ? "overwrite of" : "insertion of new");
-    if (!existing_track && track_ptr == &imdf->tracks[insert_idx]) {
-        imd_free_track_data(track_ptr);
+    if (!existing_track) {
+        release_track_view(imdf, insert_idx);
+        reset_track_layout(&imdf->layouts[insert_idx]);
+        invalidate_logical_data(&imdf->layouts[insert_idx]);
+        release_track_hashes(&imdf->layouts[insert_idx]);
         if (insert_idx < imdf->num_tracks - 1) {
-            memmove(&imdf->tracks[insert_idx],
-                &imdf->tracks[insert_idx + 1],
-                (imdf->num_tracks - 1 - insert_idx) * sizeof(ImdTrackInfo));
+            memmove(&imdf->layouts[insert_idx],
+                &imdf->layouts[insert_idx + 1],
+                (imdf->num_tracks - 1 - insert_idx) * sizeof(ImdfTrackLayout));
         }
         imdf->num_tracks--;
+        memset(&imdf->layouts[imdf->num_tracks], 0, sizeof(ImdfTrackLayout)); /* Vacated slot owns nothing */
+        rebuild_track_lut(imdf);
     }
     else if (existing_track && track_ptr) {
         DEBUG_PRINTF("Write Track: Overwrite for C%u H%u failed. In-memory track may be inconsistent until next open.\n", cyl, head);
@@ -919,6 +3976,26 @@ cleanup_inserterror:
     return result;
 }
 
+int imdf_write_track(ImdImageFile* imdf,
+    uint8_t cyl,
+    uint8_t head,
+    uint8_t mode,
+    uint8_t num_sectors,
+    uint32_t sector_size,
+    uint8_t fill_byte,
+    const uint8_t* smap,
+    const uint8_t* cmap,
+    const uint8_t* hmap)
+{
+    int res;
+
+    if (!imdf) return IMDF_ERR_INVALID_ARG;
+    table_lock_exclusive(imdf);
+    res = write_track_unlocked(imdf, cyl, head, mode, num_sectors, sector_size, fill_byte, smap, cmap, hmap);
+    table_unlock_exclusive(imdf);
+    return res;
+}
+
 /*
  * Helper function to generate the sector map (smap) based on the
  * specified formatting rules (first_sector_id, interleave, and skew).
@@ -934,23 +4011,25 @@ static void generate_formatted_smap(uint8_t* smap_out,
     }
 
     uint8_t temp_smap[LIBIMD_MAX_SECTORS_PER_TRACK];
-    uint8_t current_id;
 
     DEBUG_PRINTF("generate_formatted_smap: nsec=%u, first_id=%u, il=%d, skew=%d\n",
         num_sectors, first_sector_id, interleave, skew);
 
-    /* Generate the base (interleaved) map into a temporary buffer */
+    /*
+     * Generate the base (interleaved) map into a temporary buffer: the k-th sector
+     * in logical order, counting from first_sector_id, is ID ((first - 1 + k) % n) + 1.
+     */
     if (interleave == 1) {
         for (int i = 0; i < num_sectors; i++) {
-            temp_smap[i] = first_sector_id + i;
+            temp_smap[i] = (uint8_t)((first_sector_id - 1 + i) % num_sectors + 1);
         }
     }
     else {
         int base_rows = num_sectors / interleave;
         int extra_rows = num_sectors % interleave;
-        uint8_t col_starts[LIBIMD_MAX_SECTORS_PER_TRACK];
+        int col_starts[LIBIMD_MAX_SECTORS_PER_TRACK];
 
-        col_starts[0] = first_sector_id;
+        col_starts[0] = 0;
         for (int i = 1; i < interleave; i++) {
             col_starts[i] = col_starts[i - 1] + base_rows + (i <= extra_rows ? 1 : 0);
         }
@@ -958,27 +4037,55 @@ static void generate_formatted_smap(uint8_t* smap_out,
         for (int i = 0; i < num_sectors; i++) {
             int row = i / interleave;
             int col = i % interleave;
-            temp_smap[i] = col_starts[col] + row;
+            temp_smap[i] = (uint8_t)((first_sector_id - 1 + col_starts[col] + row) % num_sectors + 1);
         }
     }
 
-    /*
-     * Apply skew by determining the starting logical sector ID.
-     * The skew value is added to the first_sector_id to get the
-     * actual first sector in the sequence.
-     */
-    current_id = first_sector_id + skew;
-
+    /* Apply skew by rotating the interleaved map: physical sector 0 holds the skew-th entry */
     for (int i = 0; i < num_sectors; i++) {
-        smap_out[i] = current_id;
+        smap_out[i] = temp_smap[(i + skew) % num_sectors];
         DEBUG_PRINTF("  smap[%d] = %u\n", i, smap_out[i]);
+    }
+}
 
-        current_id++;
-        /* Wrap around if the ID exceeds the number of sectors */
-        if (current_id > num_sectors) {
-            current_id = first_sector_id;
-        }
+/* Checks the parameters of a track format against the image and the IMD limits */
+static int validate_track_format(const ImdImageFile* imdf, uint8_t cyl, uint8_t head, const ImdfTrackFormat* fmt) {
+    uint8_t sector_size_code;
+
+    if (imdf->write_protected) return IMDF_ERR_WRITE_PROTECTED;
+    if ((imdf->max_cyl != 0xFF && cyl > imdf->max_cyl) ||
+        (imdf->max_head != 0xFF && head > imdf->max_head)) {
+        return IMDF_ERR_GEOMETRY;
+    }
+    if (get_sector_size_code(fmt->sector_size, &sector_size_code) != 0) return IMDF_ERR_SECTOR_SIZE;
+    if (fmt->mode >= LIBIMD_NUM_MODES || fmt->num_sectors > LIBIMD_MAX_SECTORS_PER_TRACK ||
+        (fmt->num_sectors > 0 && (fmt->first_sector_id == 0 || fmt->first_sector_id > fmt->num_sectors)) ||
+        (fmt->interleave < 1 || (fmt->num_sectors > 1 && fmt->interleave >= fmt->num_sectors)) ||
+        (fmt->skew < 0 || fmt->skew >= fmt->num_sectors)) {
+        return IMDF_ERR_INVALID_ARG;
+    }
+    return IMDF_ERR_OK;
+}
+
+/* Generates the sector map of a validated track format and writes the track */
+static int format_track_internal(ImdImageFile* imdf, uint8_t cyl, uint8_t head, const ImdfTrackFormat* fmt) {
+    uint8_t generated_smap[LIBIMD_MAX_SECTORS_PER_TRACK];
+
+    if (fmt->num_sectors > 0) {
+        generate_formatted_smap(generated_smap, fmt->num_sectors, fmt->first_sector_id, fmt->interleave, fmt->skew);
     }
+
+    return write_track_unlocked(imdf,
+                                cyl,
+                                head,
+                                fmt->mode,
+                                fmt->num_sectors,
+                                fmt->sector_size,
+                                fmt->fill_byte,
+                                (fmt->num_sectors > 0) ? generated_smap : NULL,
+                                NULL, /* cmap is not generated by format. */
+                                NULL  /* hmap is not generated by format. */
+                                );
 }
 
 int imdf_format_track(ImdImageFile* imdf,
@@ -992,45 +4099,89 @@ int imdf_format_track(ImdImageFile* imdf,
                       int skew,
                       uint8_t fill_byte) {
 
-    uint8_t generated_smap[LIBIMD_MAX_SECTORS_PER_TRACK];
-    uint8_t sector_size_code; /* For validation */
+    ImdfTrackFormat fmt;
+    int res;
 
-    /*
-     * 1. Perform validation specific to formatting parameters.
-     */
     if (!imdf) return IMDF_ERR_INVALID_ARG;
-    if (imdf->write_protected) return IMDF_ERR_WRITE_PROTECTED;
-    if ((imdf->max_cyl != 0xFF && cyl > imdf->max_cyl) ||
-        (imdf->max_head != 0xFF && head > imdf->max_head)) {
-        return IMDF_ERR_GEOMETRY;
+
+    fmt.mode = mode;
+    fmt.num_sectors = num_sectors;
+    fmt.sector_size = sector_size;
+    fmt.first_sector_id = first_sector_id;
+    fmt.interleave = interleave;
+    fmt.skew = skew;
+    fmt.fill_byte = fill_byte;
+
+    table_lock_exclusive(imdf);
+    res = validate_track_format(imdf, cyl, head, &fmt);
+    if (res == IMDF_ERR_OK) res = format_track_internal(imdf, cyl, head, &fmt);
+    table_unlock_exclusive(imdf);
+    return res;
+}
+
+/* Format of one track of a disk geometry, with the cylinder skew applied */
+static void resolve_disk_track_format(const ImdfDiskGeometry* geometry, uint16_t cyl, uint8_t head, ImdfTrackFormat* fmt_out) {
+    if (geometry->track_formats) {
+        *fmt_out = geometry->track_formats[(size_t)cyl * geometry->num_heads + head];
+    }
+    else {
+        *fmt_out = geometry->format;
+    }
+    if (geometry->cylinder_skew != 0 && fmt_out->num_sectors > 0 && fmt_out->skew >= 0) {
+        long n = fmt_out->num_sectors;
+        long skew = (fmt_out->skew + (long)cyl * (geometry->cylinder_skew % n)) % n;
+        fmt_out->skew = (int)((skew + n) % n);
     }
-    if (mode >= LIBIMD_NUM_MODES || num_sectors > LIBIMD_MAX_SECTORS_PER_TRACK ||
-        get_sector_size_code(sector_size, &sector_size_code) != 0 ||
-        (num_sectors > 0 && (first_sector_id == 0 || first_sector_id > num_sectors)) ||
-        (interleave < 1 || (num_sectors > 1 && interleave >= num_sectors)) ||
-        (skew < 0 || skew >= num_sectors)) {
+}
+
+static int format_disk_unlocked(ImdImageFile* imdf, const ImdfDiskGeometry* geometry) {
+    ImdfTrackFormat fmt;
+    int saved_write_back;
+    int res = IMDF_ERR_OK;
+
+    if (imdf->write_protected) return IMDF_ERR_WRITE_PROTECTED;
+    if (geometry->num_cyls == 0 || geometry->num_cyls > 256 ||
+        geometry->num_heads == 0 || geometry->num_heads > 2) {
         return IMDF_ERR_INVALID_ARG;
     }
 
-    /*
-     * 2. Generate the sector map, which is the core logic of this function.
-     */
-    if (num_sectors > 0) {
-        generate_formatted_smap(generated_smap, num_sectors, first_sector_id, interleave, skew);
+    /* Validate every track first so that an invalid geometry changes nothing */
+    for (uint16_t cyl = 0; cyl < geometry->num_cyls; ++cyl) {
+        for (uint8_t head = 0; head < geometry->num_heads; ++head) {
+            resolve_disk_track_format(geometry, cyl, head, &fmt);
+            res = validate_track_format(imdf, (uint8_t)cyl, head, &fmt);
+            if (res != IMDF_ERR_OK) {
+                DEBUG_PRINTF("imdf_format_disk: Invalid format for C%u H%u (%d)\n", cyl, head, res);
+                return res;
+            }
+        }
     }
 
-    /*
-     * 3. Delegate track creation and file writing to the modified imdf_write_track.
-     */
-    return imdf_write_track(imdf,
-                            cyl,
-                            head,
-                            mode, /* Pass the mode parameter through. */
-                            num_sectors,
-                            sector_size,
-                            fill_byte,
-                            (num_sectors > 0) ? generated_smap : NULL,
-                            NULL, /* cmap is not generated by format. */
-                            NULL  /* hmap is not generated by format. */
-                            );
+    /* Build all tracks as deferred writes, then emit the file once */
+    saved_write_back = imdf->write_back;
+    imdf->write_back = 1;
+    for (uint16_t cyl = 0; cyl < geometry->num_cyls && res == IMDF_ERR_OK; ++cyl) {
+        for (uint8_t head = 0; head < geometry->num_heads && res == IMDF_ERR_OK; ++head) {
+            resolve_disk_track_format(geometry, cyl, head, &fmt);
+            res = format_track_internal(imdf, (uint8_t)cyl, head, &fmt);
+        }
+    }
+    imdf->write_back = saved_write_back;
+
+    if (!saved_write_back) {
+        /* Persist whatever was formatted, as immediate mode would have */
+        int flush_res = flush_unlocked(imdf);
+        if (res == IMDF_ERR_OK) res = flush_res;
+    }
+    return res;
+}
+
+int imdf_format_disk(ImdImageFile* imdf, const ImdfDiskGeometry* geometry) {
+    int res;
+
+    if (!imdf || !geometry) return IMDF_ERR_INVALID_ARG;
+    table_lock_exclusive(imdf);
+    res = format_disk_unlocked(imdf, geometry);
+    table_unlock_exclusive(imdf);
+    return res;
 }
@@ -38,11 +38,48 @@ extern "C" {
 #define IMDF_ERR_ALREADY_OPEN    -110 /* File handle already associated with an image */
 #define IMDF_ERR_CANNOT_OPEN     -111 /* Cannot open the specified image file */
 
+/* Flags for imdf_open_ex and imdf_open_from_file_ex */
+#define IMDF_OPEN_READ_ONLY   0x01 /* Open read-only and prevent modifications */
+#define IMDF_OPEN_LAZY        0x02 /* Index tracks at open, load sector data on first access */
+#define IMDF_OPEN_WRITE_BACK  0x04 /* Start in write-back mode (see imdf_set_write_back) */
+#define IMDF_OPEN_PARALLEL    0x08 /* Use one worker thread per processor (see imdf_set_worker_threads) */
+#define IMDF_OPEN_CONCURRENT  0x10 /* Allow calls from several threads at once (see imdf_set_concurrent) */
+#define IMDF_OPEN_HASH_TRACKING 0x20 /* Flushes skip tracks whose changes were undone (see imdf_set_hash_tracking) */
+
 /* --- Data Structures --- */
 
 /* Structure representing an open IMD file in memory */
 typedef struct ImdImageFile ImdImageFile; /* Opaque structure */
 
+/* Format of one track, as passed to imdf_format_track */
+typedef struct {
+    uint8_t  mode;             /* IMD mode (e.g. IMD_MODE_MFM_250) */
+    uint8_t  num_sectors;      /* Sectors per track (0-255) */
+    uint32_t sector_size;      /* Sector size in bytes (128-8192) */
+    uint8_t  first_sector_id;  /* Lowest logical sector ID (typically 1) */
+    int      interleave;       /* Interleave factor (1 = sequential) */
+    int      skew;             /* Offset of the first sector from physical sector 0 */
+    uint8_t  fill_byte;        /* Byte used to fill every sector */
+} ImdfTrackFormat;
+
+/* Whole-disk geometry for imdf_format_disk */
+typedef struct {
+    uint16_t num_cyls;         /* Cylinders 0 to num_cyls-1 (1-256) */
+    uint8_t  num_heads;        /* Heads per cylinder (1 or 2) */
+    ImdfTrackFormat format;    /* Format used for every track when track_formats is NULL */
+    /* Optional per-track formats, num_cyls * num_heads entries indexed by cyl * num_heads + head.
+     * When set, format is ignored. Can be NULL. */
+    const ImdfTrackFormat* track_formats;
+    int      cylinder_skew;    /* Extra skew added per cylinder, modulo the sectors per track (0 = none) */
+} ImdfDiskGeometry;
+
+/* A track held in memory and unchanged by other threads, see imdf_pin_track */
+typedef struct {
+    const ImdTrackInfo* track; /* The pinned track, with its sector data loaded */
+    ImdImageFile* imdf;        /* Image the pin belongs to; NULL when not pinned */
+    void* lock;                /* Internal */
+} ImdfTrackPin;
+
 /* --- Public Function Prototypes --- */
 
 /* --- Image Handling --- */
@@ -56,6 +93,19 @@ typedef struct ImdImageFile ImdImageFile; /* Opaque structure */
  */
 int imdf_open(const char* path, int read_only, ImdImageFile** imdf_out);
 
+/**
+ * Opens an IMD image file with extended options.
+ * With IMDF_OPEN_LAZY, only the track headers, maps and sector flags are read at open;
+ * a track's sector data is read the first time the track is accessed through
+ * imdf_read_sector, imdf_write_sector or imdf_get_track_info. Rewriting the file
+ * from a given track first loads all tracks that follow it.
+ * @param path Path to the IMD file.
+ * @param flags Bitwise OR of IMDF_OPEN_* flags (0 for a read/write, fully loaded image).
+ * @param imdf_out Pointer to store the allocated ImdImageFile handle on success.
+ * @return IMDF_ERR_OK on success, negative IMDF_ERR_* code on failure.
+ */
+int imdf_open_ex(const char* path, unsigned int flags, ImdImageFile** imdf_out);
+
 /**
  * Opens an IMD image from an existing file stream and loads its structure into memory.
  * The stream must be seekable. The caller retains ownership of the file stream
@@ -68,12 +118,76 @@ int imdf_open(const char* path, int read_only, ImdImageFile** imdf_out);
  */
 int imdf_open_from_file(FILE* f, int read_only, ImdImageFile** imdf_out);
 
+/**
+ * Opens an IMD image from an existing file stream with extended options.
+ * See imdf_open_ex for the meaning of the flags. With IMDF_OPEN_LAZY, the stream
+ * must stay open and seekable for as long as the image is open.
+ * @param f The file stream to read from. It will be rewound before reading.
+ * @param flags Bitwise OR of IMDF_OPEN_* flags.
+ * @param imdf_out Pointer to store the allocated ImdImageFile handle on success.
+ * @return IMDF_ERR_OK on success, negative IMDF_ERR_* code on failure.
+ */
+int imdf_open_from_file_ex(FILE* f, unsigned int flags, ImdImageFile** imdf_out);
+
+/**
+ * Opens an IMD image file read-only through a memory mapping (mmap on POSIX,
+ * MapViewOfFile on Windows). Only the header, comment and track headers are parsed
+ * at open time. imdf_read_sector copies sectors straight from the mapping and
+ * expands compressed sectors on demand; track data is only allocated when a
+ * track is requested through imdf_get_track_info.
+ * The image stays write-protected; write functions return IMDF_ERR_WRITE_PROTECTED.
+ * @param path Path to the IMD file.
+ * @param imdf_out Pointer to store the allocated ImdImageFile handle on success.
+ * @return IMDF_ERR_OK on success, negative IMDF_ERR_* code on failure.
+ */
+int imdf_open_mapped(const char* path, ImdImageFile** imdf_out);
+
+/**
+ * Opens an IMD image held in memory, as imdf_open_mapped does for a file: the image
+ * is read-only and only its header, comment and track headers are parsed at open time.
+ * The bytes are copied, so the caller's buffer may be released after the call.
+ * @param data Buffer holding the complete image.
+ * @param size Number of bytes in data.
+ * @param imdf_out Pointer to store the allocated ImdImageFile handle on success.
+ * @return IMDF_ERR_OK on success, negative IMDF_ERR_* code on failure.
+ */
+int imdf_open_buffer(const uint8_t* data, size_t size, ImdImageFile** imdf_out);
+
+/**
+ * Opens many IMD image files read-only, keeping queue_depth file reads in flight
+ * (see imd_prefetch_start). Each file is read whole and opened from memory as
+ * imdf_open_buffer does, without the copy; this suits network storage, where
+ * waiting for one file at a time is slow. Close every opened image with imdf_close.
+ * @param paths Array of count file paths.
+ * @param count Number of files.
+ * @param queue_depth Number of reads in flight (0 = 1).
+ * @param images Array of count handles, set to the opened image or NULL on failure.
+ * @param statuses Array of count ints to receive IMDF_ERR_OK or the IMDF_ERR_* code of each file, or NULL.
+ * @return The number of files that could not be opened (0 if all were),
+ * IMDF_ERR_INVALID_ARG on invalid arguments, or IMDF_ERR_ALLOC if no reader could be started.
+ */
+int imdf_open_files(const char* const* paths, size_t count, unsigned queue_depth,
+                    ImdImageFile** images, int* statuses);
+
 /**
  * Closes an open IMD image file, frees all associated memory, and closes the file handle.
+ * Pending write-back changes are flushed first; a flush failure is reported on stderr.
  * @param imdf Pointer to the ImdImageFile handle obtained from imdf_open. Can be NULL.
  */
 void imdf_close(ImdImageFile* imdf);
 
+/**
+ * Creates a new IMD image file containing only a header and comment, and opens it
+ * for writing. An existing file at path is truncated.
+ * Use imdf_format_disk or imdf_format_track to add tracks.
+ * @param path Path of the IMD file to create.
+ * @param comment Optional comment text (without the 0x1A terminator). Can be NULL.
+ * @param imdf_out Pointer to store the allocated ImdImageFile handle on success.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_CANNOT_OPEN if the file cannot be created,
+ * IMDF_ERR_IO on write error, other negative IMDF_ERR_* code on failure.
+ */
+int imdf_create(const char* path, const char* comment, ImdImageFile** imdf_out);
+
 /* --- Geometry --- */
 
 /**
@@ -116,6 +230,181 @@ int imdf_set_write_protect(ImdImageFile* imdf, int protect);
  */
 int imdf_get_write_protect(ImdImageFile* imdf, int* protect_out);
 
+/* --- Write-Back Caching --- */
+
+/**
+ * Enables or disables write-back mode for the image.
+ * In write-back mode, imdf_write_sector and imdf_write_track only update memory and
+ * mark the affected tracks dirty. The file is updated by imdf_flush or imdf_close,
+ * which rewrite the file only from the first track whose record length may have changed.
+ * Disabling write-back mode flushes pending changes first.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param enable If non-zero, enables write-back mode. If zero, writes are persisted immediately (default).
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf is NULL,
+ * or the error from imdf_flush when disabling (write-back mode then stays enabled).
+ */
+int imdf_set_write_back(ImdImageFile* imdf, int enable);
+
+/**
+ * Gets the current write-back mode of the image.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param enable_out Pointer to store the write-back mode (1 if enabled, 0 otherwise).
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf or enable_out is NULL.
+ */
+int imdf_get_write_back(ImdImageFile* imdf, int* enable_out);
+
+/**
+ * Writes all pending write-back changes to the file.
+ * Sectors changed in place are patched individually; from the first track that must be
+ * re-encoded onwards, the remainder of the file is rewritten and the file is truncated.
+ * Does nothing if no changes are pending.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @return IMDF_ERR_OK on success.
+ * @return IMDF_ERR_INVALID_ARG if imdf is NULL.
+ * @return IMDF_ERR_WRITE_PROTECTED if the image has no writable file.
+ * @return IMDF_ERR_IO on file write error. Unwritten changes stay pending.
+ * @return IMDF_ERR_LIBIMD_ERR on internal libimd errors during the rewrite.
+ */
+int imdf_flush(ImdImageFile* imdf);
+
+/* --- Worker Threads --- */
+
+/**
+ * Sets the number of threads used to re-encode tracks when the file is rewritten
+ * (imdf_flush, imdf_close, or an immediate write that changes a record's length).
+ * Opening an image with IMDF_OPEN_PARALLEL also decodes its tracks on one thread per
+ * processor. The output is identical to a serial rewrite. If a custom allocator is
+ * installed with imd_set_allocator, it must be thread-safe when more than one thread is used.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param num_threads Number of threads (1 = serial, the default; 0 = one per processor).
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf is NULL.
+ */
+int imdf_set_worker_threads(ImdImageFile* imdf, unsigned num_threads);
+
+/**
+ * Gets the number of threads used for track encoding and decoding.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param num_threads_out Pointer to store the number of threads.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf or num_threads_out is NULL.
+ */
+int imdf_get_worker_threads(ImdImageFile* imdf, unsigned* num_threads_out);
+
+/* --- Concurrent Access --- */
+
+/*
+ * By default an image must be used by one thread at a time. A concurrent image
+ * (IMDF_OPEN_CONCURRENT or imdf_set_concurrent) may be shared by any number of threads:
+ * - Sector and block reads, zero-copy pointers and imdf_pin_track run side by side.
+ *   Only the track a call touches is locked, so a write to one track does not block
+ *   the others, and lazy loads of different tracks proceed in parallel.
+ * - Sector and block writes lock their track exclusively. A write that changes a record's
+ *   length outside write-back mode rewrites the file and briefly holds the whole image.
+ * - Track writes, formatting, flushing, serialization, settings changes and the statistics
+ *   hold the whole image.
+ * Zero-copy pointers (imdf_get_sector_ptr, imdf_get_track_data_ptr, imdf_get_track_info)
+ * are not protected once the call returns: another thread's write may change or free the
+ * data behind them. Readers that run alongside writers should copy the data, or pin the
+ * track for as long as they use the pointers.
+ * imdf_close must not race with any other call on the image.
+ */
+
+/**
+ * Turns concurrent access on or off. Must not be called while another thread uses the image.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param enable Non-zero to allow concurrent calls, 0 for single-threaded use (no locking cost).
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf is NULL,
+ * IMDF_ERR_ALLOC if the locks cannot be allocated.
+ */
+int imdf_set_concurrent(ImdImageFile* imdf, int enable);
+
+/**
+ * Gets whether concurrent access is on.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param enable_out Pointer to store 1 if on, 0 if off.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf or enable_out is NULL.
+ */
+int imdf_get_concurrent(const ImdImageFile* imdf, int* enable_out);
+
+/**
+ * Pins a track: loads its sector data and keeps it from changing until imdf_unpin_track.
+ * Other threads may read the track, and read or write other tracks, meanwhile; calls that
+ * write the track or hold the whole image wait for the pin to be released.
+ * A thread may hold one pin at a time and must not call other imdf functions on the
+ * same image while it holds it. On an image without concurrent access the pin only loads the track.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param cyl Cylinder number of the track.
+ * @param head Head number of the track.
+ * @param pin_out Pointer to the pin to fill in; pin_out->track is the pinned track.
+ * @return IMDF_ERR_OK on success (the pin must then be released).
+ * @return IMDF_ERR_INVALID_ARG if imdf or pin_out is NULL.
+ * @return IMDF_ERR_NOT_FOUND if the track does not exist.
+ * @return Other negative IMDF_ERR_* codes if the track data could not be loaded.
+ */
+int imdf_pin_track(ImdImageFile* imdf, uint8_t cyl, uint8_t head, ImdfTrackPin* pin_out);
+
+/**
+ * Releases a pin taken by imdf_pin_track. Does nothing for a pin that is not held.
+ * @param pin Pointer to the pin.
+ */
+void imdf_unpin_track(ImdfTrackPin* pin);
+
+/* --- Statistics --- */
+
+/**
+ * Retrieves the performance counters of one image: the work libimdf did for it
+ * (opening, loading, rewriting, in-place writes) since it was opened or
+ * imdf_reset_stats() was called, including the share done on worker threads.
+ * Only counted while imd_stats_enable() is on. Global totals are in imd_get_stats().
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param stats_out Pointer to receive the counters.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf or stats_out is NULL.
+ */
+int imdf_get_stats(const ImdImageFile* imdf, ImdStats* stats_out);
+
+/**
+ * Clears the performance counters of an image.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf is NULL.
+ */
+int imdf_reset_stats(ImdImageFile* imdf);
+
+/* --- Serialization --- */
+
+/**
+ * Returns an upper bound on the size of the image produced by imdf_serialize_to_buffer().
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @return The bound in bytes, or 0 if imdf is NULL.
+ */
+size_t imdf_serialized_size_bound(const ImdImageFile* imdf);
+
+/**
+ * Serializes the image as it is in memory, including pending write-back changes,
+ * into a caller-supplied buffer. The bytes are those a full rewrite of the file
+ * would produce (header line with the current date, comment, all track records).
+ * Unmodified tracks are copied from the file or mapping as read; unloaded tracks are
+ * loaded first. The image file itself is not modified.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param buf Destination buffer. imdf_serialized_size_bound() bytes are always enough.
+ * @param buf_size Size of buf in bytes.
+ * @param written_out Pointer to receive the size of the serialized image.
+ * @return IMDF_ERR_OK on success.
+ * @return IMDF_ERR_INVALID_ARG if an argument is NULL.
+ * @return IMDF_ERR_BUFFER_SIZE if the image does not fit in buf.
+ * @return IMDF_ERR_IO or IMDF_ERR_LIBIMD_ERR if a track cannot be loaded or encoded.
+ */
+int imdf_serialize_to_buffer(ImdImageFile* imdf, uint8_t* buf, size_t buf_size, size_t* written_out);
+
+/**
+ * Serializes the image like imdf_serialize_to_buffer() into a newly allocated buffer.
+ * The buffer comes from the libimd allocator and must be released with imd_free().
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param buf_out Pointer to receive the buffer.
+ * @param size_out Pointer to receive the size of the serialized image.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_ALLOC on allocation failure, or an error
+ *         from imdf_serialize_to_buffer().
+ */
+int imdf_serialize_to_memory(ImdImageFile* imdf, uint8_t** buf_out, size_t* size_out);
+
 /* --- Metadata Access --- */
 
 /**
@@ -135,6 +424,22 @@ const ImdHeaderInfo* imdf_get_header_info(const ImdImageFile* imdf);
  */
 const char* imdf_get_comment(const ImdImageFile* imdf, size_t* comment_len_out);
 
+/**
+ * Replaces the comment block of the image.
+ * Changing the comment moves every track record, so the file is rewritten from the
+ * header on (immediately, or on the next imdf_flush/imdf_close in write-back mode).
+ * Tracks that were not modified are copied as read rather than re-encoded.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param comment New comment text (without the 0x1A terminator). Can be NULL if comment_len is 0.
+ * @param comment_len Length of the comment in bytes.
+ * @return IMDF_ERR_OK on success.
+ * @return IMDF_ERR_INVALID_ARG if imdf is NULL, comment is NULL with a non-zero length, or the comment contains 0x1A.
+ * @return IMDF_ERR_WRITE_PROTECTED if the image is write-protected.
+ * @return IMDF_ERR_ALLOC on memory allocation failure.
+ * @return IMDF_ERR_IO on file write error during persistence.
+ */
+int imdf_set_comment(ImdImageFile* imdf, const char* comment, size_t comment_len);
+
 /**
  * Gets the total number of tracks loaded from the IMD image.
  * @param imdf Pointer to the ImdImageFile handle.
@@ -147,9 +452,15 @@ int imdf_get_num_tracks(const ImdImageFile* imdf, size_t* num_tracks_out);
  * Gets a pointer to the information for a specific track by its index.
  * @param imdf Pointer to the ImdImageFile handle.
  * @param track_index The index of the track (0 to num_tracks-1).
+ * For an image opened with imdf_open_mapped, the track's sector data is expanded
+ * into memory on the first call. Images opened lazily, mapped or from a buffer keep
+ * only compact metadata for a track until it is first used.
  * @return Pointer to the constant ImdTrackInfo structure for the requested track,
- * or NULL if imdf is NULL or track_index is out of bounds.
+ * or NULL if imdf is NULL, track_index is out of bounds, or the track data could not be loaded.
+ * The pointer stays valid until that track is replaced by imdf_write_track, imdf_format_track
+ * or imdf_format_disk, or the image is closed; adding other tracks does not move it.
  * Do not modify the returned structure directly; use read/write functions.
+ * On a concurrent image, use imdf_pin_track to keep the track from changing while it is read.
  */
 const ImdTrackInfo* imdf_get_track_info(const ImdImageFile* imdf, size_t track_index);
 
@@ -184,10 +495,54 @@ int imdf_find_track_by_ch(const ImdImageFile* imdf, uint8_t cyl, uint8_t head, s
  */
 int imdf_read_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, uint8_t* buffer, size_t buffer_size);
 
+/**
+ * Gets a read-only pointer to a sector's data without copying it.
+ * The pointer refers to the in-memory track data, or directly into the file mapping for
+ * normal sectors of an image opened with imdf_open_mapped. It stays valid until the next call
+ * that modifies the image (sector/track write or format) or imdf_close.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param cyl Cylinder number of the sector.
+ * @param head Head number of the sector.
+ * @param logical_sector_id The logical sector ID (from SMAP) to access.
+ * @param data_out Pointer to store the sector data pointer. Set to NULL on failure.
+ * @param size_out Optional pointer to store the sector size in bytes. Can be NULL.
+ * @param sflag_out Optional pointer to store the sector's Sector Data Record type. Can be NULL.
+ * @return IMDF_ERR_OK on success.
+ * @return IMDF_ERR_INVALID_ARG if imdf or data_out is NULL.
+ * @return IMDF_ERR_GEOMETRY if cyl/head/sector exceeds limits.
+ * @return IMDF_ERR_NOT_FOUND if the track or logical sector ID does not exist.
+ * @return IMDF_ERR_UNAVAILABLE if the sector is marked as unavailable (size and sflag are still reported).
+ * @return Other negative IMDF_ERR_* codes if the track data could not be loaded.
+ */
+int imdf_get_sector_ptr(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id,
+                        const uint8_t** data_out, size_t* size_out, uint8_t* sflag_out);
+
+/**
+ * Gets a read-only pointer to the data of a whole track with its sectors in ascending
+ * logical sector ID order (sectors with equal IDs keep their physical order).
+ * If the track is not already stored in that order, a reordered copy is built and cached
+ * until the track is modified. Unavailable sectors hold the fill byte.
+ * The pointer stays valid until the next call that modifies the image or imdf_close.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param cyl Cylinder number of the track.
+ * @param head Head number of the track.
+ * @param data_out Pointer to store the track data pointer (NULL for a track with no sectors).
+ * @param size_out Optional pointer to store the size of the track data in bytes. Can be NULL.
+ * @return IMDF_ERR_OK on success.
+ * @return IMDF_ERR_INVALID_ARG if imdf or data_out is NULL.
+ * @return IMDF_ERR_GEOMETRY if cyl/head exceeds limits.
+ * @return IMDF_ERR_NOT_FOUND if the track does not exist.
+ * @return IMDF_ERR_ALLOC if the reordered copy cannot be allocated.
+ */
+int imdf_get_track_data_ptr(ImdImageFile* imdf, uint8_t cyl, uint8_t head, const uint8_t** data_out, size_t* size_out);
+
 /**
  * Writes data from a buffer to a specific sector.
- * If the target sector belongs to a track marked as compressed, the entire track
- * will be rewritten to the file decompressed. Changes are persisted immediately.
+ * If the sector is stored in the file as a normal (uncompressed) record, only
+ * its data bytes are overwritten in place. Otherwise the record length changes
+ * and the image file is rewritten; if the target sector belongs to a track marked
+ * as compressed, the entire track will be rewritten to the file decompressed.
+ * Changes are persisted immediately, unless write-back mode is enabled.
  * @param imdf Pointer to the ImdImageFile handle.
  * @param cyl Cylinder number of the target sector.
  * @param head Head number of the target sector.
@@ -207,6 +562,211 @@ int imdf_read_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logi
 int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, const uint8_t* buffer, size_t buffer_size);
 
 
+/* --- Block Access --- */
+
+/**
+ * Builds a logical block (LBA) view of the image, for block-device style access.
+ * Blocks are numbered from 0 through the tracks in ascending (cylinder, head) order,
+ * and within each track through its sectors in ascending logical sector ID order,
+ * starting at first_sector_id (sectors with lower IDs are not part of the view).
+ * Sectors outside the geometry limits are left out. The view is rebuilt automatically
+ * with the same first_sector_id when tracks are written or formatted, or the geometry changes.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param first_sector_id Sector ID of the first block of each track (usually 1, or 0).
+ * @param num_blocks_out Optional pointer to store the number of blocks. Can be NULL.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf is NULL,
+ * IMDF_ERR_ALLOC if the block table cannot be allocated.
+ */
+int imdf_build_lba_map(ImdImageFile* imdf, uint8_t first_sector_id, size_t* num_blocks_out);
+
+/**
+ * Reads consecutive logical blocks into a buffer, each block taking its sector's size.
+ * Blocks whose sectors lie back to back in the in-memory track data are copied at once.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param lba Number of the first block.
+ * @param count Number of blocks to read.
+ * @param buffer Pointer to the buffer receiving the data.
+ * @param buffer_size Size of the buffer in bytes. Must hold all the blocks.
+ * @return IMDF_ERR_OK on success.
+ * @return IMDF_ERR_INVALID_ARG if imdf or buffer is NULL, or imdf_build_lba_map was not called.
+ * @return IMDF_ERR_GEOMETRY if the range extends past the last block.
+ * @return IMDF_ERR_BUFFER_SIZE if buffer_size is too small.
+ * @return IMDF_ERR_UNAVAILABLE if a sector in the range is unavailable; the blocks before it have been read.
+ * @return Other negative IMDF_ERR_* codes if track data could not be loaded.
+ */
+int imdf_read_blocks(ImdImageFile* imdf, size_t lba, size_t count, uint8_t* buffer, size_t buffer_size);
+
+/**
+ * Writes consecutive logical blocks from a buffer, as imdf_write_sector would sector by sector.
+ * In write-back mode, runs of sectors stored as normal records are updated with a single copy.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param lba Number of the first block.
+ * @param count Number of blocks to write.
+ * @param buffer Pointer to the data to write.
+ * @param buffer_size Size of the data in bytes. Must equal the total size of the blocks.
+ * @return IMDF_ERR_OK on success.
+ * @return IMDF_ERR_INVALID_ARG if imdf or buffer is NULL, or imdf_build_lba_map was not called.
+ * @return IMDF_ERR_WRITE_PROTECTED if the image is write-protected.
+ * @return IMDF_ERR_GEOMETRY if the range extends past the last block.
+ * @return IMDF_ERR_SECTOR_SIZE if buffer_size does not match the size of the blocks.
+ * @return Other negative IMDF_ERR_* codes as from imdf_write_sector; the blocks before the failing one have been written.
+ */
+int imdf_write_blocks(ImdImageFile* imdf, size_t lba, size_t count, const uint8_t* buffer, size_t buffer_size);
+
+
+/* --- Content Hashes and Diff --- */
+
+/* Kinds of difference reported by imdf_diff (bitwise OR for sector entries) */
+#define IMDF_DIFF_ONLY_IN_A       0x01 /* Track exists only in the first image */
+#define IMDF_DIFF_ONLY_IN_B       0x02 /* Track exists only in the second image */
+#define IMDF_DIFF_FORMAT          0x04 /* Mode, sector count, sector size or maps differ */
+#define IMDF_DIFF_SECTOR_DATA     0x08 /* Sector data differs */
+#define IMDF_DIFF_SECTOR_STATUS   0x10 /* Sector availability, deleted mark or data error differs */
+
+/* One difference found by imdf_diff */
+typedef struct {
+    uint8_t cyl;                /* Physical cylinder of the track */
+    uint8_t head;               /* Physical head of the track */
+    unsigned kind;              /* IMDF_DIFF_* bits */
+    int physical_sector;        /* Physical sector index, -1 for a whole-track difference */
+    uint8_t logical_sector_id;  /* Logical sector ID (sector differences only) */
+} ImdfDiffEntry;
+
+/**
+ * Callback of imdf_diff.
+ * @param entry The difference; only valid during the call.
+ * @param user_data Pointer passed to imdf_diff.
+ * @return 0 to continue, non-zero to stop the comparison.
+ */
+typedef int (*ImdfDiffFn)(const ImdfDiffEntry* entry, void* user_data);
+
+/**
+ * Turns hash tracking on or off. With hash tracking, each track remembers the content
+ * hash it had when it was last written to the file, and imdf_flush leaves alone any dirty
+ * track whose content is back to that state (for example, an edit that was reverted).
+ * Off by default; see also IMDF_OPEN_HASH_TRACKING.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param enable Non-zero to turn hash tracking on, 0 to turn it off.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf is NULL.
+ */
+int imdf_set_hash_tracking(ImdImageFile* imdf, int enable);
+
+/**
+ * Gets whether hash tracking is on.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param enable_out Pointer to store 1 if on, 0 if off.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf or enable_out is NULL.
+ */
+int imdf_get_hash_tracking(const ImdImageFile* imdf, int* enable_out);
+
+/**
+ * Gets the content hash of a track (see imd_hash_track), loading the track if needed.
+ * Hashes are computed on first use and kept up to date by writes.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param cyl Cylinder number of the track.
+ * @param head Head number of the track.
+ * @param hash_out Pointer to store the hash.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf or hash_out is NULL,
+ * IMDF_ERR_NOT_FOUND if the track does not exist, or other negative IMDF_ERR_* codes
+ * if the track data could not be loaded.
+ */
+int imdf_get_track_hash(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint64_t* hash_out);
+
+/**
+ * Gets the content hash of a sector's data (see imd_hash_sector).
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param cyl Cylinder number of the track.
+ * @param head Head number of the track.
+ * @param logical_sector_id Logical ID of the sector.
+ * @param hash_out Pointer to store the hash.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf or hash_out is NULL,
+ * IMDF_ERR_NOT_FOUND if the track or sector does not exist,
+ * IMDF_ERR_UNAVAILABLE if the sector is marked as unavailable.
+ */
+int imdf_get_sector_hash(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t logical_sector_id, uint64_t* hash_out);
+
+/**
+ * Compares two images track by track. Tracks with equal content hashes are skipped;
+ * for the others the difference is reported once per track (format or presence) or
+ * once per differing sector. All tracks of both images are loaded.
+ * Both images are locked for the duration of the call.
+ * @param a Pointer to the first image.
+ * @param b Pointer to the second image (may be the same as a).
+ * @param on_difference Optional callback, called for each difference in (cylinder, head, sector) order.
+ * @param user_data Pointer passed to the callback.
+ * @param num_differences_out Optional pointer to store the number of differences reported.
+ * @return IMDF_ERR_OK on success (also when the callback stops early),
+ * IMDF_ERR_INVALID_ARG if a or b is NULL, or other negative IMDF_ERR_* codes
+ * if track data could not be loaded.
+ */
+int imdf_diff(ImdImageFile* a, ImdImageFile* b, ImdfDiffFn on_difference, void* user_data, size_t* num_differences_out);
+
+
+/* --- Data Stores --- */
+
+/*
+ * A data store lets images that hold the same track data share one copy of it, such as
+ * the boot tracks, empty directories and blank tracks that recur across an archive.
+ * Once an image is attached to a store (imdf_set_data_store), tracks it loads from the
+ * file are looked up by content hash: a track whose data is already in the store uses
+ * that buffer, and other tracks add theirs. Writing to a shared track first gives it a
+ * copy of its own (copy-on-write), so the other images never see the change.
+ * A store may be shared by images used from different threads.
+ */
+typedef struct ImdfDataStore ImdfDataStore; /* Opaque structure */
+
+/* Usage of a data store, see imdf_store_get_stats */
+typedef struct {
+    size_t buffers;             /* Distinct track data buffers held */
+    size_t references;          /* Tracks using them */
+    uint64_t bytes_stored;      /* Size of the buffers held */
+    uint64_t bytes_saved;       /* Memory the tracks would take in addition on their own */
+} ImdfStoreStats;
+
+/**
+ * Creates an empty data store.
+ * @param store_out Pointer to store the new store.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if store_out is NULL,
+ * IMDF_ERR_ALLOC if the store cannot be allocated.
+ */
+int imdf_store_create(ImdfDataStore** store_out);
+
+/**
+ * Releases the caller's reference to a store. The store is freed once the
+ * images attached to it have been closed or detached. Does nothing if store is NULL.
+ * @param store Pointer to the store.
+ */
+void imdf_store_release(ImdfDataStore* store);
+
+/**
+ * Gets the usage of a data store.
+ * @param store Pointer to the store.
+ * @param stats_out Pointer to the structure to fill in.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if store or stats_out is NULL.
+ */
+int imdf_store_get_stats(ImdfDataStore* store, ImdfStoreStats* stats_out);
+
+/**
+ * Attaches an image to a data store, or detaches it. Tracks already in memory are
+ * moved to the store at once (for a fully loaded image, this frees its own copy of
+ * the data); with IMDF_OPEN_LAZY, tracks are shared as they are loaded.
+ * Detaching gives every shared track a copy of its own again.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param store Store to attach to, or NULL to detach.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf is NULL,
+ * IMDF_ERR_ALLOC if the tracks could not be given their own copies to leave the
+ * previous store (the image then stays attached to it).
+ */
+int imdf_set_data_store(ImdImageFile* imdf, ImdfDataStore* store);
+
+/**
+ * Gets the data store an image is attached to.
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param store_out Pointer to store the store, NULL if none.
+ * @return IMDF_ERR_OK on success, IMDF_ERR_INVALID_ARG if imdf or store_out is NULL.
+ */
+int imdf_get_data_store(const ImdImageFile* imdf, ImdfDataStore** store_out);
+
 /* --- Track Writing --- */
 
 /**
@@ -214,7 +774,7 @@ int imdf_write_sector(ImdImageFile* imdf, uint8_t cyl, uint8_t head, uint8_t log
  * Creates the track if it doesn't exist, inserting it in C/H order.
  * If overwriting, the existing track data is replaced. Sector size can be changed.
  * All sectors in the written track will be initially marked as 'Normal' (IMD_SDR_NORMAL).
- * Changes are persisted immediately.
+ * Changes are persisted immediately, unless write-back mode is enabled.
  *
  * @param imdf Pointer to the ImdImageFile handle.
  * @param cyl Cylinder number for the track.
@@ -289,7 +849,7 @@ int get_sector_size_code(uint32_t sector_size, uint8_t* code_out);
  * @param skew The offset from physical sector 0.
  * @param fill_byte Byte value used to fill the data buffer for all sectors.
  * @return IMDF_ERR_OK on success.
- * @return IMDF_ERR_INVALID_ARG if imdf is NULL or parameters are invalid (e.g. num_sectors too large, invalid sector_size, first_sector_id out of range).
+ * @return IMDF_ERR_INVALID_ARG if imdf is NULL or parameters are invalid (e.g. num_sectors too large, first_sector_id out of range).
  * @return IMDF_ERR_WRITE_PROTECTED if the image is write-protected.
  * @return IMDF_ERR_GEOMETRY if cyl/head exceeds limits.
  * @return IMDF_ERR_SECTOR_SIZE if the specified sector_size is invalid.
@@ -308,6 +868,28 @@ int imdf_format_track(ImdImageFile* imdf,
     int skew,
     uint8_t fill_byte);
 
+/**
+ * Formats every track of a disk described by a geometry, replacing existing tracks with
+ * the same cylinder/head. Tracks outside the geometry are left unchanged.
+ * All tracks are built in memory and the file is written once at the end, instead of
+ * once per track as with repeated imdf_format_track calls. If write-back mode is
+ * enabled, the write is deferred to the next imdf_flush or imdf_close as usual.
+ * All track formats are validated before any track is changed.
+ *
+ * @param imdf Pointer to the ImdImageFile handle.
+ * @param geometry Disk geometry and track formats. Must not be NULL.
+ * @return IMDF_ERR_OK on success.
+ * @return IMDF_ERR_INVALID_ARG if imdf or geometry is NULL or a track format is invalid
+ * (same rules as imdf_format_track, applied after adding the cylinder skew).
+ * @return IMDF_ERR_WRITE_PROTECTED if the image is write-protected.
+ * @return IMDF_ERR_GEOMETRY if the geometry exceeds the limits set by imdf_set_geometry.
+ * @return IMDF_ERR_SECTOR_SIZE if a sector_size is invalid.
+ * @return IMDF_ERR_ALLOC on memory allocation failure.
+ * @return IMDF_ERR_IO on file write error. The formatted tracks stay pending in memory
+ * and are written by the next imdf_flush or imdf_close.
+ */
+int imdf_format_disk(ImdImageFile* imdf, const ImdfDiskGeometry* geometry);
+
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,87 @@
+/*
+ * Regression tests for libimd.
+ * Each test writes a small image byte by byte and reads it back through libimd.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+#include "libimd.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_IMAGE "test_libimd.imd"
+#define TEST_HEADER "IMD 1.18: 01/01/2025 00:00:00\r\ntest\r\n\x1A"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+        return; \
+    } \
+} while (0)
+
+/*
+ * Writes an image holding one mode 5 track of two normal 128-byte sectors, the second
+ * of them cut short after last_sector_bytes bytes. Returns the file size, or -1.
+ */
+static long write_truncated_image(const char* path, int last_sector_bytes) {
+    static const uint8_t track_header[] = { 5, 0, 0, 2, 0, 1, 2 }; /* Mode, C, H, sectors, size code, smap */
+    long size;
+    FILE* f = fopen(path, "wb");
+
+    if (!f) return -1;
+    fwrite(TEST_HEADER, 1, sizeof(TEST_HEADER) - 1, f);
+    fwrite(track_header, 1, sizeof(track_header), f);
+    fputc(IMD_SDR_NORMAL, f);
+    for (int b = 0; b < 128; ++b) fputc(b, f);
+    fputc(IMD_SDR_NORMAL, f);
+    for (int b = 0; b < last_sector_bytes; ++b) fputc(b, f);
+    size = ftell(f);
+    return fclose(f) == 0 ? size : -1;
+}
+
+/* A final sector cut short by the end of the file still yields the track's flags */
+static void test_truncated_final_sector(void) {
+    ImdTrackInfo track;
+    uint8_t image[512];
+    size_t consumed;
+    long size = write_truncated_image(TEST_IMAGE, 100);
+    FILE* f;
+
+    CHECK(size > 0 && (size_t)size <= sizeof(image));
+    f = fopen(TEST_IMAGE, "rb");
+    CHECK(f != NULL);
+    CHECK(fread(image, 1, (size_t)size, f) == (size_t)size);
+
+    CHECK(fseek(f, (long)(sizeof(TEST_HEADER) - 1), SEEK_SET) == 0);
+    CHECK(imd_read_track_header_and_flags(f, &track) == 1);
+    CHECK(track.num_sectors == 2 && track.sflag[1] == IMD_SDR_NORMAL);
+    CHECK(imd_read_track_header_and_flags(f, &track) == 0);
+    CHECK(imd_track_has_valid_sectors(f, 0, 0) == 1);
+
+    /* The data itself cannot be loaded */
+    CHECK(fseek(f, (long)(sizeof(TEST_HEADER) - 1), SEEK_SET) == 0);
+    CHECK(imd_load_track(f, &track, LIBIMD_FILL_BYTE_DEFAULT) == IMD_ERR_READ_ERROR);
+    fclose(f);
+
+    CHECK(imd_read_track_header_and_flags_buffer(image + sizeof(TEST_HEADER) - 1, (size_t)size - (sizeof(TEST_HEADER) - 1),
+                                                 &track, &consumed) == 1);
+    CHECK(consumed == (size_t)size - (sizeof(TEST_HEADER) - 1));
+}
+
+int main(void) {
+    test_truncated_final_sector();
+
+    remove(TEST_IMAGE);
+    if (failures) {
+        printf("%d test(s) failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Regression tests for libimdf.
+ * Each test builds a small image, changes it through libimdf and checks what
+ * a fresh open of the file reads back.
+ *
+ * www.github.com/hharte/libimd
+ *
+ * Copyright (c) 2025, Howard M. Harte
+ */
+
+#include "libimd.h"
+#include "libimdf.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_IMAGE "test_libimdf.imd"
+#define TEST_SECTOR_SIZE 128
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+        return; \
+    } \
+} while (0)
+
+/*
+ * Writes a one-track image (mode 5, C0/H0, 128-byte sectors numbered from 1) whose
+ * sectors have the given record types. Sector i holds bytes i, i+1, ... (one byte
+ * of value i if compressed). Returns 0 on success.
+ */
+static int write_test_image(const char* path, const uint8_t* sflags, uint8_t num_sectors) {
+    static const char header[] = "IMD 1.18: 01/01/2025 00:00:00\r\ntest\r\n\x1A";
+    FILE* f = fopen(path, "wb");
+
+    if (!f) return -1;
+    fwrite(header, 1, sizeof(header) - 1, f);
+    fputc(5, f);                /* Mode */
+    fputc(0, f);                /* Cylinder */
+    fputc(0, f);                /* Head */
+    fputc(num_sectors, f);
+    fputc(0, f);                /* Sector size code: 128 bytes */
+    for (uint8_t i = 0; i < num_sectors; ++i) fputc(i + 1, f);
+    for (uint8_t i = 0; i < num_sectors; ++i) {
+        fputc(sflags[i], f);
+        if (IMD_SDR_IS_COMPRESSED(sflags[i])) {
+            fputc(i, f);
+        }
+        else if (IMD_SDR_HAS_DATA(sflags[i])) {
+            for (int b = 0; b < TEST_SECTOR_SIZE; ++b) fputc((uint8_t)(i + b), f);
+        }
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/* Opens path and copies the record types of its first track to sflags_out */
+static int read_back_sflags(const char* path, uint8_t* sflags_out, uint8_t num_sectors) {
+    ImdImageFile* imdf;
+    const ImdTrackInfo* track;
+    int res = imdf_open(path, 1, &imdf);
+
+    if (res != IMDF_ERR_OK) return res;
+    track = imdf_get_track_info(imdf, 0);
+    if (!track || track->num_sectors != num_sectors) {
+        imdf_close(imdf);
+        return -1;
+    }
+    memcpy(sflags_out, track->sflag, num_sectors);
+    imdf_close(imdf);
+    return 0;
+}
+
+/* Writing non-uniform data to an unavailable sector stores it as normal data */
+static void test_write_unavailable_sector(unsigned open_flags) {
+    static const uint8_t sflags[3] = { IMD_SDR_NORMAL, IMD_SDR_UNAVAILABLE, IMD_SDR_NORMAL };
+    ImdImageFile* imdf;
+    uint8_t data[TEST_SECTOR_SIZE];
+    uint8_t check[TEST_SECTOR_SIZE];
+    uint8_t after[3];
+
+    for (int b = 0; b < TEST_SECTOR_SIZE; ++b) data[b] = (uint8_t)(b * 31 + 7);
+    CHECK(write_test_image(TEST_IMAGE, sflags, 3) == 0);
+    CHECK(imdf_open_ex(TEST_IMAGE, open_flags, &imdf) == IMDF_ERR_OK);
+    CHECK(imdf_write_sector(imdf, 0, 0, 2, data, sizeof(data)) == IMDF_ERR_OK);
+    imdf_close(imdf);
+
+    CHECK(read_back_sflags(TEST_IMAGE, after, 3) == 0);
+    CHECK(after[0] == IMD_SDR_NORMAL && after[1] == IMD_SDR_NORMAL && after[2] == IMD_SDR_NORMAL);
+    CHECK(imdf_open(TEST_IMAGE, 1, &imdf) == IMDF_ERR_OK);
+    CHECK(imdf_read_sector(imdf, 0, 0, 2, check, sizeof(check)) == IMDF_ERR_OK);
+    imdf_close(imdf);
+    CHECK(memcmp(check, data, sizeof(data)) == 0);
+}
+
+/* Decompressing a track for a non-uniform write leaves its unavailable sectors unavailable */
+static void test_decompress_keeps_unavailable(unsigned open_flags) {
+    static const uint8_t sflags[3] = { IMD_SDR_COMPRESSED, IMD_SDR_UNAVAILABLE, IMD_SDR_NORMAL };
+    ImdImageFile* imdf;
+    uint8_t data[TEST_SECTOR_SIZE];
+    uint8_t after[3];
+
+    for (int b = 0; b < TEST_SECTOR_SIZE; ++b) data[b] = (uint8_t)b;
+    CHECK(write_test_image(TEST_IMAGE, sflags, 3) == 0);
+    CHECK(imdf_open_ex(TEST_IMAGE, open_flags, &imdf) == IMDF_ERR_OK);
+    CHECK(imdf_write_sector(imdf, 0, 0, 1, data, sizeof(data)) == IMDF_ERR_OK);
+    imdf_close(imdf);
+
+    CHECK(read_back_sflags(TEST_IMAGE, after, 3) == 0);
+    CHECK(after[0] == IMD_SDR_NORMAL && after[1] == IMD_SDR_UNAVAILABLE && after[2] == IMD_SDR_NORMAL);
+}
+
+/* Checks the sector map of track 'index' of imdf against expected */
+static int smap_equals(const ImdImageFile* imdf, size_t index, const uint8_t* expected, uint8_t num_sectors) {
+    const ImdTrackInfo* track = imdf_get_track_info(imdf, index);
+
+    return track && track->num_sectors == num_sectors && memcmp(track->smap, expected, num_sectors) == 0;
+}
+
+/* Formatting honours interleave and skew, as imdf_format_track and imdf_format_disk */
+static void test_format_interleave(void) {
+    static const uint8_t il3[9] = { 1, 4, 7, 2, 5, 8, 3, 6, 9 };
+    static const uint8_t il3_skew2[9] = { 7, 2, 5, 8, 3, 6, 9, 1, 4 };
+    static const uint8_t first3[4] = { 3, 4, 1, 2 };
+    ImdfDiskGeometry geometry;
+    ImdImageFile* imdf;
+
+    remove(TEST_IMAGE);
+    CHECK(imdf_create(TEST_IMAGE, "test", &imdf) == IMDF_ERR_OK);
+    CHECK(imdf_format_track(imdf, 0, 0, 5, 9, 512, 1, 3, 0, 0xE5) == IMDF_ERR_OK);
+    CHECK(smap_equals(imdf, 0, il3, 9));
+    CHECK(imdf_format_track(imdf, 0, 0, 5, 9, 512, 1, 3, 2, 0xE5) == IMDF_ERR_OK);
+    CHECK(smap_equals(imdf, 0, il3_skew2, 9));
+    CHECK(imdf_format_track(imdf, 0, 0, 5, 4, 512, 3, 1, 0, 0xE5) == IMDF_ERR_OK);
+    CHECK(smap_equals(imdf, 0, first3, 4));
+    CHECK(imdf_format_track(imdf, 0, 0, 5, 9, 500, 1, 1, 0, 0xE5) == IMDF_ERR_SECTOR_SIZE);
+
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.num_cyls = 2;
+    geometry.num_heads = 1;
+    geometry.format.mode = 5;
+    geometry.format.num_sectors = 9;
+    geometry.format.sector_size = 512;
+    geometry.format.first_sector_id = 1;
+    geometry.format.interleave = 3;
+    geometry.format.fill_byte = 0xE5;
+    geometry.cylinder_skew = 2;
+    CHECK(imdf_format_disk(imdf, &geometry) == IMDF_ERR_OK);
+    imdf_close(imdf);
+
+    CHECK(imdf_open(TEST_IMAGE, 1, &imdf) == IMDF_ERR_OK);
+    CHECK(smap_equals(imdf, 0, il3, 9));
+    CHECK(smap_equals(imdf, 1, il3_skew2, 9));
+    imdf_close(imdf);
+
+    CHECK(imdf_open(TEST_IMAGE, 0, &imdf) == IMDF_ERR_OK);
+    geometry.format.sector_size = 500;
+    CHECK(imdf_format_disk(imdf, &geometry) == IMDF_ERR_SECTOR_SIZE);
+    imdf_close(imdf);
+}
+
+/* Images indexed at open answer sector, block and track queries from their compact metadata */
+static void test_indexed_track_metadata(int mapped) {
+    static const uint8_t sflags[3] = { IMD_SDR_NORMAL, IMD_SDR_UNAVAILABLE, IMD_SDR_COMPRESSED };
+    static const uint8_t smap[3] = { 1, 2, 3 };
+    ImdImageFile* imdf;
+    const ImdTrackInfo* track;
+    uint8_t data[TEST_SECTOR_SIZE];
+    size_t num_blocks = 0;
+
+    CHECK(write_test_image(TEST_IMAGE, sflags, 3) == 0);
+    if (mapped) CHECK(imdf_open_mapped(TEST_IMAGE, &imdf) == IMDF_ERR_OK);
+    else CHECK(imdf_open_ex(TEST_IMAGE, IMDF_OPEN_READ_ONLY | IMDF_OPEN_LAZY, &imdf) == IMDF_ERR_OK);
+
+    CHECK(imdf_build_lba_map(imdf, 1, &num_blocks) == IMDF_ERR_OK && num_blocks == 3);
+    CHECK(imdf_read_sector(imdf, 0, 0, 2, data, sizeof(data)) == IMDF_ERR_UNAVAILABLE);
+    CHECK(imdf_read_sector(imdf, 0, 0, 3, data, sizeof(data)) == IMDF_ERR_OK);
+    CHECK(data[0] == 2 && data[TEST_SECTOR_SIZE - 1] == 2);
+    CHECK(imdf_read_blocks(imdf, 0, 1, data, sizeof(data)) == IMDF_ERR_OK);
+    CHECK(data[0] == 0 && data[TEST_SECTOR_SIZE - 1] == TEST_SECTOR_SIZE - 1);
+
+    track = imdf_get_track_info(imdf, 0);
+    CHECK(track != NULL && track->loaded && track->num_sectors == 3);
+    CHECK(memcmp(track->smap, smap, 3) == 0 && memcmp(track->sflag, sflags, 3) == 0);
+    CHECK(imdf_get_track_info(imdf, 0) == track);
+    CHECK(imdf_read_sector(imdf, 0, 0, 1, data, sizeof(data)) == IMDF_ERR_OK && data[1] == 1);
+    CHECK(imdf_get_track_info(imdf, 0) == track && track->sflag[1] == IMD_SDR_UNAVAILABLE);
+    imdf_close(imdf);
+}
+
+/* Inserting a track ahead of others leaves their track info where it was */
+static void test_track_info_stable(void) {
+    ImdImageFile* imdf;
+    const ImdTrackInfo* track;
+
+    remove(TEST_IMAGE);
+    CHECK(imdf_create(TEST_IMAGE, "test", &imdf) == IMDF_ERR_OK);
+    CHECK(imdf_format_track(imdf, 2, 0, 5, 9, 512, 1, 1, 0, 0xE5) == IMDF_ERR_OK);
+    track = imdf_get_track_info(imdf, 0);
+    CHECK(track != NULL && track->cyl == 2);
+    CHECK(imdf_format_track(imdf, 0, 0, 5, 4, 512, 1, 1, 0, 0xE5) == IMDF_ERR_OK);
+    CHECK(imdf_format_track(imdf, 1, 0, 5, 4, 512, 1, 1, 0, 0xE5) == IMDF_ERR_OK);
+    CHECK(imdf_get_track_info(imdf, 2) == track);
+    CHECK(track->cyl == 2 && track->num_sectors == 9 && track->sector_size == 512);
+    imdf_close(imdf);
+}
+
+int main(void) {
+    test_write_unavailable_sector(0);
+    test_write_unavailable_sector(IMDF_OPEN_WRITE_BACK);
+    test_decompress_keeps_unavailable(0);
+    test_decompress_keeps_unavailable(IMDF_OPEN_WRITE_BACK);
+    test_format_interleave();
+    test_indexed_track_metadata(0);
+    test_indexed_track_metadata(1);
+    test_track_info_stable();
+
+    remove(TEST_IMAGE);
+    if (failures) {
+        printf("%d test(s) failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}